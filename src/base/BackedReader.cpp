@@ -54,6 +54,10 @@ int BackedReader::read(Packet* packet) {
     } else if (bytesRead > 0) {
       partialMessage.append(tmpBuf, bytesRead);
     } else if (bytesRead == -1) {
+      if (GetErrno() == EAGAIN || GetErrno() == EWOULDBLOCK) {
+        // Nothing to read yet
+        return 0;
+      }
       // Read error
       return -1;
     } else {
@@ -78,6 +82,10 @@ int BackedReader::read(Packet* packet) {
       SetErrno(EPIPE);
       return -1;
     } else if (bytesRead == -1) {
+      if (GetErrno() == EAGAIN || GetErrno() == EWOULDBLOCK) {
+        // The rest of the message hasn't arrived yet
+        return 0;
+      }
       VLOG(2) << "Error while reading";
       return bytesRead;
     } else if (bytesRead > 0) {
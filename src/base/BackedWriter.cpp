@@ -3,6 +3,24 @@
 #include <cstdint>
 
 namespace et {
+namespace {
+// Keep the kernel from queueing megabytes of bulk data ahead of the next
+// interactive packet.  Fails harmlessly on sockets that are not TCP.
+void limitUnsentBytes(int fd) {
+#ifdef TCP_NOTSENT_LOWAT
+  if (fd < 0) {
+    return;
+  }
+  int lowat = BackedWriter::MAX_UNSENT_BYTES;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char*)&lowat,
+                 sizeof(lowat)) < 0) {
+    VLOG(1) << "Cannot limit unsent bytes on " << fd << ": "
+            << strerror(errno);
+  }
+#endif
+}
+}  // namespace
+
 BackedWriter::BackedWriter(std::shared_ptr<SocketHandler> socketHandler_,
                            std::shared_ptr<CryptoHandler> cryptoHandler_,
                            int socketFd_)
@@ -11,12 +29,38 @@ BackedWriter::BackedWriter(std::shared_ptr<SocketHandler> socketHandler_,
       socketFd(socketFd_),
       backupSize(0),
       disconnectedBytes(0),
-      sequenceNumber(0) {}
+      sequenceNumber(0),
+      bulkBytes(0) {
+  limitUnsentBytes(socketFd);
+}
 
 BackedWriterWriteState BackedWriter::write(Packet packet) {
   // If recover started, Wait until finished
   lock_guard<std::mutex> guard(recoverMutex);
+  return writeLocked(packet);
+}
+
+void BackedWriter::queueBulk(const Packet& packet) {
+  lock_guard<std::mutex> guard(recoverMutex);
+  bulkQueue.push_back(packet);
+  bulkBytes += packet.length();
+}
+
+BackedWriterWriteState BackedWriter::writeBulk() {
+  lock_guard<std::mutex> guard(recoverMutex);
+  // While disconnected bulk data stays queued, so that after a reconnect it
+  // still goes out behind interactive packets.
+  if (bulkQueue.empty() || socketFd < 0 ||
+      !waitOnSocketReady(socketFd, true, 0)) {
+    return BackedWriterWriteState::SKIPPED;
+  }
+  Packet packet = bulkQueue.front();
+  bulkQueue.pop_front();
+  bulkBytes -= packet.length();
+  return writeLocked(packet);
+}
 
+BackedWriterWriteState BackedWriter::writeLocked(Packet packet) {
   // If no socket and the data buffered since the disconnect exceeds the
   // limit, signal caller to wait
   if (socketFd < 0 &&
@@ -45,6 +89,10 @@ BackedWriterWriteState BackedWriter::write(Packet packet) {
     return BackedWriterWriteState::BUFFERED_ONLY;
   }
 
+  return sendPacket(packet);
+}
+
+BackedWriterWriteState BackedWriter::sendPacket(const Packet& packet) {
   // Size before we add the header
   int messageSize = packet.length();
 
@@ -72,7 +120,9 @@ BackedWriterWriteState BackedWriter::write(Packet packet) {
       if (bytesWritten == count) {
         return BackedWriterWriteState::SUCCESS;
       }
-      std::this_thread::sleep_for(std::chrono::microseconds(1000));
+      // Resume as soon as the socket can take more.  Closing the socket
+      // requires recoverMutex, so the fd stays valid while we wait.
+      waitOnSocketReady(socketFd, true, 1000);
     } else {
       // Error, we do not know how many bytes were written but it
       // does not matter because the reader is going to have to
@@ -111,8 +161,29 @@ vector<std::string> BackedWriter::recover(int64_t lastValidSequenceNumber) {
   throw std::runtime_error("Client is too far behind server.");
 }
 
-void BackedWriter::revive(int newSocketFd) {
+void BackedWriter::revive(int newSocketFd, int64_t catchupSequenceNumber) {
   socketFd = newSocketFd;
   disconnectedBytes = 0;
+  limitUnsentBytes(socketFd);
+  if (catchupSequenceNumber < 0) {
+    return;
+  }
+  // Packets written after the catchup snapshot were only buffered; the peer
+  // has not seen them yet.  Nothing is dropped while disconnected, so they
+  // are all still in the backup buffer (newest first).
+  int64_t pending = sequenceNumber - catchupSequenceNumber;
+  if (pending < 0 || pending > int64_t(backupBuffer.size())) {
+    STFATAL << "Invalid catchup sequence number: " << catchupSequenceNumber
+            << " (current: " << sequenceNumber << ")";
+  }
+  VLOG(1) << "Resending " << pending << " packets written while recovering";
+  for (int64_t i = pending - 1; i >= 0; i--) {
+    if (sendPacket(backupBuffer[i]) != BackedWriterWriteState::SUCCESS) {
+      // The new socket already failed; the next read or write notices and
+      // the following recover replays these packets again.
+      LOG(INFO) << "Failed to resend packets after recovering";
+      return;
+    }
+  }
 }
 }  // namespace et
@@ -25,6 +25,13 @@ enum class BackedWriterWriteState {
 /**
  * @brief Writes packets to a socket while maintaining an in-memory backup for
  * recovery.
+ *
+ * Packets go out in one of two lanes.  `write()` sends right away and is
+ * used for keystrokes, terminal output and control packets.  Bulk tunnel
+ * data is queued with `queueBulk()` and only sent by `writeBulk()` while
+ * the socket has room, so it never sits in front of an interactive packet
+ * for more than `MAX_UNSENT_BYTES`.  A packet gets its sequence number when
+ * it is sent, so replay after a reconnect follows the order on the wire.
  */
 class BackedWriter {
  public:
@@ -32,6 +39,13 @@ class BackedWriter {
   static const int64_t MAX_BACKUP_BYTES = 64 * 1024 * 1024;
   /** @brief Max bytes buffered while disconnected before blocking (64MB). */
   static const int64_t DISCONNECT_BUFFER_BYTES = 64 * 1024 * 1024;
+  /**
+   * @brief Most data the kernel holds unsent on the socket where the
+   * platform can limit it (TCP_NOTSENT_LOWAT).
+   */
+  static const int MAX_UNSENT_BYTES = 64 * 1024;
+  /** @brief Bulk data queued at which tunnels stop being read. */
+  static const int64_t MAX_BULK_BYTES = 1024 * 1024;
 
   /**
    * @brief Creates a writer bound to a socket and crypto pair.
@@ -47,6 +61,22 @@ class BackedWriter {
    */
   BackedWriterWriteState write(Packet packet);
 
+  /** @brief Queues bulk data to be sent by `writeBulk()`. */
+  void queueBulk(const Packet& packet);
+
+  /**
+   * @brief Sends the oldest queued bulk packet if the socket has room.
+   * @return SKIPPED when nothing is queued or the socket is full or gone,
+   * otherwise the state of the write.
+   */
+  BackedWriterWriteState writeBulk();
+
+  /** @brief Bytes of bulk data waiting to be sent. */
+  int64_t getBulkBytes() {
+    lock_guard<std::mutex> guard(recoverMutex);
+    return bulkBytes;
+  }
+
   /**
    * @brief Returns serialized packets that the remote side still needs after
    * reconnect.
@@ -57,8 +87,12 @@ class BackedWriter {
 
   /**
    * @brief Points the writer at a new socket fd so writes can resume.
+   * @param catchupSequenceNumber Sequence number when the catchup buffer was
+   * taken; packets written since then are sent on the new socket.  Pass -1
+   * when no writes could have happened in between.  Call with the recover
+   * mutex held.
    */
-  void revive(int newSocketFd);
+  void revive(int newSocketFd, int64_t catchupSequenceNumber = -1);
 
   /**
    * @brief Returns true when writing `bytes` more will not block the caller:
@@ -112,6 +146,22 @@ class BackedWriter {
   int64_t disconnectedBytes;
   /** @brief Sequence number that increments each time a packet is backed up. */
   int64_t sequenceNumber;
+  /** @brief Bulk packets not sent yet, unencrypted and unnumbered. */
+  std::deque<Packet> bulkQueue;
+  /** @brief Running size of the bulk queue. */
+  int64_t bulkBytes;
+
+  /**
+   * @brief Encrypts, backs up and sends a packet.  Call with the recover
+   * mutex held.
+   */
+  BackedWriterWriteState writeLocked(Packet packet);
+
+  /**
+   * @brief Frames an encrypted packet and writes it to the current socket.
+   * Call with the recover mutex held.
+   */
+  BackedWriterWriteState sendPacket(const Packet& packet);
 };
 }  // namespace et
 
@@ -70,11 +70,22 @@ bool ClientConnection::connect() {
 }
 
 void ClientConnection::closeSocketAndMaybeReconnect() {
+  // Reads and writes run concurrently, so both sides can notice the same
+  // failure.  Only one of them starts the reconnect.
+  lock_guard<std::mutex> guard(reconnectMutex);
+  if (reconnecting) {
+    // The running thread notices the closed socket before it exits and
+    // keeps going.  Joining it here would stall this reader or writer for
+    // a whole reconnect attempt.
+    closeSocket();
+    return;
+  }
   waitReconnect();
   LOG(INFO) << "Closing socket";
   closeSocket();
   if (!isShuttingDown()) {
     LOG(INFO) << "Socket closed, starting new reconnect thread";
+    reconnecting = true;
     reconnectThread = std::shared_ptr<std::thread>(
         new std::thread(&ClientConnection::pollReconnect, this));
   }
@@ -93,59 +104,69 @@ void ClientConnection::pollReconnect() {
   LOG(INFO) << "Trying to reconnect to " << remoteEndpoint << endl;
   while (true) {
     {
+      // Only check the state under the locks; the connect and handshake
+      // below must not keep readers/writers from observing the connection.
+      lock_guard<std::mutex> reconnectGuard(reconnectMutex);
       lock_guard<std::recursive_mutex> guard(connectionMutex);
       if (socketFd != -1) {
+        reconnecting = false;
         break;
       }
       if (shuttingDown) {
         LOG(INFO) << "Aborting reconnect loop because shutdown was called";
+        reconnecting = false;
         return;
       }
-      LOG_EVERY_N(10, INFO) << "In reconnect loop " << remoteEndpoint << endl;
-      int newSocketFd = socketHandler->connect(remoteEndpoint);
-      if (newSocketFd != -1) {
-        try {
-          et::ConnectRequest request;
-          request.set_clientid(id);
-          request.set_version(PROTOCOL_VERSION);
-          socketHandler->writeProto(newSocketFd, request, true);
-          et::ConnectResponse response =
-              socketHandler->readProto<et::ConnectResponse>(newSocketFd, true);
-          LOG(INFO) << "Got response with status: " << response.status() << " "
-                    << INVALID_KEY;
-          if (response.status() == INVALID_KEY) {
-            LOG(INFO) << "Got invalid key on reconnect, assume that server has "
-                         "terminated the session.";
-            // This means that the server has terminated the connection.
+    }
+    LOG_EVERY_N(10, INFO) << "In reconnect loop " << remoteEndpoint << endl;
+    int newSocketFd = socketHandler->connect(remoteEndpoint);
+    if (newSocketFd != -1) {
+      try {
+        et::ConnectRequest request;
+        request.set_clientid(id);
+        request.set_version(PROTOCOL_VERSION);
+        socketHandler->writeProto(newSocketFd, request, true);
+        et::ConnectResponse response =
+            socketHandler->readProto<et::ConnectResponse>(newSocketFd, true);
+        LOG(INFO) << "Got response with status: " << response.status() << " "
+                  << INVALID_KEY;
+        if (response.status() == INVALID_KEY) {
+          LOG(INFO) << "Got invalid key on reconnect, assume that server has "
+                       "terminated the session.";
+          // This means that the server has terminated the connection.
+          {
+            lock_guard<std::mutex> reconnectGuard(reconnectMutex);
+            lock_guard<std::recursive_mutex> guard(connectionMutex);
             shuttingDown = true;
-            socketHandler->close(newSocketFd);
-            return;
-          }
-          if (response.status() != RETURNING_CLIENT) {
-            STERROR << "Error reconnecting to server: " << response.status()
-                    << ": " << response.error();
-            CLOG(INFO, "stdout")
-                << "Error reconnecting to server: " << response.status() << ": "
-                << response.error() << endl;
-            socketHandler->close(newSocketFd);
-          } else {
-            recover(newSocketFd);
+            reconnecting = false;
           }
-        } catch (const std::runtime_error& re) {
-          LOG(INFO) << "Got failure during reconnect";
           socketHandler->close(newSocketFd);
-        } catch (...) {
-          LOG(ERROR) << "Got an unknown error!";
-          std::exception_ptr eptr = std::current_exception();
-          if (eptr) {
-            try {
-              std::rethrow_exception(eptr);
-            } catch (const std::exception& e) {
-              LOG(ERROR) << "Uncaught c++ exception: " << e.what();
-            }
-          } else {
-            LOG(ERROR) << "Uncaught c++ exception (unknown)";
+          return;
+        }
+        if (response.status() != RETURNING_CLIENT) {
+          STERROR << "Error reconnecting to server: " << response.status()
+                  << ": " << response.error();
+          CLOG(INFO, "stdout")
+              << "Error reconnecting to server: " << response.status() << ": "
+              << response.error() << endl;
+          socketHandler->close(newSocketFd);
+        } else if (recover(newSocketFd) && reconnectCallback) {
+          reconnectCallback();
+        }
+      } catch (const std::runtime_error& re) {
+        LOG(INFO) << "Got failure during reconnect";
+        socketHandler->close(newSocketFd);
+      } catch (...) {
+        LOG(ERROR) << "Got an unknown error!";
+        std::exception_ptr eptr = std::current_exception();
+        if (eptr) {
+          try {
+            std::rethrow_exception(eptr);
+          } catch (const std::exception& e) {
+            LOG(ERROR) << "Uncaught c++ exception: " << e.what();
           }
+        } else {
+          LOG(ERROR) << "Uncaught c++ exception (unknown)";
         }
       }
     }
@@ -38,6 +38,15 @@ class ClientConnection : public Connection {
    */
   void waitReconnect();
 
+  /**
+   * @brief Registers a callback run on the reconnect thread each time a new
+   * socket has been recovered, so an event loop can start watching it.
+   * Set it before the first reconnect can start.
+   */
+  void setReconnectCallback(std::function<void()> callback) {
+    reconnectCallback = callback;
+  }
+
  protected:
   /**
    * @brief Background loop used to re-establish a connection when lost.
@@ -48,6 +57,14 @@ class ClientConnection : public Connection {
   SocketEndpoint remoteEndpoint;
   /** @brief Thread that keeps retrying the handshake after disconnects. */
   std::shared_ptr<std::thread> reconnectThread;
+  /**
+   * @brief Serializes starting `reconnectThread` with its decision to stop.
+   */
+  std::mutex reconnectMutex;
+  /** @brief True while `reconnectThread` is still trying to reconnect. */
+  std::atomic<bool> reconnecting{false};
+  /** @brief Called after a successful `recover()`, if set. */
+  std::function<void()> reconnectCallback;
 };
 }  // namespace et
 
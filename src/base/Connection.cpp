@@ -40,8 +40,8 @@ inline bool isSkippableError(int err_no) {
 }
 
 bool Connection::readPacket(Packet* packet) {
-  lock_guard<std::recursive_mutex> guard(connectionMutex);
-  if (shuttingDown) {
+  lock_guard<std::recursive_mutex> guard(readMutex);
+  if (isShuttingDown()) {
     return false;
   }
   bool result = read(packet);
@@ -53,21 +53,14 @@ bool Connection::readPacket(Packet* packet) {
 
 void Connection::writePacket(const Packet& packet) {
   while (true) {
-    {
-      lock_guard<std::recursive_mutex> guard(connectionMutex);
-      if (shuttingDown) {
-        break;
-      }
+    if (isShuttingDown()) {
+      break;
     }
     bool success = write(packet);
     if (success) {
       return;
     }
-    bool hasConnection;
-    {
-      lock_guard<std::recursive_mutex> guard(connectionMutex);
-      hasConnection = (socketFd != -1);
-    }
+    bool hasConnection = !isDisconnected();
 
     // Yield the processor
     if (hasConnection) {
@@ -103,14 +96,16 @@ void Connection::closeSocket() {
 }
 
 bool Connection::recover(int newSocketFd) {
-  LOG(INFO) << "Locking reader/writer to recover...";
-  lock_guard<std::recursive_mutex> guard(connectionMutex);
-  lock_guard<std::mutex> readerGuard(reader->getRecoverMutex());
-  lock_guard<std::mutex> writerGuard(writer->getRecoverMutex());
+  // Reads and writes keep going while the handshake runs: reads return
+  // nothing and writes are buffered until the new socket is swapped in.
+  lock_guard<std::mutex> recoveryGuard(recoveryMutex);
   LOG(INFO) << "Recovering with socket fd " << newSocketFd << "...";
+  vector<string> recoveredMessages;
+  int64_t catchupSequenceNumber;
   try {
     {
-      // Write the current sequence number
+      // Write the current sequence number.  The reader is detached from any
+      // socket, so its count cannot move until revive().
       et::SequenceHeader sh;
       sh.set_sequencenumber(reader->getSequenceNumber());
       socketHandler->writeProto(newSocketFd, sh, true);
@@ -121,11 +116,16 @@ bool Connection::recover(int newSocketFd) {
         socketHandler->readProto<et::SequenceHeader>(newSocketFd, true);
 
     {
-      // Fetch the catchup bytes and send
+      // Fetch the catchup bytes and send.  Remember where the snapshot was
+      // taken so writes made during the rest of the handshake are resent.
       et::CatchupBuffer catchupBuffer;
-      vector<string> recoveredMessages =
-          writer->recover(remoteHeader.sequencenumber());
-      for (auto it : recoveredMessages) {
+      vector<string> writerMessages;
+      {
+        lock_guard<std::mutex> writerGuard(writer->getRecoverMutex());
+        writerMessages = writer->recover(remoteHeader.sequencenumber());
+        catchupSequenceNumber = writer->getSequenceNumber();
+      }
+      for (auto it : writerMessages) {
         catchupBuffer.add_buffer(it);
       }
       socketHandler->writeProto(newSocketFd, catchupBuffer, true);
@@ -133,20 +133,29 @@ bool Connection::recover(int newSocketFd) {
 
     et::CatchupBuffer catchupBuffer =
         socketHandler->readProto<et::CatchupBuffer>(newSocketFd, true);
-
-    socketFd = newSocketFd;
-    vector<string> recoveredMessages(catchupBuffer.buffer().begin(),
-                                     catchupBuffer.buffer().end());
-
-    reader->revive(socketFd, recoveredMessages);
-    writer->revive(socketFd);
-    LOG(INFO) << "Finished recovering with socket fd: " << socketFd;
-    return true;
+    recoveredMessages.assign(catchupBuffer.buffer().begin(),
+                             catchupBuffer.buffer().end());
   } catch (const runtime_error& err) {
     LOG(WARNING) << "Error recovering: " << err.what();
     socketHandler->close(newSocketFd);
     return false;
   }
+
+  lock_guard<std::recursive_mutex> guard(connectionMutex);
+  if (shuttingDown) {
+    LOG(INFO) << "Connection shut down while recovering";
+    socketHandler->close(newSocketFd);
+    return false;
+  }
+  {
+    lock_guard<std::mutex> readerGuard(reader->getRecoverMutex());
+    lock_guard<std::mutex> writerGuard(writer->getRecoverMutex());
+    reader->revive(newSocketFd, recoveredMessages);
+    writer->revive(newSocketFd, catchupSequenceNumber);
+  }
+  socketFd = newSocketFd;
+  LOG(INFO) << "Finished recovering with socket fd: " << socketFd;
+  return true;
 }
 
 void Connection::shutdown() {
@@ -157,9 +166,9 @@ void Connection::shutdown() {
 }
 
 bool Connection::read(Packet* packet) {
-  VLOG(4) << "Before read get connectionMutex";
-  lock_guard<std::recursive_mutex> guard(connectionMutex);
-  VLOG(4) << "After read get connectionMutex";
+  VLOG(4) << "Before read get readMutex";
+  lock_guard<std::recursive_mutex> guard(readMutex);
+  VLOG(4) << "After read get readMutex";
 
   if (!reader) {
     VLOG(3) << "Cannot read: reader not initialized";
@@ -189,7 +198,7 @@ bool Connection::read(Packet* packet) {
 }
 
 bool Connection::write(const Packet& packet) {
-  lock_guard<std::recursive_mutex> guard(connectionMutex);
+  lock_guard<std::recursive_mutex> guard(writeMutex);
 
   if (!writer) {
     VLOG(3) << "Cannot write: writer not initialized";
@@ -199,8 +208,55 @@ bool Connection::write(const Packet& packet) {
   // Let the writer buffer even if no socket - data will be recovered on
   // reconnect
   BackedWriterWriteState bwws = writer->write(packet);
-  auto writeErrno = GetErrno();
+  return handleWriteState(bwws, GetErrno());
+}
+
+void Connection::writeBulkPacket(const Packet& packet) {
+  {
+    lock_guard<std::recursive_mutex> guard(writeMutex);
+    if (!writer) {
+      VLOG(3) << "Cannot write: writer not initialized";
+      return;
+    }
+    writer->queueBulk(packet);
+  }
+  // The session loops stop reading tunnels at MAX_BULK_BYTES rather than
+  // wait here: both ends waiting for the other to read would never end.
+  // This only holds back a producer that keeps going regardless.
+  while (flushBulk() && !isShuttingDown()) {
+    int fd = getSocketFd();
+    if (getBulkBytes() <= BackedWriter::DISCONNECT_BUFFER_BYTES) {
+      break;
+    }
+    if (fd >= 0) {
+      waitOnSocketReady(fd, true, 100);
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    LOG_EVERY_N(1000, INFO) << "Waiting to queue bulk data...";
+  }
+}
+
+bool Connection::flushBulk() {
+  lock_guard<std::recursive_mutex> guard(writeMutex);
+  if (!writer) {
+    return false;
+  }
+  while (true) {
+    BackedWriterWriteState bwws = writer->writeBulk();
+    if (bwws == BackedWriterWriteState::SKIPPED) {
+      break;
+    }
+    if (bwws != BackedWriterWriteState::SUCCESS) {
+      handleWriteState(bwws, GetErrno());
+      break;
+    }
+  }
+  return writer->getBulkBytes() > 0;
+}
 
+bool Connection::handleWriteState(BackedWriterWriteState bwws,
+                                  int writeErrno) {
   if (bwws == BackedWriterWriteState::SKIPPED) {
     VLOG(4) << "Write skipped";
     return false;
@@ -215,7 +271,7 @@ bool Connection::write(const Packet& packet) {
   if (bwws == BackedWriterWriteState::WROTE_WITH_FAILURE) {
     VLOG(4) << "Wrote with failure";
     // Error writing.
-    if (socketFd == -1) {
+    if (isDisconnected()) {
       // The socket was already closed
       VLOG(1) << "Socket closed";
     } else if (isSkippableError(writeErrno)) {
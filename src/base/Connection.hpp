@@ -13,6 +13,15 @@ namespace et {
  *
  * Connection owns {@link BackedReader} and {@link BackedWriter} instances to
  * read/write encrypted packets while keeping replay buffers for reconnects.
+ *
+ * Reads and writes are serialized independently (`readMutex` and
+ * `writeMutex`), so a writer stuck on a full socket never keeps incoming
+ * packets from being read.  `recover()` takes neither: it handshakes on the
+ * new socket while reads return nothing and writes are buffered, then swaps
+ * the socket in under `connectionMutex`, resending anything written in the
+ * meantime.  `connectionMutex` guards the connection state and is never held
+ * across a connect or handshake; the lock order is readMutex, writeMutex,
+ * connectionMutex, then the reader/writer recover mutexes.
  */
 class Connection {
  public:
@@ -43,6 +52,25 @@ class Connection {
    */
   virtual bool write(const Packet& packet);
 
+  /**
+   * @brief Queues a bulk packet (tunnel data) behind interactive ones and
+   * sends what the socket has room for.  Call `flushBulk()` as the socket
+   * drains to send the rest.  Producers should stop once
+   * `BackedWriter::MAX_BULK_BYTES` are queued; past
+   * `BackedWriter::DISCONNECT_BUFFER_BYTES` this blocks.
+   */
+  void writeBulkPacket(const Packet& packet);
+  /**
+   * @brief Sends queued bulk packets while the socket has room.
+   * @return Whether bulk packets are still queued.
+   */
+  bool flushBulk();
+  /** @brief Bytes of bulk packets waiting to be sent. */
+  inline int64_t getBulkBytes() {
+    lock_guard<std::recursive_mutex> guard(writeMutex);
+    return writer ? writer->getBulkBytes() : 0;
+  }
+
   inline shared_ptr<BackedReader> getReader() { return reader; }
   inline shared_ptr<BackedWriter> getWriter() { return writer; }
 
@@ -74,7 +102,7 @@ class Connection {
   inline string getId() { return id; }
 
   inline bool hasData() {
-    lock_guard<std::recursive_mutex> guard(connectionMutex);
+    lock_guard<std::recursive_mutex> guard(readMutex);
     return reader && reader->hasData();
   }
 
@@ -106,6 +134,12 @@ class Connection {
    */
   bool recover(int newSocketFd);
 
+  /**
+   * @brief Handles the outcome of a write, reconnecting after failures.
+   * @return Whether the packet was sent or buffered.
+   */
+  bool handleWriteState(BackedWriterWriteState bwws, int writeErrno);
+
   /** @brief Socket API used by all derived connection types. */
   shared_ptr<SocketHandler> socketHandler;
   /** @brief Logical identifier for this connection (client ID for clients). */
@@ -120,8 +154,14 @@ class Connection {
   int socketFd;
   /** @brief Flag that is set when `shutdown()` has been called. */
   bool shuttingDown;
-  /** @brief Guards connection state changes in multi-threaded scenarios. */
+  /** @brief Guards `socketFd` and `shuttingDown`; only held briefly. */
   recursive_mutex connectionMutex;
+  /** @brief Serializes readers of the connection. */
+  recursive_mutex readMutex;
+  /** @brief Serializes writers of the connection. */
+  recursive_mutex writeMutex;
+  /** @brief Serializes `recover()` calls; no reader or writer takes it. */
+  std::mutex recoveryMutex;
 };
 }  // namespace et
 
@@ -0,0 +1,406 @@
+#include "EventLoop.hpp"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
+
+namespace et {
+namespace {
+#ifdef __linux__
+/** @brief What an epoll entry refers to, stored in the high half of u64. */
+enum EpollTag : uint64_t {
+  EPOLL_TAG_FD = 0,
+  EPOLL_TAG_TIMER = 1,
+  EPOLL_TAG_SIGNAL = 2,
+  EPOLL_TAG_WAKE = 3,
+};
+
+void addToEpoll(int epollFd, int fd, EpollTag tag, uint32_t value) {
+  epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u64 = (uint64_t(tag) << 32) | value;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1 && errno != EEXIST) {
+    STFATAL << "Error adding fd " << fd << " to epoll: " << strerror(errno);
+  }
+}
+#endif
+
+#ifndef WIN32
+/** @brief Write end of the wake pipe of the loop watching signals. */
+std::atomic<int> signalWakeFd(-1);
+
+void forwardSignal(int signum) {
+  int savedErrno = errno;
+  int fd = signalWakeFd.load();
+  if (fd >= 0) {
+    unsigned char b = (unsigned char)signum;
+    // A full pipe already has a wakeup pending, so the result is ignored.
+    ssize_t rc = ::write(fd, &b, 1);
+    (void)rc;
+  }
+  errno = savedErrno;
+}
+#endif
+}  // namespace
+
+EventLoop::EventLoop() {
+#ifdef WIN32
+  wakePipe[0] = wakePipe[1] = -1;
+  pollFdsDirty = true;
+#else
+  FATAL_FAIL(::pipe(wakePipe));
+  for (int fd : wakePipe) {
+    FATAL_FAIL(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+    FATAL_FAIL(fcntl(fd, F_SETFD, FD_CLOEXEC));
+  }
+#ifdef __linux__
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  FATAL_FAIL(epollFd);
+  signalFd = -1;
+  sigemptyset(&signalMask);
+  addToEpoll(epollFd, wakePipe[0], EPOLL_TAG_WAKE, 0);
+#else
+  pollFdsDirty = true;
+#endif
+#endif
+}
+
+EventLoop::~EventLoop() {
+#ifndef WIN32
+  if (!watchedSignals.empty()) {
+    for (auto& it : previousActions) {
+      sigaction(it.first, &it.second, NULL);
+    }
+    signalWakeFd = -1;
+#ifdef __linux__
+    pthread_sigmask(SIG_UNBLOCK, &signalMask, NULL);
+#endif
+  }
+#ifdef __linux__
+  for (auto& timer : timers) {
+    ::close(timer.fd);
+  }
+  if (signalFd >= 0) {
+    ::close(signalFd);
+  }
+  ::close(epollFd);
+#endif
+  ::close(wakePipe[0]);
+  ::close(wakePipe[1]);
+#endif
+}
+
+#ifdef __linux__
+void EventLoop::updateEpollInterest(int fd) {
+  epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events =
+      (fds.count(fd) ? EPOLLIN : 0) | (writeFds.count(fd) ? EPOLLOUT : 0);
+  ev.data.u64 = (uint64_t(EPOLL_TAG_FD) << 32) | uint32_t(fd);
+  if (!ev.events) {
+    // Closing an fd already drops it from the epoll set, so ENOENT/EBADF are
+    // expected here.
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+    return;
+  }
+  // Try ADD first: an fd that was closed and reused is no longer in the set
+  // even though we still track its number.
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+    return;
+  }
+  if (errno == EBADF) {
+    // Closed while still watched the other way, which the caller is about
+    // to drop as well.  A new fd with this number gets added again.
+    VLOG(1) << "Not watching closed fd " << fd;
+    return;
+  }
+  if (errno != EEXIST) {
+    STFATAL << "Error adding fd " << fd << " to epoll: " << strerror(errno);
+  }
+  FATAL_FAIL(epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev));
+}
+#endif
+
+void EventLoop::addFd(int fd) {
+  fds.insert(fd);
+#ifdef __linux__
+  updateEpollInterest(fd);
+#else
+  pollFdsDirty = true;
+#endif
+}
+
+void EventLoop::removeFd(int fd) {
+  if (!fds.erase(fd)) {
+    return;
+  }
+#ifdef __linux__
+  updateEpollInterest(fd);
+#else
+  pollFdsDirty = true;
+#endif
+}
+
+void EventLoop::watchWritable(int fd, bool enabled) {
+  if (enabled ? !writeFds.insert(fd).second : !writeFds.erase(fd)) {
+    return;
+  }
+#ifdef __linux__
+  updateEpollInterest(fd);
+#else
+  pollFdsDirty = true;
+#endif
+}
+
+void EventLoop::watchSignal(int signum) {
+#ifndef WIN32
+  if (watchedSignals.count(signum)) {
+    return;
+  }
+  if (watchedSignals.empty()) {
+    int unclaimed = -1;
+    if (!signalWakeFd.compare_exchange_strong(unclaimed, wakePipe[1])) {
+      LOG(WARNING) << "Another EventLoop is already watching signals";
+      return;
+    }
+  }
+  watchedSignals.insert(signum);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = forwardSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  struct sigaction previous;
+  FATAL_FAIL(sigaction(signum, &action, &previous));
+  previousActions[signum] = previous;
+
+#ifdef __linux__
+  sigaddset(&signalMask, signum);
+  sigset_t blockSet;
+  sigemptyset(&blockSet);
+  sigaddset(&blockSet, signum);
+  int maskResult = pthread_sigmask(SIG_BLOCK, &blockSet, NULL);
+  if (maskResult != 0) {
+    STFATAL << "Error blocking signal " << signum << ": "
+            << strerror(maskResult);
+  }
+  bool created = signalFd == -1;
+  signalFd = signalfd(signalFd, &signalMask, SFD_NONBLOCK | SFD_CLOEXEC);
+  FATAL_FAIL(signalFd);
+  if (created) {
+    addToEpoll(epollFd, signalFd, EPOLL_TAG_SIGNAL, 0);
+  }
+#endif
+#endif
+}
+
+int EventLoop::addTimer() {
+  Timer timer;
+#ifdef __linux__
+  timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  FATAL_FAIL(timer.fd);
+  addToEpoll(epollFd, timer.fd, EPOLL_TAG_TIMER, uint32_t(timers.size()));
+#endif
+  timers.push_back(timer);
+  return int(timers.size()) - 1;
+}
+
+void EventLoop::armTimer(int timerId, int64_t delayMs) {
+  Timer& timer = timers.at(timerId);
+  timer.armed = true;
+  timer.deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs);
+#ifdef __linux__
+  itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = delayMs / 1000;
+  spec.it_value.tv_nsec = (delayMs % 1000) * 1000 * 1000;
+  if (delayMs <= 0) {
+    // An all-zero value would disarm the timer instead.
+    spec.it_value.tv_sec = 0;
+    spec.it_value.tv_nsec = 1;
+  }
+  FATAL_FAIL(timerfd_settime(timer.fd, 0, &spec, NULL));
+#endif
+}
+
+void EventLoop::disarmTimer(int timerId) {
+  Timer& timer = timers.at(timerId);
+  if (!timer.armed) {
+    return;
+  }
+  timer.armed = false;
+#ifdef __linux__
+  itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  FATAL_FAIL(timerfd_settime(timer.fd, 0, &spec, NULL));
+  // Discard an expiration that raced with the disarm.
+  uint64_t expirations;
+  ssize_t rc = ::read(timer.fd, &expirations, sizeof(expirations));
+  (void)rc;
+#endif
+}
+
+void EventLoop::wake() {
+#ifndef WIN32
+  char b = 0;
+  // A full pipe already has a wakeup pending, so the result is ignored.
+  ssize_t rc = ::write(wakePipe[1], &b, 1);
+  (void)rc;
+#endif
+}
+
+void EventLoop::drainWakePipe(Events* events) {
+#ifndef WIN32
+  unsigned char buf[64];
+  while (true) {
+    ssize_t rc = ::read(wakePipe[0], buf, sizeof(buf));
+    if (rc <= 0) {
+      break;
+    }
+    for (ssize_t a = 0; a < rc; a++) {
+      if (buf[a] == 0) {
+        events->woken = true;
+      } else {
+        events->signals.push_back(buf[a]);
+      }
+    }
+  }
+#endif
+}
+
+void EventLoop::collectExpiredTimers(Events* events) {
+  auto now = std::chrono::steady_clock::now();
+  for (int a = 0; a < int(timers.size()); a++) {
+    if (timers[a].armed && timers[a].deadline <= now) {
+      timers[a].armed = false;
+      events->timers.push_back(a);
+    }
+  }
+}
+
+EventLoop::Events EventLoop::wait(int timeoutMs) {
+  Events events;
+#ifdef __linux__
+  epoll_event ready[64];
+  int numReady = epoll_wait(epollFd, ready, 64, timeoutMs);
+  if (numReady < 0) {
+    if (errno == EINTR) {
+      return events;
+    }
+    FATAL_FAIL(numReady);
+  }
+  for (int a = 0; a < numReady; a++) {
+    uint64_t tag = ready[a].data.u64 >> 32;
+    uint32_t value = uint32_t(ready[a].data.u64);
+    switch (tag) {
+      case EPOLL_TAG_FD: {
+        int fd = int(value);
+        uint32_t flags = ready[a].events;
+        if ((flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) && fds.count(fd)) {
+          events.readableFds.push_back(fd);
+        }
+        if ((flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && writeFds.count(fd)) {
+          events.writableFds.push_back(fd);
+        }
+        break;
+      }
+      case EPOLL_TAG_TIMER: {
+        uint64_t expirations;
+        Timer& timer = timers[value];
+        if (::read(timer.fd, &expirations, sizeof(expirations)) > 0 &&
+            timer.armed) {
+          timer.armed = false;
+          events.timers.push_back(int(value));
+        }
+        break;
+      }
+      case EPOLL_TAG_SIGNAL: {
+        signalfd_siginfo info;
+        while (::read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+          events.signals.push_back(int(info.ssi_signo));
+        }
+        break;
+      }
+      case EPOLL_TAG_WAKE:
+        drainWakePipe(&events);
+        break;
+    }
+  }
+#else
+  if (pollFdsDirty) {
+    pollFds.clear();
+#ifndef WIN32
+    pollFds.push_back({wakePipe[0], POLLIN, 0});
+#endif
+    set<int> allFds(fds);
+    allFds.insert(writeFds.begin(), writeFds.end());
+    for (int fd : allFds) {
+      short flags = (fds.count(fd) ? POLLIN : 0) |
+                    (writeFds.count(fd) ? POLLOUT : 0);
+      pollFds.push_back({fd, flags, 0});
+    }
+    pollFdsDirty = false;
+  }
+  auto now = std::chrono::steady_clock::now();
+  for (auto& timer : timers) {
+    if (!timer.armed) {
+      continue;
+    }
+    int64_t remainingMs =
+        std::chrono::duration_cast<std::chrono::milliseconds>(timer.deadline -
+                                                              now)
+            .count() +
+        1;
+    remainingMs = max(remainingMs, int64_t(0));
+    if (timeoutMs < 0 || remainingMs < timeoutMs) {
+      timeoutMs = int(remainingMs);
+    }
+  }
+#ifdef WIN32
+  // The console is not pollable and there is no wake pipe, so keep the
+  // 10ms cadence the client has always used on Windows.
+  if (timeoutMs < 0 || timeoutMs > 10) {
+    timeoutMs = 10;
+  }
+  int numReady = 0;
+  if (pollFds.empty()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+  } else {
+    numReady = WSAPoll(pollFds.data(), ULONG(pollFds.size()), timeoutMs);
+  }
+#else
+  int numReady = ::poll(pollFds.data(), pollFds.size(), timeoutMs);
+#endif
+  if (numReady < 0 && GetErrno() != EINTR) {
+    FATAL_FAIL(numReady);
+  }
+  for (auto& pfd : pollFds) {
+    if (numReady <= 0) {
+      break;
+    }
+    if (!pfd.revents) {
+      continue;
+    }
+    numReady--;
+    if (pfd.fd == wakePipe[0]) {
+      drainWakePipe(&events);
+      continue;
+    }
+    const short hangup = POLLHUP | POLLERR | POLLNVAL;
+    if ((pfd.revents & (POLLIN | hangup)) && fds.count(pfd.fd)) {
+      events.readableFds.push_back(pfd.fd);
+    }
+    if ((pfd.revents & (POLLOUT | hangup)) && writeFds.count(pfd.fd)) {
+      events.writableFds.push_back(pfd.fd);
+    }
+  }
+  collectExpiredTimers(&events);
+#endif
+  return events;
+}
+}  // namespace et
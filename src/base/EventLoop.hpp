@@ -0,0 +1,136 @@
+#ifndef __ET_EVENT_LOOP__
+#define __ET_EVENT_LOOP__
+
+#include "Headers.hpp"
+
+namespace et {
+/**
+ * @brief Blocks until a descriptor is readable, a signal arrives, a timer
+ * expires or another thread calls `wake()`, so an idle loop never wakes up.
+ *
+ * On Linux this is an epoll set with a signalfd and one monotonic timerfd per
+ * timer.  Other platforms use poll() and compute the timeout from the nearest
+ * timer deadline.  Signals are also caught by a handler that writes to the
+ * wake pipe, because a process-wide signal may be delivered to a thread that
+ * does not block it.  Only one loop per process may watch signals; later
+ * loops log a warning and ignore `watchSignal()`.
+ *
+ * Registration is incremental: descriptors are added and removed as they
+ * open and close instead of being rebuilt on every pass.  Not thread-safe
+ * except for `wake()`.
+ */
+class EventLoop {
+ public:
+  /** @brief Everything one call to `wait()` observed. */
+  struct Events {
+    /** @brief Registered descriptors that are readable (or hung up). */
+    vector<int> readableFds;
+    /** @brief Descriptors from `watchWritable()` that can take more bytes. */
+    vector<int> writableFds;
+    /** @brief Watched signals that were delivered. */
+    vector<int> signals;
+    /** @brief Timers that expired. */
+    vector<int> timers;
+    /** @brief Whether `wake()` was called. */
+    bool woken = false;
+
+    /** @brief Returns true if @p fd is in `readableFds`. */
+    bool isReadable(int fd) const {
+      return std::find(readableFds.begin(), readableFds.end(), fd) !=
+             readableFds.end();
+    }
+    /** @brief Returns true if @p fd is in `writableFds`. */
+    bool isWritable(int fd) const {
+      return std::find(writableFds.begin(), writableFds.end(), fd) !=
+             writableFds.end();
+    }
+  };
+
+  EventLoop();
+  ~EventLoop();
+
+  /**
+   * @brief Watches @p fd for readability.  Adding a descriptor that is
+   * already registered is a no-op, so callers can re-add after fd reuse.
+   */
+  void addFd(int fd);
+  /** @brief Stops watching @p fd.  The fd may already be closed. */
+  void removeFd(int fd);
+  /**
+   * @brief Starts or stops reporting @p fd as writable, independently of
+   * `addFd()`.  Only enable it while there is output waiting, since an idle
+   * socket is almost always writable.
+   */
+  void watchWritable(int fd, bool enabled);
+
+  /** @brief Reports deliveries of @p signum through `wait()`. */
+  void watchSignal(int signum);
+
+  /** @brief Creates a disarmed one-shot timer and returns its id. */
+  int addTimer();
+  /** @brief (Re)arms @p timerId to expire after @p delayMs milliseconds. */
+  void armTimer(int timerId, int64_t delayMs);
+  /** @brief Disarms @p timerId. */
+  void disarmTimer(int timerId);
+
+  /** @brief Makes the current or next `wait()` return.  Thread-safe. */
+  void wake();
+
+  /**
+   * @brief Waits for events.
+   * @param timeoutMs Longest time to block, 0 to only collect pending events
+   * or -1 to wait indefinitely.
+   */
+  Events wait(int timeoutMs);
+
+ protected:
+  /** @brief State kept for each timer. */
+  struct Timer {
+    /** @brief timerfd backing the timer (Linux only). */
+    int fd = -1;
+    /** @brief Whether the timer is armed. */
+    bool armed = false;
+    /** @brief Expiry time when armed. */
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  /** @brief Descriptors watched for reading. */
+  set<int> fds;
+  /** @brief Descriptors watched for writing. */
+  set<int> writeFds;
+  /** @brief Timers indexed by id. */
+  vector<Timer> timers;
+  /** @brief Signals passed to `watchSignal()`. */
+  set<int> watchedSignals;
+  /** @brief Self-pipe written by `wake()` and the signal handler. */
+  int wakePipe[2];
+#ifndef WIN32
+  /** @brief Dispositions replaced by `watchSignal()`, restored on exit. */
+  map<int, struct sigaction> previousActions;
+#endif
+#ifdef __linux__
+  /** @brief epoll set holding every descriptor, timerfd and the signalfd. */
+  int epollFd;
+  /** @brief signalfd for `watchedSignals`, or -1 before the first one. */
+  int signalFd;
+  /** @brief Signal mask of `signalFd`. */
+  sigset_t signalMask;
+#else
+  /** @brief pollfd list matching `fds`/`writeFds`, rebuilt after changes. */
+  vector<pollfd> pollFds;
+  /** @brief Whether `pollFds` is stale. */
+  bool pollFdsDirty;
+#endif
+
+#ifdef __linux__
+  /** @brief Syncs the epoll entry of @p fd with `fds` and `writeFds`. */
+  void updateEpollInterest(int fd);
+#endif
+  /** @brief Drains the wake pipe, recording signals written to it. */
+  void drainWakePipe(Events* events);
+  /** @brief Appends expired timers to @p events and disarms them. */
+  void collectExpiredTimers(Events* events);
+};
+}  // namespace et
+
+#endif  // __ET_EVENT_LOOP__
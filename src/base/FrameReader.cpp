@@ -0,0 +1,71 @@
+#include "FrameReader.hpp"
+
+namespace et {
+FrameReader::FrameReader(shared_ptr<SocketHandler> _socketHandler, int _fd,
+                         int64_t _maxLength)
+    : socketHandler(_socketHandler),
+      fd(_fd),
+      maxLength(_maxLength),
+      lengthBytesRead(0),
+      length(-1),
+      bodyBytesRead(0) {}
+
+ssize_t FrameReader::readSome(char* buf, size_t count) {
+  ssize_t bytesRead = socketHandler->read(fd, buf, count);
+  if (bytesRead == 0) {
+    error = "Connection closed during handshake";
+    return -1;
+  }
+  if (bytesRead < 0) {
+    auto localErrno = GetErrno();
+    if (localErrno == EAGAIN || localErrno == EWOULDBLOCK) {
+      return 0;
+    }
+    error = string("Error reading handshake: ") + strerror(localErrno);
+    return -1;
+  }
+  return bytesRead;
+}
+
+FrameReader::Status FrameReader::readAvailable() {
+  if (!error.empty()) {
+    return FRAME_ERROR;
+  }
+  while (length < 0) {
+    ssize_t bytesRead = readSome(lengthBytes + lengthBytesRead,
+                                 sizeof(int64_t) - lengthBytesRead);
+    if (bytesRead < 0) {
+      return FRAME_ERROR;
+    }
+    if (bytesRead == 0) {
+      return FRAME_INCOMPLETE;
+    }
+    lengthBytesRead += bytesRead;
+    if (lengthBytesRead < sizeof(int64_t)) {
+      continue;
+    }
+    int64_t declaredLength;
+    memcpy(&declaredLength, lengthBytes, sizeof(int64_t));
+    if (declaredLength < 0 || declaredLength > maxLength) {
+      error = string("Invalid handshake size (<0 or >") + to_string(maxLength) +
+              "): " + to_string(declaredLength);
+      return FRAME_ERROR;
+    }
+    length = declaredLength;
+    body.resize(length);
+  }
+
+  while (bodyBytesRead < size_t(length)) {
+    ssize_t bytesRead =
+        readSome(&body[bodyBytesRead], size_t(length) - bodyBytesRead);
+    if (bytesRead < 0) {
+      return FRAME_ERROR;
+    }
+    if (bytesRead == 0) {
+      return FRAME_INCOMPLETE;
+    }
+    bodyBytesRead += bytesRead;
+  }
+  return FRAME_COMPLETE;
+}
+}  // namespace et
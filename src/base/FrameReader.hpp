@@ -0,0 +1,92 @@
+#ifndef __ET_FRAME_READER__
+#define __ET_FRAME_READER__
+
+#include "Headers.hpp"
+#include "SocketHandler.hpp"
+
+namespace et {
+/**
+ * @brief Incrementally assembles one length-prefixed frame (as written by
+ * `SocketHandler::writeProto`/`writePacket`) from a non-blocking socket.
+ *
+ * Every call consumes only the bytes that are already available, so a slow or
+ * silent peer can never stall the caller.  The claimed length is validated
+ * against a hard cap before any buffer is allocated, which keeps
+ * unauthenticated peers from reserving large amounts of memory.
+ */
+class FrameReader {
+ public:
+  /** @brief Progress reported by `readAvailable()`. */
+  enum Status {
+    /** @brief More bytes are required before the frame is complete. */
+    FRAME_INCOMPLETE,
+    /** @brief A full frame has been received and is ready in `getFrame()`. */
+    FRAME_COMPLETE,
+    /** @brief The peer closed, errored, or sent an invalid length. */
+    FRAME_ERROR,
+  };
+
+  /**
+   * @brief Creates a reader for @p fd that rejects frames above @p
+   * maxLength bytes.
+   */
+  FrameReader(shared_ptr<SocketHandler> socketHandler, int fd,
+              int64_t maxLength);
+
+  /**
+   * @brief Reads whatever bytes are currently available without blocking.
+   */
+  Status readAvailable();
+
+  /** @brief Returns the frame body once `FRAME_COMPLETE` was reported. */
+  inline const string& getFrame() const { return body; }
+
+  /** @brief Describes why `FRAME_ERROR` was reported. */
+  inline const string& getError() const { return error; }
+
+  /** @brief Returns the descriptor this reader consumes. */
+  inline int getFd() const { return fd; }
+
+  /**
+   * @brief Parses the completed frame as a protobuf of type T.
+   * @throws std::runtime_error when the frame is not a valid T.
+   */
+  template <typename T>
+  inline T parseProto() const {
+    T t;
+    if (!body.empty() && !t.ParseFromString(body)) {
+      throw std::runtime_error("Invalid proto");
+    }
+    return t;
+  }
+
+ protected:
+  /** @brief Socket helper used for the non-blocking reads. */
+  shared_ptr<SocketHandler> socketHandler;
+  /** @brief Descriptor being read. */
+  int fd;
+  /** @brief Largest frame body accepted from the peer. */
+  int64_t maxLength;
+  /** @brief Raw bytes of the length prefix received so far. */
+  char lengthBytes[sizeof(int64_t)];
+  /** @brief Number of length prefix bytes received so far. */
+  size_t lengthBytesRead;
+  /** @brief Declared body length, or -1 until the prefix is complete. */
+  int64_t length;
+  /** @brief Frame body accumulated so far. */
+  string body;
+  /** @brief Number of body bytes received so far. */
+  size_t bodyBytesRead;
+  /** @brief Error description for `FRAME_ERROR`. */
+  string error;
+
+  /**
+   * @brief Reads up to @p count bytes into @p buf from the non-blocking
+   * socket.
+   * @return Bytes read, 0 when nothing is available, -1 on error/EOF.
+   */
+  ssize_t readSome(char* buf, size_t count);
+};
+}  // namespace et
+
+#endif  // __ET_FRAME_READER__
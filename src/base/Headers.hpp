@@ -43,6 +43,11 @@ inline int close(int fd) { return ::closesocket(fd); }
 #ifdef WIN32
 using uid_t = int;
 using gid_t = int;
+/** @brief Scatter/gather segment, mirroring the POSIX definition. */
+struct iovec {
+  void* iov_base;
+  size_t iov_len;
+};
 #else
 #include <arpa/inet.h>
 #include <grp.h>
@@ -50,11 +55,13 @@ using gid_t = int;
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <paths.h>
+#include <poll.h>
 #include <pthread.h>
 #include <pwd.h>
 #include <resolv.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <termios.h>
@@ -399,6 +406,35 @@ inline bool isSocketWritable(int fd) {
   return FD_ISSET(fd, &fdset);
 }
 
+/**
+ * Wait up to timeoutMs milliseconds (-1 for no limit) for a fd to become
+ * readable, or writable when forWrite is set.  Returns as soon as the kernel
+ * reports the fd ready, so callers never oversleep a transient EAGAIN.
+ *
+ * @return true if the fd is ready (or in an error state that the next
+ *   read/write will report), or false on timeout or interruption.
+ */
+inline bool waitOnSocketReady(int fd, bool forWrite, int timeoutMs) {
+  pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = forWrite ? POLLOUT : POLLIN;
+  pfd.revents = 0;
+#ifdef WIN32
+  const int pollResult = WSAPoll(&pfd, 1, timeoutMs);
+#else
+  const int pollResult = ::poll(&pfd, 1, timeoutMs);
+#endif
+  if (pollResult < 0) {
+    if (errno == EINTR) {
+      // Interrupted by the signal, the caller will retry.
+      return false;
+    } else {
+      FATAL_FAIL(pollResult);
+    }
+  }
+  return pollResult > 0;
+}
+
 inline string genRandomAlphaNum(int len) {
   static const char alphanum[] =
       "0123456789"
@@ -1,6 +1,11 @@
 #include "RawSocketUtils.hpp"
 
 namespace et {
+// Longest single readiness wait; the loops simply wait again afterwards.
+#define RAW_SOCKET_READY_POLL_MS (1000)
+// Descriptors a single receiveFd() message has room for
+#define RECEIVE_FD_SLOTS (4)
+
 void RawSocketUtils::writeAll(int fd, const char* buf, size_t count) {
   if (fd < 0) {
     throw std::runtime_error("Invalid file descriptor for readAll");
@@ -19,8 +24,8 @@ void RawSocketUtils::writeAll(int fd, const char* buf, size_t count) {
     if (rc < 0) {
       auto localErrno = GetErrno();
       if (localErrno == EAGAIN || localErrno == EWOULDBLOCK) {
-        // This is fine, just keep retrying
-        std::this_thread::sleep_for(std::chrono::microseconds(100 * 1000));
+        // This is fine, retry as soon as the descriptor drains
+        waitOnSocketReady(fd, true, RAW_SOCKET_READY_POLL_MS);
         continue;
       }
       STERROR << "Cannot write to raw socket: " << strerror(localErrno);
@@ -43,7 +48,7 @@ void RawSocketUtils::readAll(int fd, char* buf, size_t count) {
 
   size_t bytesRead = 0;
   do {
-    if (!waitOnSocketData(fd)) {
+    if (!waitOnSocketReady(fd, false, RAW_SOCKET_READY_POLL_MS)) {
       continue;
     }
 #ifdef WIN32
@@ -66,4 +71,121 @@ void RawSocketUtils::readAll(int fd, char* buf, size_t count) {
     bytesRead += rc;
   } while (bytesRead != count);
 }
+
+#ifndef WIN32
+void RawSocketUtils::sendFd(int socketFd, int fd) {
+  // A descriptor has to travel with at least one byte of regular data
+  char marker = 'F';
+  iovec iov;
+  iov.iov_base = &marker;
+  iov.iov_len = 1;
+  union {
+    cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  while (true) {
+    ssize_t rc = ::sendmsg(socketFd, &msg, 0);
+    if (rc == 1) {
+      return;
+    }
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      waitOnSocketReady(socketFd, true, RAW_SOCKET_READY_POLL_MS);
+      continue;
+    }
+    STERROR << "Cannot send descriptor: " << strerror(errno);
+    throw std::runtime_error("Cannot send descriptor");
+  }
+}
+
+int RawSocketUtils::receiveFd(int socketFd, int timeoutMs) {
+  char marker;
+  iovec iov;
+  iov.iov_base = &marker;
+  iov.iov_len = 1;
+  // Room for a few extra descriptors, so a peer that sends more than one
+  // has them all delivered here to be closed rather than leaked
+  union {
+    cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int) * RECEIVE_FD_SLOTS)];
+  } control;
+  msghdr msg;
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  while (true) {
+    memset(&control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         deadline - std::chrono::steady_clock::now())
+                         .count();
+    if (remaining <= 0) {
+      throw std::runtime_error("Timed out waiting for a descriptor");
+    }
+    if (!waitOnSocketReady(socketFd, false, int(remaining))) {
+      continue;
+    }
+#ifdef MSG_CMSG_CLOEXEC
+    ssize_t rc = ::recvmsg(socketFd, &msg, MSG_CMSG_CLOEXEC);
+#else
+    ssize_t rc = ::recvmsg(socketFd, &msg, 0);
+#endif
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      continue;
+    }
+    if (rc < 0) {
+      STERROR << "Cannot receive descriptor: " << strerror(errno);
+      throw std::runtime_error("Cannot receive descriptor");
+    }
+    if (rc == 0) {
+      throw std::runtime_error("Socket closed before a descriptor arrived");
+    }
+    break;
+  }
+  vector<int> fds;
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t a = 0; a < count; a++) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + a * sizeof(int), sizeof(int));
+      fds.push_back(fd);
+    }
+  }
+  if ((msg.msg_flags & MSG_CTRUNC) || fds.size() != 1) {
+    // Anything we did receive is ours to close
+    for (int fd : fds) {
+      ::close(fd);
+    }
+    if (fds.empty() && !(msg.msg_flags & MSG_CTRUNC)) {
+      throw std::runtime_error("Message did not carry a descriptor");
+    }
+    STERROR << "Expected one descriptor, got " << fds.size()
+            << ((msg.msg_flags & MSG_CTRUNC) ? " (truncated)" : "");
+    throw std::runtime_error("Message carried more than one descriptor");
+  }
+#ifndef MSG_CMSG_CLOEXEC
+  FATAL_FAIL(::fcntl(fds[0], F_SETFD, FD_CLOEXEC));
+#endif
+  return fds[0];
+}
+#endif
 }  // namespace et
@@ -10,8 +10,8 @@ namespace et {
 class RawSocketUtils {
  public:
   /**
-   * @brief Writes the entire buffer to the given descriptor, retrying on
-   * EAGAIN.
+   * @brief Writes the entire buffer to the given descriptor, waiting for
+   * writability on EAGAIN.
    */
   static void writeAll(int fd, const char* buf, size_t count);
 
@@ -19,6 +19,23 @@ class RawSocketUtils {
    * @brief Reads exactly `count` bytes from the descriptor, waiting for data.
    */
   static void readAll(int fd, char* buf, size_t count);
+
+#ifndef WIN32
+  /**
+   * @brief Sends a copy of descriptor `fd` over the unix socket `socketFd`
+   * (SCM_RIGHTS).  The caller keeps its own copy.
+   */
+  static void sendFd(int socketFd, int fd);
+
+  /**
+   * @brief Receives a descriptor sent with `sendFd`, waiting up to
+   * @p timeoutMs for it to arrive.  The descriptor is close-on-exec.
+   * @throws std::runtime_error if the socket closes, the time runs out or
+   * the message carries no descriptor or more than one; any that did
+   * arrive are closed.
+   */
+  static int receiveFd(int socketFd, int timeoutMs);
+#endif
 };
 }  // namespace et
 #endif  // __ET_RAW_SOCKET_UTILS__
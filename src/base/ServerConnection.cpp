@@ -12,157 +12,367 @@ ServerConnection::ServerConnection(
 ServerConnection::~ServerConnection() {}
 
 bool ServerConnection::acceptNewConnection(int fd) {
-  // Loop through existing threads, killing the ones that are done
   VLOG(1) << "Accepting connection";
   int clientSocketFd = socketHandler->accept(fd);
   if (clientSocketFd < 0) {
     return false;
   }
   VLOG(1) << "SERVER: got client socket fd: " << clientSocketFd;
-  lock_guard<std::recursive_mutex> guard(classMutex);
-  clientHandlerThreadPool->enqueue(
-      [this, clientSocketFd]() { this->clientHandler(clientSocketFd); });
+  {
+    lock_guard<std::mutex> guard(handshakeMutex);
+    if (pendingHandshakes.size() >= size_t(MAX_PENDING_HANDSHAKES)) {
+      // Drop the peer that has been stalling the longest rather than refusing
+      // the newcomer, so idle sockets can't lock out real clients.
+      auto oldest = pendingHandshakes.begin();
+      for (auto it = pendingHandshakes.begin(); it != pendingHandshakes.end();
+           ++it) {
+        if (it->second.deadline < oldest->second.deadline) {
+          oldest = it;
+        }
+      }
+      LOG(WARNING) << "Too many pending handshakes, dropping fd "
+                   << oldest->first;
+      socketHandler->close(oldest->first);
+      pendingHandshakes.erase(oldest);
+    }
+    PendingHandshake handshake;
+    handshake.reader.reset(new FrameReader(socketHandler, clientSocketFd,
+                                           MAX_PRE_AUTH_FRAME_LENGTH));
+    handshake.deadline = std::chrono::steady_clock::now() +
+                         std::chrono::seconds(HANDSHAKE_DEADLINE_SECONDS);
+    pendingHandshakes[clientSocketFd] = handshake;
+  }
+  // Clients send their request right after connecting, so it is often
+  // already here.
+  processPendingHandshakes({clientSocketFd});
   return true;
 }
 
-void ServerConnection::shutdown() {
-  lock_guard<std::recursive_mutex> guard(classMutex);
-  socketHandler->stopListening(serverEndpoint);
-  clientHandlerThreadPool.reset();
-  for (const auto& it : clientConnections) {
-    it.second->shutdown();
+void ServerConnection::getPendingHandshakeFds(set<int>* fds) {
+  lock_guard<std::mutex> guard(handshakeMutex);
+  for (const auto& it : pendingHandshakes) {
+    fds->insert(it.first);
   }
-  clientConnections.clear();
 }
 
-void ServerConnection::clientHandler(int clientSocketFd) {
-  el::Helpers::setThreadName("server-clientHandler");
+void ServerConnection::getPendingResponseFds(set<int>* fds) {
+  lock_guard<std::mutex> guard(handshakeMutex);
+  for (const auto& it : pendingResponses) {
+    fds->insert(it.first);
+  }
+}
 
-  string clientId;
-  bool createdClientConnection = false;
-  try {
-    et::ConnectRequest request =
-        socketHandler->readProto<et::ConnectRequest>(clientSocketFd, true);
-    {
-      int version = request.version();
-      if (version != PROTOCOL_VERSION) {
-        STERROR << "Got a client request but the client version does not "
-                   "match.  Client: "
-                << version << " != Server: " << PROTOCOL_VERSION;
-        et::ConnectResponse response;
-
-        std::ostringstream errorStream;
-        errorStream
-            << "Mismatched protocol versions.  "
-            << "Your client & server must be on the same version of ET.  "
-            << "Client: " << request.version()
-            << " != Server: " << PROTOCOL_VERSION;
-        response.set_status(MISMATCHED_PROTOCOL);
-        response.set_error(errorStream.str());
-        socketHandler->writeProto(clientSocketFd, response, true);
+void ServerConnection::processPendingHandshakes(const set<int>& readyFds) {
+  vector<pair<int, ConnectRequest>> completedRequests;
+  vector<pair<PendingResponse, bool>> finishedResponses;
+  {
+    lock_guard<std::mutex> guard(handshakeMutex);
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = pendingHandshakes.begin(); it != pendingHandshakes.end();) {
+      int clientSocketFd = it->first;
+      const auto& reader = it->second.reader;
+      FrameReader::Status status = FrameReader::FRAME_INCOMPLETE;
+      if (readyFds.count(clientSocketFd)) {
+        status = reader->readAvailable();
+      }
+      if (status == FrameReader::FRAME_INCOMPLETE) {
+        if (now < it->second.deadline) {
+          ++it;
+          continue;
+        }
+        LOG(WARNING) << "Client on fd " << clientSocketFd
+                     << " did not finish its handshake in time";
+        socketHandler->close(clientSocketFd);
+      } else if (status == FrameReader::FRAME_ERROR) {
+        LOG(WARNING) << "Error handling new client: " << reader->getError();
         socketHandler->close(clientSocketFd);
-        return;
+      } else {
+        try {
+          completedRequests.push_back(
+              make_pair(clientSocketFd, reader->parseProto<ConnectRequest>()));
+        } catch (const runtime_error& err) {
+          LOG(WARNING) << "Error handling new client: " << err.what();
+          socketHandler->close(clientSocketFd);
+        }
       }
+      it = pendingHandshakes.erase(it);
     }
-    clientId = request.clientid();
-    shared_ptr<ServerClientConnection> serverClientState = NULL;
-    bool clientKeyExistsNow;
 
-    {
-      lock_guard<std::recursive_mutex> guard(classMutex);
-
-      // Log within the mutex, so that we can guarantee that this client id wins
-      // the lock when this message appears.
-      LOG(INFO) << "Got client with id: " << clientId;
-
-      clientKeyExistsNow = clientKeyExists(clientId);
-      if (clientConnectionExists(clientId)) {
-        serverClientState = getClientConnection(clientId);
-      } else if (clientKeyExistsNow) {
-        createdClientConnection = true;
-        serverClientState.reset(new ServerClientConnection(
-            socketHandler, clientId, clientSocketFd, clientKeys.at(clientId)));
-        clientConnections.insert(std::make_pair(clientId, serverClientState));
-      }
-    }
-    if (!clientKeyExistsNow) {
-      LOG(INFO) << "Got a client that we have no key for";
-
-      et::ConnectResponse response;
-      std::ostringstream errorStream;
-      errorStream << "Client is not registered";
-      response.set_error(errorStream.str());
-      response.set_status(INVALID_KEY);
-      socketHandler->writeProto(clientSocketFd, response, true);
-
-      socketHandler->close(clientSocketFd);
-    } else if (createdClientConnection) {
-      et::ConnectResponse response;
-      response.set_status(NEW_CLIENT);
-      socketHandler->writeProto(clientSocketFd, response, true);
-
-      LOG(INFO) << "New client.  Setting up connection";
-      VLOG(1) << "Created client with id " << clientId;
-
-      {
-        lock_guard<std::recursive_mutex> guard(classMutex);
-
-        if (!newClient(serverClientState)) {
-          VLOG(1) << "newClient failed";
-          // Client creation failed, Destroy the new client
-          removeClient(clientId);
-          socketHandler->close(clientSocketFd);
+    for (auto it = pendingResponses.begin(); it != pendingResponses.end();) {
+      bool sent = false;
+      if (readyFds.count(it->first)) {
+        if (!flushResponse(it->first, &it->second)) {
+          finishedResponses.push_back(make_pair(it->second, false));
+          it = pendingResponses.erase(it);
+          continue;
         }
+        sent = it->second.buffer.empty();
       }
-    } else {
-      et::ConnectResponse response;
-      response.set_status(RETURNING_CLIENT);
-      socketHandler->writeProto(clientSocketFd, response, true);
+      if (!sent && now < it->second.deadline) {
+        ++it;
+        continue;
+      }
+      if (!sent) {
+        LOG(WARNING) << "Client on fd " << it->first
+                     << " did not take its response in time";
+      }
+      finishedResponses.push_back(make_pair(it->second, sent));
+      it = pendingResponses.erase(it);
+    }
+  }
+  // Callbacks hand sockets to sessions and may take a while, so they run
+  // without handshakeMutex.
+  for (const auto& it : finishedResponses) {
+    finishResponse(it.first, it.second);
+  }
+  for (const auto& it : completedRequests) {
+    handleConnectRequest(it.first, it.second);
+  }
+}
 
-      lock_guard<std::recursive_mutex> guard(classMutex);
-      serverClientState->recoverClient(clientSocketFd);
+void ServerConnection::shutdown() {
+  std::unique_ptr<ThreadPool> threadPool;
+  {
+    lock_guard<std::recursive_mutex> guard(classMutex);
+    socketHandler->stopListening(serverEndpoint);
+    threadPool = std::move(clientHandlerThreadPool);
+  }
+  // Join outside of classMutex: recovery tasks take it.
+  threadPool.reset();
+  vector<PendingResponse> unsentResponses;
+  {
+    lock_guard<std::mutex> guard(handshakeMutex);
+    for (const auto& it : pendingHandshakes) {
+      socketHandler->close(it.first);
     }
-  } catch (const runtime_error& err) {
-    // Comm failed, close the connection
-    LOG(WARNING) << "Error handling new client: " << err.what();
-    if (createdClientConnection) {
-      destroyPartialConnection(clientId);
-    } else {
-      socketHandler->close(clientSocketFd);
+    pendingHandshakes.clear();
+    for (const auto& it : pendingResponses) {
+      unsentResponses.push_back(it.second);
     }
-  } catch (const std::exception& e) {
-    LOG(ERROR) << "Got an unexpected error handling new client: " << e.what();
-    if (createdClientConnection) {
-      destroyPartialConnection(clientId);
+    pendingResponses.clear();
+  }
+  for (const auto& pending : unsentResponses) {
+    finishResponse(pending, false);
+  }
+  for (const auto& session : sessions.removeAll()) {
+    shared_ptr<ServerClientConnection> connection;
+    {
+      lock_guard<std::mutex> guard(session->stateMutex);
+      connection = session->connection;
+    }
+    if (connection) {
+      connection->shutdown();
+    }
+  }
+}
+
+bool ServerConnection::clientConnectionExists(const string& clientId) {
+  shared_ptr<ClientSession> session = sessions.find(clientId);
+  if (!session) {
+    return false;
+  }
+  lock_guard<std::mutex> guard(session->stateMutex);
+  return session->connection != nullptr;
+}
+
+shared_ptr<ServerClientConnection> ServerConnection::getClientConnection(
+    const string& clientId) {
+  shared_ptr<ClientSession> session = sessions.find(clientId);
+  shared_ptr<ServerClientConnection> connection;
+  if (session) {
+    lock_guard<std::mutex> guard(session->stateMutex);
+    connection = session->connection;
+  }
+  if (!connection) {
+    STFATAL << "Error: Tried to get a client connection that doesn't exist";
+  }
+  return connection;
+}
+
+void ServerConnection::handleConnectRequest(int clientSocketFd,
+                                            const ConnectRequest& request) {
+  auto closeSocket = [this, clientSocketFd]() {
+    socketHandler->close(clientSocketFd);
+  };
+  int version = request.version();
+  if (version != PROTOCOL_VERSION) {
+    STERROR << "Got a client request but the client version does not "
+               "match.  Client: "
+            << version << " != Server: " << PROTOCOL_VERSION;
+    et::ConnectResponse response;
+
+    std::ostringstream errorStream;
+    errorStream << "Mismatched protocol versions.  "
+                << "Your client & server must be on the same version of ET.  "
+                << "Client: " << request.version()
+                << " != Server: " << PROTOCOL_VERSION;
+    response.set_status(MISMATCHED_PROTOCOL);
+    response.set_error(errorStream.str());
+    sendResponse(clientSocketFd, response, closeSocket, closeSocket);
+    return;
+  }
+  string clientId = request.clientid();
+  shared_ptr<ServerClientConnection> serverClientState = NULL;
+  bool createdClientConnection = false;
+  LOG(INFO) << "Got client with id: " << clientId;
+
+  shared_ptr<ClientSession> session = sessions.find(clientId);
+  if (session) {
+    // Only this client's session is locked, and only to pick or create its
+    // connection.
+    lock_guard<std::mutex> guard(session->stateMutex);
+    if (session->connection) {
+      serverClientState = session->connection;
     } else {
-      socketHandler->close(clientSocketFd);
+      createdClientConnection = true;
+      serverClientState.reset(new ServerClientConnection(
+          socketHandler, clientId, clientSocketFd, session->key));
+      session->connection = serverClientState;
+    }
+  }
+  if (!session) {
+    LOG(INFO) << "Got a client that we have no key for";
+
+    et::ConnectResponse response;
+    std::ostringstream errorStream;
+    errorStream << "Client is not registered";
+    response.set_error(errorStream.str());
+    response.set_status(INVALID_KEY);
+    sendResponse(clientSocketFd, response, closeSocket, closeSocket);
+  } else if (createdClientConnection) {
+    et::ConnectResponse response;
+    response.set_status(NEW_CLIENT);
+    sendResponse(
+        clientSocketFd, response,
+        [this, clientId, serverClientState]() {
+          LOG(INFO) << "New client.  Setting up connection";
+          VLOG(1) << "Created client with id " << clientId;
+
+          if (!newClient(serverClientState)) {
+            VLOG(1) << "newClient failed";
+            // Client creation failed, Destroy the new client
+            removeClient(clientId);
+          }
+        },
+        [this, clientId]() { destroyPartialConnection(clientId); });
+  } else {
+    et::ConnectResponse response;
+    response.set_status(RETURNING_CLIENT);
+    sendResponse(
+        clientSocketFd, response,
+        [this, session, serverClientState, clientSocketFd]() {
+          // Recovery exchanges catchup buffers that can be large, so it runs
+          // on the pool instead of the thread driving the handshakes.  Only
+          // this client's recoverMutex is held during the exchange.
+          lock_guard<std::recursive_mutex> guard(classMutex);
+          if (!clientHandlerThreadPool) {
+            socketHandler->close(clientSocketFd);
+            return;
+          }
+          clientHandlerThreadPool->enqueue(
+              [session, serverClientState, clientSocketFd]() {
+                el::Helpers::setThreadName("server-clientHandler");
+                lock_guard<std::mutex> recoverGuard(session->recoverMutex);
+                serverClientState->recoverClient(clientSocketFd);
+              });
+        },
+        closeSocket);
+  }
+}
+
+void ServerConnection::sendResponse(int clientSocketFd,
+                                    const ConnectResponse& response,
+                                    std::function<void()> onSent,
+                                    std::function<void()> onFailed) {
+  string s;
+  if (!response.SerializeToString(&s)) {
+    STFATAL << "Serialization of " << response.GetTypeName() << " failed!";
+  }
+  int64_t length = s.length();
+  PendingResponse pending;
+  pending.buffer.append((const char*)&length, sizeof(int64_t));
+  pending.buffer.append(s);
+  pending.deadline = std::chrono::steady_clock::now() +
+                     std::chrono::seconds(HANDSHAKE_DEADLINE_SECONDS);
+  pending.onSent = onSent;
+  pending.onFailed = onFailed;
+  if (!flushResponse(clientSocketFd, &pending)) {
+    finishResponse(pending, false);
+    return;
+  }
+  if (pending.buffer.empty()) {
+    finishResponse(pending, true);
+    return;
+  }
+  // The peer isn't reading; the event loop writes the rest once it can.
+  lock_guard<std::mutex> guard(handshakeMutex);
+  pendingResponses[clientSocketFd] = pending;
+}
+
+bool ServerConnection::flushResponse(int clientSocketFd,
+                                     PendingResponse* pending) {
+  while (!pending->buffer.empty()) {
+    ssize_t bytesWritten = socketHandler->write(
+        clientSocketFd, pending->buffer.data(), pending->buffer.length());
+    if (bytesWritten < 0) {
+      auto localErrno = GetErrno();
+      if (localErrno == EAGAIN || localErrno == EWOULDBLOCK) {
+        return true;
+      }
+      LOG(WARNING) << "Error writing to new client: " << strerror(localErrno);
+      return false;
     }
+    pending->buffer.erase(0, bytesWritten);
+  }
+  return true;
+}
+
+void ServerConnection::finishResponse(const PendingResponse& pending,
+                                      bool sent) {
+  if (!sent) {
+    pending.onFailed();
+    return;
+  }
+  try {
+    pending.onSent();
+  } catch (const std::exception& e) {
+    // Comm failed, close the connection
+    LOG(WARNING) << "Error handling new client: " << e.what();
+    pending.onFailed();
   }
 }
 
 bool ServerConnection::removeClient(const string& id) {
-  lock_guard<std::recursive_mutex> guard(classMutex);
-  if (clientKeys.find(id) == clientKeys.end()) {
+  shared_ptr<ClientSession> session = sessions.remove(id);
+  if (!session) {
     return false;
   }
-  clientKeys.erase(id);
-  if (clientConnections.find(id) == clientConnections.end()) {
-    return true;
+  shared_ptr<ServerClientConnection> connection;
+  {
+    lock_guard<std::mutex> guard(session->stateMutex);
+    connection = session->connection;
+    session->connection.reset();
+  }
+  if (connection) {
+    connection->shutdown();
   }
-  auto connection = clientConnections[id];
-  connection->shutdown();
-  clientConnections.erase(id);
   return true;
 }
 
 void ServerConnection::destroyPartialConnection(const string& clientId) {
-  lock_guard<std::recursive_mutex> guard(classMutex);
-  const auto it = clientConnections.find(clientId);
-  if (it == clientConnections.end()) {
+  shared_ptr<ClientSession> session = sessions.find(clientId);
+  if (!session) {
     return;
   }
-  it->second->shutdown();
-  clientConnections.erase(it);
+  shared_ptr<ServerClientConnection> connection;
+  {
+    lock_guard<std::mutex> guard(session->stateMutex);
+    connection = session->connection;
+    session->connection.reset();
+  }
+  if (connection) {
+    connection->shutdown();
+  }
 }
 
 }  // namespace et
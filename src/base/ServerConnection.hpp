@@ -1,8 +1,10 @@
 #ifndef __ET_SERVER_CONNECTION__
 #define __ET_SERVER_CONNECTION__
 
+#include "FrameReader.hpp"
 #include "Headers.hpp"
 #include "ServerClientConnection.hpp"
+#include "SessionRegistry.hpp"
 #include "SocketHandler.hpp"
 
 namespace et {
@@ -11,12 +13,48 @@ struct IdKeyPair {
   string key;
 };
 
+/** @brief Largest handshake frame accepted from a peer that is not yet
+ * identified. */
+const int64_t MAX_PRE_AUTH_FRAME_LENGTH = 4 * 1024;
+/** @brief Seconds a freshly accepted peer has to finish its handshake. */
+const int HANDSHAKE_DEADLINE_SECONDS = 10;
+/** @brief Handshakes tracked at once; the oldest is dropped past this. */
+const int MAX_PENDING_HANDSHAKES = 256;
+
+/**
+ * @brief A handshake that is waiting on its peer, advanced by the owner's
+ * event loop.
+ */
+struct PendingHandshake {
+  /** @brief Accumulates the handshake frame without blocking. */
+  shared_ptr<FrameReader> reader;
+  /** @brief Time after which the peer is dropped. */
+  std::chrono::steady_clock::time_point deadline;
+};
+
+/**
+ * @brief A `ConnectResponse` the peer has not taken in full yet, flushed by
+ * the owner's event loop.
+ */
+struct PendingResponse {
+  /** @brief Length-prefixed response bytes still to be written. */
+  string buffer;
+  /** @brief Time after which the peer is dropped. */
+  std::chrono::steady_clock::time_point deadline;
+  /** @brief Runs once the whole response is written. */
+  std::function<void()> onSent;
+  /** @brief Releases the socket when the response can't be written. */
+  std::function<void()> onFailed;
+};
+
 /**
  * @brief Base class for servers that accept clients over sockets and track
  * them.
  *
  * Holds registered client keys and creates `ServerClientConnection` instances
- * for each authenticated client that connects.
+ * for each authenticated client that connects.  Sessions live in a sharded
+ * registry and every network exchange runs without any registry lock held,
+ * so one slow client can't delay the others.
  */
 class ServerConnection {
  public:
@@ -26,53 +64,60 @@ class ServerConnection {
   ~ServerConnection();
 
   inline bool clientKeyExists(const string& clientId) {
-    lock_guard<std::recursive_mutex> guard(classMutex);
-    return clientKeys.find(clientId) != clientKeys.end();
+    return sessions.find(clientId) != nullptr;
   }
 
-  inline bool clientConnectionExists(const string& clientId) {
-    lock_guard<std::recursive_mutex> guard(classMutex);
-    return clientConnections.find(clientId) != clientConnections.end();
-  }
+  /** @brief Returns true once the client has connected at least once. */
+  bool clientConnectionExists(const string& clientId);
 
   inline shared_ptr<SocketHandler> getSocketHandler() { return socketHandler; }
 
   /**
-   * @brief Accepts a pending connection on the listening fd and starts a
-   * handler.
+   * @brief Accepts a pending connection on the listening fd and queues its
+   * handshake.
+   *
+   * The handshake is advanced by `processPendingHandshakes()`, so this never
+   * blocks on the new peer.
    * @param fd Listening socket descriptor returned by `listen()`.
    */
   bool acceptNewConnection(int fd);
 
+  /**
+   * @brief Adds the sockets of in-progress handshakes to @p fds so the event
+   * loop can wake up when they become readable.
+   */
+  void getPendingHandshakeFds(set<int>* fds);
+
+  /**
+   * @brief Adds the sockets of responses that are waiting for room to @p fds
+   * so the event loop can wake up when they become writable.
+   */
+  void getPendingResponseFds(set<int>* fds);
+
+  /**
+   * @brief Advances the handshakes and responses whose sockets are in
+   * @p readyFds and drops peers that are past their deadline or misbehave.
+   */
+  void processPendingHandshakes(const set<int>& readyFds);
+
   /**
    * @brief Stops accepting new clients and shuts down existing connections.
    */
   void shutdown();
 
   inline void addClientKey(const string& id, const string& passkey) {
-    lock_guard<std::recursive_mutex> guard(classMutex);
-    clientKeys[id] = passkey;
+    sessions.addKey(id, passkey);
   }
 
-  /**
-   * @brief Entry point invoked on the thread pool for each client connection.
-   */
-  void clientHandler(int clientSocketFd);
-
   /**
    * @brief Removes a registered client and terminates its active connection.
    */
   bool removeClient(const string& id);
 
+  /** @brief Returns the client's connection; the client must be connected.
+   */
   shared_ptr<ServerClientConnection> getClientConnection(
-      const string& clientId) {
-    lock_guard<std::recursive_mutex> guard(classMutex);
-    auto it = clientConnections.find(clientId);
-    if (it == clientConnections.end()) {
-      STFATAL << "Error: Tried to get a client connection that doesn't exist";
-    }
-    return it->second;
-  }
+      const string& clientId);
 
   /**
    * @brief Callback that derived classes use to integrate newly authenticated
@@ -87,18 +132,44 @@ class ServerConnection {
    */
   void destroyPartialConnection(const string& clientId);
 
+  /**
+   * @brief Answers a fully received `ConnectRequest` and hands the socket to
+   * a new or returning client.
+   */
+  void handleConnectRequest(int clientSocketFd, const ConnectRequest& request);
+
+  /**
+   * @brief Writes @p response without blocking, then runs @p onSent.  What
+   * the socket can't take yet is queued in `pendingResponses`.
+   */
+  void sendResponse(int clientSocketFd, const ConnectResponse& response,
+                    std::function<void()> onSent,
+                    std::function<void()> onFailed);
+
+  /**
+   * @brief Writes as much of @p pending as @p clientSocketFd takes.
+   * @return false if the socket failed.
+   */
+  bool flushResponse(int clientSocketFd, PendingResponse* pending);
+
+  /** @brief Runs the callback for a response that was sent or failed. */
+  void finishResponse(const PendingResponse& pending, bool sent);
+
   /** @brief Socket helper used by the server. */
   shared_ptr<SocketHandler> socketHandler;
   /** @brief Endpoint the server listens on. */
   SocketEndpoint serverEndpoint;
-  /** @brief Map of client IDs to their registered passkeys. */
-  std::unordered_map<string, string> clientKeys;
-  /** @brief Active client connections indexed by ID. */
-  std::unordered_map<string, shared_ptr<ServerClientConnection>>
-      clientConnections;
-  /** @brief Thread pool used to handle incoming client sockets. */
+  /** @brief Registered clients, their passkeys and connections. */
+  SessionRegistry sessions;
+  /** @brief Thread pool used to recover returning clients. */
   std::unique_ptr<ThreadPool> clientHandlerThreadPool;
-  /** @brief Guards server state, including the client maps. */
+  /** @brief Handshakes still waiting on their peer, keyed by socket. */
+  std::unordered_map<int, PendingHandshake> pendingHandshakes;
+  /** @brief Responses still waiting on their peer, keyed by socket. */
+  std::unordered_map<int, PendingResponse> pendingResponses;
+  /** @brief Guards `pendingHandshakes` and `pendingResponses`. */
+  mutex handshakeMutex;
+  /** @brief Guards the thread pool pointer. */
   recursive_mutex classMutex;
   /** @brief Serializes connect/disconnect events. */
   mutex connectMutex;
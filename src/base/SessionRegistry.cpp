@@ -0,0 +1,51 @@
+#include "SessionRegistry.hpp"
+
+namespace et {
+void SessionRegistry::addKey(const string& id, const string& key) {
+  Shard& shard = shardFor(id);
+  lock_guard<std::mutex> guard(shard.shardMutex);
+  auto it = shard.sessions.find(id);
+  if (it == shard.sessions.end()) {
+    shared_ptr<ClientSession> session(new ClientSession());
+    session->key = key;
+    shard.sessions.insert(make_pair(id, session));
+    return;
+  }
+  lock_guard<std::mutex> sessionGuard(it->second->stateMutex);
+  it->second->key = key;
+}
+
+shared_ptr<ClientSession> SessionRegistry::find(const string& id) {
+  Shard& shard = shardFor(id);
+  lock_guard<std::mutex> guard(shard.shardMutex);
+  auto it = shard.sessions.find(id);
+  if (it == shard.sessions.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+shared_ptr<ClientSession> SessionRegistry::remove(const string& id) {
+  Shard& shard = shardFor(id);
+  lock_guard<std::mutex> guard(shard.shardMutex);
+  auto it = shard.sessions.find(id);
+  if (it == shard.sessions.end()) {
+    return nullptr;
+  }
+  shared_ptr<ClientSession> session = it->second;
+  shard.sessions.erase(it);
+  return session;
+}
+
+vector<shared_ptr<ClientSession>> SessionRegistry::removeAll() {
+  vector<shared_ptr<ClientSession>> removed;
+  for (Shard& shard : shards) {
+    lock_guard<std::mutex> guard(shard.shardMutex);
+    for (auto& it : shard.sessions) {
+      removed.push_back(it.second);
+    }
+    shard.sessions.clear();
+  }
+  return removed;
+}
+}  // namespace et
@@ -0,0 +1,79 @@
+#ifndef __ET_SESSION_REGISTRY__
+#define __ET_SESSION_REGISTRY__
+
+#include "Headers.hpp"
+#include "ServerClientConnection.hpp"
+
+namespace et {
+/**
+ * @brief Server-side record for one registered client id.
+ *
+ * The registry only hands these out; everything that touches the network
+ * for a client serializes on that client's own `recoverMutex`.
+ */
+struct ClientSession {
+  /** @brief Passkey registered for the client. */
+  string key;
+  /** @brief Active connection, or null until the client first connects. */
+  shared_ptr<ServerClientConnection> connection;
+  /** @brief Guards `key` and `connection`; never held across I/O. */
+  mutex stateMutex;
+  /** @brief Serializes socket handoffs (recoveries) for this client only. */
+  mutex recoverMutex;
+};
+
+/**
+ * @brief Sharded map of client id to `ClientSession`.
+ *
+ * Each shard has its own small lock that is only held for the map lookup
+ * itself, so logins and reconnects of unrelated clients never contend on a
+ * single server-wide mutex.
+ */
+class SessionRegistry {
+ public:
+  SessionRegistry() {}
+
+  /**
+   * @brief Registers (or replaces) the passkey for @p id.
+   */
+  void addKey(const string& id, const string& key);
+
+  /**
+   * @brief Returns the session for @p id, or null when it is not registered.
+   */
+  shared_ptr<ClientSession> find(const string& id);
+
+  /**
+   * @brief Unregisters @p id.
+   * @return The removed session, or null when it was not registered.
+   */
+  shared_ptr<ClientSession> remove(const string& id);
+
+  /**
+   * @brief Unregisters every client and returns the removed sessions.
+   */
+  vector<shared_ptr<ClientSession>> removeAll();
+
+ protected:
+  /** @brief Number of independently locked shards. */
+  static const int NUM_SHARDS = 16;
+
+  /** @brief One slice of the registry with its own lock. */
+  struct Shard {
+    /** @brief Guards `sessions`. */
+    mutex shardMutex;
+    /** @brief Sessions whose id hashes to this shard. */
+    unordered_map<string, shared_ptr<ClientSession>> sessions;
+  };
+
+  /** @brief The shards, indexed by the hash of the client id. */
+  array<Shard, NUM_SHARDS> shards;
+
+  /** @brief Returns the shard responsible for @p id. */
+  inline Shard& shardFor(const string& id) {
+    return shards[std::hash<string>()(id) % NUM_SHARDS];
+  }
+};
+}  // namespace et
+
+#endif  // __ET_SESSION_REGISTRY__
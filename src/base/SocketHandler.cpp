@@ -4,14 +4,35 @@
 
 namespace et {
 #define SOCKET_DATA_TRANSFER_TIMEOUT (30)
+// Longest single readiness wait when no transfer deadline applies, so the
+// loops still wake up periodically.
+#define SOCKET_READY_POLL_MS (1000)
+
+namespace {
+std::chrono::steady_clock::time_point transferDeadline() {
+  return std::chrono::steady_clock::now() +
+         std::chrono::seconds(SOCKET_DATA_TRANSFER_TIMEOUT);
+}
+
+int readyWaitMs(bool timeout,
+                const std::chrono::steady_clock::time_point& deadline) {
+  if (!timeout) {
+    return SOCKET_READY_POLL_MS;
+  }
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       deadline - std::chrono::steady_clock::now())
+                       .count();
+  return int(std::max<int64_t>(
+      0, std::min<int64_t>(remaining, SOCKET_READY_POLL_MS)));
+}
+}  // namespace
 
 void SocketHandler::readAll(int fd, void* buf, size_t count, bool timeout) {
-  time_t startTime = time(NULL);
+  auto deadline = transferDeadline();
   size_t pos = 0;
   while (pos < count) {
-    if (!waitOnSocketData(fd)) {
-      time_t currentTime = time(NULL);
-      if (timeout && currentTime > startTime + SOCKET_DATA_TRANSFER_TIMEOUT) {
+    if (!waitOnSocketReady(fd, false, readyWaitMs(timeout, deadline))) {
+      if (timeout && std::chrono::steady_clock::now() > deadline) {
         throw std::runtime_error("Socket Timeout");
       }
       continue;
@@ -29,33 +50,36 @@ void SocketHandler::readAll(int fd, void* buf, size_t count, bool timeout) {
       auto localErrno = GetErrno();
       if (localErrno == EAGAIN || localErrno == EWOULDBLOCK) {
         // This is fine, just keep retrying
-        LOG(INFO) << "Got EAGAIN, waiting...";
+        VLOG(2) << "Got EAGAIN, waiting...";
+        if (timeout && std::chrono::steady_clock::now() > deadline) {
+          throw std::runtime_error("Socket Timeout");
+        }
       } else {
         VLOG(1) << "Failed a call to readAll: " << strerror(localErrno);
         throw std::runtime_error("Failed a call to readAll");
       }
     } else {
       pos += bytesRead;
-      startTime = time(NULL);
+      // Reset the timeout as long as we are reading bytes
+      deadline = transferDeadline();
     }
   }
 }
 
 int SocketHandler::writeAllOrReturn(int fd, const void* buf, size_t count) {
   size_t pos = 0;
-  time_t startTime = time(NULL);
+  auto deadline = transferDeadline();
   while (pos < count) {
-    time_t currentTime = time(NULL);
-    if (currentTime > startTime + SOCKET_DATA_TRANSFER_TIMEOUT) {
+    if (std::chrono::steady_clock::now() > deadline) {
       return -1;
     }
     ssize_t bytesWritten = write(fd, ((const char*)buf) + pos, count - pos);
     auto localErrno = GetErrno();
     if (bytesWritten < 0) {
       if (localErrno == EAGAIN || localErrno == EWOULDBLOCK) {
-        LOG(INFO) << "Got EAGAIN, waiting...";
-        // This is fine, just keep retrying at 10hz
-        std::this_thread::sleep_for(std::chrono::microseconds(100 * 1000));
+        VLOG(2) << "Got EAGAIN, waiting...";
+        // Resume as soon as the socket drains
+        waitOnSocketReady(fd, true, readyWaitMs(true, deadline));
       } else {
         VLOG(1) << "Failed a call to writeAll: " << strerror(localErrno);
         return -1;
@@ -65,28 +89,79 @@ int SocketHandler::writeAllOrReturn(int fd, const void* buf, size_t count) {
     } else {
       pos += bytesWritten;
       // Reset the timeout as long as we are writing bytes
-      startTime = currentTime;
+      deadline = transferDeadline();
     }
   }
   return count;
 }
 
+ssize_t SocketHandler::writev(int fd, const struct iovec* iov, int iovcnt) {
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    ssize_t bytesWritten = write(fd, iov[i].iov_base, iov[i].iov_len);
+    if (bytesWritten < 0) {
+      return total > 0 ? total : bytesWritten;
+    }
+    total += bytesWritten;
+    if (size_t(bytesWritten) < iov[i].iov_len) {
+      break;
+    }
+  }
+  return total;
+}
+
+ssize_t SocketHandler::readv(int fd, const struct iovec* iov, int iovcnt) {
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    ssize_t bytesRead = read(fd, iov[i].iov_base, iov[i].iov_len);
+    if (bytesRead < 0) {
+      return total > 0 ? total : bytesRead;
+    }
+    total += bytesRead;
+    if (size_t(bytesRead) < iov[i].iov_len) {
+      break;
+    }
+  }
+  return total;
+}
+
 void SocketHandler::writeAllOrThrow(int fd, const void* buf, size_t count,
                                     bool timeout) {
-  time_t startTime = time(NULL);
-  size_t pos = 0;
-  while (pos < count) {
-    time_t currentTime = time(NULL);
-    if (timeout && currentTime > startTime + SOCKET_DATA_TRANSFER_TIMEOUT) {
+  struct iovec iov;
+  iov.iov_base = (void*)buf;
+  iov.iov_len = count;
+  writevAllOrThrow(fd, &iov, 1, timeout);
+}
+
+void SocketHandler::writevAllOrThrow(int fd, const struct iovec* iov,
+                                     int iovcnt, bool timeout) {
+  vector<struct iovec> pending(iov, iov + iovcnt);
+  size_t first = 0;
+  auto deadline = transferDeadline();
+  while (true) {
+    while (first < pending.size() && pending[first].iov_len == 0) {
+      first++;
+    }
+    if (first == pending.size()) {
+      return;
+    }
+    if (timeout && std::chrono::steady_clock::now() > deadline) {
       throw std::runtime_error("Socket Timeout");
     }
-    ssize_t bytesWritten = write(fd, ((const char*)buf) + pos, count - pos);
+    ssize_t bytesWritten =
+        writev(fd, &pending[first], int(pending.size() - first));
     auto localErrno = GetErrno();
     if (bytesWritten < 0) {
       if (localErrno == EAGAIN || localErrno == EWOULDBLOCK) {
-        LOG(INFO) << "Got EAGAIN, waiting...";
-        // This is fine, just keep retrying at 10hz
-        std::this_thread::sleep_for(std::chrono::microseconds(100 * 1000));
+        VLOG(2) << "Got EAGAIN, waiting...";
+        // Resume as soon as the socket drains
+        waitOnSocketReady(fd, true, readyWaitMs(timeout, deadline));
       } else if (!timeout && localErrno == ETIMEDOUT) {
         // macOS returns ETIMEDOUT on unix sockets whose peer has stopped
         // draining even though the connection is intact; keep retrying
@@ -99,9 +174,19 @@ void SocketHandler::writeAllOrThrow(int fd, const void* buf, size_t count,
     } else if (bytesWritten == 0) {
       throw std::runtime_error("Socket closed during writeAll");
     } else {
-      pos += bytesWritten;
+      // Skip past whatever was written, which may end mid-buffer
+      size_t remaining = bytesWritten;
+      while (remaining > 0) {
+        size_t consumed = std::min(remaining, pending[first].iov_len);
+        pending[first].iov_base = (char*)pending[first].iov_base + consumed;
+        pending[first].iov_len -= consumed;
+        remaining -= consumed;
+        if (pending[first].iov_len == 0) {
+          first++;
+        }
+      }
       // Reset the timeout as long as we are writing bytes
-      startTime = currentTime;
+      deadline = transferDeadline();
     }
   }
 }
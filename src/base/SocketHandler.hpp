@@ -28,6 +28,19 @@ class SocketHandler {
    * @brief Writes up to count bytes to fd.
    */
   virtual ssize_t write(int fd, const void* buf, size_t count) = 0;
+  /**
+   * @brief Writes the @p iovcnt buffers in @p iov, in order, in one call.
+   *
+   * The default writes the buffers one at a time through `write()`; handlers
+   * backed by real descriptors override it with a single vectored syscall.
+   * @return Total bytes written (possibly short), or -1 if nothing was.
+   */
+  virtual ssize_t writev(int fd, const struct iovec* iov, int iovcnt);
+  /**
+   * @brief Reads into the @p iovcnt buffers in @p iov, filling each in order.
+   * @return Total bytes read (possibly short), 0 on EOF, or -1 on error.
+   */
+  virtual ssize_t readv(int fd, const struct iovec* iov, int iovcnt);
 
   /**
    * @brief Reads exactly `count` bytes, retrying on EAGAIN until the buffer
@@ -46,6 +59,12 @@ class SocketHandler {
    * fails.
    */
   void writeAllOrThrow(int fd, const void* buf, size_t count, bool timeout);
+  /**
+   * @brief Vectored `writeAllOrThrow()`: writes every buffer in @p iov, in
+   * order, usually with a single `writev()`.
+   */
+  void writevAllOrThrow(int fd, const struct iovec* iov, int iovcnt,
+                        bool timeout);
 
   /**
    * @brief Reads a length-prefixed protobuf from the socket.
@@ -88,10 +107,12 @@ class SocketHandler {
       STFATAL << "Invalid proto length: " << length << " For proto "
               << t.GetTypeName();
     }
-    writeAllOrThrow(fd, &length, sizeof(int64_t), timeout);
-    if (length > 0) {
-      writeAllOrThrow(fd, &s[0], length, timeout);
-    }
+    struct iovec iov[2];
+    iov[0].iov_base = &length;
+    iov[0].iov_len = sizeof(int64_t);
+    iov[1].iov_base = &s[0];
+    iov[1].iov_len = length;
+    writevAllOrThrow(fd, iov, 2, timeout);
   }
 
   /**
@@ -125,10 +146,12 @@ class SocketHandler {
     if (length < 0 || length > 128 * 1024 * 1024) {
       STFATAL << "Invalid message length: " << length;
     }
-    writeAllOrThrow(fd, (const char*)&length, sizeof(int64_t), false);
-    if (length) {
-      writeAllOrThrow(fd, &s[0], length, false);
-    }
+    struct iovec iov[2];
+    iov[0].iov_base = &length;
+    iov[0].iov_len = sizeof(int64_t);
+    iov[1].iov_base = &s[0];
+    iov[1].iov_len = length;
+    writevAllOrThrow(fd, iov, 2, false);
   }
 
   /** @brief Sends a base64-encoded version of the provided buffer. */
@@ -0,0 +1,73 @@
+#ifndef __ET_SPSC_QUEUE__
+#define __ET_SPSC_QUEUE__
+
+#include "Headers.hpp"
+
+namespace et {
+/**
+ * @brief Bounded single-producer single-consumer queue of values.
+ *
+ * One thread pushes and one other thread pops, without locks: each side
+ * only writes its own index and reads the other's.  Waking the consumer is
+ * left to the caller, so a queue that is checked on every pass costs no
+ * system calls.
+ */
+template <typename T>
+class SpscQueue {
+ public:
+  /** @param capacity Most values queued at once, rounded up to a power of
+   * two. */
+  explicit SpscQueue(size_t capacity) : head(0), tail(0) {
+    size_t size = 1;
+    while (size < capacity) {
+      size *= 2;
+    }
+    slots.resize(size);
+    mask = size - 1;
+  }
+
+  /** @brief Moves @p value in, unless the queue is full.  Producer only. */
+  bool push(T&& value) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) {
+      return false;
+    }
+    slots[t & mask] = std::move(value);
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool push(const T& value) { return push(T(value)); }
+
+  /** @brief Moves the oldest value out, if any.  Consumer only. */
+  bool pop(T* value) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *value = std::move(slots[h & mask]);
+    // Do not keep what the value owned alive until the slot is reused
+    slots[h & mask] = T();
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** @brief Whether the queue looked empty. */
+  bool empty() const {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  }
+
+  size_t getCapacity() const { return slots.size(); }
+
+ protected:
+  vector<T> slots;
+  size_t mask;
+  /** @brief Values popped so far; written by the consumer. */
+  alignas(64) std::atomic<size_t> head;
+  /** @brief Values pushed so far; written by the producer. */
+  alignas(64) std::atomic<size_t> tail;
+};
+}  // namespace et
+
+#endif  // __ET_SPSC_QUEUE__
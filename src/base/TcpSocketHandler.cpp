@@ -4,7 +4,6 @@ namespace et {
 TcpSocketHandler::TcpSocketHandler() {}
 
 int TcpSocketHandler::connect(const SocketEndpoint& endpoint) {
-  lock_guard<std::recursive_mutex> guard(globalMutex);
   int sockFd = -1;
   addrinfo* results = NULL;
   addrinfo* p = NULL;
@@ -21,8 +20,13 @@ int TcpSocketHandler::connect(const SocketEndpoint& endpoint) {
   std::string hostname = endpoint.name();
 
 #ifndef WIN32
-  // (re)initialize the DNS system
-  ::res_init();
+  {
+    // Only this is shared: connects to slow destinations run side by side
+    // and must not hold up the other users of the handler.
+    lock_guard<std::recursive_mutex> guard(globalMutex);
+    // (re)initialize the DNS system
+    ::res_init();
+  }
 #endif
   int rc = getaddrinfo(hostname.c_str(), portname.c_str(), &hints, &results);
 
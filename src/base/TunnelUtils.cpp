@@ -4,6 +4,38 @@ namespace et {
 
 bool isSocketPath(const string& s) { return !s.empty() && s[0] == '/'; }
 
+// Strips a "/udp" suffix from a tunnel argument.  Only a port or a port
+// range can take one, so a socket path ending in /udp is left alone.
+bool stripUdpSuffix(string* arg) {
+  const string suffix = "/udp";
+  if (arg->length() <= suffix.length() ||
+      arg->compare(arg->length() - suffix.length(), suffix.length(),
+                   suffix) != 0) {
+    return false;
+  }
+  string rest = arg->substr(0, arg->length() - suffix.length());
+  size_t colon = rest.rfind(':');
+  string port = colon == string::npos ? rest : rest.substr(colon + 1);
+  if (port.empty() || port.find_first_not_of("0123456789-") != string::npos) {
+    return false;
+  }
+  *arg = rest;
+  return true;
+}
+
+// Marks the requests parsed from a "/udp" argument, which only ports take.
+void setUdp(vector<PortForwardSourceRequest>& pfsrs, size_t first,
+            const string& input) {
+  for (size_t a = first; a < pfsrs.size(); a++) {
+    auto& pfsr = pfsrs[a];
+    if (!pfsr.source().has_port() || !pfsr.destination().has_port()) {
+      throw TunnelParseException("Invalid tunnel argument '" + input +
+                                 "': only ports can forward udp");
+    }
+    pfsr.set_udp(true);
+  }
+}
+
 void processEtStyleTunnelArg(vector<PortForwardSourceRequest>& pfsrs,
                              const vector<string> sourceDestination,
                              const string& input) {
@@ -130,12 +162,18 @@ vector<PortForwardSourceRequest> parseRangesToRequests(const string& input) {
   auto splitByComma = split(input, ',');
   if (splitByComma.size() > 1) {
     for (auto& element : splitByComma) {
+      size_t first = pfsrs.size();
+      bool udp = stripUdpSuffix(&element);
       vector<string> sourceDestination = split(element, ':');
       processEtStyleTunnelArg(pfsrs, sourceDestination, input);
+      if (udp) {
+        setUdp(pfsrs, first, input);
+      }
     }
   } else {
     // no commas
     auto tunnelArg = splitByComma[0];
+    bool udp = stripUdpSuffix(&tunnelArg);
     vector<string> sourceDestination = split(tunnelArg, ':');
     if (sourceDestination.size() <= 2) {
       // et style tunnel arg
@@ -154,8 +192,43 @@ vector<PortForwardSourceRequest> parseRangesToRequests(const string& input) {
       pfsr.mutable_destination()->set_port(stoi(sshStyleArgParts[3]));
       pfsrs.push_back(pfsr);
     }
+    if (udp) {
+      setUdp(pfsrs, 0, input);
+    }
   }
   return pfsrs;
 }
 
+vector<PortForwardSourceRequest> parseDynamicTunnelArg(const string& input) {
+  vector<PortForwardSourceRequest> pfsrs;
+  for (auto& element : split(input, ',')) {
+    string bindAddress = "localhost";
+    string port = element;
+    size_t colon = element.rfind(':');
+    if (colon != string::npos) {
+      bindAddress = element.substr(0, colon);
+      port = element.substr(colon + 1);
+      if (bindAddress.length() > 2 && bindAddress.front() == '[' &&
+          bindAddress.back() == ']') {
+        bindAddress = bindAddress.substr(1, bindAddress.length() - 2);
+      } else if (bindAddress.find(':') != string::npos) {
+        throw TunnelParseException(
+            "Ipv6 addresses must be inside of square brackets, ie "
+            "[::1]:1080");
+      }
+    }
+    if (bindAddress.empty() || port.empty() || port.length() > 5 ||
+        port.find_first_not_of("0123456789") != string::npos ||
+        stoi(port) > 65535) {
+      throw TunnelParseException("Invalid dynamic tunnel argument '" + input +
+                                 "': expected [bind_address:]port");
+    }
+    PortForwardSourceRequest pfsr;
+    pfsr.mutable_source()->set_name(bindAddress);
+    pfsr.mutable_source()->set_port(stoi(port));
+    pfsr.set_dynamic(true);
+    pfsrs.push_back(pfsr);
+  }
+  return pfsrs;
+}
 }  // namespace et
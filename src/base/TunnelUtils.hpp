@@ -7,12 +7,21 @@ namespace et {
 
 /**
  * @brief Parses a comma-separated list of tunnel arguments into proto messages.
+ * A "/udp" suffix on an argument (e.g. 5353:53/udp) forwards UDP.
  * @throws TunnelParseException when the syntax is invalid.
  */
 vector<PortForwardSourceRequest> parseRangesToRequests(const string& input);
 
 vector<string> parseSshTunnelArg(const string& input);
 
+/**
+ * @brief Parses a comma-separated list of dynamic (SOCKS5) tunnels, each
+ * "[bind_address:]port" like ssh -D.  The bind address defaults to
+ * localhost; an ipv6 one goes in square brackets.
+ * @throws TunnelParseException when the syntax is invalid.
+ */
+vector<PortForwardSourceRequest> parseDynamicTunnelArg(const string& input);
+
 /**
  * @brief Thrown when an invalid tunnel source/destination string is
  * encountered.
@@ -3,7 +3,40 @@
 #include <cstdint>
 
 namespace et {
-UnixSocketHandler::UnixSocketHandler() {}
+UnixSocketHandler::UnixSocketHandler() {
+  for (int i = 0; i < MAX_SOCKET_STATE_CHUNKS; i++) {
+    socketStateChunks[i] = nullptr;
+  }
+}
+
+UnixSocketHandler::~UnixSocketHandler() {
+  for (int i = 0; i < MAX_SOCKET_STATE_CHUNKS; i++) {
+    delete[] socketStateChunks[i].load();
+  }
+}
+
+SocketState* UnixSocketHandler::getSocketState(int fd, bool create) {
+  if (fd < 0) {
+    return nullptr;
+  }
+  int chunkIndex = fd / SOCKET_STATE_CHUNK_SIZE;
+  if (chunkIndex >= MAX_SOCKET_STATE_CHUNKS) {
+    STFATAL << "File descriptor is too large to track: " << fd;
+  }
+  SocketState* chunk = socketStateChunks[chunkIndex].load();
+  if (chunk == nullptr) {
+    if (!create) {
+      return nullptr;
+    }
+    lock_guard<std::recursive_mutex> guard(globalMutex);
+    chunk = socketStateChunks[chunkIndex].load();
+    if (chunk == nullptr) {
+      chunk = new SocketState[SOCKET_STATE_CHUNK_SIZE];
+      socketStateChunks[chunkIndex] = chunk;
+    }
+  }
+  return &chunk[fd % SOCKET_STATE_CHUNK_SIZE];
+}
 
 bool UnixSocketHandler::waitForData(int fd, int64_t sec, int64_t usec) {
   fd_set input;
@@ -32,18 +65,19 @@ ssize_t UnixSocketHandler::read(int fd, void* buf, size_t count) {
   if (fd <= 0) {
     STFATAL << "Tried to read from an invalid socket: " << fd;
   }
-  map<int, shared_ptr<recursive_mutex>>::iterator it;
-  {
-    lock_guard<std::recursive_mutex> guard(globalMutex);
-    it = activeSocketMutexes.find(fd);
-    if (it == activeSocketMutexes.end()) {
-      LOG(INFO) << "Tried to read from a socket that has been closed: " << fd;
-      SetErrno(EPIPE);
-      return -1;
-    }
+  SocketState* state = getSocketState(fd, false);
+  uint32_t generation = state ? state->generation.load() : 0;
+  if (generation % 2 == 0) {
+    LOG(INFO) << "Tried to read from a socket that has been closed: " << fd;
+    SetErrno(EPIPE);
+    return -1;
+  }
+  lock_guard<std::mutex> guard(state->readMutex);
+  if (state->generation.load() != generation) {
+    LOG(INFO) << "Socket was closed while waiting to read: " << fd;
+    SetErrno(EPIPE);
+    return -1;
   }
-  waitForData(fd, 5, 0);
-  lock_guard<recursive_mutex> guard(*(it->second));
   VLOG(4) << "Unixsocket handler read from fd: " << fd;
 #ifdef WIN32
   ssize_t readBytes = ::recv(fd, (char*)buf, count, 0);
@@ -64,57 +98,136 @@ ssize_t UnixSocketHandler::write(int fd, const void* buf, size_t count) {
   if (fd <= 0) {
     STFATAL << "Tried to write to an invalid socket: " << fd;
   }
-  map<int, shared_ptr<recursive_mutex>>::iterator it;
-  {
-    lock_guard<std::recursive_mutex> guard(globalMutex);
-    it = activeSocketMutexes.find(fd);
-    if (it == activeSocketMutexes.end()) {
-      LOG(INFO) << "Tried to write to a socket that has been closed: " << fd;
-      SetErrno(EPIPE);
-      return -1;
-    }
+  SocketState* state = getSocketState(fd, false);
+  uint32_t generation = state ? state->generation.load() : 0;
+  if (generation % 2 == 0) {
+    LOG(INFO) << "Tried to write to a socket that has been closed: " << fd;
+    SetErrno(EPIPE);
+    return -1;
   }
   // Try to write for around 5 seconds before giving up
-  time_t startTime = time(NULL);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
   int bytesWritten = 0;
   while (bytesWritten < int(count)) {
-    lock_guard<recursive_mutex> guard(*(it->second));
-    int w;
+    {
+      lock_guard<std::mutex> guard(state->writeMutex);
+      if (state->generation.load() != generation) {
+        LOG(INFO) << "Socket was closed while waiting to write: " << fd;
+        SetErrno(EPIPE);
+        return -1;
+      }
+      int w;
 #ifdef WIN32
-    w = ::send(fd, ((const char*)buf) + bytesWritten, count - bytesWritten, 0);
+      w = ::send(fd, ((const char*)buf) + bytesWritten, count - bytesWritten,
+                 0);
 #else
 #ifdef MSG_NOSIGNAL
-    w = ::send(fd, ((const char*)buf) + bytesWritten, count - bytesWritten,
-               MSG_NOSIGNAL);
+      w = ::send(fd, ((const char*)buf) + bytesWritten, count - bytesWritten,
+                 MSG_NOSIGNAL);
 #else
-    w = ::write(fd, ((const char*)buf) + bytesWritten, count - bytesWritten);
+      w = ::write(fd, ((const char*)buf) + bytesWritten,
+                  count - bytesWritten);
 #endif
 #endif
-    auto localErrno = GetErrno();
-    if (w < 0) {
-      if (localErrno == EAGAIN || localErrno == EWOULDBLOCK) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        if (time(NULL) > startTime + 5) {
-          // Give up
-          return -1;
-        }
-      } else {
+      auto localErrno = GetErrno();
+      if (w >= 0) {
+        bytesWritten += w;
+        continue;
+      }
+      if (localErrno != EAGAIN && localErrno != EWOULDBLOCK) {
         return -1;
       }
-    } else {
-      bytesWritten += w;
     }
+    // The send buffer is full: wait (without holding the write lock) until
+    // the kernel reports room again.
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         deadline - std::chrono::steady_clock::now())
+                         .count();
+    if (remaining <= 0) {
+      // Give up
+      SetErrno(EAGAIN);
+      return -1;
+    }
+    waitOnSocketReady(fd, true, int(remaining));
   }
   return count;
 }
 
+ssize_t UnixSocketHandler::writev(int fd, const struct iovec* iov,
+                                  int iovcnt) {
+#ifdef WIN32
+  return SocketHandler::writev(fd, iov, iovcnt);
+#else
+  VLOG(4) << "Unixsocket handler writev to fd: " << fd;
+  if (fd <= 0) {
+    STFATAL << "Tried to write to an invalid socket: " << fd;
+  }
+  SocketState* state = getSocketState(fd, false);
+  uint32_t generation = state ? state->generation.load() : 0;
+  if (generation % 2 == 0) {
+    LOG(INFO) << "Tried to write to a socket that has been closed: " << fd;
+    SetErrno(EPIPE);
+    return -1;
+  }
+  lock_guard<std::mutex> guard(state->writeMutex);
+  if (state->generation.load() != generation) {
+    LOG(INFO) << "Socket was closed while waiting to write: " << fd;
+    SetErrno(EPIPE);
+    return -1;
+  }
+  // sendmsg() rather than ::writev() so that MSG_NOSIGNAL applies.
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = (struct iovec*)iov;
+  message.msg_iovlen = iovcnt;
+#ifdef MSG_NOSIGNAL
+  return ::sendmsg(fd, &message, MSG_NOSIGNAL);
+#else
+  return ::sendmsg(fd, &message, 0);
+#endif
+#endif
+}
+
+ssize_t UnixSocketHandler::readv(int fd, const struct iovec* iov,
+                                 int iovcnt) {
+#ifdef WIN32
+  return SocketHandler::readv(fd, iov, iovcnt);
+#else
+  if (fd <= 0) {
+    STFATAL << "Tried to read from an invalid socket: " << fd;
+  }
+  SocketState* state = getSocketState(fd, false);
+  uint32_t generation = state ? state->generation.load() : 0;
+  if (generation % 2 == 0) {
+    LOG(INFO) << "Tried to read from a socket that has been closed: " << fd;
+    SetErrno(EPIPE);
+    return -1;
+  }
+  lock_guard<std::mutex> guard(state->readMutex);
+  if (state->generation.load() != generation) {
+    LOG(INFO) << "Socket was closed while waiting to read: " << fd;
+    SetErrno(EPIPE);
+    return -1;
+  }
+  VLOG(4) << "Unixsocket handler readv from fd: " << fd;
+  ssize_t readBytes = ::readv(fd, iov, iovcnt);
+  auto localErrno = GetErrno();
+  if (readBytes < 0 && localErrno != EAGAIN && localErrno != EWOULDBLOCK) {
+    LOG(WARNING) << "Error reading: " << localErrno << " "
+                 << strerror(localErrno);
+  }
+  SetErrno(localErrno);
+  return readBytes;
+#endif
+}
+
 void UnixSocketHandler::addToActiveSockets(int fd) {
-  lock_guard<std::recursive_mutex> guard(globalMutex);
-  if (activeSocketMutexes.find(fd) != activeSocketMutexes.end()) {
+  SocketState* state = getSocketState(fd, true);
+  uint32_t generation = state->generation.load();
+  if (generation % 2 == 1) {
     STFATAL << "Tried to insert an fd that already exists: " << fd;
   }
-  activeSocketMutexes.insert(
-      make_pair(fd, shared_ptr<recursive_mutex>(new recursive_mutex())));
+  state->generation = generation + 1;
 }
 
 int UnixSocketHandler::accept(int sockFd) {
@@ -122,25 +235,21 @@ int UnixSocketHandler::accept(int sockFd) {
   socklen_t c = sizeof(client);
   int client_sock = ::accept(sockFd, (sockaddr*)&client, &c);
   auto acceptErrno = GetErrno();
-  while (true) {
-    {
-      lock_guard<std::recursive_mutex> guard(globalMutex);
-      if (activeSocketMutexes.find(client_sock) == activeSocketMutexes.end()) {
-        break;
-      }
-    }
-    // Wait until this socket is no longer active
-    LOG_EVERY_N(100, INFO) << "Waiting for read/write to time out...";
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  }
 
-  lock_guard<std::recursive_mutex> guard(globalMutex);
   if (client_sock >= 0) {
     VLOG(3) << "Socket " << sockFd
             << " accepted, returned client_sock: " << client_sock;
+    SocketState* state = getSocketState(client_sock, true);
+    if (state->generation.load() % 2 == 1) {
+      // The previous owner of this fd number was closed without going
+      // through close(); retire its state so stale users fail cleanly.
+      LOG(WARNING) << "Reusing fd that was still tracked: " << client_sock;
+      lock(state->readMutex, state->writeMutex);
+      lock_guard<std::mutex> readGuard(state->readMutex, std::adopt_lock);
+      lock_guard<std::mutex> writeGuard(state->writeMutex, std::adopt_lock);
+      state->generation++;
+    }
     addToActiveSockets(client_sock);
-    lock_guard<recursive_mutex> guard(
-        *(activeSocketMutexes.find(client_sock)->second));
     initSocket(client_sock);
     VLOG(3) << "Client_socket inserted to activeSockets";
     return client_sock;
@@ -169,19 +278,25 @@ bool UnixSocketHandler::isTransientAcceptError(int err) {
 }
 
 void UnixSocketHandler::close(int fd) {
-  lock_guard<std::recursive_mutex> globalGuard(globalMutex);
   if (fd == -1) {
     return;
   }
-  auto it = activeSocketMutexes.find(fd);
-  if (it == activeSocketMutexes.end()) {
+  SocketState* state = getSocketState(fd, false);
+  if (state == nullptr || state->generation.load() % 2 == 0) {
     // Connection was already killed.
     STERROR << "Tried to close a connection that doesn't exist: " << fd;
     return;
   }
-  auto m = it->second;
-  lock_guard<std::recursive_mutex> guard(*m);
+  lock(state->readMutex, state->writeMutex);
+  lock_guard<std::mutex> readGuard(state->readMutex, std::adopt_lock);
+  lock_guard<std::mutex> writeGuard(state->writeMutex, std::adopt_lock);
+  if (state->generation.load() % 2 == 0) {
+    STERROR << "Tried to close a connection that doesn't exist: " << fd;
+    return;
+  }
   VLOG(1) << "Closing connection: " << fd;
+  // Retire the slot before the fd number can be handed out again.
+  state->generation++;
   setBlocking(fd, true);
 #ifdef _MSC_VER
   FATAL_FAIL_UNLESS_ZERO(::closesocket(fd));
@@ -192,13 +307,20 @@ void UnixSocketHandler::close(int fd) {
   FATAL_FAIL(::close(fd));
 #endif
 #endif
-  activeSocketMutexes.erase(it);
 }
 
 vector<int> UnixSocketHandler::getActiveSockets() {
   vector<int> fds;
-  for (auto it : activeSocketMutexes) {
-    fds.push_back(it.first);
+  for (int i = 0; i < MAX_SOCKET_STATE_CHUNKS; i++) {
+    SocketState* chunk = socketStateChunks[i].load();
+    if (chunk == nullptr) {
+      continue;
+    }
+    for (int j = 0; j < SOCKET_STATE_CHUNK_SIZE; j++) {
+      if (chunk[j].generation.load() % 2 == 1) {
+        fds.push_back(i * SOCKET_STATE_CHUNK_SIZE + j);
+      }
+    }
   }
   return fds;
 }
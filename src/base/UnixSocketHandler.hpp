@@ -4,6 +4,23 @@
 #include "SocketHandler.hpp"
 
 namespace et {
+/**
+ * @brief Bookkeeping for one tracked descriptor, stored in a table indexed by
+ * the fd itself.
+ */
+struct SocketState {
+  /**
+   * @brief Bumped when the fd starts and stops being tracked; odd while the
+   * fd is open.  Lets an operation notice that the fd was closed (and maybe
+   * reused) while it waited for a lock.
+   */
+  std::atomic<uint32_t> generation{0};
+  /** @brief Serializes reads on the descriptor. */
+  std::mutex readMutex;
+  /** @brief Serializes writes on the descriptor. */
+  std::mutex writeMutex;
+};
+
 /**
  * @brief Default SocketHandler implementation using POSIX sockets with mutex
  * guards.
@@ -11,7 +28,7 @@ namespace et {
 class UnixSocketHandler : public SocketHandler {
  public:
   UnixSocketHandler();
-  virtual ~UnixSocketHandler() {}
+  virtual ~UnixSocketHandler();
 
   /**
    * @brief Blocks with select() until the fd becomes readable.
@@ -19,10 +36,24 @@ class UnixSocketHandler : public SocketHandler {
   virtual bool waitForData(int fd, int64_t sec, int64_t usec);
   /** @brief Queries whether the descriptor currently has readable bytes. */
   virtual bool hasData(int fd);
-  /** @brief Reads up to `count` bytes while holding the per-socket mutex. */
+  /**
+   * @brief Reads up to `count` bytes while holding the per-socket read
+   * mutex.
+   *
+   * Never waits for readiness: on a socket with nothing to read this fails
+   * with EAGAIN, so callers should consult `hasData()` or their own poll
+   * results first.
+   */
   virtual ssize_t read(int fd, void* buf, size_t count);
   /** @brief Writes `count` bytes by retrying until completion or timeout. */
   virtual ssize_t write(int fd, const void* buf, size_t count);
+  /**
+   * @brief Gathers the buffers into a single `sendmsg()`; makes one attempt
+   * and may write only part of the data.
+   */
+  virtual ssize_t writev(int fd, const struct iovec* iov, int iovcnt);
+  /** @brief Scatters one `readv()` across the buffers; never waits. */
+  virtual ssize_t readv(int fd, const struct iovec* iov, int iovcnt);
   /**
    * @brief Accepts a pending connection on the provided listening socket.
    */
@@ -43,6 +74,11 @@ class UnixSocketHandler : public SocketHandler {
    * @brief Ensures that a descriptor is tracked and has its own mutex.
    */
   void addToActiveSockets(int fd);
+  /**
+   * @brief Returns the state slot for @p fd, allocating its chunk when
+   * @p create is set; returns null for untracked fds otherwise.
+   */
+  SocketState* getSocketState(int fd, bool create);
   /**
    * @brief Performs per-socket initialization (non-blocking, signal handling).
    */
@@ -56,9 +92,16 @@ class UnixSocketHandler : public SocketHandler {
    */
   void setBlocking(int sockFd, bool blocking);
 
-  /** @brief Mutex per active socket to ensure serial read/write. */
-  map<int, shared_ptr<recursive_mutex>> activeSocketMutexes;
-  /** @brief Guards access to the active socket map. */
+  /** @brief Number of `SocketState` slots allocated together. */
+  static const int SOCKET_STATE_CHUNK_SIZE = 1024;
+  /** @brief Number of chunks, bounding the largest fd that can be tracked. */
+  static const int MAX_SOCKET_STATE_CHUNKS = 4096;
+  /**
+   * @brief Per-fd state, in chunks that are never moved or freed while the
+   * handler lives so lookups need no lock.
+   */
+  std::atomic<SocketState*> socketStateChunks[MAX_SOCKET_STATE_CHUNKS];
+  /** @brief Guards chunk allocation and the listening socket bookkeeping. */
   recursive_mutex globalMutex;
 };
 }  // namespace et
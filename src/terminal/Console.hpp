@@ -36,6 +36,19 @@ class Console {
     WriteConsole(hstdout, wide.c_str(), wide.length(), &numWritten, NULL);
 #else
     RawSocketUtils::writeAll(getFd(), &s[0], s.length());
+#endif
+  }
+
+  /**
+   * @brief Writes as much of @p buf as the console accepts without blocking.
+   * @return Bytes written, or -1 with errno set (EAGAIN when it is full).
+   */
+  virtual ssize_t writeSome(const char* buf, size_t count) {
+#ifdef WIN32
+    write(string(buf, count));
+    return count;
+#else
+    return ::write(getFd(), buf, count);
 #endif
   }
 };
@@ -0,0 +1,69 @@
+#include "ConsoleWriter.hpp"
+
+namespace et {
+ConsoleWriter::ConsoleWriter(shared_ptr<Console> _console,
+                             int pacingIntervalMs)
+    : console(_console), pacingInterval(pacingIntervalMs), offset(0) {}
+
+void ConsoleWriter::enqueue(const string& s) {
+  if (offset > 0 && offset >= buffer.length() / 2) {
+    // Drop what was already written once it dominates the buffer.
+    buffer.erase(0, offset);
+    offset = 0;
+  }
+  buffer.append(s);
+}
+
+bool ConsoleWriter::flush() {
+  if (empty()) {
+    return true;
+  }
+  lastFlush = std::chrono::steady_clock::now();
+  while (offset < buffer.length()) {
+    ssize_t rc =
+        console->writeSome(&buffer[offset], buffer.length() - offset);
+    if (rc < 0) {
+      auto localErrno = GetErrno();
+      if (localErrno == EAGAIN || localErrno == EWOULDBLOCK) {
+        return false;
+      }
+      if (localErrno == EINTR) {
+        continue;
+      }
+      STERROR << "Cannot write to console: " << strerror(localErrno);
+      throw std::runtime_error("Cannot write to console");
+    }
+    if (rc == 0) {
+      throw std::runtime_error("Cannot write to console: console closed");
+    }
+    offset += rc;
+  }
+  buffer.clear();
+  offset = 0;
+  return true;
+}
+
+int64_t ConsoleWriter::msUntilFlush() const {
+  if (pacingInterval.count() == 0) {
+    return 0;
+  }
+  auto nextFlush = lastFlush + pacingInterval;
+  auto now = std::chrono::steady_clock::now();
+  if (now >= nextFlush) {
+    return 0;
+  }
+  // Round up so a timer set for this long never fires early.
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             nextFlush - now + std::chrono::microseconds(999))
+      .count();
+}
+
+void ConsoleWriter::drain() {
+  if (empty()) {
+    return;
+  }
+  console->write(buffer.substr(offset));
+  buffer.clear();
+  offset = 0;
+}
+}  // namespace et
@@ -0,0 +1,79 @@
+#ifndef __ET_CONSOLE_WRITER__
+#define __ET_CONSOLE_WRITER__
+
+#include "Console.hpp"
+#include "Headers.hpp"
+
+namespace et {
+/**
+ * @brief Bounded queue of terminal output waiting for the local console.
+ *
+ * `flush()` only writes what the console accepts without blocking, so a
+ * terminal emulator that renders slowly never stalls the client loop.  Once
+ * `MAX_QUEUED_BYTES` are waiting the caller should stop reading from the
+ * connection until the queue drains below `RESUME_QUEUED_BYTES`, pushing the
+ * backpressure to the server.
+ *
+ * With a pacing interval, output arriving in a burst is flushed at most once
+ * per interval (e.g. one display refresh), so the emulator renders fewer,
+ * larger updates.  Output after an idle period still goes out immediately.
+ */
+class ConsoleWriter {
+ public:
+  /** @brief Queue size at which reading from the connection pauses. */
+  static const int64_t MAX_QUEUED_BYTES = 4 * 1024 * 1024;
+  /** @brief Queue size at which reading from the connection resumes. */
+  static const int64_t RESUME_QUEUED_BYTES = 1024 * 1024;
+
+  /**
+   * @param pacingIntervalMs Minimum time between flushes, or 0 to flush as
+   * soon as output arrives.
+   */
+  ConsoleWriter(shared_ptr<Console> console, int pacingIntervalMs);
+
+  /** @brief Queues @p s behind any output not yet written. */
+  void enqueue(const string& s);
+
+  /**
+   * @brief Writes queued output until the console would block.
+   * @return false if output remains because the console is full; wait for
+   * it to become writable before calling again.
+   */
+  bool flush();
+
+  /**
+   * @brief Milliseconds until the pacer allows the next flush, 0 if a flush
+   * may happen now.
+   */
+  int64_t msUntilFlush() const;
+
+  /** @brief Bytes waiting to be written. */
+  inline int64_t size() const { return buffer.length() - offset; }
+  inline bool empty() const { return size() == 0; }
+
+  /** @brief Whether the connection should stop being read. */
+  inline bool isFull() const { return size() >= MAX_QUEUED_BYTES; }
+  /** @brief Whether a paused connection may be read again. */
+  inline bool canResume() const { return size() < RESUME_QUEUED_BYTES; }
+
+  /**
+   * @brief Writes everything still queued, blocking as needed.  Used when
+   * the session ends.
+   */
+  void drain();
+
+ protected:
+  /** @brief Console receiving the output. */
+  shared_ptr<Console> console;
+  /** @brief Minimum time between flushes. */
+  std::chrono::milliseconds pacingInterval;
+  /** @brief When output was last written. */
+  std::chrono::steady_clock::time_point lastFlush;
+  /** @brief Queued output; bytes before `offset` were already written. */
+  string buffer;
+  /** @brief Start of the unwritten output in `buffer`. */
+  size_t offset;
+};
+}  // namespace et
+
+#endif  // __ET_CONSOLE_WRITER__
@@ -0,0 +1,43 @@
+#include "OutputBatcher.hpp"
+
+namespace et {
+OutputBatcher::OutputBatcher(int windowUs) : window(max(0, windowUs)) {}
+
+void OutputBatcher::append(const char* data, size_t length) {
+  if (batch.empty()) {
+    auto now = std::chrono::steady_clock::now();
+    // Output after an idle period goes out right away; within a burst it
+    // waits for the rest of the window.
+    deadline = (now - lastTake >= window) ? now : now + window;
+  }
+  batch.append(data, length);
+}
+
+bool OutputBatcher::isReady() const { return usUntilReady() == 0; }
+
+int64_t OutputBatcher::usUntilReady() const {
+  if (batch.empty()) {
+    return -1;
+  }
+  if (batch.length() >= MAX_BATCH_BYTES) {
+    return 0;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (now >= deadline) {
+    return 0;
+  }
+  // Round up so a wait this long never wakes up early.
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             deadline - now + std::chrono::nanoseconds(999))
+      .count();
+}
+
+string OutputBatcher::take() {
+  string s;
+  s.swap(batch);
+  lastTake = std::chrono::steady_clock::now();
+  return s;
+}
+
+void OutputBatcher::clear() { batch.clear(); }
+}  // namespace et
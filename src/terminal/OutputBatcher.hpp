@@ -0,0 +1,60 @@
+#ifndef __ET_OUTPUT_BATCHER__
+#define __ET_OUTPUT_BATCHER__
+
+#include "Headers.hpp"
+
+namespace et {
+/**
+ * @brief Gathers terminal output that arrives in quick succession so it is
+ * sent as one packet instead of many small ones.
+ *
+ * Output after an idle period is ready immediately, so a lone keystroke echo
+ * is not delayed.  Output arriving within `window` of the previous send is
+ * held until `window` has passed since its first byte or `MAX_BATCH_BYTES`
+ * have been gathered, which merges the stream of small writes that curses
+ * programs and progress bars produce.
+ */
+class OutputBatcher {
+ public:
+  /** @brief Default batching window. */
+  static const int DEFAULT_WINDOW_US = 1000;
+  /** @brief A batch this large is sent without waiting for the window. */
+  static const size_t MAX_BATCH_BYTES = 64 * 1024;
+
+  /** @param windowUs Batching window in microseconds, 0 to disable. */
+  explicit OutputBatcher(int windowUs);
+
+  /** @brief Adds output to the current batch. */
+  void append(const char* data, size_t length);
+
+  /** @brief Whether the current batch should be sent now. */
+  bool isReady() const;
+
+  /**
+   * @brief Microseconds until the current batch is ready, 0 if it is ready
+   * now, or -1 if there is nothing to send.
+   */
+  int64_t usUntilReady() const;
+
+  /** @brief Returns the current batch and starts a new one. */
+  string take();
+
+  /** @brief Drops the current batch. */
+  void clear();
+
+  inline size_t size() const { return batch.length(); }
+  inline bool empty() const { return batch.empty(); }
+
+ protected:
+  /** @brief How long a burst is gathered. */
+  std::chrono::microseconds window;
+  /** @brief Output waiting to be sent. */
+  string batch;
+  /** @brief When the current batch becomes ready. */
+  std::chrono::steady_clock::time_point deadline;
+  /** @brief When the last batch was taken. */
+  std::chrono::steady_clock::time_point lastTake;
+};
+}  // namespace et
+
+#endif  // __ET_OUTPUT_BATCHER__
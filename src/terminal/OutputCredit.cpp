@@ -0,0 +1,76 @@
+#include "OutputCredit.hpp"
+
+namespace et {
+namespace {
+/** @brief Sends remembered for measuring; older ones are dropped. */
+const size_t MAX_SAMPLES = 1024;
+}  // namespace
+
+OutputCredit::OutputCredit()
+    : enabled(false),
+      totalSent(0),
+      totalGranted(0),
+      window(MIN_WINDOW),
+      minRttUs(0),
+      maxRate(0) {}
+
+bool OutputCredit::hasCredit() const {
+  return !enabled || inFlight() < window;
+}
+
+void OutputCredit::sent(int64_t bytes, Clock::time_point now) {
+  if (bytes <= 0) {
+    return;
+  }
+  totalSent += bytes;
+  if (!enabled) {
+    return;
+  }
+  samples.push_back({totalSent, totalGranted, now});
+  if (samples.size() > MAX_SAMPLES) {
+    samples.pop_front();
+  }
+}
+
+void OutputCredit::granted(int64_t consumed, Clock::time_point now) {
+  enabled = true;
+  // Grants are cumulative, so an old one adds nothing.
+  consumed = min(consumed, totalSent);
+  if (consumed <= totalGranted) {
+    return;
+  }
+  totalGranted = consumed;
+
+  // The newest send this grant covers gives one round trip and the rate
+  // output was delivered at over it.
+  bool measured = false;
+  Sample sample;
+  while (!samples.empty() && samples.front().end <= consumed) {
+    sample = samples.front();
+    samples.pop_front();
+    measured = true;
+  }
+  if (!measured) {
+    return;
+  }
+  int64_t rttUs =
+      std::chrono::duration_cast<std::chrono::microseconds>(now - sample.time)
+          .count();
+  if (rttUs <= 0) {
+    return;
+  }
+  auto lifetime = std::chrono::microseconds(SAMPLE_LIFETIME_US);
+  if (minRttUs == 0 || rttUs <= minRttUs || now - minRttTime > lifetime) {
+    minRttUs = rttUs;
+    minRttTime = now;
+  }
+  double rate = double(consumed - sample.grantedAtSend) * 1000000.0 / rttUs;
+  if (rate >= maxRate || now - maxRateTime > lifetime) {
+    maxRate = rate;
+    maxRateTime = now;
+  }
+  double bandwidthDelay = maxRate * minRttUs / 1000000.0;
+  window = max(int64_t(MIN_WINDOW),
+               min(int64_t(MAX_WINDOW), int64_t(2 * bandwidthDelay)));
+}
+}  // namespace et
@@ -0,0 +1,80 @@
+#ifndef __ET_OUTPUT_CREDIT__
+#define __ET_OUTPUT_CREDIT__
+
+#include "Headers.hpp"
+
+namespace et {
+/**
+ * @brief Credit the client has granted etserver for terminal output.
+ *
+ * The client reports how many output bytes its console has taken in
+ * TERMINAL_CREDIT packets.  etserver only reads the shell while fewer than
+ * `getWindow()` bytes are unaccounted for, so a flood backs up into the
+ * shell instead of into socket buffers and the connection backup, and a
+ * Ctrl-C takes effect about one round trip later.
+ *
+ * The window is twice the measured bandwidth-delay product: the lowest
+ * recent round trip times the highest recent delivery rate.  The slack
+ * lets the window grow while it is what limits the rate.
+ *
+ * Nothing is limited until the first grant arrives, so clients that never
+ * send credit (older ones, or any behind a jumphost) are not stalled.
+ */
+class OutputCredit {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  /** @brief Smallest window, also used before anything is measured. */
+  static const int64_t MIN_WINDOW = 64 * 1024;
+  /** @brief Largest window. */
+  static const int64_t MAX_WINDOW = 8 * 1024 * 1024;
+  /** @brief The client grants credit once it has taken this much. */
+  static const int64_t GRANT_BYTES = 16 * 1024;
+  /** @brief How long a round trip or rate measurement is trusted. */
+  static const int64_t SAMPLE_LIFETIME_US = 10 * 1000 * 1000;
+
+  OutputCredit();
+
+  /** @brief Whether more output may be sent now. */
+  bool hasCredit() const;
+
+  /** @brief Records @p bytes of output sent at @p now. */
+  void sent(int64_t bytes, Clock::time_point now = Clock::now());
+
+  /**
+   * @brief Records a grant covering the first @p consumed output bytes and
+   * starts limiting output if this is the first one.
+   */
+  void granted(int64_t consumed, Clock::time_point now = Clock::now());
+
+  /** @brief Output bytes the client has not granted credit for yet. */
+  inline int64_t inFlight() const { return totalSent - totalGranted; }
+  inline int64_t getWindow() const { return window; }
+  inline bool isEnabled() const { return enabled; }
+
+ protected:
+  /** @brief A send waiting for the grant that covers it. */
+  struct Sample {
+    /** @brief `totalSent` after the send. */
+    int64_t end;
+    /** @brief `totalGranted` at the time of the send. */
+    int64_t grantedAtSend;
+    Clock::time_point time;
+  };
+
+  /** @brief Whether a grant has arrived, which turns the limit on. */
+  bool enabled;
+  int64_t totalSent;
+  int64_t totalGranted;
+  int64_t window;
+  deque<Sample> samples;
+  /** @brief Lowest recent round trip in microseconds, 0 if unknown. */
+  int64_t minRttUs;
+  Clock::time_point minRttTime;
+  /** @brief Highest recent delivery rate in bytes per second. */
+  double maxRate;
+  Clock::time_point maxRateTime;
+};
+}  // namespace et
+
+#endif  // __ET_OUTPUT_CREDIT__
@@ -0,0 +1,169 @@
+#include "PredictiveEcho.hpp"
+
+namespace et {
+PredictiveEcho::PredictiveEcho(int rows, int columns)
+    : screen(rows, columns, 0),
+      displayedCount(0),
+      confirmed(false),
+      suspended(false) {}
+
+string PredictiveEcho::onServerOutput(const string& s) {
+  string out = hide() + s;
+  screen.write(s);
+
+  bool echoed = false;
+  bool mispredicted = false;
+  while (!predictions.empty()) {
+    const Prediction& p = predictions.front();
+    bool passed = screen.getCursorRow() != p.row ||
+                  screen.getCursorColumn() > p.column;
+    if (!passed) {
+      break;
+    }
+    if (p.row >= screen.getRows() || p.column >= screen.getColumns() ||
+        screen.getGlyph(p.row, p.column) != string(1, p.c)) {
+      mispredicted = true;
+      break;
+    }
+    predictions.pop_front();
+    echoed = true;
+  }
+  // The rest must still start at the cursor, or the server went elsewhere.
+  if (!predictions.empty() &&
+      (screen.getCursorRow() != predictions.front().row ||
+       screen.getCursorColumn() != predictions.front().column)) {
+    mispredicted = true;
+  }
+
+  if (mispredicted) {
+    clearPredictions();
+  } else if (echoed) {
+    confirmed = true;
+  } else if (predictions.empty()) {
+    // Output that is not an echo starts a new run of typing
+    confirmed = false;
+  }
+  if (predictions.empty()) {
+    suspended = false;
+  }
+  return out + show();
+}
+
+string PredictiveEcho::onKeystrokes(const string& s) {
+  string out = hide();
+  auto now = std::chrono::steady_clock::now();
+  for (char c : s) {
+    if ((c == 0x7F || c == 0x08) && !suspended && !predictions.empty()) {
+      // Erases a character that is still waiting for its echo
+      predictions.pop_back();
+      continue;
+    }
+    if (c >= 0x20 && c < 0x7F && canPredict()) {
+      Prediction p;
+      p.row = screen.getCursorRow();
+      p.column = predictions.empty() ? screen.getCursorColumn()
+                                     : predictions.back().column + 1;
+      p.c = c;
+      p.typed = now;
+      predictions.push_back(p);
+      continue;
+    }
+    // Anything else may move the cursor in ways that cannot be predicted
+    suspended = true;
+    confirmed = false;
+  }
+  return out + show();
+}
+
+string PredictiveEcho::expire() {
+  if (predictions.empty() ||
+      std::chrono::steady_clock::now() - predictions.front().typed <
+          std::chrono::milliseconds(ECHO_TIMEOUT_MS)) {
+    return "";
+  }
+  VLOG(1) << "Keystrokes were not echoed, erasing predictions";
+  string out = hide();
+  clearPredictions();
+  return out;
+}
+
+int64_t PredictiveEcho::msUntilExpiry() const {
+  if (predictions.empty()) {
+    return -1;
+  }
+  auto expiry = predictions.front().typed +
+                std::chrono::milliseconds(ECHO_TIMEOUT_MS);
+  auto now = std::chrono::steady_clock::now();
+  if (now >= expiry) {
+    return 0;
+  }
+  // Round up so a timer set for this long never fires early.
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             expiry - now + std::chrono::microseconds(999))
+      .count();
+}
+
+string PredictiveEcho::resize(int rows, int columns) {
+  string out = hide();
+  clearPredictions();
+  screen.resize(rows, columns);
+  return out;
+}
+
+bool PredictiveEcho::canPredict() const {
+  if (suspended || screen.isAlternateScreen() || screen.isWrapPending() ||
+      screen.isInsertMode()) {
+    return false;
+  }
+  int column = predictions.empty() ? screen.getCursorColumn()
+                                   : predictions.back().column + 1;
+  // Keep off the last column so the console never wraps on a prediction.
+  if (column + 1 >= screen.getColumns()) {
+    return false;
+  }
+  if (predictions.empty()) {
+    // Only typing at the end of a line is predicted; editing in the middle
+    // makes the shell redraw the rest of the line.
+    for (int c = column; c < screen.getColumns(); c++) {
+      if (screen.getGlyph(screen.getCursorRow(), c) != " ") {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void PredictiveEcho::clearPredictions() {
+  predictions.clear();
+  confirmed = false;
+}
+
+string PredictiveEcho::show() {
+  if (predictions.empty() || !confirmed || screen.isAlternateScreen() ||
+      screen.isWrapPending() || screen.isInsertMode()) {
+    return "";
+  }
+  string s = "\x1b[0;4m";
+  for (const Prediction& p : predictions) {
+    s += p.c;
+  }
+  displayedCount = int(predictions.size());
+  return s;
+}
+
+string PredictiveEcho::hide() {
+  if (displayedCount == 0) {
+    return "";
+  }
+  // The model has not changed since the predictions were drawn, so they
+  // start at its cursor.
+  const string back = "\x1b[" + to_string(displayedCount) + "D";
+  string s = back;
+  for (int a = 0; a < displayedCount; a++) {
+    s += screen.renderCell(screen.getCursorRow(),
+                           screen.getCursorColumn() + a);
+  }
+  displayedCount = 0;
+  return s + back + screen.getPenSgr();
+}
+}  // namespace et
@@ -0,0 +1,99 @@
+#ifndef __ET_PREDICTIVE_ECHO__
+#define __ET_PREDICTIVE_ECHO__
+
+#include "Headers.hpp"
+#include "ScreenModel.hpp"
+
+namespace et {
+/**
+ * @brief Displays typed characters before the server echoes them.
+ *
+ * All terminal output passes through `onServerOutput()`, which keeps a
+ * ScreenModel of the client's screen.  Printable keystrokes typed at the end
+ * of a line are predicted to appear at the cursor and are drawn underlined
+ * right away.  When the echo arrives the prediction is confirmed and the
+ * server's output takes its place; if the server drew something else, the
+ * prediction is erased and predicting pauses until echoes line up again.
+ *
+ * Predictions are only shown once an earlier keystroke of the same run of
+ * typing was confirmed, so input that is never echoed (passwords) is never
+ * drawn.  Nothing is predicted on the alternate screen, where full-screen
+ * programs redraw on their own, nor after control keys until the server's
+ * response arrives.  Predictions are drawn and erased with relative cursor
+ * movement only, so they stay on the cursor's line even when the model does
+ * not know where the session started on the client's screen.
+ */
+class PredictiveEcho {
+ public:
+  /** @brief Predictions not echoed within this time are erased. */
+  static const int ECHO_TIMEOUT_MS = 2000;
+
+  PredictiveEcho(int rows, int columns);
+
+  /**
+   * @brief Accounts for terminal output from the server.
+   * @return What to write to the console instead of @p s.
+   */
+  string onServerOutput(const string& s);
+
+  /**
+   * @brief Accounts for keystrokes sent to the server.
+   * @return What to write to the console to show the predictions.
+   */
+  string onKeystrokes(const string& s);
+
+  /**
+   * @brief Erases predictions the server did not echo in time.
+   * @return What to write to the console.
+   */
+  string expire();
+
+  /** @brief Milliseconds until `expire()` has work to do, or -1 if none. */
+  int64_t msUntilExpiry() const;
+
+  /**
+   * @brief Follows a change of the client's window size.
+   * @return What to write to the console.
+   */
+  string resize(int rows, int columns);
+
+  /** @brief Number of keystrokes waiting for their echo. */
+  inline int pendingPredictions() const { return int(predictions.size()); }
+
+  /** @brief Number of predictions currently drawn on the console. */
+  inline int displayedPredictions() const { return displayedCount; }
+
+ protected:
+  /** @brief A keystroke expected to be echoed at a screen position. */
+  struct Prediction {
+    int row;
+    int column;
+    char c;
+    std::chrono::steady_clock::time_point typed;
+  };
+
+  /** @brief Model of the screen as the server drew it. */
+  ScreenModel screen;
+  /** @brief Unconfirmed keystrokes, contiguous from the cursor. */
+  deque<Prediction> predictions;
+  /** @brief How many predictions are drawn on the console after the
+   * cursor. */
+  int displayedCount;
+  /** @brief Whether a keystroke of the current run of typing was echoed. */
+  bool confirmed;
+  /** @brief Set after a keystroke that is not predicted, until the server
+   * responds. */
+  bool suspended;
+
+  /** @brief Whether a keystroke may be predicted now. */
+  bool canPredict() const;
+  /** @brief Drops all predictions after a misprediction. */
+  void clearPredictions();
+  /** @brief Console output drawing the predictions after the cursor. */
+  string show();
+  /** @brief Console output restoring what the predictions covered. */
+  string hide();
+};
+}  // namespace et
+
+#endif  // __ET_PREDICTIVE_ECHO__
@@ -57,6 +57,14 @@ class PseudoTerminalConsole : public Console {
     memcpy(&terminal_backup, &terminal_local, sizeof(struct termios));
     cfmakeraw(&terminal_local);
     tcsetattr(0, TCSANOW, &terminal_local);
+    // Output is queued and flushed as the terminal keeps up, so a slow
+    // emulator never blocks the client loop.  The terminal is opened again
+    // for that: O_NONBLOCK on stdout would reach the shell that started us,
+    // and stay there if we die.
+    const char* ttyName = isatty(STDOUT_FILENO) ? ttyname(STDOUT_FILENO) : NULL;
+    if (ttyName != NULL) {
+      ttyFd = ::open(ttyName, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    }
 #endif
   }
 
@@ -69,6 +77,10 @@ class PseudoTerminalConsole : public Console {
     SetConsoleMode(hstdout, outputMode);
 #else
     tcsetattr(0, TCSANOW, &terminal_backup);
+    if (ttyFd != -1) {
+      ::close(ttyFd);
+      ttyFd = -1;
+    }
 #endif
   }
 
@@ -112,7 +124,7 @@ class PseudoTerminalConsole : public Console {
 #ifdef WIN32
     return _fileno(stdout);
 #else
-    return STDOUT_FILENO;
+    return ttyFd != -1 ? ttyFd : STDOUT_FILENO;
 #endif
   }
 
@@ -125,6 +137,9 @@ class PseudoTerminalConsole : public Console {
 #else
   /** @brief Backup of the terminal's `termios` state for teardown. */
   termios terminal_backup;
+  /** @brief Non-blocking descriptor of the terminal behind stdout, opened by
+   * `setup()`, or -1. */
+  int ttyFd = -1;
 #endif
 
 };  // namespace et
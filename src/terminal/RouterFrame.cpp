@@ -0,0 +1,74 @@
+#include "RouterFrame.hpp"
+
+namespace et {
+void RouterFrame::write(const shared_ptr<SocketHandler>& socketHandler, int fd,
+                        char type, const string& body, bool compact) {
+  int64_t length = body.length();
+  if (length > MAX_ROUTER_FRAME_LENGTH) {
+    STFATAL << "Invalid router message length: " << length;
+  }
+  char header[1 + sizeof(int64_t)];
+  size_t headerLength;
+  header[0] = type;
+  if (compact) {
+    uint32_t networkLength = htonl(uint32_t(length));
+    memcpy(header + 1, &networkLength, sizeof(uint32_t));
+    headerLength = COMPACT_ROUTER_FRAME_HEADER_LENGTH;
+  } else {
+    memcpy(header + 1, &length, sizeof(int64_t));
+    headerLength = 1 + sizeof(int64_t);
+  }
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = headerLength;
+  iov[1].iov_base = (void*)body.data();
+  iov[1].iov_len = body.length();
+  socketHandler->writevAllOrThrow(fd, iov, 2, false);
+}
+
+string RouterFrame::encode(char type, const string& body) {
+  if (int64_t(body.length()) > MAX_ROUTER_FRAME_LENGTH) {
+    STFATAL << "Invalid router message length: " << body.length();
+  }
+  string frame(COMPACT_ROUTER_FRAME_HEADER_LENGTH, '\0');
+  frame[0] = type;
+  uint32_t networkLength = htonl(uint32_t(body.length()));
+  memcpy(&frame[1], &networkLength, sizeof(uint32_t));
+  frame.append(body);
+  return frame;
+}
+
+void RouterFrameDecoder::append(const char* data, size_t length) {
+  if (offset > 0) {
+    // Drop consumed frames; what is left is at most one partial frame.
+    buffer.erase(0, offset);
+    offset = 0;
+  }
+  buffer.append(data, length);
+}
+
+bool RouterFrameDecoder::next(char* type, string* body) {
+  if (buffer.length() - offset < size_t(COMPACT_ROUTER_FRAME_HEADER_LENGTH)) {
+    return false;
+  }
+  uint32_t networkLength;
+  memcpy(&networkLength, &buffer[offset + 1], sizeof(uint32_t));
+  int64_t length = ntohl(networkLength);
+  if (length > MAX_ROUTER_FRAME_LENGTH) {
+    throw std::runtime_error("Invalid router frame size: " +
+                             to_string(length));
+  }
+  size_t frameLength = COMPACT_ROUTER_FRAME_HEADER_LENGTH + length;
+  if (buffer.length() - offset < frameLength) {
+    return false;
+  }
+  *type = buffer[offset];
+  body->assign(buffer, offset + COMPACT_ROUTER_FRAME_HEADER_LENGTH, length);
+  offset += frameLength;
+  if (offset == buffer.length()) {
+    buffer.clear();
+    offset = 0;
+  }
+  return true;
+}
+}  // namespace et
@@ -0,0 +1,60 @@
+#ifndef __ET_ROUTER_FRAME__
+#define __ET_ROUTER_FRAME__
+
+#include "Headers.hpp"
+#include "SocketHandler.hpp"
+
+namespace et {
+/** @brief Bytes in a compact frame header: 1 type byte + 4 length bytes. */
+const int COMPACT_ROUTER_FRAME_HEADER_LENGTH = 5;
+/** @brief Largest message body accepted on the router hop. */
+const int64_t MAX_ROUTER_FRAME_LENGTH = 128 * 1024 * 1024;
+
+/**
+ * @brief Framing for messages sent from etserver to etterminal.
+ *
+ * The legacy frame is a type byte followed by a `writeProto()` frame (8-byte
+ * host-order length, then the body).  The compact frame, negotiated through
+ * `TerminalUserInfo`/`TermInit`, is a type byte, a 4-byte big-endian length
+ * and the body.  Either way the whole frame leaves in one vectored write.
+ */
+class RouterFrame {
+ public:
+  /**
+   * @brief Writes one frame of type @p type carrying @p body.
+   * @param compact Whether the peer negotiated the compact format.
+   */
+  static void write(const shared_ptr<SocketHandler>& socketHandler, int fd,
+                    char type, const string& body, bool compact);
+
+  /** @brief Returns a compact frame of type @p type carrying @p body. */
+  static string encode(char type, const string& body);
+};
+
+/**
+ * @brief Reassembles compact router frames from whatever bytes one read
+ * returned, so a single read can yield zero, one or several messages.
+ */
+class RouterFrameDecoder {
+ public:
+  RouterFrameDecoder() : offset(0) {}
+
+  /** @brief Buffers bytes read from the router. */
+  void append(const char* data, size_t length);
+
+  /**
+   * @brief Pops the next complete frame.
+   * @return false when no complete frame is buffered yet.
+   * @throws std::runtime_error when the declared length is invalid.
+   */
+  bool next(char* type, string* body);
+
+ protected:
+  /** @brief Bytes received but not yet consumed. */
+  string buffer;
+  /** @brief Start of the first unconsumed frame in `buffer`. */
+  size_t offset;
+};
+}  // namespace et
+
+#endif  // __ET_ROUTER_FRAME__
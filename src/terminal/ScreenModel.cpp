@@ -0,0 +1,966 @@
+#include "ScreenModel.hpp"
+
+namespace et {
+namespace {
+/** @brief Longest CSI parameter string kept; longer ones are truncated. */
+const size_t MAX_SEQUENCE_LENGTH = 256;
+/** @brief Longest OSC payload kept (e.g. a window title). */
+const size_t MAX_OSC_LENGTH = 4096;
+const uint32_t REPLACEMENT_CHARACTER = 0xFFFD;
+
+struct CodepointRange {
+  uint32_t first;
+  uint32_t last;
+};
+
+const CodepointRange ZERO_WIDTH_RANGES[] = {
+    {0x0300, 0x036F}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F},
+    {0x20D0, 0x20FF}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+};
+
+const CodepointRange WIDE_RANGES[] = {
+    {0x1100, 0x115F},   {0x2E80, 0x303E},   {0x3041, 0x33FF},
+    {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},   {0xA000, 0xA4CF},
+    {0xAC00, 0xD7A3},   {0xF900, 0xFAFF},   {0xFE30, 0xFE4F},
+    {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x1F300, 0x1F64F},
+    {0x1F900, 0x1F9FF}, {0x20000, 0x3FFFD},
+};
+
+template <size_t N>
+bool inRanges(uint32_t c, const CodepointRange (&ranges)[N]) {
+  for (const auto& range : ranges) {
+    if (c >= range.first && c <= range.last) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int codepointWidth(uint32_t c) {
+  if (inRanges(c, ZERO_WIDTH_RANGES)) {
+    return 0;
+  }
+  if (inRanges(c, WIDE_RANGES)) {
+    return 2;
+  }
+  return 1;
+}
+
+string encodeUtf8(uint32_t c) {
+  string s;
+  if (c < 0x80) {
+    s += char(c);
+  } else if (c < 0x800) {
+    s += char(0xC0 | (c >> 6));
+    s += char(0x80 | (c & 0x3F));
+  } else if (c < 0x10000) {
+    s += char(0xE0 | (c >> 12));
+    s += char(0x80 | ((c >> 6) & 0x3F));
+    s += char(0x80 | (c & 0x3F));
+  } else {
+    s += char(0xF0 | ((c >> 18) & 0x07));
+    s += char(0x80 | ((c >> 12) & 0x3F));
+    s += char(0x80 | ((c >> 6) & 0x3F));
+    s += char(0x80 | (c & 0x3F));
+  }
+  return s;
+}
+}  // namespace
+
+string ScreenModel::Rendition::sgr() const {
+  auto color = [](int32_t value, int base) -> string {
+    if (value < 0) {
+      return "";
+    }
+    if (value & TRUE_COLOR) {
+      return ";" + to_string(base + 8) + ";2;" +
+             to_string((value >> 16) & 0xFF) + ";" +
+             to_string((value >> 8) & 0xFF) + ";" + to_string(value & 0xFF);
+    }
+    if (value < 8) {
+      return ";" + to_string(base + value);
+    }
+    if (value < 16) {
+      return ";" + to_string(base + 60 + value - 8);
+    }
+    return ";" + to_string(base + 8) + ";5;" + to_string(value);
+  };
+  string s = "\x1b[0";
+  static const pair<int, const char*> FLAG_CODES[] = {
+      {BOLD, ";1"},    {DIM, ";2"},     {ITALIC, ";3"}, {UNDERLINE, ";4"},
+      {BLINK, ";5"},   {INVERSE, ";7"}, {HIDDEN, ";8"}, {STRIKE, ";9"},
+  };
+  for (const auto& it : FLAG_CODES) {
+    if (flags & it.first) {
+      s += it.second;
+    }
+  }
+  s += color(foreground, 30);
+  s += color(background, 40);
+  return s + "m";
+}
+
+const int ScreenModel::MAX_ROWS;
+const int ScreenModel::MAX_COLUMNS;
+
+ScreenModel::ScreenModel(int _rows, int _columns, int _scrollbackLimit)
+    : rows(std::clamp(_rows, 1, MAX_ROWS)),
+      columns(std::clamp(_columns, 1, MAX_COLUMNS)),
+      scrollbackLimit(_scrollbackLimit),
+      scrollbackEnd(0),
+      state(GROUND),
+      stringEscape(false),
+      codepoint(0),
+      utf8Remaining(0) {
+  reset();
+}
+
+void ScreenModel::reset() {
+  primary = Grid(rows, Line(columns, Cell()));
+  alternate = primary;
+  alternateActive = false;
+  cursorRow = 0;
+  cursorColumn = 0;
+  wrapPending = false;
+  pen = Rendition();
+  savedCursor[0] = savedCursor[1] = SavedCursor();
+  scrollTop = 0;
+  scrollBottom = rows - 1;
+  autoWrap = true;
+  originMode = false;
+  insertMode = false;
+  cursorVisible = true;
+  keypadApplication = false;
+  privateModes.clear();
+}
+
+void ScreenModel::write(const string& s) {
+  for (char c : s) {
+    processByte(uint8_t(c));
+  }
+}
+
+void ScreenModel::processByte(uint8_t b) {
+  switch (state) {
+    case GROUND:
+      if (utf8Remaining > 0) {
+        if ((b & 0xC0) == 0x80) {
+          codepoint = (codepoint << 6) | (b & 0x3F);
+          if (--utf8Remaining == 0) {
+            print(codepoint);
+          }
+          return;
+        }
+        // Truncated sequence
+        utf8Remaining = 0;
+        print(REPLACEMENT_CHARACTER);
+      }
+      if (b < 0x20 || b == 0x7F) {
+        executeControl(b);
+      } else if (b < 0x80) {
+        print(b);
+      } else if ((b & 0xE0) == 0xC0) {
+        codepoint = b & 0x1F;
+        utf8Remaining = 1;
+      } else if ((b & 0xF0) == 0xE0) {
+        codepoint = b & 0x0F;
+        utf8Remaining = 2;
+      } else if ((b & 0xF8) == 0xF0) {
+        codepoint = b & 0x07;
+        utf8Remaining = 3;
+      } else {
+        print(REPLACEMENT_CHARACTER);
+      }
+      return;
+    case ESCAPE:
+      if (b < 0x20) {
+        executeControl(b);
+      } else {
+        dispatchEscape(b);
+      }
+      return;
+    case ESCAPE_INTERMEDIATE:
+      // Charset designations and the like, which do not affect the screen
+      if (b < 0x20) {
+        executeControl(b);
+      } else if (b >= 0x30 && b != 0x7F) {
+        state = GROUND;
+      }
+      return;
+    case CSI:
+      if (b < 0x20) {
+        executeControl(b);
+      } else if (b >= 0x40 && b <= 0x7E) {
+        state = GROUND;
+        dispatchCsi(b);
+      } else if (b < 0x40 && sequence.length() < MAX_SEQUENCE_LENGTH) {
+        sequence += char(b);
+      }
+      return;
+    case OSC:
+    case IGNORED_STRING:
+      if (stringEscape) {
+        stringEscape = false;
+        if (b == '\\') {
+          if (state == OSC) {
+            dispatchOsc();
+          }
+          state = GROUND;
+          return;
+        }
+        // Anything but ST aborts the string and starts a new sequence
+        state = ESCAPE;
+        processByte(b);
+        return;
+      }
+      if (b == 0x1B) {
+        stringEscape = true;
+      } else if (b == 0x07 && state == OSC) {
+        dispatchOsc();
+        state = GROUND;
+      } else if (b == 0x18 || b == 0x1A) {
+        state = GROUND;
+      } else if (state == OSC && sequence.length() < MAX_OSC_LENGTH) {
+        sequence += char(b);
+      }
+      return;
+  }
+}
+
+void ScreenModel::executeControl(uint8_t b) {
+  switch (b) {
+    case 0x08:  // BS
+      moveCursor(cursorRow, cursorColumn - 1);
+      break;
+    case 0x09:  // HT, with fixed tab stops every 8 columns
+      moveCursor(cursorRow, (cursorColumn / 8 + 1) * 8);
+      break;
+    case 0x0A:  // LF
+    case 0x0B:  // VT
+    case 0x0C:  // FF
+      lineFeed();
+      break;
+    case 0x0D:  // CR
+      moveCursor(cursorRow, 0);
+      break;
+    case 0x18:  // CAN
+    case 0x1A:  // SUB
+      state = GROUND;
+      break;
+    case 0x1B:  // ESC
+      state = ESCAPE;
+      sequence.clear();
+      break;
+    default:
+      break;
+  }
+}
+
+void ScreenModel::dispatchEscape(uint8_t b) {
+  state = GROUND;
+  if (b >= 0x20 && b <= 0x2F) {
+    state = ESCAPE_INTERMEDIATE;
+    return;
+  }
+  switch (b) {
+    case '[':
+      state = CSI;
+      sequence.clear();
+      break;
+    case ']':
+      state = OSC;
+      sequence.clear();
+      stringEscape = false;
+      break;
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+      state = IGNORED_STRING;
+      stringEscape = false;
+      break;
+    case '7':
+      saveCursor();
+      break;
+    case '8':
+      restoreCursor();
+      break;
+    case 'D':
+      lineFeed();
+      break;
+    case 'E':
+      moveCursor(cursorRow, 0);
+      lineFeed();
+      break;
+    case 'M':
+      reverseIndex();
+      break;
+    case 'c':
+      reset();
+      break;
+    case '=':
+      keypadApplication = true;
+      break;
+    case '>':
+      keypadApplication = false;
+      break;
+    default:
+      break;
+  }
+}
+
+void ScreenModel::dispatchCsi(uint8_t final) {
+  char marker = 0;
+  string paramString = sequence;
+  if (!paramString.empty() && paramString[0] >= '<' &&
+      paramString[0] <= '?') {
+    marker = paramString[0];
+    paramString = paramString.substr(1);
+  }
+  vector<int> params(1, 0);
+  for (char c : paramString) {
+    if (c >= '0' && c <= '9') {
+      params.back() = min(params.back() * 10 + (c - '0'), 65535);
+    } else if (c == ';' || c == ':') {
+      params.push_back(0);
+    } else {
+      // Intermediate bytes (e.g. cursor style, soft reset) are not modeled
+      return;
+    }
+  }
+  auto param = [&params](size_t index, int defaultValue) {
+    return (index < params.size() && params[index] > 0) ? params[index]
+                                                         : defaultValue;
+  };
+
+  if (marker == '?') {
+    if (final == 'h' || final == 'l') {
+      for (int mode : params) {
+        setPrivateMode(mode, final == 'h');
+      }
+    }
+    return;
+  }
+  if (marker) {
+    // Device attribute and similar queries
+    return;
+  }
+
+  Grid& g = grid();
+  const int n = param(0, 1);
+  switch (final) {
+    case '@': {  // ICH
+      Line& line = g[cursorRow];
+      int count = min(n, columns - cursorColumn);
+      breakWide(line, cursorColumn);
+      line.insert(line.begin() + cursorColumn, count, blankCell());
+      if (line[columns].glyph.empty()) {
+        line[columns - 1] = Cell();
+      }
+      line.resize(columns);
+      wrapPending = false;
+      break;
+    }
+    case 'A':  // CUU
+      moveCursor(max(cursorRow >= scrollTop ? scrollTop : 0, cursorRow - n),
+                 cursorColumn);
+      break;
+    case 'B':  // CUD
+    case 'e':  // VPR
+      moveCursor(
+          min(cursorRow <= scrollBottom ? scrollBottom : rows - 1,
+              cursorRow + n),
+          cursorColumn);
+      break;
+    case 'C':  // CUF
+    case 'a':  // HPR
+      moveCursor(cursorRow, cursorColumn + n);
+      break;
+    case 'D':  // CUB
+      moveCursor(cursorRow, cursorColumn - n);
+      break;
+    case 'E':  // CNL
+      moveCursor(min(scrollBottom, cursorRow + n), 0);
+      break;
+    case 'F':  // CPL
+      moveCursor(max(scrollTop, cursorRow - n), 0);
+      break;
+    case 'G':  // CHA
+    case '`':  // HPA
+      moveCursor(cursorRow, n - 1);
+      break;
+    case 'H':  // CUP
+    case 'f':  // HVP
+    case 'd': {  // VPA
+      int row = n - 1;
+      int column = final == 'd' ? cursorColumn : param(1, 1) - 1;
+      if (originMode) {
+        row = min(row + scrollTop, scrollBottom);
+      }
+      moveCursor(row, column);
+      break;
+    }
+    case 'J':  // ED
+      switch (param(0, 0)) {
+        case 0:
+          eraseCells(cursorRow, cursorColumn, columns);
+          for (int row = cursorRow + 1; row < rows; row++) {
+            eraseCells(row, 0, columns);
+          }
+          break;
+        case 1:
+          for (int row = 0; row < cursorRow; row++) {
+            eraseCells(row, 0, columns);
+          }
+          eraseCells(cursorRow, 0, cursorColumn + 1);
+          break;
+        case 2:
+          for (int row = 0; row < rows; row++) {
+            eraseCells(row, 0, columns);
+          }
+          break;
+        case 3:
+          scrollback.clear();
+          break;
+      }
+      wrapPending = false;
+      break;
+    case 'K':  // EL
+      switch (param(0, 0)) {
+        case 0:
+          eraseCells(cursorRow, cursorColumn, columns);
+          break;
+        case 1:
+          eraseCells(cursorRow, 0, cursorColumn + 1);
+          break;
+        case 2:
+          eraseCells(cursorRow, 0, columns);
+          break;
+      }
+      wrapPending = false;
+      break;
+    case 'L':  // IL
+      if (cursorRow >= scrollTop && cursorRow <= scrollBottom) {
+        scrollDown(cursorRow, scrollBottom, n);
+        moveCursor(cursorRow, 0);
+      }
+      break;
+    case 'M':  // DL
+      if (cursorRow >= scrollTop && cursorRow <= scrollBottom) {
+        scrollUp(cursorRow, scrollBottom, n);
+        moveCursor(cursorRow, 0);
+      }
+      break;
+    case 'P': {  // DCH
+      Line& line = g[cursorRow];
+      int count = min(n, columns - cursorColumn);
+      breakWide(line, cursorColumn);
+      breakWide(line, cursorColumn + count - 1);
+      line.erase(line.begin() + cursorColumn,
+                 line.begin() + cursorColumn + count);
+      line.resize(columns, blankCell());
+      wrapPending = false;
+      break;
+    }
+    case 'S':  // SU
+      if (!alternateActive && scrollTop == 0) {
+        for (int row = 0; row < min(n, scrollBottom + 1); row++) {
+          pushScrollback(g[row]);
+        }
+      }
+      scrollUp(scrollTop, scrollBottom, n);
+      break;
+    case 'T':  // SD
+      scrollDown(scrollTop, scrollBottom, n);
+      break;
+    case 'X':  // ECH
+      eraseCells(cursorRow, cursorColumn, min(columns, cursorColumn + n));
+      wrapPending = false;
+      break;
+    case 'm':  // SGR
+      setRendition(params);
+      break;
+    case 'r': {  // DECSTBM
+      int top = param(0, 1) - 1;
+      int bottom = min(param(1, rows), rows) - 1;
+      if (top < bottom) {
+        scrollTop = top;
+        scrollBottom = bottom;
+        moveCursor(originMode ? scrollTop : 0, 0);
+      }
+      break;
+    }
+    case 's':  // SCOSC
+      saveCursor();
+      break;
+    case 'u':  // SCORC
+      restoreCursor();
+      break;
+    case 'h':
+    case 'l':
+      for (int mode : params) {
+        setMode(mode, final == 'h');
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void ScreenModel::dispatchOsc() {
+  size_t separator = sequence.find(';');
+  if (separator == string::npos) {
+    return;
+  }
+  string command = sequence.substr(0, separator);
+  if (command == "0" || command == "2") {
+    title = sequence.substr(separator + 1);
+  }
+}
+
+void ScreenModel::print(uint32_t c) {
+  int width = codepointWidth(c);
+  const string glyph = encodeUtf8(c);
+  Grid& g = grid();
+  if (width == 0) {
+    // Combining characters join the character before the cursor
+    int column = wrapPending ? cursorColumn : cursorColumn - 1;
+    if (column >= 0) {
+      Line& line = g[cursorRow];
+      if (line[column].glyph.empty() && column > 0) {
+        column--;
+      }
+      line[column].glyph += glyph;
+    }
+    return;
+  }
+  width = min(width, columns);
+
+  if (wrapPending) {
+    moveCursor(cursorRow, 0);
+    lineFeed();
+  }
+  if (cursorColumn + width > columns) {
+    // A wide character does not fit at the end of the line
+    if (autoWrap) {
+      moveCursor(cursorRow, 0);
+      lineFeed();
+    } else {
+      cursorColumn = columns - width;
+    }
+  }
+
+  Line& line = g[cursorRow];
+  if (insertMode) {
+    breakWide(line, cursorColumn);
+    line.insert(line.begin() + cursorColumn, width, blankCell());
+    if (line[columns].glyph.empty()) {
+      line[columns - 1] = Cell();
+    }
+    line.resize(columns);
+  }
+  breakWide(line, cursorColumn);
+  if (width == 2) {
+    breakWide(line, cursorColumn + 1);
+  }
+  line[cursorColumn].glyph = glyph;
+  line[cursorColumn].rendition = pen;
+  if (width == 2) {
+    line[cursorColumn + 1].glyph.clear();
+    line[cursorColumn + 1].rendition = pen;
+  }
+  cursorColumn += width;
+  if (cursorColumn >= columns) {
+    cursorColumn = columns - 1;
+    wrapPending = autoWrap;
+  }
+}
+
+void ScreenModel::breakWide(Line& line, int column) {
+  if (column < 0 || column >= int(line.size())) {
+    return;
+  }
+  if (line[column].glyph.empty() && column > 0) {
+    line[column - 1] = Cell();
+  }
+  if (column + 1 < int(line.size()) && line[column + 1].glyph.empty()) {
+    line[column + 1] = Cell();
+  }
+}
+
+ScreenModel::Cell ScreenModel::blankCell() const {
+  // Erased cells keep the current background color, like xterm
+  Cell cell;
+  cell.rendition.background = pen.background;
+  return cell;
+}
+
+ScreenModel::Line ScreenModel::blankLine() const {
+  return Line(columns, blankCell());
+}
+
+void ScreenModel::clampCursor() {
+  cursorRow = max(0, min(cursorRow, rows - 1));
+  cursorColumn = max(0, min(cursorColumn, columns - 1));
+}
+
+void ScreenModel::moveCursor(int row, int column) {
+  cursorRow = row;
+  cursorColumn = column;
+  wrapPending = false;
+  clampCursor();
+}
+
+void ScreenModel::lineFeed() {
+  wrapPending = false;
+  if (cursorRow == scrollBottom) {
+    if (!alternateActive && scrollTop == 0) {
+      pushScrollback(primary[0]);
+    }
+    scrollUp(scrollTop, scrollBottom, 1);
+  } else if (cursorRow < rows - 1) {
+    cursorRow++;
+  }
+}
+
+void ScreenModel::reverseIndex() {
+  wrapPending = false;
+  if (cursorRow == scrollTop) {
+    scrollDown(scrollTop, scrollBottom, 1);
+  } else if (cursorRow > 0) {
+    cursorRow--;
+  }
+}
+
+void ScreenModel::scrollUp(int top, int bottom, int count) {
+  Grid& g = grid();
+  count = min(count, bottom - top + 1);
+  g.erase(g.begin() + top, g.begin() + top + count);
+  g.insert(g.begin() + bottom - count + 1, count, blankLine());
+}
+
+void ScreenModel::scrollDown(int top, int bottom, int count) {
+  Grid& g = grid();
+  count = min(count, bottom - top + 1);
+  g.erase(g.begin() + bottom - count + 1, g.begin() + bottom + 1);
+  g.insert(g.begin() + top, count, blankLine());
+}
+
+void ScreenModel::eraseCells(int row, int from, int to) {
+  Line& line = grid()[row];
+  breakWide(line, from);
+  breakWide(line, to - 1);
+  for (int column = from; column < to; column++) {
+    line[column] = blankCell();
+  }
+}
+
+void ScreenModel::setMode(int mode, bool on) {
+  if (mode == 4) {  // IRM
+    insertMode = on;
+  }
+}
+
+void ScreenModel::setPrivateMode(int mode, bool on) {
+  switch (mode) {
+    case 3:
+      // DECCOLM would resize the client's window; not replayed.
+      break;
+    case 6:
+      originMode = on;
+      moveCursor(originMode ? scrollTop : 0, 0);
+      break;
+    case 7:
+      autoWrap = on;
+      if (!on) {
+        wrapPending = false;
+      }
+      break;
+    case 25:
+      cursorVisible = on;
+      break;
+    case 47:
+      switchScreen(on, false);
+      break;
+    case 1047:
+      if (!on && alternateActive) {
+        alternate = Grid(rows, Line(columns, Cell()));
+      }
+      switchScreen(on, on);
+      break;
+    case 1048:
+      if (on) {
+        saveCursor();
+      } else {
+        restoreCursor();
+      }
+      break;
+    case 1049:
+      if (on) {
+        saveCursor();
+        switchScreen(true, true);
+      } else {
+        switchScreen(false, false);
+        restoreCursor();
+      }
+      break;
+    default:
+      privateModes[mode] = on;
+      break;
+  }
+}
+
+void ScreenModel::switchScreen(bool alternateScreen, bool clear) {
+  if (alternateScreen == alternateActive) {
+    return;
+  }
+  alternateActive = alternateScreen;
+  if (alternateActive && clear) {
+    alternate = Grid(rows, Line(columns, Cell()));
+  }
+  wrapPending = false;
+}
+
+void ScreenModel::saveCursor() {
+  SavedCursor& saved = savedCursor[alternateActive];
+  saved.row = cursorRow;
+  saved.column = cursorColumn;
+  saved.pen = pen;
+  saved.originMode = originMode;
+}
+
+void ScreenModel::restoreCursor() {
+  const SavedCursor& saved = savedCursor[alternateActive];
+  pen = saved.pen;
+  originMode = saved.originMode;
+  moveCursor(saved.row, saved.column);
+}
+
+void ScreenModel::setRendition(const vector<int>& params) {
+  for (size_t a = 0; a < params.size(); a++) {
+    int p = params[a];
+    if (p == 38 || p == 48) {
+      int32_t color;
+      if (a + 2 < params.size() && params[a + 1] == 5) {
+        color = params[a + 2] & 0xFF;
+        a += 2;
+      } else if (a + 4 < params.size() && params[a + 1] == 2) {
+        color = Rendition::TRUE_COLOR | ((params[a + 2] & 0xFF) << 16) |
+                ((params[a + 3] & 0xFF) << 8) | (params[a + 4] & 0xFF);
+        a += 4;
+      } else {
+        // Malformed extended color, the rest cannot be interpreted
+        return;
+      }
+      (p == 38 ? pen.foreground : pen.background) = color;
+      continue;
+    }
+    if (p >= 30 && p <= 37) {
+      pen.foreground = p - 30;
+    } else if (p >= 40 && p <= 47) {
+      pen.background = p - 40;
+    } else if (p >= 90 && p <= 97) {
+      pen.foreground = p - 90 + 8;
+    } else if (p >= 100 && p <= 107) {
+      pen.background = p - 100 + 8;
+    } else {
+      switch (p) {
+        case 0:
+          pen = Rendition();
+          break;
+        case 1:
+          pen.flags |= Rendition::BOLD;
+          break;
+        case 2:
+          pen.flags |= Rendition::DIM;
+          break;
+        case 3:
+          pen.flags |= Rendition::ITALIC;
+          break;
+        case 4:
+        case 21:
+          pen.flags |= Rendition::UNDERLINE;
+          break;
+        case 5:
+        case 6:
+          pen.flags |= Rendition::BLINK;
+          break;
+        case 7:
+          pen.flags |= Rendition::INVERSE;
+          break;
+        case 8:
+          pen.flags |= Rendition::HIDDEN;
+          break;
+        case 9:
+          pen.flags |= Rendition::STRIKE;
+          break;
+        case 22:
+          pen.flags &= ~(Rendition::BOLD | Rendition::DIM);
+          break;
+        case 23:
+          pen.flags &= ~Rendition::ITALIC;
+          break;
+        case 24:
+          pen.flags &= ~Rendition::UNDERLINE;
+          break;
+        case 25:
+          pen.flags &= ~Rendition::BLINK;
+          break;
+        case 27:
+          pen.flags &= ~Rendition::INVERSE;
+          break;
+        case 28:
+          pen.flags &= ~Rendition::HIDDEN;
+          break;
+        case 29:
+          pen.flags &= ~Rendition::STRIKE;
+          break;
+        case 39:
+          pen.foreground = -1;
+          break;
+        case 49:
+          pen.background = -1;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+void ScreenModel::resize(int newRows, int newColumns) {
+  newRows = std::clamp(newRows, 1, MAX_ROWS);
+  newColumns = std::clamp(newColumns, 1, MAX_COLUMNS);
+  if (newRows == rows && newColumns == columns) {
+    return;
+  }
+  for (Grid* g : {&primary, &alternate}) {
+    const bool active = (g == &grid());
+    if (newRows < rows) {
+      // Keep the cursor on screen by dropping lines from the top first
+      int shift =
+          active ? min(rows - newRows, max(0, cursorRow - (newRows - 1))) : 0;
+      if (g == &primary) {
+        for (int row = 0; row < shift; row++) {
+          pushScrollback((*g)[row]);
+        }
+      }
+      g->erase(g->begin(), g->begin() + shift);
+      g->resize(newRows);
+      if (active) {
+        cursorRow -= shift;
+      }
+    } else {
+      g->resize(newRows, Line(columns, Cell()));
+    }
+    for (Line& line : *g) {
+      if (newColumns < columns && line[newColumns].glyph.empty()) {
+        line[newColumns - 1] = Cell();
+      }
+      line.resize(newColumns);
+    }
+  }
+  rows = newRows;
+  columns = newColumns;
+  scrollTop = 0;
+  scrollBottom = rows - 1;
+  moveCursor(cursorRow, cursorColumn);
+}
+
+string ScreenModel::renderLine(const Line& line) {
+  size_t end = line.size();
+  while (end > 0 && line[end - 1].glyph == " " &&
+         line[end - 1].rendition.isDefault()) {
+    end--;
+  }
+  string s;
+  Rendition current;
+  for (size_t column = 0; column < end; column++) {
+    const Cell& cell = line[column];
+    if (cell.rendition != current) {
+      current = cell.rendition;
+      s += current.sgr();
+    }
+    s += cell.glyph;
+  }
+  if (!current.isDefault()) {
+    s += "\x1b[0m";
+  }
+  return s;
+}
+
+void ScreenModel::pushScrollback(const Line& line) {
+  if (scrollbackLimit <= 0) {
+    return;
+  }
+  scrollback.push_back(renderLine(line));
+  scrollbackEnd++;
+  while (int(scrollback.size()) > scrollbackLimit) {
+    scrollback.pop_front();
+  }
+}
+
+string ScreenModel::renderCell(int row, int column) const {
+  const Cell& cell = grid()[row][column];
+  return cell.rendition.sgr() + cell.glyph;
+}
+
+string ScreenModel::getRowText(int row) const {
+  string s;
+  for (const Cell& cell : grid()[row]) {
+    s += cell.glyph;
+  }
+  size_t end = s.find_last_not_of(' ');
+  return end == string::npos ? "" : s.substr(0, end + 1);
+}
+
+string ScreenModel::snapshot(int64_t scrollbackStart) const {
+  // Start from the primary screen with plain, wrapping output and the whole
+  // screen scrollable, so printing the scrollback pushes it into the
+  // client's history.
+  string s = "\x1b[?1049l\x1b[r\x1b[?6l\x1b[?7h\x1b[4l\x1b[0m\x1b[H\x1b[2J";
+  int64_t number = scrollbackEnd - int64_t(scrollback.size());
+  for (const string& line : scrollback) {
+    if (number++ >= scrollbackStart) {
+      s += line + "\r\n";
+    }
+  }
+  for (int row = 0; row < rows; row++) {
+    s += renderLine(primary[row]);
+    if (row + 1 < rows) {
+      s += "\r\n";
+    }
+  }
+  if (alternateActive) {
+    s += "\x1b[?1049h";
+    for (int row = 0; row < rows; row++) {
+      s += "\x1b[" + to_string(row + 1) + ";1H" + renderLine(alternate[row]);
+    }
+  }
+
+  if (scrollTop != 0 || scrollBottom != rows - 1) {
+    s += "\x1b[" + to_string(scrollTop + 1) + ";" +
+         to_string(scrollBottom + 1) + "r";
+  }
+  if (!title.empty()) {
+    s += "\x1b]0;" + title + "\x07";
+  }
+  for (const auto& it : privateModes) {
+    s += "\x1b[?" + to_string(it.first) + (it.second ? "h" : "l");
+  }
+  if (!autoWrap) {
+    s += "\x1b[?7l";
+  }
+  if (insertMode) {
+    s += "\x1b[4h";
+  }
+  s += keypadApplication ? "\x1b=" : "\x1b>";
+  s += cursorVisible ? "\x1b[?25h" : "\x1b[?25l";
+  if (originMode) {
+    s += "\x1b[?6h";
+  }
+  const int row = originMode ? cursorRow - scrollTop : cursorRow;
+  s += "\x1b[" + to_string(row + 1) + ";" + to_string(cursorColumn + 1) + "H";
+  return s + pen.sgr();
+}
+}  // namespace et
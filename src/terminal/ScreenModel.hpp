@@ -0,0 +1,222 @@
+#ifndef __ET_SCREEN_MODEL__
+#define __ET_SCREEN_MODEL__
+
+#include "Headers.hpp"
+
+namespace et {
+/**
+ * @brief Model of a VT/xterm screen and its scrollback, fed with the output
+ * of a terminal.
+ *
+ * The server keeps one per session when screen snapshots are enabled.  While
+ * the client cannot keep up, output only updates the model, and `snapshot()`
+ * later repaints the client in one go.  The cost of catching up is then
+ * bounded by the screen and scrollback size instead of by how much output
+ * happened meanwhile.
+ *
+ * Covers what shells and full-screen programs rely on: cursor movement,
+ * erasing, insert/delete, scroll regions, SGR attributes, the alternate
+ * screen and the DEC private modes that change input handling.  Character
+ * widths use a built-in table of wide and combining ranges rather than the
+ * locale.
+ */
+class ScreenModel {
+ public:
+  /** @brief Lines kept above the primary screen by default. */
+  static const int DEFAULT_SCROLLBACK_LINES = 500;
+  /**
+   * @brief Largest screen the model keeps.  Sizes come from the client's
+   * window, so anything bigger is clamped rather than allocated.
+   */
+  static const int MAX_ROWS = 1000;
+  static const int MAX_COLUMNS = 1000;
+
+  /**
+   * @param scrollbackLimit Maximum lines kept once they scroll off the top of
+   * the primary screen.
+   */
+  ScreenModel(int rows, int columns,
+              int scrollbackLimit = DEFAULT_SCROLLBACK_LINES);
+
+  /** @brief Applies terminal output to the model. */
+  void write(const string& s);
+
+  /** @brief Changes the screen size, e.g. after the client's window did. */
+  void resize(int rows, int columns);
+
+  /**
+   * @brief Escape sequences that repaint a terminal of the same size with
+   * the scrollback, the screen, the cursor and the current modes.
+   * @param scrollbackStart Scrollback lines numbered below this (see
+   * `getScrollbackEnd()`) are already in the client's history and left out.
+   */
+  string snapshot(int64_t scrollbackStart = 0) const;
+
+  inline int getRows() const { return rows; }
+  inline int getColumns() const { return columns; }
+  inline int getCursorRow() const { return cursorRow; }
+  inline int getCursorColumn() const { return cursorColumn; }
+  inline bool isAlternateScreen() const { return alternateActive; }
+  inline bool isWrapPending() const { return wrapPending; }
+  inline bool isInsertMode() const { return insertMode; }
+  inline const string& getTitle() const { return title; }
+
+  /** @brief UTF-8 glyph in a cell of the visible screen; empty for the
+   * right half of a wide character. */
+  inline const string& getGlyph(int row, int column) const {
+    return grid()[row][column].glyph;
+  }
+
+  /** @brief SGR and glyph that redraw a cell at the cursor. */
+  string renderCell(int row, int column) const;
+
+  /** @brief SGR selecting the attributes output is currently drawn with. */
+  inline string getPenSgr() const { return pen.sgr(); }
+
+  /** @brief Characters on @p row of the visible screen, without attributes
+   * or trailing blanks. */
+  string getRowText(int row) const;
+
+  /** @brief Rendered scrollback lines, oldest first. */
+  inline const deque<string>& getScrollback() const { return scrollback; }
+
+  /** @brief Lines pushed to the scrollback so far, which is also the number
+   * the next one gets. */
+  inline int64_t getScrollbackEnd() const { return scrollbackEnd; }
+
+ protected:
+  /** @brief Character attributes selected with SGR. */
+  struct Rendition {
+    enum {
+      BOLD = 1,
+      DIM = 2,
+      ITALIC = 4,
+      UNDERLINE = 8,
+      BLINK = 16,
+      INVERSE = 32,
+      HIDDEN = 64,
+      STRIKE = 128
+    };
+    /** @brief Color value for a 24-bit color; the low bits hold RGB. */
+    static const int32_t TRUE_COLOR = 1 << 24;
+
+    uint8_t flags = 0;
+    /** @brief -1 for the default color, 0-255 for the palette. */
+    int32_t foreground = -1;
+    int32_t background = -1;
+
+    bool operator==(const Rendition& other) const {
+      return flags == other.flags && foreground == other.foreground &&
+             background == other.background;
+    }
+    bool operator!=(const Rendition& other) const { return !(*this == other); }
+    bool isDefault() const { return *this == Rendition(); }
+    /** @brief SGR sequence selecting exactly this rendition. */
+    string sgr() const;
+  };
+
+  /** @brief One character cell. */
+  struct Cell {
+    /** @brief UTF-8 glyph; empty for the right half of a wide character. */
+    string glyph = " ";
+    Rendition rendition;
+  };
+
+  typedef vector<Cell> Line;
+  typedef vector<Line> Grid;
+
+  /** @brief Cursor state kept by DECSC and restored by DECRC. */
+  struct SavedCursor {
+    int row = 0;
+    int column = 0;
+    Rendition pen;
+    bool originMode = false;
+  };
+
+  enum ParserState {
+    GROUND,
+    ESCAPE,
+    ESCAPE_INTERMEDIATE,
+    CSI,
+    OSC,
+    /** @brief DCS, SOS, PM and APC strings, which are ignored. */
+    IGNORED_STRING
+  };
+
+  int rows;
+  int columns;
+  int scrollbackLimit;
+  Grid primary;
+  Grid alternate;
+  bool alternateActive;
+  deque<string> scrollback;
+  /** @brief Number of the line after the last one in `scrollback`. */
+  int64_t scrollbackEnd;
+
+  int cursorRow;
+  int cursorColumn;
+  /** @brief Set after printing in the last column; the next character
+   * wraps. */
+  bool wrapPending;
+  Rendition pen;
+  SavedCursor savedCursor[2];
+  /** @brief Scroll region, inclusive. */
+  int scrollTop;
+  int scrollBottom;
+
+  bool autoWrap;
+  bool originMode;
+  bool insertMode;
+  bool cursorVisible;
+  bool keypadApplication;
+  /** @brief Other DEC private modes seen, replayed as-is by snapshots. */
+  map<int, bool> privateModes;
+  string title;
+
+  ParserState state;
+  /** @brief Parameters of the CSI or payload of the OSC being parsed. */
+  string sequence;
+  /** @brief Whether an ESC was seen inside an OSC or ignored string. */
+  bool stringEscape;
+  uint32_t codepoint;
+  int utf8Remaining;
+
+  inline Grid& grid() { return alternateActive ? alternate : primary; }
+  inline const Grid& grid() const {
+    return alternateActive ? alternate : primary;
+  }
+
+  void reset();
+  void processByte(uint8_t b);
+  void executeControl(uint8_t b);
+  void dispatchEscape(uint8_t b);
+  void dispatchCsi(uint8_t final);
+  void dispatchOsc();
+  void print(uint32_t c);
+
+  Cell blankCell() const;
+  Line blankLine() const;
+  void clampCursor();
+  void moveCursor(int row, int column);
+  void lineFeed();
+  void reverseIndex();
+  void scrollUp(int top, int bottom, int count);
+  void scrollDown(int top, int bottom, int count);
+  void eraseCells(int row, int from, int to);
+  /** @brief Blanks the other half of a wide character about to be split at
+   * @p column. */
+  static void breakWide(Line& line, int column);
+  void setMode(int mode, bool on);
+  void setPrivateMode(int mode, bool on);
+  void switchScreen(bool alternateScreen, bool clear);
+  void saveCursor();
+  void restoreCursor();
+  void setRendition(const vector<int>& params);
+
+  /** @brief Line with SGR sequences, trailing blanks trimmed. */
+  static string renderLine(const Line& line);
+  void pushScrollback(const Line& line);
+};
+}  // namespace et
+
+#endif  // __ET_SCREEN_MODEL__
@@ -0,0 +1,151 @@
+#include "SessionScheduler.hpp"
+
+namespace et {
+namespace {
+/** @brief Smallest shared bucket, so a round always has something to give. */
+const double MIN_BURST = 64 * 1024;
+}  // namespace
+
+SessionScheduler::SessionScheduler(int64_t _bytesPerSecond,
+                                   int _interactiveWeight, int _bulkWeight)
+    : bytesPerSecond(max(int64_t(1), _bytesPerSecond)),
+      interactiveWeight(max(1, _interactiveWeight)),
+      bulkWeight(max(1, _bulkWeight)),
+      burst(max(MIN_BURST, bytesPerSecond / 10.0)),
+      tokens(burst),
+      lastRefill(Clock::now()),
+      nextId(0),
+      cursor(-1) {}
+
+int SessionScheduler::addSession() {
+  lock_guard<std::mutex> guard(mutex);
+  int id = nextId++;
+  sessions[id] = {0, false, Clock::time_point(), Clock::time_point()};
+  return id;
+}
+
+void SessionScheduler::removeSession(int id) {
+  lock_guard<std::mutex> guard(mutex);
+  auto it = sessions.find(id);
+  if (it == sessions.end()) {
+    return;
+  }
+  tokens = min(burst, tokens + it->second.deficit);
+  sessions.erase(it);
+}
+
+void SessionScheduler::noteInput(int id, Clock::time_point now) {
+  lock_guard<std::mutex> guard(mutex);
+  auto it = sessions.find(id);
+  if (it != sessions.end()) {
+    it->second.lastInput = now;
+  }
+}
+
+int64_t SessionScheduler::acquire(int id, int64_t wanted,
+                                  Clock::time_point now) {
+  lock_guard<std::mutex> guard(mutex);
+  auto it = sessions.find(id);
+  if (it == sessions.end()) {
+    return wanted;
+  }
+  Session& session = it->second;
+  session.backlogged = true;
+  session.lastWant = now;
+  if (session.deficit <= 0) {
+    refill(now);
+    distribute(now);
+  }
+  int64_t granted = min(wanted, session.deficit);
+  session.deficit -= granted;
+  return granted;
+}
+
+void SessionScheduler::refund(int id, int64_t bytes) {
+  lock_guard<std::mutex> guard(mutex);
+  auto it = sessions.find(id);
+  if (it != sessions.end() && bytes > 0) {
+    it->second.deficit += bytes;
+  }
+}
+
+int64_t SessionScheduler::usUntilReady(int id, Clock::time_point now) {
+  lock_guard<std::mutex> guard(mutex);
+  auto it = sessions.find(id);
+  if (it == sessions.end() || it->second.deficit > 0) {
+    return 0;
+  }
+  refill(now);
+  if (tokens >= QUANTUM) {
+    return 0;
+  }
+  return int64_t((QUANTUM - tokens) * 1000000.0 / bytesPerSecond) + 1;
+}
+
+void SessionScheduler::refill(Clock::time_point now) {
+  if (now <= lastRefill) {
+    return;
+  }
+  double elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                         now - lastRefill)
+                         .count();
+  tokens = min(burst, tokens + bytesPerSecond * elapsedUs / 1000000.0);
+  lastRefill = now;
+}
+
+void SessionScheduler::distribute(Clock::time_point now) {
+  // A session that stopped asking has no queue, and in deficit round-robin
+  // an empty queue gives up what it had saved.
+  vector<int> order;
+  vector<int> wrapped;
+  for (auto& it : sessions) {
+    Session& session = it.second;
+    if (session.backlogged &&
+        now - session.lastWant > std::chrono::microseconds(IDLE_US)) {
+      session.backlogged = false;
+      tokens = min(burst, tokens + session.deficit);
+      session.deficit = 0;
+    }
+    if (session.backlogged) {
+      (it.first > cursor ? order : wrapped).push_back(it.first);
+    }
+  }
+  // Start after the session served last, interactive sessions first
+  order.insert(order.end(), wrapped.begin(), wrapped.end());
+  std::stable_partition(order.begin(), order.end(), [&](int id) {
+    return isInteractive(sessions[id], now);
+  });
+
+  bool progress = true;
+  while (progress && tokens >= QUANTUM) {
+    progress = false;
+    for (int id : order) {
+      Session& session = sessions[id];
+      int64_t quantum = QUANTUM * weight(session, now);
+      // Two rounds' worth at most, so a slow reader cannot hoard
+      int64_t grant =
+          min(min(quantum, 2 * quantum - session.deficit), int64_t(tokens));
+      if (grant <= 0) {
+        continue;
+      }
+      session.deficit += grant;
+      tokens -= grant;
+      cursor = id;
+      progress = true;
+      if (tokens < 1) {
+        break;
+      }
+    }
+  }
+}
+
+bool SessionScheduler::isInteractive(const Session& session,
+                                     Clock::time_point now) const {
+  return now - session.lastInput < std::chrono::microseconds(INTERACTIVE_US);
+}
+
+int64_t SessionScheduler::weight(const Session& session,
+                                 Clock::time_point now) const {
+  return isInteractive(session, now) ? interactiveWeight : bulkWeight;
+}
+}  // namespace et
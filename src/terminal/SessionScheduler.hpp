@@ -0,0 +1,96 @@
+#ifndef __ET_SESSION_SCHEDULER__
+#define __ET_SESSION_SCHEDULER__
+
+#include "Headers.hpp"
+
+namespace et {
+/**
+ * @brief Shares one terminal output budget fairly between all of etserver's
+ * sessions.
+ *
+ * A server-wide token bucket fills at `bytesPerSecond`.  Sessions with
+ * output waiting are served by deficit round-robin: each round moves a
+ * quantum times the session's weight from the shared bucket into the
+ * session's own bucket, which its reads then draw from.  Sessions that had
+ * input recently count as interactive.  They get `interactiveWeight`
+ * instead of `bulkWeight` and are served first in every round, so a shell
+ * prompt stays responsive next to someone's `yes`.
+ *
+ * All sessions run on their own threads and share one scheduler.
+ */
+class SessionScheduler {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  static const int DEFAULT_INTERACTIVE_WEIGHT = 4;
+  static const int DEFAULT_BULK_WEIGHT = 1;
+  /** @brief Bytes a round gives a session for each unit of weight. */
+  static const int64_t QUANTUM = 4096;
+  /** @brief How long after its last input a session is interactive. */
+  static const int64_t INTERACTIVE_US = 1000 * 1000;
+  /** @brief A session that has not asked for this long is idle. */
+  static const int64_t IDLE_US = 50 * 1000;
+
+  /**
+   * @param bytesPerSecond Output all sessions together may send.
+   * @param interactiveWeight Share of a session with recent input.
+   * @param bulkWeight Share of any other session.
+   */
+  SessionScheduler(int64_t bytesPerSecond, int interactiveWeight,
+                   int bulkWeight);
+
+  /** @brief Adds a session and returns its id. */
+  int addSession();
+  /** @brief Removes a session, putting its unused share back. */
+  void removeSession(int id);
+
+  /** @brief Marks the session interactive for the next `INTERACTIVE_US`. */
+  void noteInput(int id, Clock::time_point now = Clock::now());
+
+  /**
+   * @brief Takes up to @p wanted bytes of the session's share.  0 means
+   * it has to wait, about `usUntilReady()` microseconds.
+   */
+  int64_t acquire(int id, int64_t wanted,
+                  Clock::time_point now = Clock::now());
+
+  /** @brief Returns bytes acquired but not used. */
+  void refund(int id, int64_t bytes);
+
+  /** @brief Microseconds until `acquire()` is likely to succeed. */
+  int64_t usUntilReady(int id, Clock::time_point now = Clock::now());
+
+ protected:
+  struct Session {
+    /** @brief Bytes this session may still send. */
+    int64_t deficit;
+    /** @brief Whether the session has output waiting. */
+    bool backlogged;
+    Clock::time_point lastWant;
+    Clock::time_point lastInput;
+  };
+
+  /** @brief Adds tokens for the time since the last refill. */
+  void refill(Clock::time_point now);
+  /** @brief Runs rounds that move the shared bucket into sessions. */
+  void distribute(Clock::time_point now);
+  bool isInteractive(const Session& session, Clock::time_point now) const;
+  int64_t weight(const Session& session, Clock::time_point now) const;
+
+  std::mutex mutex;
+  int64_t bytesPerSecond;
+  int interactiveWeight;
+  int bulkWeight;
+  /** @brief Most the shared bucket holds. */
+  double burst;
+  /** @brief Bytes in the shared bucket. */
+  double tokens;
+  Clock::time_point lastRefill;
+  map<int, Session> sessions;
+  int nextId;
+  /** @brief Last session a round served; the next round starts after it. */
+  int cursor;
+};
+}  // namespace et
+
+#endif  // __ET_SESSION_SCHEDULER__
@@ -0,0 +1,292 @@
+#ifndef WIN32
+#include "SharedRing.hpp"
+
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "RawSocketUtils.hpp"
+
+namespace et {
+namespace {
+/** @brief Bytes reserved for the control block at the start of a region. */
+const size_t CONTROL_BYTES = 256;
+/** @brief Eventfds in a link: data and space for each of the two rings. */
+const int LINK_EVENT_FDS = 4;
+
+bool validCapacity(size_t capacity) {
+  return capacity >= 64 && (capacity & (capacity - 1)) == 0;
+}
+}  // namespace
+
+/**
+ * @brief Shared indices of a ring.  Each sits on its own cache line so the
+ * two processes do not fight over one.
+ */
+struct SharedRing::Control {
+  /** @brief Total bytes read, advanced by the reader. */
+  alignas(64) std::atomic<uint64_t> head;
+  /** @brief Total bytes written, advanced by the writer. */
+  alignas(64) std::atomic<uint64_t> tail;
+  /** @brief Set by a writer that is waiting on the space eventfd. */
+  alignas(64) std::atomic<uint32_t> writerWaiting;
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "Shared ring indices must be lock free to work across processes");
+
+SharedRing::SharedRing(char* region, size_t _capacity, int _dataFd,
+                       int _spaceFd)
+    : control(reinterpret_cast<Control*>(region)),
+      data(region + CONTROL_BYTES),
+      capacity(_capacity),
+      dataFd(_dataFd),
+      spaceFd(_spaceFd),
+      peerFd(-1) {
+  static_assert(sizeof(Control) <= CONTROL_BYTES,
+                "Shared ring control block does not fit");
+  if (!validCapacity(capacity)) {
+    STFATAL << "Invalid shared ring capacity: " << capacity;
+  }
+}
+
+size_t SharedRing::regionSize(size_t capacity) {
+  return CONTROL_BYTES + capacity;
+}
+
+size_t SharedRing::used(uint64_t head, uint64_t tail) const {
+  uint64_t count = tail - head;
+  if (count > capacity) {
+    throw std::runtime_error("Shared ring is corrupt");
+  }
+  return count;
+}
+
+size_t SharedRing::write(const char* buf, size_t length) {
+  uint64_t tail = control->tail.load(std::memory_order_relaxed);
+  uint64_t head = control->head.load(std::memory_order_acquire);
+  size_t count = min(length, capacity - used(head, tail));
+  if (count == 0) {
+    return 0;
+  }
+  size_t offset = tail & (capacity - 1);
+  size_t first = min(count, capacity - offset);
+  memcpy(data + offset, buf, first);
+  memcpy(data, buf + first, count - first);
+  control->tail.store(tail + count, std::memory_order_seq_cst);
+  // Only a reader that found the ring empty can be asleep.  Either it sees
+  // the new tail before it sleeps or we see that it had caught up.
+  if (control->head.load(std::memory_order_seq_cst) == tail) {
+    signal(dataFd);
+  }
+  return count;
+}
+
+void SharedRing::writeAll(const char* buf, size_t length) {
+  size_t written = 0;
+  while (true) {
+    written += write(buf + written, length - written);
+    if (written == length) {
+      return;
+    }
+    // Wait for a decent chunk of room instead of trickling byte by byte.
+    if (hasSpace(min(length - written, capacity / 2))) {
+      continue;
+    }
+    pollfd pfds[2];
+    pfds[0].fd = spaceFd;
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+    pfds[1].fd = peerFd;
+    pfds[1].events = 0;
+    pfds[1].revents = 0;
+    int rc = poll(pfds, peerFd >= 0 ? 2 : 1, 1000);
+    if (rc < 0 && errno != EINTR) {
+      FATAL_FAIL(rc);
+    }
+    if (peerFd >= 0 && (pfds[1].revents & (POLLHUP | POLLERR))) {
+      throw std::runtime_error("Shared ring reader went away");
+    }
+    if (pfds[0].revents & POLLIN) {
+      clearSpaceSignal();
+    }
+  }
+}
+
+size_t SharedRing::read(char* buf, size_t length) {
+  uint64_t head = control->head.load(std::memory_order_relaxed);
+  uint64_t tail = control->tail.load(std::memory_order_seq_cst);
+  size_t count = min(length, used(head, tail));
+  if (count == 0) {
+    return 0;
+  }
+  size_t offset = head & (capacity - 1);
+  size_t first = min(count, capacity - offset);
+  memcpy(buf, data + offset, first);
+  memcpy(buf + first, data, count - first);
+  control->head.store(head + count, std::memory_order_seq_cst);
+  if (control->writerWaiting.load(std::memory_order_seq_cst) &&
+      control->writerWaiting.exchange(0)) {
+    signal(spaceFd);
+  }
+  return count;
+}
+
+size_t SharedRing::readable() const {
+  return used(control->head.load(std::memory_order_acquire),
+              control->tail.load(std::memory_order_acquire));
+}
+
+bool SharedRing::hasSpace(size_t length) {
+  auto free = [this]() {
+    uint64_t tail = control->tail.load(std::memory_order_relaxed);
+    return capacity - used(control->head.load(std::memory_order_seq_cst),
+                           tail);
+  };
+  if (free() >= length) {
+    return true;
+  }
+  control->writerWaiting.store(1, std::memory_order_seq_cst);
+  // The reader may have freed space before it could see the flag.
+  return free() >= length;
+}
+
+void SharedRing::signal(int fd) {
+  uint64_t one = 1;
+  // EAGAIN means the counter is saturated, which still wakes the peer.
+  if (::write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    LOG(ERROR) << "Error signaling shared ring: " << strerror(errno);
+  }
+}
+
+void SharedRing::clearSignal(int fd) {
+  uint64_t count;
+  if (::read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    LOG(ERROR) << "Error clearing shared ring signal: " << strerror(errno);
+  }
+}
+
+bool SharedRingLink::supported() {
+#ifdef __linux__
+  return true;
+#else
+  return false;
+#endif
+}
+
+shared_ptr<SharedRingLink> SharedRingLink::create(size_t capacity) {
+#ifdef __linux__
+  if (!validCapacity(capacity)) {
+    throw std::runtime_error("Invalid shared ring capacity");
+  }
+  int memoryFd =
+      memfd_create("et_router_rings", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memoryFd < 0) {
+    throw std::runtime_error(string("Cannot create shared rings: ") +
+                             strerror(errno));
+  }
+  // Sealing the size keeps the peer from truncating the memory under us,
+  // which would turn our next access into a SIGBUS.
+  if (ftruncate(memoryFd, 2 * SharedRing::regionSize(capacity)) < 0 ||
+      fcntl(memoryFd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+    int savedErrno = errno;
+    close(memoryFd);
+    throw std::runtime_error(string("Cannot size shared rings: ") +
+                             strerror(savedErrno));
+  }
+  vector<int> eventFds;
+  for (int a = 0; a < LINK_EVENT_FDS; a++) {
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+      int savedErrno = errno;
+      close(memoryFd);
+      for (int eventFd : eventFds) {
+        close(eventFd);
+      }
+      throw std::runtime_error(string("Cannot create eventfd: ") +
+                               strerror(savedErrno));
+    }
+    eventFds.push_back(fd);
+  }
+  // New memfd pages are zero, which is an empty ring.
+  return shared_ptr<SharedRingLink>(
+      new SharedRingLink(memoryFd, capacity, eventFds));
+#else
+  throw std::runtime_error("Shared rings are not supported on this platform");
+#endif
+}
+
+shared_ptr<SharedRingLink> SharedRingLink::receive(int socketFd,
+                                                   int timeoutMs) {
+  int memoryFd = RawSocketUtils::receiveFd(socketFd, timeoutMs);
+  vector<int> eventFds;
+  try {
+    for (int a = 0; a < LINK_EVENT_FDS; a++) {
+      eventFds.push_back(RawSocketUtils::receiveFd(socketFd, timeoutMs));
+    }
+  } catch (const std::runtime_error& re) {
+    close(memoryFd);
+    for (int fd : eventFds) {
+      close(fd);
+    }
+    throw;
+  }
+  struct stat memoryStat;
+  FATAL_FAIL(fstat(memoryFd, &memoryStat));
+  size_t capacity = 0;
+  if (memoryStat.st_size > off_t(2 * CONTROL_BYTES)) {
+    capacity = memoryStat.st_size / 2 - CONTROL_BYTES;
+  }
+  if (!validCapacity(capacity)) {
+    close(memoryFd);
+    for (int fd : eventFds) {
+      close(fd);
+    }
+    throw std::runtime_error("Invalid shared ring size");
+  }
+  auto link = shared_ptr<SharedRingLink>(
+      new SharedRingLink(memoryFd, capacity, eventFds));
+  link->toServerRing->setPeerFd(socketFd);
+  link->toTerminalRing->setPeerFd(socketFd);
+  return link;
+}
+
+SharedRingLink::SharedRingLink(int _memoryFd, size_t capacity,
+                               const vector<int>& _eventFds)
+    : memoryFd(_memoryFd),
+      memoryLength(2 * SharedRing::regionSize(capacity)),
+      eventFds(_eventFds) {
+  void* mapped = mmap(NULL, memoryLength, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      memoryFd, 0);
+  if (mapped == MAP_FAILED) {
+    STFATAL << "Cannot map shared rings: " << strerror(errno);
+  }
+  memory = static_cast<char*>(mapped);
+  toServerRing.reset(
+      new SharedRing(memory, capacity, eventFds[0], eventFds[1]));
+  toTerminalRing.reset(new SharedRing(memory + memoryLength / 2, capacity,
+                                      eventFds[2], eventFds[3]));
+}
+
+SharedRingLink::~SharedRingLink() {
+  toServerRing.reset();
+  toTerminalRing.reset();
+  munmap(memory, memoryLength);
+  close(memoryFd);
+  for (int fd : eventFds) {
+    close(fd);
+  }
+}
+
+void SharedRingLink::send(int socketFd) {
+  RawSocketUtils::sendFd(socketFd, memoryFd);
+  for (int fd : eventFds) {
+    RawSocketUtils::sendFd(socketFd, fd);
+  }
+  toServerRing->setPeerFd(socketFd);
+  toTerminalRing->setPeerFd(socketFd);
+}
+}  // namespace et
+#endif
@@ -0,0 +1,140 @@
+#ifndef __ET_SHARED_RING__
+#define __ET_SHARED_RING__
+
+#include "Headers.hpp"
+
+namespace et {
+/**
+ * @brief Single-producer single-consumer byte ring in memory shared by two
+ * processes.
+ *
+ * Data moves with plain loads and stores.  A side only makes a system call
+ * to wake the other one: the writer signals `getDataFd()` when the ring
+ * goes from empty to non-empty, and the reader signals `getSpaceFd()` when
+ * it frees space while the writer is waiting for some.
+ *
+ * The indices live in memory the peer can write, so they are checked before
+ * every copy.  A corrupt ring throws instead of touching memory outside it.
+ */
+class SharedRing {
+ public:
+  /**
+   * @param region Start of `regionSize(capacity)` bytes of shared memory.
+   * @param capacity Data bytes in the ring, a power of two.
+   * @param dataFd eventfd signaled when data arrives on an empty ring.
+   * @param spaceFd eventfd signaled when space frees up for the writer.
+   */
+  SharedRing(char* region, size_t capacity, int dataFd, int spaceFd);
+
+  /** @brief Bytes of shared memory a ring of @p capacity data bytes uses. */
+  static size_t regionSize(size_t capacity);
+
+  /** @brief Copies as much of @p data as fits and returns how much did. */
+  size_t write(const char* data, size_t length);
+
+  /**
+   * @brief Writes all of @p data, waiting for the reader to make room.
+   * @throws std::runtime_error if the peer socket hangs up while waiting.
+   */
+  void writeAll(const char* data, size_t length);
+
+  /** @brief Copies up to @p length bytes out; 0 means the ring is empty. */
+  size_t read(char* buf, size_t length);
+
+  /** @brief Bytes waiting to be read. */
+  size_t readable() const;
+
+  /**
+   * @brief Whether @p length bytes fit right now.  When they do not, the
+   * reader signals `getSpaceFd()` the next time it frees space.
+   */
+  bool hasSpace(size_t length);
+
+  /**
+   * @brief Becomes readable when data arrives on an empty ring.  Call
+   * `clearDataSignal()` and then `read()` until it returns 0 before waiting
+   * on it again.
+   */
+  int getDataFd() const { return dataFd; }
+  /** @brief Becomes readable when space frees up after `hasSpace()` failed. */
+  int getSpaceFd() const { return spaceFd; }
+  void clearDataSignal() { clearSignal(dataFd); }
+  void clearSpaceSignal() { clearSignal(spaceFd); }
+
+  /** @brief Socket whose hang-up aborts `writeAll()`, or -1. */
+  void setPeerFd(int fd) { peerFd = fd; }
+
+  size_t getCapacity() const { return capacity; }
+
+ protected:
+  struct Control;
+  /** @brief Indices and flags at the start of the region. */
+  Control* control;
+  /** @brief Ring storage right after the control block. */
+  char* data;
+  size_t capacity;
+  int dataFd;
+  int spaceFd;
+  int peerFd;
+
+  /** @brief Bytes the writer has in the ring; throws if corrupt. */
+  size_t used(uint64_t head, uint64_t tail) const;
+  void signal(int fd);
+  void clearSignal(int fd);
+};
+
+/**
+ * @brief The two shared rings that carry terminal traffic between etserver
+ * and etterminal in place of the router socket.
+ *
+ * etserver creates the link and passes the memory and eventfds to
+ * etterminal over the router socket, which stays open to tell either side
+ * when the other goes away.
+ */
+class SharedRingLink {
+ public:
+  /** @brief Data bytes in each ring. */
+  static const size_t DEFAULT_CAPACITY = 1024 * 1024;
+
+  /** @brief Whether `create()` works here (it needs memfd and eventfd). */
+  static bool supported();
+
+  /**
+   * @brief Creates a link with two rings of @p capacity bytes each.
+   * @throws std::runtime_error if the memory or eventfds cannot be made.
+   */
+  static shared_ptr<SharedRingLink> create(size_t capacity = DEFAULT_CAPACITY);
+
+  /**
+   * @brief Maps a link that the peer passed with `send()`, waiting up to
+   * @p timeoutMs for it.
+   * @throws std::runtime_error if the socket closes, the time runs out or
+   * the link is invalid.
+   */
+  static shared_ptr<SharedRingLink> receive(int socketFd, int timeoutMs);
+
+  ~SharedRingLink();
+
+  /** @brief Passes the memory and eventfds to the peer on @p socketFd. */
+  void send(int socketFd);
+
+  /** @brief Ring carrying terminal output from etterminal to etserver. */
+  SharedRing* toServer() { return toServerRing.get(); }
+  /** @brief Ring carrying router frames from etserver to etterminal. */
+  SharedRing* toTerminal() { return toTerminalRing.get(); }
+
+ protected:
+  /** @brief Maps @p _memoryFd and takes ownership of every descriptor. */
+  SharedRingLink(int _memoryFd, size_t capacity, const vector<int>& _eventFds);
+
+  int memoryFd;
+  char* memory;
+  size_t memoryLength;
+  /** @brief Data and space eventfds of the server ring, then the terminal's. */
+  vector<int> eventFds;
+  unique_ptr<SharedRing> toServerRing;
+  unique_ptr<SharedRing> toTerminalRing;
+};
+}  // namespace et
+
+#endif  // __ET_SHARED_RING__
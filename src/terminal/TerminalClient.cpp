@@ -2,8 +2,12 @@
 
 #include <cstdint>
 
+#include "ConsoleWriter.hpp"
+#include "PredictiveEcho.hpp"
 #include "TelemetryService.hpp"
+#include "TerminalPackets.hpp"
 #include "TunnelUtils.hpp"
+#include "TunnelWorker.hpp"
 
 namespace et {
 
@@ -14,14 +18,30 @@ TerminalClient::TerminalClient(
     const string& passkey, shared_ptr<Console> _console, bool jumphost,
     const string& tunnels, const string& reverseTunnels, bool forwardSshAgent,
     const string& identityAgent, int _keepaliveDuration,
-    const vector<pair<string, string>>& envVars)
+    const vector<pair<string, string>>& envVars, const string& dynamicTunnels)
     : console(_console),
       shuttingDown(false),
-      keepaliveDuration(_keepaliveDuration) {
+      keepaliveDuration(_keepaliveDuration),
+      outputPacingMs(0),
+      predictiveEcho(false),
+      rawPackets(false),
+      outputCredit(false),
+      outputReceived(0),
+      outputGranted(0),
+      eventLoop(new EventLoop()),
+      connectionChanged(false) {
   portForwardHandler = shared_ptr<PortForwardHandler>(
       new PortForwardHandler(_socketHandler, _pipeSocketHandler));
   InitialPayload payload;
   payload.set_jumphost(jumphost);
+  payload.set_rawpackets(true);
+  payload.set_tunnelwindows(true);
+  payload.set_tunnelearlydata(true);
+  payload.set_tunneludp(true);
+  // UDP tunnels wait for the server to say it forwards udp
+  vector<PortForwardSourceRequest> udpTunnels;
+  // SOCKS tunnels wait for the server to say it connects to hosts
+  vector<PortForwardSourceRequest> socksTunnels;
 
   for (const auto& envVar : envVars) {
     (*payload.mutable_environmentvariables())[envVar.first] = envVar.second;
@@ -31,6 +51,10 @@ TerminalClient::TerminalClient(
     if (tunnels.length()) {
       auto pfsrs = parseRangesToRequests(tunnels);
       for (auto& pfsr : pfsrs) {
+        if (pfsr.udp()) {
+          udpTunnels.push_back(pfsr);
+          continue;
+        }
         auto pfsresponse =
             portForwardHandler->createSource(pfsr, nullptr, -1, -1);
         if (pfsresponse.has_error()) {
@@ -41,10 +65,17 @@ TerminalClient::TerminalClient(
         }
       }
     }
+    if (dynamicTunnels.length()) {
+      socksTunnels = parseDynamicTunnelArg(dynamicTunnels);
+    }
     if (reverseTunnels.length()) {
       auto pfsrs = parseRangesToRequests(reverseTunnels);
       for (auto& pfsr : pfsrs) {
-        *(payload.add_reversetunnels()) = pfsr;
+        if (pfsr.udp()) {
+          *(payload.add_udpreversetunnels()) = pfsr;
+        } else {
+          *(payload.add_reversetunnels()) = pfsr;
+        }
       }
     }
     if (forwardSshAgent) {
@@ -78,6 +109,10 @@ TerminalClient::TerminalClient(
 
   connection = shared_ptr<ClientConnection>(
       new ClientConnection(_socketHandler, _socketEndpoint, id, passkey));
+  connection->setReconnectCallback([this]() {
+    connectionChanged = true;
+    eventLoop->wake();
+  });
 
   int connectFailCount = 0;
   while (true) {
@@ -114,6 +149,53 @@ TerminalClient::TerminalClient(
                                      << initialResponse.error() << endl;
                 exit(1);
               }
+              rawPackets = initialResponse.rawpackets();
+              outputCredit = initialResponse.outputcredit();
+              portForwardHandler->setSendWindowUpdates(
+                  initialResponse.tunnelwindows());
+              portForwardHandler->setOpenEarly(
+                  initialResponse.tunnelearlydata());
+              if (!initialResponse.tunneludp() &&
+                  (udpTunnels.size() || payload.udpreversetunnels_size())) {
+                CLOG(INFO, "stdout")
+                    << "The server does not forward udp, skipping udp "
+                       "tunnels"
+                    << endl;
+                udpTunnels.clear();
+              }
+              for (auto& pfsr : udpTunnels) {
+                auto pfsresponse =
+                    portForwardHandler->createSource(pfsr, nullptr, -1, -1);
+                if (pfsresponse.has_error()) {
+                  LOG(WARNING) << "Failed to establish udp port forward "
+                               << pfsr.source() << " -> "
+                               << pfsr.destination() << " - "
+                               << pfsresponse.error();
+                }
+              }
+              if (!initialResponse.tunnelhosts() && socksTunnels.size()) {
+                CLOG(INFO, "stdout")
+                    << "The server does not connect to hosts, skipping "
+                       "dynamic tunnels"
+                    << endl;
+                socksTunnels.clear();
+              }
+              for (auto& pfsr : socksTunnels) {
+                auto pfsresponse =
+                    portForwardHandler->createSource(pfsr, nullptr, -1, -1);
+                if (pfsresponse.has_error()) {
+                  LOG(WARNING) << "Failed to establish dynamic port forward "
+                               << pfsr.source() << " - "
+                               << pfsresponse.error();
+                }
+              }
+              if (outputCredit) {
+                // The first grant turns on the server's output limit
+                TerminalCredit tc;
+                tc.set_consumed(0);
+                connection->writePacket(Packet(
+                    TerminalPacketType::TERMINAL_CREDIT, protoToString(tc)));
+              }
               fail = false;
               break;
             }
@@ -157,19 +239,20 @@ void TerminalClient::run(const string& command, const bool noexit) {
 #define BUF_SIZE (16 * 1024)
   char b[BUF_SIZE];
 
-  time_t keepaliveTime = time(NULL) + keepaliveDuration;
+  // The keepalive timer is re-armed lazily: activity only moves the
+  // deadline, and an early expiry re-arms for the remainder.
+  const auto keepaliveInterval = std::chrono::seconds(keepaliveDuration);
+  auto keepaliveDeadline = std::chrono::steady_clock::now() + keepaliveInterval;
+  auto bumpKeepalive = [&]() {
+    keepaliveDeadline = std::chrono::steady_clock::now() + keepaliveInterval;
+  };
+  const int keepaliveTimer = eventLoop->addTimer();
   bool waitingOnKeepalive = false;
 
   if (command.length()) {
     LOG(INFO) << "Got command: " << command;
-    et::TerminalBuffer tb;
-    if (noexit)
-      tb.set_buffer(command + "\n");
-    else
-      tb.set_buffer(command + "; exit\n");
-
-    connection->writePacket(
-        Packet(TerminalPacketType::TERMINAL_BUFFER, protoToString(tb)));
+    connection->writePacket(TerminalPackets::terminalBuffer(
+        noexit ? command + "\n" : command + "; exit\n", rawPackets));
   }
 
   TerminalInfo lastTerminalInfo;
@@ -180,6 +263,46 @@ void TerminalClient::run(const string& command, const bool noexit) {
     CLOG(INFO, "stdout") << "ET running, feel free to background..." << endl;
   }
 
+  int consoleFd = -1;
+  if (console) {
+    consoleFd = console->getFd();
+#ifndef WIN32
+    eventLoop->addFd(consoleFd);
+    eventLoop->watchSignal(SIGWINCH);
+#endif
+  }
+  // Terminal output is queued and written as the console keeps up.  While
+  // too much is queued the connection is not read, so the server sees the
+  // backpressure instead of the loop blocking on the console.
+  shared_ptr<ConsoleWriter> consoleWriter;
+  if (console) {
+    consoleWriter.reset(new ConsoleWriter(console, outputPacingMs));
+  }
+  const int pacingTimer = eventLoop->addTimer();
+  // Local echo of keystrokes; sized with the first terminal info below.
+  shared_ptr<PredictiveEcho> predictor;
+  if (console && predictiveEcho) {
+    predictor.reset(new PredictiveEcho(24, 80));
+  }
+  const int predictionTimer = eventLoop->addTimer();
+  bool outputPaused = false;
+  int registeredClientFd = -1;
+  // Connection fd watched for room while tunnel data is queued, or -1
+  int bulkWatchFd = -1;
+  // Tunnels run on their own thread, so they never hold up the console.
+  TunnelWorker tunnelWorker(portForwardHandler, rawPackets);
+  tunnelWorker.start();
+  const int tunnelFd = tunnelWorker.getNotifyFd();
+  // Whether tunnels are left unread while their data waits for the socket
+  bool tunnelReadsPaused = false;
+#ifndef WIN32
+  eventLoop->addFd(tunnelFd);
+#endif
+  // Run one pass without blocking: the window size has to be sent before
+  // anything can wake us up.
+  bool checkTerminalInfo = true;
+  bool pendingWork = true;
+
   while (!connection->isShuttingDown()) {
     {
       lock_guard<recursive_mutex> guard(shutdownMutex);
@@ -187,39 +310,59 @@ void TerminalClient::run(const string& command, const bool noexit) {
         break;
       }
     }
-    // Data structures needed for select() and
-    // non-blocking I/O.
-    fd_set rfd;
-    timeval tv;
-
-    FD_ZERO(&rfd);
-    int maxfd = -1;
-    int consoleFd = -1;
-    if (console) {
-      consoleFd = console->getFd();
-      maxfd = consoleFd;
-      FD_SET(consoleFd, &rfd);
-    }
+    // The connection socket changes on every reconnect.  The reconnect
+    // thread flags a recovery even when the new socket reused the old fd
+    // number, since closing the old one dropped it from the loop.
     int clientFd = connection->getSocketFd();
-    if (clientFd > 0) {
-      FD_SET(clientFd, &rfd);
-      maxfd = max(maxfd, clientFd);
+    if (clientFd != registeredClientFd || connectionChanged.exchange(false)) {
+      if (registeredClientFd >= 0) {
+        eventLoop->removeFd(registeredClientFd);
+      }
+      if (bulkWatchFd >= 0) {
+        eventLoop->watchWritable(bulkWatchFd, false);
+        bulkWatchFd = -1;
+      }
+      registeredClientFd = clientFd;
+      if (clientFd >= 0) {
+        if (!outputPaused) {
+          eventLoop->addFd(clientFd);
+        }
+        bumpKeepalive();
+        eventLoop->armTimer(keepaliveTimer, keepaliveDuration * 1000);
+        // Recovered packets wait in the reader, not on the socket.
+        pendingWork = true;
+      } else {
+        // We are disconnected, so stop waiting for keepalive.
+        eventLoop->disarmTimer(keepaliveTimer);
+        waitingOnKeepalive = false;
+      }
     }
-    // Include port forward sockets in select for low-latency forwarding.
-    set<int> pfFds;
-    portForwardHandler->getForwardFds(&pfFds);
-    for (int fd : pfFds) {
-      FD_SET(fd, &rfd);
-      maxfd = max(maxfd, fd);
+
+    auto ready = eventLoop->wait(pendingWork ? 0 : -1);
+    // Packets the reader already holds do not raise an event
+    bool readConnection = pendingWork;
+    pendingWork = false;
+#ifdef WIN32
+    // There is no SIGWINCH on Windows.
+    checkTerminalInfo = true;
+#else
+    for (int signum : ready.signals) {
+      if (signum == SIGWINCH) {
+        checkTerminalInfo = true;
+      }
     }
-    tv.tv_sec = 0;
-    tv.tv_usec = 10000;
-    select(maxfd + 1, &rfd, NULL, NULL, &tv);
+#endif
 
     try {
       if (console) {
         // Check for data to send.
-        if (FD_ISSET(consoleFd, &rfd)) {
+#ifdef WIN32
+        // Console input is not pollable on Windows; peeking never blocks.
+        bool consoleReady = true;
+#else
+        bool consoleReady = ready.isReadable(consoleFd);
+#endif
+        if (consoleReady) {
           // Read from stdin and write to our client that will then send it to
           // the server.
           VLOG(4) << "Got data from stdin";
@@ -242,12 +385,12 @@ void TerminalClient::run(const string& command, const bool noexit) {
               }
             }
             if (s.length()) {
-              et::TerminalBuffer tb;
-              tb.set_buffer(s);
-
-              connection->writePacket(Packet(
-                  TerminalPacketType::TERMINAL_BUFFER, protoToString(tb)));
-              keepaliveTime = time(NULL) + keepaliveDuration;
+              connection->writePacket(
+                  TerminalPackets::terminalBuffer(s, rawPackets));
+              bumpKeepalive();
+              if (predictor) {
+                consoleWriter->enqueue(predictor->onKeystrokes(s));
+              }
             }
           }
 #else
@@ -258,12 +401,12 @@ void TerminalClient::run(const string& command, const bool noexit) {
               // VLOG(1) << "Sending byte: " << int(b) << " " << char(b) << " "
               // << connection->getWriter()->getSequenceNumber();
               string s(b, rc);
-              et::TerminalBuffer tb;
-              tb.set_buffer(s);
-
-              connection->writePacket(Packet(
-                  TerminalPacketType::TERMINAL_BUFFER, protoToString(tb)));
-              keepaliveTime = time(NULL) + keepaliveDuration;
+              connection->writePacket(
+                  TerminalPackets::terminalBuffer(s, rawPackets));
+              bumpKeepalive();
+              if (predictor) {
+                consoleWriter->enqueue(predictor->onKeystrokes(s));
+              }
             } else if (rc == 0) {
               LOG(INFO) << "Console EOF";
               break;
@@ -281,7 +424,8 @@ void TerminalClient::run(const string& command, const bool noexit) {
         }
       }
 
-      if (clientFd > 0 && FD_ISSET(clientFd, &rfd)) {
+      if (clientFd >= 0 && !outputPaused &&
+          (readConnection || ready.isReadable(clientFd))) {
         VLOG(4) << "Clientfd is selected";
         // Accumulate terminal output across all available packets so we can
         // write it in a single call.  Writing each packet individually causes
@@ -290,6 +434,12 @@ void TerminalClient::run(const string& command, const bool noexit) {
         // produces visible flicker.
         string coalesced;
         while (connection->hasData()) {
+          if (consoleWriter &&
+              consoleWriter->size() + int64_t(coalesced.length()) >=
+                  ConsoleWriter::MAX_QUEUED_BYTES) {
+            // Leave the rest on the socket until the console catches up.
+            break;
+          }
           VLOG(4) << "connection has data";
           Packet packet;
           if (!connection->read(&packet)) {
@@ -297,23 +447,25 @@ void TerminalClient::run(const string& command, const bool noexit) {
           }
           uint8_t packetType = packet.getHeader();
           if (packetType == et::TerminalPacketType::PORT_FORWARD_DATA ||
+              packetType == et::TerminalPacketType::PORT_FORWARD_DATA_RAW ||
               packetType ==
                   et::TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST ||
               packetType ==
                   et::TerminalPacketType::PORT_FORWARD_DESTINATION_RESPONSE) {
-            keepaliveTime = time(NULL) + keepaliveDuration;
+            bumpKeepalive();
             VLOG(4) << "Got PF packet type " << packetType;
-            portForwardHandler->handlePacket(packet, connection);
+            tunnelWorker.post(packet);
             continue;
           }
           switch (packetType) {
-            case et::TerminalPacketType::TERMINAL_BUFFER: {
+            case et::TerminalPacketType::TERMINAL_BUFFER:
+            case et::TerminalPacketType::TERMINAL_BUFFER_RAW: {
+              string data = TerminalPackets::terminalBufferData(packet);
+              outputReceived += data.length();
               if (console) {
                 VLOG(3) << "Got terminal buffer";
-                et::TerminalBuffer tb =
-                    stringToProto<et::TerminalBuffer>(packet.getPayload());
-                coalesced += tb.buffer();
-                keepaliveTime = time(NULL) + keepaliveDuration;
+                coalesced += data;
+                bumpKeepalive();
               }
               break;
             }
@@ -328,12 +480,88 @@ void TerminalClient::run(const string& command, const bool noexit) {
           }
         }
         if (console && !coalesced.empty()) {
-          console->write(coalesced);
+          consoleWriter->enqueue(
+              predictor ? predictor->onServerOutput(coalesced) : coalesced);
         }
       }
 
-      if (clientFd > 0 && keepaliveTime < time(NULL)) {
-        keepaliveTime = time(NULL) + keepaliveDuration;
+      if (predictor) {
+        consoleWriter->enqueue(predictor->expire());
+        int64_t expiryMs = predictor->msUntilExpiry();
+        if (expiryMs >= 0) {
+          eventLoop->armTimer(predictionTimer, expiryMs);
+        } else {
+          eventLoop->disarmTimer(predictionTimer);
+        }
+      }
+
+      if (consoleWriter) {
+        bool blocked = false;
+        if (!consoleWriter->empty()) {
+          int64_t waitMs = consoleWriter->msUntilFlush();
+          if (waitMs > 0) {
+            // Pacing: collect the rest of the burst until the next frame.
+            eventLoop->armTimer(pacingTimer, waitMs);
+          } else {
+            blocked = !consoleWriter->flush();
+          }
+        }
+        eventLoop->watchWritable(consoleFd, blocked);
+
+        if (!outputPaused && consoleWriter->isFull()) {
+          VLOG(1) << "Console is behind, pausing reads from the server";
+          outputPaused = true;
+          if (registeredClientFd >= 0) {
+            eventLoop->removeFd(registeredClientFd);
+          }
+        } else if (outputPaused && consoleWriter->canResume()) {
+          VLOG(1) << "Console caught up, resuming reads from the server";
+          outputPaused = false;
+          if (registeredClientFd >= 0) {
+            eventLoop->addFd(registeredClientFd);
+          }
+          // The reader may already hold packets that will not raise an event.
+          pendingWork = true;
+        }
+      }
+
+      if (outputCredit) {
+        // Grant credit for output once the console has taken it, so the
+        // server never has much more in flight than the link holds.
+        int64_t consumed = outputReceived;
+        if (consoleWriter) {
+          consumed -= min(consumed - outputGranted, consoleWriter->size());
+        }
+        if (consumed - outputGranted >= OutputCredit::GRANT_BYTES) {
+          TerminalCredit tc;
+          tc.set_consumed(consumed);
+          connection->writePacket(
+              Packet(TerminalPacketType::TERMINAL_CREDIT, protoToString(tc)));
+          outputGranted = consumed;
+        }
+      }
+
+      for (int timerId : ready.timers) {
+        if (timerId != keepaliveTimer || clientFd < 0) {
+          continue;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (outputPaused) {
+          // The reply may simply be sitting unread behind terminal output,
+          // so the connection is not presumed dead while reads are paused.
+          bumpKeepalive();
+          waitingOnKeepalive = false;
+        }
+        if (now < keepaliveDeadline) {
+          eventLoop->armTimer(
+              keepaliveTimer,
+              std::chrono::duration_cast<std::chrono::milliseconds>(
+                  keepaliveDeadline - now)
+                  .count());
+          continue;
+        }
+        bumpKeepalive();
+        eventLoop->armTimer(keepaliveTimer, keepaliveDuration * 1000);
         if (waitingOnKeepalive) {
           LOG(INFO) << "Missed a keepalive, killing connection.";
           connection->closeSocketAndMaybeReconnect();
@@ -344,12 +572,9 @@ void TerminalClient::run(const string& command, const bool noexit) {
           waitingOnKeepalive = true;
         }
       }
-      if (clientFd < 0) {
-        // We are disconnected, so stop waiting for keepalive.
-        waitingOnKeepalive = false;
-      }
 
-      if (console) {
+      if (console && checkTerminalInfo) {
+        checkTerminalInfo = false;
         TerminalInfo ti = console->getTerminalInfo();
 
         if (ti != lastTerminalInfo) {
@@ -357,26 +582,61 @@ void TerminalClient::run(const string& command, const bool noexit) {
                   << " column: " << ti.column() << " width: " << ti.width()
                   << " height: " << ti.height();
           lastTerminalInfo = ti;
+          if (predictor) {
+            consoleWriter->enqueue(predictor->resize(ti.row(), ti.column()));
+          }
           connection->writePacket(
               Packet(TerminalPacketType::TERMINAL_INFO, protoToString(ti)));
         }
       }
 
-      vector<PortForwardDestinationRequest> requests;
-      vector<PortForwardData> dataToSend;
-      portForwardHandler->update(&requests, &dataToSend);
-      for (auto& pfr : requests) {
-        connection->writePacket(
-            Packet(TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST,
-                   protoToString(pfr)));
-        VLOG(4) << "send PF request";
-        keepaliveTime = time(NULL) + keepaliveDuration;
+      // Tunnel packets are only taken while the bulk queue has room.  Until
+      // then the worker stops reading tunnels and holds on to what it has.
+      bool tunnelsBehind =
+          connection->getBulkBytes() >= BackedWriter::MAX_BULK_BYTES;
+      tunnelWorker.setReadsPaused(tunnelsBehind);
+#ifdef WIN32
+      bool tunnelsReady = !tunnelsBehind;
+#else
+      if (tunnelsBehind != tunnelReadsPaused) {
+        if (tunnelsBehind) {
+          eventLoop->removeFd(tunnelFd);
+        } else {
+          eventLoop->addFd(tunnelFd);
+        }
       }
-      for (auto& pwd : dataToSend) {
-        connection->writePacket(
-            Packet(TerminalPacketType::PORT_FORWARD_DATA, protoToString(pwd)));
-        VLOG(4) << "send PF data";
-        keepaliveTime = time(NULL) + keepaliveDuration;
+      bool tunnelsReady = !tunnelsBehind && ready.isReadable(tunnelFd);
+#endif
+      tunnelReadsPaused = tunnelsBehind;
+      if (tunnelsReady) {
+        vector<TunnelWorker::Frame> frames;
+        tunnelWorker.take(&frames);
+        for (auto& frame : frames) {
+          if (frame.bulk) {
+            connection->writeBulkPacket(frame.packet);
+          } else {
+            connection->writePacket(frame.packet);
+          }
+          bumpKeepalive();
+        }
+      }
+
+      // Tunnel data queued behind interactive packets goes out as the
+      // socket drains.
+      int bulkFd = (clientFd >= 0 && connection->flushBulk()) ? clientFd : -1;
+      if (bulkFd != bulkWatchFd) {
+        if (bulkWatchFd >= 0) {
+          eventLoop->watchWritable(bulkWatchFd, false);
+        }
+        if (bulkFd >= 0) {
+          eventLoop->watchWritable(bulkFd, true);
+        }
+        bulkWatchFd = bulkFd;
+      }
+      if (tunnelReadsPaused &&
+          connection->getBulkBytes() < BackedWriter::MAX_BULK_BYTES) {
+        // Resume reading and watching the tunnels
+        pendingWork = true;
       }
     } catch (const runtime_error& re) {
       STERROR << "Error: " << re.what();
@@ -386,6 +646,13 @@ void TerminalClient::run(const string& command, const bool noexit) {
       shuttingDown = true;
     }
   }
+  if (consoleWriter) {
+    try {
+      consoleWriter->drain();
+    } catch (const runtime_error& re) {
+      LOG(INFO) << "Could not write the remaining output: " << re.what();
+    }
+  }
   if (console) {
     console->teardown();
   }
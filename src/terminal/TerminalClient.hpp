@@ -5,9 +5,11 @@
 #include "Console.hpp"
 #include "CryptoHandler.hpp"
 #include "ETerminal.pb.h"
+#include "EventLoop.hpp"
 #include "ForwardSourceHandler.hpp"
 #include "Headers.hpp"
 #include "LogHandler.hpp"
+#include "OutputCredit.hpp"
 #include "PortForwardHandler.hpp"
 #include "RawSocketUtils.hpp"
 #include "ServerConnection.hpp"
@@ -32,19 +34,31 @@ class TerminalClient {
                  bool jumphost, const string& tunnels,
                  const string& reverseTunnels, bool forwardSshAgent,
                  const string& identityAgent, int _keepaliveDuration,
-                 const vector<pair<string, string>>& envVars);
+                 const vector<pair<string, string>>& envVars,
+                 const string& dynamicTunnels = "");
   /** @brief Tears down the client, closing sockets and stopping background
    * threads. */
   virtual ~TerminalClient();
   /** @brief Runs the interactive session for `command`, optionally staying
    * alive. */
   void run(const string& command, const bool noexit);
+  /**
+   * @brief Flushes terminal output at most once per @p intervalMs while
+   * output arrives in bursts; 0 (the default) flushes immediately.
+   */
+  void setOutputPacing(int intervalMs) { outputPacingMs = intervalMs; }
+  /**
+   * @brief Shows typed characters before the server echoes them (see
+   * PredictiveEcho).
+   */
+  void setPredictiveEcho(bool enabled) { predictiveEcho = enabled; }
   /**
    * @brief Flags the client loop to exit gracefully on the next iteration.
    */
   void shutdown() {
     lock_guard<recursive_mutex> guard(shutdownMutex);
     shuttingDown = true;
+    eventLoop->wake();
   }
 
  protected:
@@ -60,6 +74,22 @@ class TerminalClient {
   recursive_mutex shutdownMutex;
   /** @brief Keepalive interval (seconds) sent to the server. */
   int keepaliveDuration;
+  /** @brief Minimum milliseconds between console flushes, 0 for none. */
+  int outputPacingMs;
+  /** @brief Whether keystrokes are echoed locally ahead of the server. */
+  bool predictiveEcho;
+  /** @brief Whether the server reads raw buffer packets (TerminalPackets). */
+  bool rawPackets;
+  /** @brief Whether the server sends output against granted credit. */
+  bool outputCredit;
+  /** @brief Terminal output bytes received from the server. */
+  int64_t outputReceived;
+  /** @brief Output bytes covered by the last credit grant. */
+  int64_t outputGranted;
+  /** @brief Loop `run()` blocks on until there is something to do. */
+  shared_ptr<EventLoop> eventLoop;
+  /** @brief Set by the reconnect thread once a new socket is recovered. */
+  std::atomic<bool> connectionChanged;
 };
 
 }  // namespace et
@@ -149,11 +149,17 @@ int main(int argc, char** argv) {
          "argument, or Unix socket paths (e.g. "
          "/tmp/local.sock:/tmp/remote.sock, 8080:/tmp/remote.sock, "
          "/tmp/local.sock:8080). Defaults to localhost for bind address "
-         "unless ssh-style tunnel argument is used.",
+         "unless ssh-style tunnel argument is used. Add /udp to a port or "
+         "range to forward UDP (e.g. 5353:53/udp).",
          cxxopts::value<std::string>())  //
         ("r,reversetunnel",
          "Reverse Tunnel: Same syntax as -t/--tunnel but reversed.",
          cxxopts::value<std::string>())  //
+        ("D,dynamictunnel",
+         "Dynamic Tunnel: Array of [bind_address:]port (e.g. 1080, "
+         "[::1]:1080) to listen on for SOCKS5 clients.  The server connects "
+         "to the hosts they name.",
+         cxxopts::value<std::string>())  //
         ("jumphost", "jumphost between localhost and destination",
          cxxopts::value<std::string>())  //
         ("jport", "Jumphost machine port",
@@ -170,6 +176,13 @@ int main(int argc, char** argv) {
          cxxopts::value<int>()->default_value("0"))  //
         ("k,keepalive", "Client keepalive duration in seconds",
          cxxopts::value<int>())  //
+        ("frame-pacing",
+         "During output bursts, update the terminal at most once per this "
+         "many milliseconds (16 if no value is given)",
+         cxxopts::value<int>()->implicit_value("16"))  //
+        ("predictive-echo",
+         "Show typed characters right away, underlined until the server "
+         "echoes them")  //
         ("l,logdir", "Base directory for log files.",
          cxxopts::value<std::string>()->default_value(tmpDir))  //
         ("logtostdout", "Write log to stdout")                  //
@@ -290,6 +303,14 @@ int main(int argc, char** argv) {
       CLOG(INFO, "stdout") << options.help({}) << endl;
       exit(0);
     }
+    int framePacingMs =
+        extractSingleOptionWithDefault<int>(result, options, "frame-pacing", 0);
+    if (framePacingMs < 0 || framePacingMs > 1000) {
+      CLOG(INFO, "stdout") << "Frame pacing must be between 0 and 1000 ms"
+                           << endl;
+      CLOG(INFO, "stdout") << options.help({}) << endl;
+      exit(0);
+    }
 
     {
       char* home_dir = ssh_get_user_home_dir();
@@ -419,6 +440,8 @@ int main(int argc, char** argv) {
         extractSingleOptionWithDefault<string>(result, options, "tunnel", "");
     string r_tunnel_arg = extractSingleOptionWithDefault<string>(
         result, options, "reversetunnel", "");
+    string d_tunnel_arg = extractSingleOptionWithDefault<string>(
+        result, options, "dynamictunnel", "");
 
     for (const auto& localForward : sshConfigOptions.local_forwards) {
       string tunnelEntry =
@@ -442,7 +465,10 @@ int main(int argc, char** argv) {
     TerminalClient terminalClient(
         clientSocket, clientPipeSocket, socketEndpoint, idpasskeypair.first,
         idpasskeypair.second, console, is_jumphost, tunnel_arg, r_tunnel_arg,
-        forwardAgent, sshSocket, keepaliveDuration, sshConfigOptions.env_vars);
+        forwardAgent, sshSocket, keepaliveDuration, sshConfigOptions.env_vars,
+        d_tunnel_arg);
+    terminalClient.setOutputPacing(framePacingMs);
+    terminalClient.setPredictiveEcho(result.count("predictive-echo") > 0);
     terminalClient.run(
         result.count("command") ? result["command"].as<string>() : "",
         result.count("noexit"));
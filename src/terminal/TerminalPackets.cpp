@@ -0,0 +1,45 @@
+#include "TerminalPackets.hpp"
+
+namespace et {
+Packet TerminalPackets::terminalBuffer(const string& buffer, bool raw) {
+  if (raw) {
+    return Packet(TerminalPacketType::TERMINAL_BUFFER_RAW, buffer);
+  }
+  TerminalBuffer tb;
+  tb.set_buffer(buffer);
+  return Packet(TerminalPacketType::TERMINAL_BUFFER, protoToString(tb));
+}
+
+string TerminalPackets::terminalBufferData(const Packet& packet) {
+  if (packet.getHeader() == TerminalPacketType::TERMINAL_BUFFER_RAW) {
+    return packet.getPayload();
+  }
+  return stringToProto<TerminalBuffer>(packet.getPayload()).buffer();
+}
+
+Packet TerminalPackets::portForwardData(const PortForwardData& pwd,
+                                        bool raw) {
+  if (!raw || pwd.has_closed() || pwd.has_error() || pwd.has_consumed() ||
+      pwd.has_connected()) {
+    return Packet(TerminalPacketType::PORT_FORWARD_DATA, protoToString(pwd));
+  }
+  string payload(RAW_PORT_FORWARD_HEADER_LENGTH, '\0');
+  payload[0] = pwd.sourcetodestination() ? 1 : 0;
+  uint32_t networkSocketId = htonl(uint32_t(pwd.socketid()));
+  memcpy(&payload[1], &networkSocketId, sizeof(uint32_t));
+  payload.append(pwd.buffer());
+  return Packet(TerminalPacketType::PORT_FORWARD_DATA_RAW, payload);
+}
+
+void TerminalPackets::parseRawPortForwardData(const string& payload,
+                                              bool* sourceToDestination,
+                                              int* socketId) {
+  if (payload.length() < size_t(RAW_PORT_FORWARD_HEADER_LENGTH)) {
+    throw std::runtime_error("Truncated port forward data");
+  }
+  *sourceToDestination = payload[0] != 0;
+  uint32_t networkSocketId;
+  memcpy(&networkSocketId, &payload[1], sizeof(uint32_t));
+  *socketId = int(ntohl(networkSocketId));
+}
+}  // namespace et
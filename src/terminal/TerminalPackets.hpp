@@ -0,0 +1,48 @@
+#ifndef __ET_TERMINAL_PACKETS__
+#define __ET_TERMINAL_PACKETS__
+
+#include "ETerminal.pb.h"
+#include "Headers.hpp"
+#include "Packet.hpp"
+
+namespace et {
+/**
+ * @brief Builds and reads the packets that carry terminal and tunnel bytes.
+ *
+ * Once the peer has said it reads them (`rawpackets` in InitialPayload or
+ * InitialResponse), terminal bytes go out as TERMINAL_BUFFER_RAW, whose
+ * payload is the bytes themselves, and tunnel bytes as
+ * PORT_FORWARD_DATA_RAW, whose payload is a direction byte, the socket id
+ * as 4 big-endian bytes and then the bytes.  Neither goes through protobuf.
+ * Tunnel closes, errors, connects and window updates stay PortForwardData
+ * messages, and both forms are always accepted.
+ */
+class TerminalPackets {
+ public:
+  /** @brief Bytes before the data in a PORT_FORWARD_DATA_RAW payload. */
+  static const int RAW_PORT_FORWARD_HEADER_LENGTH = 5;
+
+  /** @brief Wraps terminal bytes, without protobuf when @p raw is set. */
+  static Packet terminalBuffer(const string& buffer, bool raw);
+
+  /** @brief Returns the bytes of a TERMINAL_BUFFER(_RAW) packet. */
+  static string terminalBufferData(const Packet& packet);
+
+  /**
+   * @brief Wraps tunnel data, without protobuf when @p raw is set and the
+   * message only carries bytes.
+   */
+  static Packet portForwardData(const PortForwardData& pwd, bool raw);
+
+  /**
+   * @brief Reads the header of a PORT_FORWARD_DATA_RAW payload; the data
+   * starts at RAW_PORT_FORWARD_HEADER_LENGTH.
+   * @throws std::runtime_error if the payload is too short.
+   */
+  static void parseRawPortForwardData(const string& payload,
+                                      bool* sourceToDestination,
+                                      int* socketId);
+};
+}  // namespace et
+
+#endif  // __ET_TERMINAL_PACKETS__
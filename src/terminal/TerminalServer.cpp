@@ -3,7 +3,13 @@
 
 #include <cstdint>
 
+#include "OutputCredit.hpp"
+#include "RawSocketUtils.hpp"
+#include "RouterFrame.hpp"
+#include "SharedRing.hpp"
 #include "TelemetryService.hpp"
+#include "TerminalPackets.hpp"
+#include "TunnelWorker.hpp"
 
 #define BUF_SIZE (16 * 1024)
 
@@ -23,25 +29,15 @@ TerminalServer::~TerminalServer() {}
 
 void TerminalServer::run() {
   LOG(INFO) << "Creating server";
-  fd_set coreFds;
-  int numCoreFds = 0;
-  int maxCoreFd = 0;
-  FD_ZERO(&coreFds);
   set<int> serverPortFds = socketHandler->getEndpointFds(serverEndpoint);
-  for (int i : serverPortFds) {
-    FD_SET(i, &coreFds);
-    maxCoreFd = max(maxCoreFd, i);
-    numCoreFds++;
-  }
-  FD_SET(terminalRouter->getServerFd(), &coreFds);
-  maxCoreFd = max(maxCoreFd, terminalRouter->getServerFd());
-  numCoreFds++;
+  const int routerServerFd = terminalRouter->getServerFd();
 
   if (TelemetryService::exists()) {
     TelemetryService::get()->logToDatadog("Server started", el::Level::Info,
                                           __FILE__, __LINE__);
   }
 
+  vector<pollfd> pollFds;
   while (true) {
     {
       lock_guard<std::mutex> guard(terminalThreadMutex);
@@ -49,44 +45,62 @@ void TerminalServer::run() {
         break;
       }
     }
-    // Select blocks until there is something useful to do
-    fd_set rfds = coreFds;
-    int numFds = numCoreFds;
-    int maxFd = maxCoreFd;
-    timeval tv;
-
-    if (numFds > FD_SETSIZE) {
-      STFATAL << "Tried to select() on too many FDs";
+    // Listening sockets plus every handshake that is still waiting on its
+    // peer.  Handshakes come and go, so the set is rebuilt on each pass.
+    set<int> fds = serverPortFds;
+    fds.insert(routerServerFd);
+    getPendingHandshakeFds(&fds);
+    terminalRouter->getPendingFds(&fds);
+    set<int> responseFds;
+    getPendingResponseFds(&responseFds);
+    pollFds.clear();
+    for (int fd : fds) {
+      pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      pollFds.push_back(pfd);
+    }
+    for (int fd : responseFds) {
+      pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
+      pollFds.push_back(pfd);
     }
 
-    tv.tv_sec = 0;
-    tv.tv_usec = 100000;
-
-    const int numFdsSet = select(maxFd + 1, &rfds, NULL, NULL, &tv);
+    // Wake up periodically to notice halt and expire stalled handshakes.
+    const int numFdsSet = poll(pollFds.data(), pollFds.size(), 100);
     if (numFdsSet < 0 && errno == EINTR) {
       // If EINTR was returned, then the syscall was interrupted by a signal.
       // This is not an error, but can be a signal that the program is being
       // shutdown, so restart the loop to check for the halt condition.
       continue;
     }
-
     FATAL_FAIL(numFdsSet);
-    if (numFdsSet == 0) {
-      continue;
-    }
 
-    // We have something to do!
-    for (int i : serverPortFds) {
-      if (FD_ISSET(i, &rfds)) {
-        acceptNewConnection(i);
+    set<int> readyFds;
+    for (const pollfd& pfd : pollFds) {
+      if (!pfd.revents) {
+        continue;
       }
-    }
-    if (FD_ISSET(terminalRouter->getServerFd(), &rfds)) {
-      auto idKeyPair = terminalRouter->acceptNewConnection();
-      if (idKeyPair.id.length()) {
-        addClientKey(idKeyPair.id, idKeyPair.key);
+      readyFds.insert(pfd.fd);
+      if (serverPortFds.find(pfd.fd) != serverPortFds.end()) {
+        acceptNewConnection(pfd.fd);
+      } else if (pfd.fd == routerServerFd) {
+        auto idKeyPair = terminalRouter->acceptNewConnection();
+        if (idKeyPair.id.length()) {
+          addClientKey(idKeyPair.id, idKeyPair.key);
+        }
       }
     }
+    // Register terminals before advancing client handshakes so a client
+    // never races ahead of its own key.
+    for (const auto& idKeyPair :
+         terminalRouter->processPendingConnections(readyFds)) {
+      addClientKey(idKeyPair.id, idKeyPair.key);
+    }
+    processPendingHandshakes(readyFds);
   }
 
   shutdown();
@@ -220,6 +234,12 @@ void TerminalServer::runTerminal(
   shared_ptr<SocketHandler> pipeSocketHandler(new PipeSocketHandler());
   shared_ptr<PortForwardHandler> portForwardHandler(
       new PortForwardHandler(serverSocketHandler, pipeSocketHandler));
+  // Only a client that sends window updates reads ours
+  portForwardHandler->setSendWindowUpdates(payload.tunnelwindows());
+  // Reverse tunnels skip the round trip when the client takes our ids
+  portForwardHandler->setOpenEarly(payload.tunnelearlydata());
+  // Other hosts only when the admin allows it, as sshd does
+  portForwardHandler->setConnectHosts(tunnelHosts);
   map<string, string> environmentVariables;
 
   for (const auto& envVar : payload.environmentvariables()) {
@@ -228,7 +248,13 @@ void TerminalServer::runTerminal(
   }
 
   vector<string> pipePaths;
-  for (const PortForwardSourceRequest& pfsr : payload.reversetunnels()) {
+  vector<PortForwardSourceRequest> reverseTunnels(
+      payload.reversetunnels().begin(), payload.reversetunnels().end());
+  for (auto pfsr : payload.udpreversetunnels()) {
+    pfsr.set_udp(true);
+    reverseTunnels.push_back(pfsr);
+  }
+  for (const PortForwardSourceRequest& pfsr : reverseTunnels) {
     string sourceName;
     PortForwardSourceResponse pfsresponse;
     if (pfsr.has_environmentvariable()) {
@@ -250,6 +276,18 @@ void TerminalServer::runTerminal(
       pipePaths.push_back(sourceName);
     }
   }
+  // Tell the client we read terminal and tunnel bytes without protobuf
+  response.set_rawpackets(true);
+  // and that terminal output follows the credit it grants
+  response.set_outputcredit(true);
+  // and that tunnels follow the windows it advertises
+  response.set_tunnelwindows(true);
+  // and that they may open without waiting for our response
+  response.set_tunnelearlydata(true);
+  // and that it forwards udp
+  response.set_tunneludp(true);
+  // and whether it connects to the hosts tunnels name
+  response.set_tunnelhosts(tunnelHosts);
   serverClientState->writePacket(
       Packet(uint8_t(EtPacketType::INITIAL_RESPONSE), protoToString(response)));
 
@@ -265,14 +303,152 @@ void TerminalServer::runTerminal(
   shared_ptr<SocketHandler> terminalSocketHandler =
       terminalRouter->getSocketHandler();
 
+  // Use compact frames on the router hop when etterminal understands them
+  const bool compactFrames = userInfo.compactframes();
+  // Take over the pty when enabled and etterminal is able to pass it
+  const bool directPty = passPty && userInfo.passpty();
+  // Otherwise carry terminal traffic over shared rings when both sides can.
+  // They ride on compact frames, which every etterminal with rings has.
+  shared_ptr<SharedRingLink> rings;
+  if (sharedRings && !directPty && compactFrames && userInfo.sharedring()) {
+    try {
+      rings = SharedRingLink::create();
+    } catch (const std::runtime_error& re) {
+      LOG(ERROR) << "Falling back to the router socket: " << re.what();
+    }
+  }
   TermInit termInit;
   for (auto& it : environmentVariables) {
     *(termInit.add_environmentnames()) = it.first;
     *(termInit.add_environmentvalues()) = it.second;
   }
+  termInit.set_compactframes(compactFrames);
+  termInit.set_passpty(directPty);
+  termInit.set_sharedring(rings != nullptr);
   terminalSocketHandler->writePacket(
       terminalFd,
       Packet(TerminalPacketType::TERMINAL_INIT, protoToString(termInit)));
+  if (rings) {
+    try {
+      rings->send(terminalFd);
+      LOG(INFO) << "Using shared rings to etterminal";
+    } catch (const std::runtime_error& re) {
+      LOG(ERROR) << "Could not pass shared rings: " << re.what();
+      ::shutdown(terminalFd, SHUT_RDWR);
+      run = false;
+    }
+  }
+
+  // With the pty master passed over, this thread reads and writes the shell
+  // directly and the router socket only tells when etterminal goes away.
+  int ptyFd = -1;
+  if (directPty) {
+    try {
+      ptyFd = RawSocketUtils::receiveFd(terminalFd,
+                                        HANDSHAKE_DEADLINE_SECONDS * 1000);
+      int flags = fcntl(ptyFd, F_GETFL, 0);
+      FATAL_FAIL(flags);
+      FATAL_FAIL(fcntl(ptyFd, F_SETFL, flags | O_NONBLOCK));
+      LOG(INFO) << "Reading the pty directly";
+    } catch (const std::runtime_error& re) {
+      LOG(ERROR) << "etterminal did not pass its pty: " << re.what();
+      run = false;
+    }
+  }
+  // Where terminal output shows up.  With rings or a passed pty, the router
+  // socket is still watched to notice etterminal exiting.
+  int outputFd = terminalFd;
+  if (ptyFd >= 0) {
+    outputFd = ptyFd;
+  } else if (rings) {
+    outputFd = rings->toServer()->getDataFd();
+  }
+  const bool watchRouter = (outputFd != terminalFd);
+  // Keystrokes waiting for room in the pty input buffer.  Once this fills,
+  // the client is no longer read so backpressure reaches it.
+  string pendingInput;
+  const size_t maxPendingInput = 256 * 1024;
+
+  // With screen snapshots, output the client is too far behind to take only
+  // updates the screen model, and one repaint replaces it once the client
+  // catches up or reconnects.
+  unique_ptr<ScreenModel> screenModel;
+  if (screenSnapshots) {
+    screenModel.reset(new ScreenModel(24, 80));
+  }
+  bool snapshotPending = false;
+  // Scrollback lines numbered below this are in the client's history
+  int64_t syncedScrollback = 0;
+  // Output the client has not granted credit for yet
+  OutputCredit credit;
+  // The client is behind while it is disconnected, or once it has been out
+  // of credit or socket room for SNAPSHOT_LAG_MS.  Shorter stalls only hold
+  // back reading the terminal, as without snapshots.
+  optional<std::chrono::steady_clock::time_point> stalledSince;
+  auto clientIsBehind = [&serverClientState, &credit, &stalledSince]() {
+    int fd = serverClientState->getSocketFd();
+    if (fd < 0) {
+      return true;
+    }
+    if (credit.hasCredit() && waitOnSocketReady(fd, true, 0)) {
+      stalledSince.reset();
+      return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (!stalledSince) {
+      stalledSince = now;
+    }
+    return now - *stalledSince >= std::chrono::milliseconds(SNAPSHOT_LAG_MS);
+  };
+  // Output read in quick succession goes out as one packet.
+  OutputBatcher outputBatcher(outputBatchWindowUs);
+  // Skip protobuf on the bytes we send when the client reads them raw
+  const bool rawPackets = payload.rawpackets();
+  auto sendOutput = [&serverClientState, &credit, &screenModel,
+                     &snapshotPending, &syncedScrollback,
+                     rawPackets](const string& output) {
+    credit.sent(output.length());
+    if (screenModel && !snapshotPending) {
+      // The client scrolls the same lines into its history as the model
+      syncedScrollback = screenModel->getScrollbackEnd();
+    }
+    serverClientState->writePacket(
+        TerminalPackets::terminalBuffer(output, rawPackets));
+  };
+  auto takeOutput = [&](const char* data, size_t length) {
+    VLOG(2) << "Got bytes from terminal: " << length;
+    if (screenModel) {
+      screenModel->write(string(data, length));
+    }
+    if (screenModel && (snapshotPending || clientIsBehind())) {
+      // The snapshot covers the pending batch as well
+      snapshotPending = true;
+      outputBatcher.clear();
+    } else {
+      outputBatcher.append(data, length);
+    }
+  };
+  auto sendToTerminal = [&](char type, const string& payload) {
+    if (rings) {
+      string frame = RouterFrame::encode(type, payload);
+      rings->toTerminal()->writeAll(frame.data(), frame.length());
+    } else {
+      RouterFrame::write(terminalSocketHandler, terminalFd, type, payload,
+                         compactFrames);
+    }
+  };
+
+  // This session's share of the output budget all sessions split
+  int scheduleId = -1;
+  if (sessionScheduler) {
+    scheduleId = sessionScheduler->addSession();
+  }
+  // Set while output is waiting for the scheduler to give this session room
+  bool awaitingShare = false;
+  // Tunnels run on their own thread, so they never hold up the shell.
+  TunnelWorker tunnelWorker(portForwardHandler, rawPackets);
+  tunnelWorker.start();
+  const int tunnelFd = tunnelWorker.getNotifyFd();
 
   while (run) {
     {
@@ -285,51 +461,115 @@ void TerminalServer::runTerminal(
     // Data structures needed for select() and
     // non-blocking I/O.
     fd_set rfd;
+    fd_set wfd;
     timeval tv;
 
     FD_ZERO(&rfd);
+    FD_ZERO(&wfd);
     int maxfd = -1;
-    // Only drain the terminal while the client connection can absorb the
-    // data, so backpressure reaches the shell instead of this loop blocking
-    // inside writePacket()
-    if (serverClientState->canBufferWrite(2 * BUF_SIZE)) {
+    // Only drain the terminal while the client has granted credit and the
+    // connection can absorb the data, so backpressure reaches the shell
+    // instead of this loop blocking inside writePacket().  Once the client
+    // is behind, the screen model absorbs anything.
+    const bool readOutput =
+        !awaitingShare &&
+        ((screenModel && (snapshotPending || clientIsBehind())) ||
+         (credit.hasCredit() &&
+          serverClientState->canBufferWrite(2 * BUF_SIZE)));
+    if (readOutput) {
+      FD_SET(outputFd, &rfd);
+      maxfd = outputFd;
+    }
+    if (watchRouter) {
       FD_SET(terminalFd, &rfd);
-      maxfd = terminalFd;
+      maxfd = max(maxfd, terminalFd);
+    }
+    if (ptyFd >= 0 && !pendingInput.empty()) {
+      FD_SET(ptyFd, &wfd);
+      maxfd = max(maxfd, ptyFd);
     }
     int serverClientFd = serverClientState->getSocketFd();
     if (serverClientFd > 0) {
-      FD_SET(serverClientFd, &rfd);
+      if (pendingInput.length() < maxPendingInput) {
+        FD_SET(serverClientFd, &rfd);
+      }
+      // Queued tunnel data goes out as the socket drains
+      if ((snapshotPending && credit.hasCredit()) ||
+          serverClientState->getBulkBytes() > 0) {
+        FD_SET(serverClientFd, &wfd);
+      }
       maxfd = max(maxfd, serverClientFd);
     }
-    // Include port forward sockets in select for low-latency forwarding.
-    set<int> pfFds;
-    portForwardHandler->getForwardFds(&pfFds);
-    for (int fd : pfFds) {
-      FD_SET(fd, &rfd);
-      maxfd = max(maxfd, fd);
+    // Tunnel packets are only taken while the bulk queue has room.  Until
+    // then the worker stops reading tunnels and holds on to what it has.
+    const bool tunnelsBehind =
+        serverClientState->getBulkBytes() >= BackedWriter::MAX_BULK_BYTES;
+    tunnelWorker.setReadsPaused(tunnelsBehind);
+    if (!tunnelsBehind) {
+      FD_SET(tunnelFd, &rfd);
+      maxfd = max(maxfd, tunnelFd);
     }
     tv.tv_sec = 0;
     tv.tv_usec = 100000;
-    select(maxfd + 1, &rfd, NULL, NULL, &tv);
+    int64_t batchWaitUs = outputBatcher.usUntilReady();
+    if (batchWaitUs >= 0 && batchWaitUs < tv.tv_usec) {
+      tv.tv_usec = batchWaitUs;
+    }
+    if (readOutput && rings && rings->toServer()->readable() > 0) {
+      // The ring only signals when it was empty, so do not wait on it.
+      tv.tv_usec = 0;
+    }
+    if (awaitingShare) {
+      tv.tv_usec =
+          min(int64_t(tv.tv_usec), sessionScheduler->usUntilReady(scheduleId));
+    }
+    select(maxfd + 1, &rfd, &wfd, NULL, &tv);
 
     try {
       // Check for data to receive; the received
       // data includes also the data previously sent
       // on the same master descriptor (line 90).
-      if (FD_ISSET(terminalFd, &rfd)) {
+      bool outputPending = awaitingShare;
+      if (rings && readOutput) {
+        if (FD_ISSET(outputFd, &rfd)) {
+          rings->toServer()->clearDataSignal();
+        }
+        outputPending = rings->toServer()->readable() > 0;
+      } else if (readOutput) {
+        outputPending = FD_ISSET(outputFd, &rfd);
+      }
+      // Only read as much as the scheduler lets this session send
+      size_t outputAllowance = BUF_SIZE;
+      if (outputPending && sessionScheduler) {
+        outputAllowance =
+            size_t(sessionScheduler->acquire(scheduleId, BUF_SIZE));
+        awaitingShare = (outputAllowance == 0);
+        outputPending = !awaitingShare;
+      }
+      if (outputPending && rings) {
+        size_t count = rings->toServer()->read(b, outputAllowance);
+        if (sessionScheduler) {
+          sessionScheduler->refund(scheduleId, outputAllowance - count);
+        }
+        if (count > 0) {
+          takeOutput(b, count);
+        }
+      } else if (outputPending) {
         // Read from terminal and write to client
-        memset(b, 0, BUF_SIZE);
-        int rc = read(terminalFd, b, BUF_SIZE);
+        int rc = read(outputFd, b, outputAllowance);
+        if (sessionScheduler) {
+          sessionScheduler->refund(scheduleId,
+                                   outputAllowance - max(rc, 0));
+        }
         if (rc > 0) {
-          VLOG(2) << "Sending bytes from terminal: " << rc << " "
-                  << serverClientState->getWriter()->getSequenceNumber();
-          string s(b, rc);
-          et::TerminalBuffer tb;
-          tb.set_buffer(s);
-          serverClientState->writePacket(
-              Packet(TerminalPacketType::TERMINAL_BUFFER, protoToString(tb)));
-        } else if (rc == 0) {
+          takeOutput(b, rc);
+        } else if (rc == 0 || (ptyFd >= 0 && errno == EIO)) {
+          // A pty master reads EIO once every process on the shell side has
+          // closed it.
           LOG(INFO) << "Terminal session ended";
+          if (!outputBatcher.empty()) {
+            sendOutput(outputBatcher.take());
+          }
           run = false;
           break;
         } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
@@ -344,18 +584,53 @@ void TerminalServer::runTerminal(
         }
       }
 
-      vector<PortForwardDestinationRequest> requests;
-      vector<PortForwardData> dataToSend;
-      portForwardHandler->update(&requests, &dataToSend);
-      for (auto& pfr : requests) {
-        serverClientState->writePacket(
-            Packet(TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST,
-                   protoToString(pfr)));
+      if (watchRouter && FD_ISSET(terminalFd, &rfd)) {
+        // etterminal sends nothing more on the socket, so this is it exiting
+        char routerByte;
+        if (read(terminalFd, &routerByte, 1) == 0) {
+          LOG(INFO) << "etterminal exited, ending the terminal session";
+          if (rings) {
+            // Output written just before it exited is still in the ring
+            size_t count;
+            while ((count = rings->toServer()->read(b, BUF_SIZE)) > 0) {
+              takeOutput(b, count);
+            }
+          }
+          if (!outputBatcher.empty()) {
+            sendOutput(outputBatcher.take());
+          }
+          run = false;
+          break;
+        }
       }
-      for (auto& pwd : dataToSend) {
-        serverClientState->writePacket(
-            Packet(TerminalPacketType::PORT_FORWARD_DATA, protoToString(pwd)));
+
+      if (outputBatcher.isReady()) {
+        VLOG(2) << "Sending bytes from terminal: " << outputBatcher.size()
+                << " " << serverClientState->getWriter()->getSequenceNumber();
+        sendOutput(outputBatcher.take());
+      }
+
+      if (snapshotPending && !clientIsBehind()) {
+        // Repaint the client instead of sending what it missed
+        string snapshot = screenModel->snapshot(syncedScrollback);
+        VLOG(1) << "Client caught up, sending a screen snapshot of "
+                << snapshot.length() << " bytes";
+        snapshotPending = false;
+        sendOutput(snapshot);
+      }
+
+      if (!tunnelsBehind && FD_ISSET(tunnelFd, &rfd)) {
+        vector<TunnelWorker::Frame> frames;
+        tunnelWorker.take(&frames);
+        for (auto& frame : frames) {
+          if (frame.bulk) {
+            serverClientState->writeBulkPacket(frame.packet);
+          } else {
+            serverClientState->writePacket(frame.packet);
+          }
+        }
       }
+      serverClientState->flushBulk();
 
       if (serverClientFd > 0 && FD_ISSET(serverClientFd, &rfd)) {
         VLOG(3) << "ServerClientFd is selected";
@@ -367,25 +642,39 @@ void TerminalServer::runTerminal(
           }
           uint8_t packetType = packet.getHeader();
           if (packetType == et::TerminalPacketType::PORT_FORWARD_DATA ||
+              packetType == et::TerminalPacketType::PORT_FORWARD_DATA_RAW ||
               packetType ==
                   et::TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST ||
               packetType ==
                   et::TerminalPacketType::PORT_FORWARD_DESTINATION_RESPONSE) {
-            portForwardHandler->handlePacket(packet, serverClientState);
+            tunnelWorker.post(packet);
             continue;
           }
           switch (packetType) {
-            case et::TerminalPacketType::TERMINAL_BUFFER: {
-              // Read from the server and write to our fake terminal
-              et::TerminalBuffer tb =
-                  stringToProto<et::TerminalBuffer>(packet.getPayload());
-              VLOG(2) << "Got bytes from client: " << tb.buffer().length()
-                      << " "
+            case et::TerminalPacketType::TERMINAL_BUFFER:
+            case et::TerminalPacketType::TERMINAL_BUFFER_RAW: {
+              // Read from the server and write to our fake terminal.  A
+              // TERMINAL_BUFFER payload already is a serialized
+              // TerminalBuffer, so it is forwarded as-is and etterminal
+              // parses it.  Raw bytes are wrapped for etterminal here.
+              VLOG(2) << "Got bytes from client: "
+                      << packet.getPayload().length() << " "
                       << serverClientState->getReader()->getSequenceNumber();
-              char c = TERMINAL_BUFFER;
-              terminalSocketHandler->writeAllOrThrow(terminalFd, &c,
-                                                     sizeof(char), false);
-              terminalSocketHandler->writeProto(terminalFd, tb, false);
+              if (sessionScheduler) {
+                sessionScheduler->noteInput(scheduleId);
+              }
+              if (ptyFd >= 0) {
+                pendingInput.append(
+                    TerminalPackets::terminalBufferData(packet));
+                break;
+              }
+              if (packetType == et::TerminalPacketType::TERMINAL_BUFFER_RAW) {
+                et::TerminalBuffer tb;
+                tb.set_buffer(packet.getPayload());
+                sendToTerminal(TERMINAL_BUFFER, protoToString(tb));
+                break;
+              }
+              sendToTerminal(TERMINAL_BUFFER, packet.getPayload());
               break;
             }
             case et::TerminalPacketType::KEEP_ALIVE: {
@@ -395,14 +684,36 @@ void TerminalServer::runTerminal(
                   Packet(TerminalPacketType::KEEP_ALIVE, ""));
               break;
             }
+            case et::TerminalPacketType::TERMINAL_CREDIT: {
+              auto tc = stringToProto<TerminalCredit>(packet.getPayload());
+              if (!credit.isEnabled()) {
+                LOG(INFO) << "Client grants credit for terminal output";
+              }
+              credit.granted(tc.consumed());
+              VLOG(2) << "Got credit: " << tc.consumed() << " in flight "
+                      << credit.inFlight() << " window "
+                      << credit.getWindow();
+              break;
+            }
             case et::TerminalPacketType::TERMINAL_INFO: {
               LOG(INFO) << "Got terminal info";
-              et::TerminalInfo ti =
-                  stringToProto<et::TerminalInfo>(packet.getPayload());
-              char c = TERMINAL_INFO;
-              terminalSocketHandler->writeAllOrThrow(terminalFd, &c,
-                                                     sizeof(char), false);
-              terminalSocketHandler->writeProto(terminalFd, ti, false);
+              auto ti = stringToProto<TerminalInfo>(packet.getPayload());
+              if (screenModel) {
+                screenModel->resize(ti.row(), ti.column());
+              }
+              if (ptyFd >= 0) {
+                winsize tmpwin;
+                tmpwin.ws_row = ti.row();
+                tmpwin.ws_col = ti.column();
+                tmpwin.ws_xpixel = ti.width();
+                tmpwin.ws_ypixel = ti.height();
+                if (ioctl(ptyFd, TIOCSWINSZ, &tmpwin) < 0) {
+                  LOG(ERROR) << "Could not resize the pty: "
+                             << strerror(errno);
+                }
+                break;
+              }
+              sendToTerminal(TERMINAL_INFO, packet.getPayload());
               break;
             }
             default:
@@ -410,6 +721,20 @@ void TerminalServer::runTerminal(
           }
         }
       }
+
+      // Feed buffered keystrokes to the shell without blocking; whatever
+      // does not fit waits for the pty to become writable.
+      if (ptyFd >= 0 && !pendingInput.empty()) {
+        int rc = write(ptyFd, pendingInput.data(), pendingInput.length());
+        if (rc > 0) {
+          pendingInput.erase(0, rc);
+        } else if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+          LOG(ERROR) << "Error writing to the pty: " << errno << " "
+                     << strerror(errno);
+          run = false;
+          break;
+        }
+      }
     } catch (const runtime_error& re) {
       STERROR << "Error: " << re.what();
       CLOG(INFO, "stdout") << "Error: " << re.what();
@@ -421,6 +746,14 @@ void TerminalServer::runTerminal(
       // run=false;
     }
   }
+  if (sessionScheduler) {
+    sessionScheduler->removeSession(scheduleId);
+  }
+  if (ptyFd >= 0) {
+    close(ptyFd);
+    // Lets etterminal know the session is over
+    ::shutdown(terminalFd, SHUT_RDWR);
+  }
   {
     string id = serverClientState->getId();
     serverClientState.reset();
@@ -433,7 +766,12 @@ void TerminalServer::handleConnection(
   Packet packet;
   while (!serverClientState->readPacket(&packet)) {
     LOG(INFO) << "Waiting for initial packet...";
-    sleep(1);
+    int socketFd = serverClientState->getSocketFd();
+    if (socketFd < 0) {
+      sleep(1);
+    } else {
+      waitOnSocketData(socketFd);
+    }
   }
   if (packet.getHeader() != EtPacketType::INITIAL_PAYLOAD) {
     STFATAL << "Invalid header: expecting INITIAL_PAYLOAD but got "
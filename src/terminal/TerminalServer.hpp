@@ -7,13 +7,20 @@
 #include "ETerminal.pb.h"
 #include "Headers.hpp"
 #include "LogHandler.hpp"
+#include "OutputBatcher.hpp"
 #include "PortForwardHandler.hpp"
+#include "ScreenModel.hpp"
 #include "ServerConnection.hpp"
+#include "SessionScheduler.hpp"
 #include "TcpSocketHandler.hpp"
 #include "UserTerminalHandler.hpp"
 #include "UserTerminalRouter.hpp"
 
 namespace et {
+/** @brief How long a connected client has to be out of credit or socket room
+ * before screen snapshots stand in for its output. */
+const int SNAPSHOT_LAG_MS = 500;
+
 /**
  * @brief Eternal terminal server that accepts clients and routes them to jump
  * hosts or terminals.
@@ -51,12 +58,64 @@ class TerminalServer : public ServerConnection {
     halt = true;
   }
 
+  /**
+   * @brief Keeps a ScreenModel per terminal so a client that falls behind
+   * or reconnects gets a repaint instead of all the output it missed.
+   */
+  void setScreenSnapshots(bool enabled) { screenSnapshots = enabled; }
+
+  /**
+   * @brief Gathers terminal output for up to @p windowUs microseconds during
+   * bursts before sending it (see OutputBatcher); 0 sends every read.
+   */
+  void setOutputBatchWindow(int windowUs) { outputBatchWindowUs = windowUs; }
+
+  /**
+   * @brief Has etterminal pass its pty master over the router socket so
+   * terminal I/O skips the extra hop through etterminal.
+   */
+  void setPassPty(bool enabled) { passPty = enabled; }
+
+  /**
+   * @brief Carries terminal traffic to etterminal over shared-memory rings
+   * instead of the router socket where the platform allows (see SharedRing).
+   */
+  void setSharedRings(bool enabled) { sharedRings = enabled; }
+
+  /**
+   * @brief Lets tunnels connect to any host the user could reach, like
+   * ssh -L and -D, instead of only to localhost.
+   */
+  void setTunnelHosts(bool enabled) { tunnelHosts = enabled; }
+
+  /**
+   * @brief Splits @p bytesPerSecond of terminal output between all sessions
+   * by weight, favoring ones with recent input (see SessionScheduler).
+   */
+  void setOutputRate(int64_t bytesPerSecond, int interactiveWeight,
+                     int bulkWeight) {
+    sessionScheduler.reset(
+        new SessionScheduler(bytesPerSecond, interactiveWeight, bulkWeight));
+  }
+
   /** @brief Router that hands reconnecting clients to their terminals. */
   shared_ptr<UserTerminalRouter> terminalRouter;
   /** @brief Threads that manage active terminal/jumphost sessions. */
   vector<shared_ptr<thread>> terminalThreads;
   /** @brief Flag that stops the accept loop when true. */
   bool halt = false;
+  /** @brief Whether terminals keep a screen model for snapshots. */
+  bool screenSnapshots = false;
+  /** @brief Batching window for terminal output in microseconds. */
+  int outputBatchWindowUs = OutputBatcher::DEFAULT_WINDOW_US;
+  /** @brief Whether terminals hand their pty master to this process. */
+  bool passPty = false;
+  /** @brief Whether terminals use shared rings for the router hop. */
+  bool sharedRings = false;
+  /** @brief Whether tunnel destinations may name other hosts. */
+  bool tunnelHosts = false;
+  /** @brief Shares output between sessions, or null for no limit. */
+  shared_ptr<SessionScheduler> sessionScheduler;
 
  protected:
   /** @brief Guards access to `terminalThreads` and the halt flag. */
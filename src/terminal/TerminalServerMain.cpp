@@ -51,6 +51,31 @@ int main(int argc, char** argv) {
         ("telemetry",
          "Allow et to anonymously send errors to guide future improvements",
          cxxopts::value<bool>())  //
+        ("screensnapshots",
+         "Track each terminal's screen so a client that falls behind or "
+         "reconnects gets a repaint instead of all the output it missed")  //
+        ("batchwindow",
+         "Microseconds to gather terminal output during bursts before "
+         "sending it (0 sends every read)",
+         cxxopts::value<int>())  //
+        ("passpty",
+         "Have etterminal pass its pty to etserver, which then reads and "
+         "writes the shell directly")  //
+        ("sharedrings",
+         "Carry terminal traffic between etserver and etterminal over shared "
+         "memory instead of a socket (Linux only)")  //
+        ("tunnelhosts",
+         "Let tunnels connect to any host the user could reach, like ssh -L "
+         "and -D, instead of only to localhost")  //
+        ("outputrate",
+         "Bytes per second of terminal output shared fairly by all sessions "
+         "(0 for no limit)",
+         cxxopts::value<int64_t>())  //
+        ("interactiveweight",
+         "Share of the output rate for sessions with recent input",
+         cxxopts::value<int>())  //
+        ("bulkweight", "Share of the output rate for other sessions",
+         cxxopts::value<int>())  //
         ;
 
     auto result = options.parse(argc, argv);
@@ -80,6 +105,14 @@ int main(int argc, char** argv) {
     int port = 0;
     string bindIp = "";
     bool enableTelemetry = false;
+    bool screenSnapshots = false;
+    int batchWindowUs = OutputBatcher::DEFAULT_WINDOW_US;
+    bool passPty = false;
+    bool sharedRings = false;
+    bool tunnelHosts = false;
+    int64_t outputRate = 0;
+    int interactiveWeight = SessionScheduler::DEFAULT_INTERACTIVE_WEIGHT;
+    int bulkWeight = SessionScheduler::DEFAULT_BULK_WEIGHT;
     string logDirectory = GetTempDirectory();
     if (result.count("cfgfile")) {
       // Load the config file
@@ -101,6 +134,22 @@ int main(int argc, char** argv) {
           }
         }
 
+        screenSnapshots =
+            ini.GetBoolValue("Networking", "screen_snapshots", false);
+        const char* batchWindow =
+            ini.GetValue("Networking", "batch_window", NULL);
+        if (batchWindow) {
+          batchWindowUs = atoi(batchWindow);
+        }
+        passPty = ini.GetBoolValue("Networking", "pass_pty", false);
+        sharedRings = ini.GetBoolValue("Networking", "shared_rings", false);
+        tunnelHosts = ini.GetBoolValue("Networking", "tunnel_hosts", false);
+        outputRate = ini.GetLongValue("Networking", "output_rate", 0);
+        interactiveWeight =
+            ini.GetLongValue("Networking", "interactive_weight",
+                             SessionScheduler::DEFAULT_INTERACTIVE_WEIGHT);
+        bulkWeight = ini.GetLongValue("Networking", "bulk_weight",
+                                      SessionScheduler::DEFAULT_BULK_WEIGHT);
         enableTelemetry = ini.GetBoolValue("Debug", "telemetry", false);
         // read verbose level (prioritize command line option over cfgfile)
         const char* vlevel = ini.GetValue("Debug", "verbose", NULL);
@@ -158,6 +207,47 @@ int main(int argc, char** argv) {
       enableTelemetry = result["telemetry"].as<bool>();
     }
 
+    if (result.count("screensnapshots")) {
+      screenSnapshots = true;
+    }
+
+    if (result.count("batchwindow")) {
+      batchWindowUs = result["batchwindow"].as<int>();
+    }
+    if (batchWindowUs < 0 || batchWindowUs > 100000) {
+      CLOG(INFO, "stdout") << "Batch window must be between 0 and 100000 us"
+                           << endl;
+      exit(1);
+    }
+
+    if (result.count("passpty")) {
+      passPty = true;
+    }
+
+    if (result.count("sharedrings")) {
+      sharedRings = true;
+    }
+
+    if (result.count("tunnelhosts")) {
+      tunnelHosts = true;
+    }
+
+    if (result.count("outputrate")) {
+      outputRate = result["outputrate"].as<int64_t>();
+    }
+    if (result.count("interactiveweight")) {
+      interactiveWeight = result["interactiveweight"].as<int>();
+    }
+    if (result.count("bulkweight")) {
+      bulkWeight = result["bulkweight"].as<int>();
+    }
+    if (outputRate < 0 || interactiveWeight < 1 || bulkWeight < 1) {
+      CLOG(INFO, "stdout")
+          << "Output rate must not be negative and weights must be positive"
+          << endl;
+      exit(1);
+    }
+
     if (result.count("logdir")) {
       logDirectory = result["logdir"].as<string>();
     }
@@ -200,6 +290,14 @@ int main(int argc, char** argv) {
     routerFifo.set_name(serverFifo.getPathForCreation());
     TerminalServer terminalServer(tcpSocketHandler, serverEndpoint,
                                   pipeSocketHandler, routerFifo);
+    terminalServer.setScreenSnapshots(screenSnapshots);
+    terminalServer.setOutputBatchWindow(batchWindowUs);
+    terminalServer.setPassPty(passPty);
+    terminalServer.setSharedRings(sharedRings);
+    terminalServer.setTunnelHosts(tunnelHosts);
+    if (outputRate > 0) {
+      terminalServer.setOutputRate(outputRate, interactiveWeight, bulkWeight);
+    }
     terminalServer.run();
 
   } catch (cxxopts::exceptions::exception& oe) {
@@ -55,6 +55,13 @@ void UserJumphostHandler::run() {
     STFATAL << "Jumphost should be set by the initial client";
   }
   payload.set_jumphost(false);
+  // The client settles on protobuf packets and plain tunnels from the
+  // jumphost's empty InitialResponse, so the destination has to use them too
+  payload.clear_rawpackets();
+  payload.clear_tunnelwindows();
+  payload.clear_tunnelearlydata();
+  payload.clear_tunneludp();
+  payload.clear_udpreversetunnels();
 
   jumpclient = shared_ptr<ClientConnection>(new ClientConnection(
       jumpClientSocketHandler, dstSocketEndpoint, id, passkey));
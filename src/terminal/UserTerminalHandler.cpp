@@ -7,6 +7,7 @@
 #include "RawSocketUtils.hpp"
 #include "ServerConnection.hpp"
 #include "ServerFifoPath.hpp"
+#include "SharedRing.hpp"
 #include "UserTerminalRouter.hpp"
 
 namespace et {
@@ -17,7 +18,9 @@ UserTerminalHandler::UserTerminalHandler(
     : socketHandler(_socketHandler),
       term(_term),
       noratelimit(_noratelimit),
-      shuttingDown(false) {
+      shuttingDown(false),
+      compactFrames(false),
+      passPty(false) {
   auto idpasskey_splited = split(idPasskey, '/');
   string id = idpasskey_splited[0];
   string passkey = idpasskey_splited[1];
@@ -26,6 +29,9 @@ UserTerminalHandler::UserTerminalHandler(
   tui.set_passkey(passkey);
   tui.set_uid(getuid());
   tui.set_gid(getgid());
+  tui.set_compactframes(true);
+  tui.set_passpty(true);
+  tui.set_sharedring(SharedRingLink::supported());
 
   routerFd = ServerFifoPath::detectAndConnect(routerEndpoint, socketHandler);
 
@@ -50,16 +56,31 @@ void UserTerminalHandler::run() {
               << termInitPacket.getHeader();
     }
     TermInit ti = stringToProto<TermInit>(termInitPacket.getPayload());
+    compactFrames = ti.compactframes();
+    passPty = ti.passpty();
     for (int a = 0; a < ti.environmentnames_size(); a++) {
       setenv(ti.environmentnames(a).c_str(), ti.environmentvalues(a).c_str(),
              true);
     }
+    if (ti.sharedring()) {
+      try {
+        rings = SharedRingLink::receive(routerFd,
+                                        HANDSHAKE_DEADLINE_SECONDS * 1000);
+      } catch (const std::runtime_error& re) {
+        STFATAL << "Error receiving shared rings: " << re.what();
+      }
+      VLOG(1) << "Using shared rings to etserver";
+    }
     break;
   }
 
   int masterfd = term->setup(routerFd);
   VLOG(1) << "pty opened " << masterfd;
-  runUserTerminal(masterfd);
+  if (passPty) {
+    handOffPty(masterfd);
+  } else {
+    runUserTerminal(masterfd);
+  }
   close(routerFd);
 }
 
@@ -99,26 +120,39 @@ void UserTerminalHandler::runUserTerminal(int masterFd) {
 
     // Only read terminal output when the router can accept it, so
     // backpressure reaches the shell instead of killing the session
-    const bool routerWritable = isSocketWritable(routerFd);
+    const bool routerWritable = rings ? rings->toServer()->hasSpace(BUF_SIZE)
+                                      : isSocketWritable(routerFd);
+    const bool acceptInput = pendingInput.length() < maxPendingInput;
 
     FD_ZERO(&rfd);
     FD_ZERO(&wfd);
+    int maxfd = max(masterFd, routerFd);
     if (routerWritable) {
       FD_SET(masterFd, &rfd);
+    } else if (rings) {
+      FD_SET(rings->toServer()->getSpaceFd(), &rfd);
+      maxfd = max(maxfd, rings->toServer()->getSpaceFd());
     }
     // Stop pulling more input from the router once the pty-input buffer is
     // full, so backpressure reaches the client instead of buffering without
     // bound.
-    if (pendingInput.length() < maxPendingInput) {
+    if (acceptInput) {
       FD_SET(routerFd, &rfd);
+      if (rings) {
+        FD_SET(rings->toTerminal()->getDataFd(), &rfd);
+        maxfd = max(maxfd, rings->toTerminal()->getDataFd());
+      }
     }
     // Wake as soon as the pty can accept more of the buffered input.
     if (!pendingInput.empty()) {
       FD_SET(masterFd, &wfd);
     }
-    int maxfd = max(masterFd, routerFd);
     tv.tv_sec = 0;
     tv.tv_usec = 10000;
+    if (acceptInput && rings && rings->toTerminal()->readable() > 0) {
+      // The ring only signals when it was empty, so do not wait on it.
+      tv.tv_usec = 0;
+    }
     select(maxfd + 1, &rfd, &wfd, NULL, &tv);
     VLOG(4) << "select is done";
 
@@ -134,14 +168,18 @@ void UserTerminalHandler::runUserTerminal(int masterFd) {
       // on the same master descriptor (line 90).
       if (FD_ISSET(masterFd, &rfd) && (noratelimit || outputPerSecond < 1024)) {
         // Read from terminal and write to client, with a limit in rows/sec
-        memset(b, 0, BUF_SIZE);
         int rc = read(masterFd, b, BUF_SIZE);
         int readErrno = errno;  // Save errno before any logging
         if (rc > 0) {
           VLOG(4) << "Read from terminal";
           string s(b, rc);
           outputPerSecond += std::count(s.begin(), s.end(), '\n');
-          socketHandler->writeAllOrThrow(routerFd, b, rc, false);
+          if (rings) {
+            // hasSpace() made room for a whole read
+            rings->toServer()->write(b, rc);
+          } else {
+            socketHandler->writeAllOrThrow(routerFd, b, rc, false);
+          }
           VLOG(4) << "Write to client: "
                   << std::count(s.begin(), s.end(), '\n');
         } else if (rc == 0) {
@@ -165,7 +203,51 @@ void UserTerminalHandler::runUserTerminal(int masterFd) {
         }
       }
 
-      if (FD_ISSET(routerFd, &rfd)) {
+      if (rings && FD_ISSET(rings->toServer()->getSpaceFd(), &rfd)) {
+        rings->toServer()->clearSpaceSignal();
+      }
+
+      if (rings && acceptInput) {
+        SharedRing* input = rings->toTerminal();
+        if (FD_ISSET(input->getDataFd(), &rfd)) {
+          input->clearDataSignal();
+        }
+        char ringBuf[BUF_SIZE];
+        size_t count = input->read(ringBuf, BUF_SIZE);
+        if (count > 0) {
+          routerFrames.append(ringBuf, count);
+          char packetType;
+          string payload;
+          while (routerFrames.next(&packetType, &payload)) {
+            handleRouterMessage(packetType, payload, &pendingInput);
+          }
+        }
+      }
+
+      if (FD_ISSET(routerFd, &rfd) && compactFrames) {
+        // One read picks up every frame that has arrived so far.
+        char routerBuf[BUF_SIZE];
+        ssize_t rc = socketHandler->read(routerFd, routerBuf, BUF_SIZE);
+        int readErrno = errno;  // Save errno before any logging
+        if (rc == -1) {
+          if (readErrno == EAGAIN || readErrno == EWOULDBLOCK ||
+              readErrno == EINTR) {
+            continue;  // Transient error, retry
+          }
+          throw std::runtime_error(string("Router read error: ") +
+                                   strerror(readErrno));
+        }
+        if (rc == 0) {
+          throw std::runtime_error(
+              "Router has ended abruptly.  Killing terminal session.");
+        }
+        routerFrames.append(routerBuf, rc);
+        char packetType;
+        string payload;
+        while (routerFrames.next(&packetType, &payload)) {
+          handleRouterMessage(packetType, payload, &pendingInput);
+        }
+      } else if (FD_ISSET(routerFd, &rfd)) {
         char packetType;
         int rc = read(routerFd, &packetType, 1);
         int readErrno = errno;  // Save errno before any logging
@@ -180,28 +262,17 @@ void UserTerminalHandler::runUserTerminal(int masterFd) {
           throw std::runtime_error(
               "Router has ended abruptly.  Killing terminal session.");
         }
-        switch (packetType) {
-          case TERMINAL_BUFFER: {
-            TerminalBuffer tb =
-                socketHandler->readProto<TerminalBuffer>(routerFd, false);
-            VLOG(4) << "Read from router";
-            // Buffer the input; it is drained to the pty (non-blocking) below
-            // so a large burst can never block this loop.
-            pendingInput.append(tb.buffer());
-            break;
-          }
-          case TERMINAL_INFO: {
-            TerminalInfo ti =
-                socketHandler->readProto<TerminalInfo>(routerFd, false);
-            winsize tmpwin;
-            tmpwin.ws_row = ti.row();
-            tmpwin.ws_col = ti.column();
-            tmpwin.ws_xpixel = ti.width();
-            tmpwin.ws_ypixel = ti.height();
-            term->setInfo(tmpwin);
-            break;
-          }
+        int64_t length;
+        socketHandler->readAll(routerFd, &length, sizeof(int64_t), false);
+        if (length < 0 || length > MAX_ROUTER_FRAME_LENGTH) {
+          throw std::runtime_error("Invalid router message size: " +
+                                   to_string(length));
         }
+        string payload(length, '\0');
+        if (length > 0) {
+          socketHandler->readAll(routerFd, &payload[0], length, false);
+        }
+        handleRouterMessage(packetType, payload, &pendingInput);
       }
 
       // Drain buffered input to the pty without blocking.  A short write (the
@@ -233,5 +304,74 @@ void UserTerminalHandler::runUserTerminal(int masterFd) {
 
   term->cleanup();
 }
+
+void UserTerminalHandler::handOffPty(int masterFd) {
+  // etserver reads and writes the pty itself from now on.  Our copy of the
+  // master stays open for the utmp record until etserver closes the router
+  // socket, which it does when the session ends.
+  try {
+    RawSocketUtils::sendFd(routerFd, masterFd);
+    LOG(INFO) << "Passed the pty to etserver";
+  } catch (const std::runtime_error& re) {
+    LOG(ERROR) << "Could not pass the pty to etserver: " << re.what();
+    term->cleanup();
+    return;
+  }
+
+  while (true) {
+    {
+      lock_guard<recursive_mutex> guard(shutdownMutex);
+      if (shuttingDown) {
+        break;
+      }
+    }
+    if (!waitOnSocketReady(routerFd, false, 1000)) {
+      continue;
+    }
+    char b[1024];
+    ssize_t rc = socketHandler->read(routerFd, b, sizeof(b));
+    if (rc == 0 ||
+        (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      LOG(INFO) << "Router closed, terminal session ended";
+      break;
+    }
+  }
+
+  // When we are the ones stopping, this makes etserver drop the pty so the
+  // shell is hung up.
+  ::shutdown(routerFd, SHUT_RDWR);
+  term->cleanup();
+}
+
+void UserTerminalHandler::handleRouterMessage(char packetType,
+                                              const string& payload,
+                                              string* pendingInput) {
+  switch (packetType) {
+    case TERMINAL_BUFFER: {
+      TerminalBuffer tb;
+      if (!tb.ParseFromString(payload)) {
+        throw std::runtime_error("Invalid terminal buffer from router");
+      }
+      VLOG(4) << "Read from router";
+      // Buffer the input; it is drained to the pty (non-blocking) by the
+      // main loop so a large burst can never block it.
+      pendingInput->append(tb.buffer());
+      break;
+    }
+    case TERMINAL_INFO: {
+      TerminalInfo ti;
+      if (!ti.ParseFromString(payload)) {
+        throw std::runtime_error("Invalid terminal info from router");
+      }
+      winsize tmpwin;
+      tmpwin.ws_row = ti.row();
+      tmpwin.ws_col = ti.column();
+      tmpwin.ws_xpixel = ti.width();
+      tmpwin.ws_ypixel = ti.height();
+      term->setInfo(tmpwin);
+      break;
+    }
+  }
+}
 }  // namespace et
 #endif
@@ -2,6 +2,8 @@
 #define __ET_USER_TERMINAL_HANDLER__
 
 #include "Headers.hpp"
+#include "RouterFrame.hpp"
+#include "SharedRing.hpp"
 #include "SocketHandler.hpp"
 #include "UserTerminal.hpp"
 
@@ -41,9 +43,29 @@ class UserTerminalHandler {
   bool shuttingDown;
   /** @brief Guards `shuttingDown` across threads. */
   recursive_mutex shutdownMutex;
+  /** @brief Whether etserver agreed to send compact router frames. */
+  bool compactFrames;
+  /** @brief Reassembles compact frames read from the router. */
+  RouterFrameDecoder routerFrames;
+  /** @brief Whether etserver asked for the pty master. */
+  bool passPty;
+  /** @brief Rings etserver passed to carry terminal traffic, if any. */
+  shared_ptr<SharedRingLink> rings;
 
   /** @brief Reads from the master fd and forwards data to the client socket. */
   void runUserTerminal(int masterFd);
+  /**
+   * @brief Passes the pty master to etserver and waits for etserver to end
+   * the session.
+   */
+  void handOffPty(int masterFd);
+  /**
+   * @brief Applies one message from etserver: buffers keystrokes into @p
+   * pendingInput or resizes the terminal.
+   * @throws std::runtime_error when the payload is malformed.
+   */
+  void handleRouterMessage(char packetType, const string& payload,
+                           string* pendingInput);
 };
 }  // namespace et
 
@@ -28,35 +28,116 @@ IdKeyPair UserTerminalRouter::acceptNewConnection() {
   }
 
   LOG(INFO) << "Connected";
-
-  try {
-    Packet packet;
-    if (!socketHandler->readPacket(terminalFd, &packet)) {
-      STFATAL << "Missing user info packet";
+  if (pendingConnections.size() >= size_t(MAX_PENDING_HANDSHAKES)) {
+    auto oldest = pendingConnections.begin();
+    for (auto it = pendingConnections.begin(); it != pendingConnections.end();
+         ++it) {
+      if (it->second.deadline < oldest->second.deadline) {
+        oldest = it;
+      }
     }
-    if (packet.getHeader() != TerminalPacketType::TERMINAL_USER_INFO) {
-      STFATAL << "Got an invalid packet header: " << int(packet.getHeader());
+    LOG(ERROR) << "Too many pending terminal connections, dropping fd "
+               << oldest->first;
+    socketHandler->close(oldest->first);
+    pendingConnections.erase(oldest);
+  }
+  PendingHandshake handshake;
+  handshake.reader.reset(
+      new FrameReader(socketHandler, terminalFd, MAX_PRE_AUTH_FRAME_LENGTH));
+  handshake.deadline = std::chrono::steady_clock::now() +
+                       std::chrono::seconds(HANDSHAKE_DEADLINE_SECONDS);
+  pendingConnections[terminalFd] = handshake;
+
+  // Terminals send their user info right after connecting, so it is often
+  // already here.
+  IdKeyPair result({"", ""});
+  advancePendingConnection(terminalFd, true, &result);
+  return result;
+}
+
+void UserTerminalRouter::getPendingFds(set<int>* fds) {
+  lock_guard<recursive_mutex> guard(routerMutex);
+  for (const auto& it : pendingConnections) {
+    fds->insert(it.first);
+  }
+}
+
+vector<IdKeyPair> UserTerminalRouter::processPendingConnections(
+    const set<int>& readyFds) {
+  lock_guard<recursive_mutex> guard(routerMutex);
+  vector<IdKeyPair> registered;
+  vector<int> terminalFds;
+  for (const auto& it : pendingConnections) {
+    terminalFds.push_back(it.first);
+  }
+  for (int terminalFd : terminalFds) {
+    IdKeyPair result({"", ""});
+    if (advancePendingConnection(terminalFd, readyFds.count(terminalFd) > 0,
+                                 &result) &&
+        result.id.length()) {
+      registered.push_back(result);
     }
-    TerminalUserInfo tui = stringToProto<TerminalUserInfo>(packet.getPayload());
-    tui.set_fd(terminalFd);
+  }
+  return registered;
+}
 
-    const bool inserted =
-        idInfoMap.insert(std::make_pair(tui.id(), tui)).second;
-    if (!inserted) {
-      LOG(ERROR) << "Rejecting duplicate terminal connection for " << tui.id();
-      socketHandler->close(terminalFd);
-      return IdKeyPair({"", ""});
+bool UserTerminalRouter::advancePendingConnection(int terminalFd, bool ready,
+                                                  IdKeyPair* result) {
+  auto it = pendingConnections.find(terminalFd);
+  if (it == pendingConnections.end()) {
+    return true;
+  }
+  shared_ptr<FrameReader> reader = it->second.reader;
+  FrameReader::Status status = FrameReader::FRAME_INCOMPLETE;
+  if (ready) {
+    status = reader->readAvailable();
+  }
+  if (status == FrameReader::FRAME_INCOMPLETE) {
+    if (std::chrono::steady_clock::now() < it->second.deadline) {
+      return false;
     }
+    LOG(ERROR) << "Terminal on fd " << terminalFd
+               << " did not send its user info in time";
+    pendingConnections.erase(it);
+    socketHandler->close(terminalFd);
+    return true;
+  }
+  pendingConnections.erase(it);
+  if (status == FrameReader::FRAME_ERROR) {
+    LOG(ERROR) << "Router can't talk to terminal: " << reader->getError();
+    socketHandler->close(terminalFd);
+    return true;
+  }
+
+  const string& frame = reader->getFrame();
+  if (frame.length() < 2) {
+    LOG(ERROR) << "Missing user info packet";
+    socketHandler->close(terminalFd);
+    return true;
+  }
+  Packet packet(frame);
+  if (packet.getHeader() != TerminalPacketType::TERMINAL_USER_INFO) {
+    LOG(ERROR) << "Got an invalid packet header: " << int(packet.getHeader());
+    socketHandler->close(terminalFd);
+    return true;
+  }
+  TerminalUserInfo tui;
+  if (!tui.ParseFromString(packet.getPayload())) {
+    LOG(ERROR) << "Got an invalid user info packet";
+    socketHandler->close(terminalFd);
+    return true;
+  }
+  tui.set_fd(terminalFd);
 
-    return IdKeyPair({tui.id(), tui.passkey()});
-  } catch (const std::runtime_error& re) {
-    LOG(ERROR) << "Router can't talk to terminal: " << re.what();
+  const bool inserted = idInfoMap.insert(std::make_pair(tui.id(), tui)).second;
+  if (!inserted) {
+    LOG(ERROR) << "Rejecting duplicate terminal connection for " << tui.id();
     socketHandler->close(terminalFd);
-    return IdKeyPair({"", ""});
+    return true;
   }
 
-  STFATAL << "Should never get here";
-  return IdKeyPair({"", ""});
+  *result = IdKeyPair({tui.id(), tui.passkey()});
+  return true;
 }
 
 std::optional<TerminalUserInfo> UserTerminalRouter::tryGetInfoForConnection(
@@ -26,10 +26,25 @@ class UserTerminalRouter {
   /** @brief Returns the active server side descriptor that accepts router
    * clients. */
   inline int getServerFd() { return serverFd; }
-  /** @brief Blocks until a new router client connects and returns its id/key
-   * info. */
+  /**
+   * @brief Accepts a new router client without blocking on it.
+   *
+   * Returns the client's id/key info if its `TERMINAL_USER_INFO` packet has
+   * already arrived; otherwise returns an empty pair and keeps the client
+   * pending until `processPendingConnections()` completes it.
+   */
   IdKeyPair acceptNewConnection();
 
+  /** @brief Adds the sockets of router clients that are still handshaking. */
+  void getPendingFds(set<int>* fds);
+
+  /**
+   * @brief Advances the pending router clients whose sockets are in
+   * @p readyFds, drops the ones past their deadline, and returns the id/key
+   * info of every client that finished registering.
+   */
+  vector<IdKeyPair> processPendingConnections(const set<int>& readyFds);
+
   /**
    * @brief Returns the previously-registered `TerminalUserInfo` for a
    * reconnecting client.
@@ -47,10 +62,21 @@ class UserTerminalRouter {
   int serverFd;
   /** @brief Terminal metadata registered by `handleConnection` clients. */
   unordered_map<string, TerminalUserInfo> idInfoMap;
+  /** @brief Router clients that have not sent their user info yet. */
+  unordered_map<int, PendingHandshake> pendingConnections;
   /** @brief Pipe handler used for communicating with router clients. */
   shared_ptr<PipeSocketHandler> socketHandler;
   /** @brief Synchronizes access to the router state. */
   recursive_mutex routerMutex;
+
+  /**
+   * @brief Reads whatever a pending client has sent if @p ready, and
+   * registers it once complete.
+   * @return true when the client is no longer pending; @p result holds its
+   * id/key info on success and stays empty otherwise.
+   */
+  bool advancePendingConnection(int terminalFd, bool ready,
+                                IdKeyPair* result);
 };
 }  // namespace et
 
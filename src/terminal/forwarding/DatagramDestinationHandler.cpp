@@ -0,0 +1,70 @@
+#include "DatagramDestinationHandler.hpp"
+
+namespace et {
+DatagramDestinationHandler::DatagramDestinationHandler(int _fd, int _socketId)
+    : fd(_fd),
+      socketId(_socketId),
+      readsPaused(false),
+      idleTimeout(std::chrono::seconds(DatagramSocket::IDLE_SECONDS)),
+      lastActive(Clock::now()) {}
+
+void DatagramDestinationHandler::close() {
+  if (fd != -1) {
+    DatagramSocket::close(fd);
+    fd = -1;
+  }
+}
+
+void DatagramDestinationHandler::write(const string& data) {
+  if (fd == -1) {
+    return;
+  }
+  if (int(queue.size()) >= DatagramSocket::MAX_QUEUED_DATAGRAMS) {
+    VLOG(1) << "Dropping a datagram for udp flow " << socketId;
+    return;
+  }
+  lastActive = Clock::now();
+  Datagram datagram;
+  datagram.data = data;
+  queue.push_back(std::move(datagram));
+  DatagramSocket::send(fd, &queue);
+}
+
+void DatagramDestinationHandler::update(vector<PortForwardData>* retval) {
+  if (fd == -1) {
+    return;
+  }
+  // A refused datagram is dropped; the read below reports the failure
+  while (DatagramSocket::send(fd, &queue) < 0) {
+  }
+
+  PortForwardData pwd;
+  pwd.set_socketid(socketId);
+  pwd.set_sourcetodestination(false);
+  vector<Datagram> datagrams;
+  if (!readsPaused &&
+      DatagramSocket::receive(fd, DatagramSocket::READ_DATAGRAMS,
+                              &datagrams) < 0) {
+    auto readErrno = GetErrno();
+    LOG(INFO) << "Udp flow " << socketId << " failed: " << strerror(readErrno);
+    pwd.set_error(strerror(readErrno));
+    retval->push_back(pwd);
+    close();
+    return;
+  }
+  if (!datagrams.empty()) {
+    lastActive = Clock::now();
+  }
+  for (auto& datagram : datagrams) {
+    pwd.set_buffer(std::move(datagram.data));
+    retval->push_back(pwd);
+  }
+  if (Clock::now() - lastActive >= idleTimeout) {
+    VLOG(1) << "Udp flow " << socketId << " expired";
+    pwd.clear_buffer();
+    pwd.set_closed(true);
+    retval->push_back(pwd);
+    close();
+  }
+}
+}  // namespace et
@@ -0,0 +1,67 @@
+#ifndef __DATAGRAM_DESTINATION_HANDLER_H__
+#define __DATAGRAM_DESTINATION_HANDLER_H__
+
+#include "DatagramSocket.hpp"
+
+namespace et {
+/**
+ * @brief Carries one UDP flow to its destination (the side that did not
+ * receive the first datagram).
+ *
+ * Datagrams from the peer go out on a socket connected to the destination,
+ * and each one that comes back is staged as its own PortForwardData.  The
+ * source closes idle flows; the flow also closes itself after
+ * `IDLE_SECONDS` without datagrams in case that close never arrives.
+ */
+class DatagramDestinationHandler {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  /** @param _fd A socket from `DatagramSocket::connect()`. */
+  DatagramDestinationHandler(int _fd, int _socketId);
+
+  /**
+   * @brief Sends queued datagrams and reads what came back.  Once the flow
+   * fails or idles out it is staged as closed, the socket is closed and the
+   * fd becomes -1.
+   */
+  void update(vector<PortForwardData>* retval);
+
+  /** @brief Queues a datagram from the peer and sends what the socket
+   * takes. */
+  void write(const string& data);
+
+  /** @brief Closes the socket. */
+  void close();
+
+  /** @brief Whether datagrams are waiting for the socket. */
+  inline bool hasQueuedData() const { return !queue.empty(); }
+
+  /** @brief Whether the socket may be read. */
+  inline bool canRead() const { return !readsPaused; }
+
+  /** @brief Stops or resumes reading the socket. */
+  inline void setReadsPaused(bool paused) { readsPaused = paused; }
+
+  /** @brief Sets how long the flow lives without datagrams. */
+  inline void setIdleTimeout(Clock::duration timeout) {
+    idleTimeout = timeout;
+  }
+
+  inline int getFd() const { return fd; }
+
+ protected:
+  /** @brief Socket connected to the destination. */
+  int fd;
+  /** @brief Id the source picked for the flow. */
+  int socketId;
+  /** @brief Datagrams from the peer not sent yet. */
+  std::deque<Datagram> queue;
+  bool readsPaused;
+  Clock::duration idleTimeout;
+  /** @brief When the last datagram went either way. */
+  Clock::time_point lastActive;
+};
+}  // namespace et
+
+#endif  // __DATAGRAM_DESTINATION_HANDLER_H__
@@ -0,0 +1,251 @@
+#include "DatagramSocket.hpp"
+
+namespace et {
+namespace {
+void initDatagramSocket(int fd) {
+#ifdef WIN32
+  u_long iMode = 1;
+  auto result = ioctlsocket(fd, FIONBIO, &iMode);
+  if (result != NO_ERROR) {
+    STFATAL << result;
+  }
+#else
+  FATAL_FAIL(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+  FATAL_FAIL(fcntl(fd, F_SETFD, FD_CLOEXEC));
+#endif
+}
+
+bool wouldBlock(int error) { return error == EAGAIN || error == EWOULDBLOCK; }
+
+/** @brief Scratch space for a batch of reads, shared by every socket read on
+ * the thread. */
+char* receiveBuffer() {
+  thread_local vector<char> buffer(DatagramSocket::BATCH *
+                                   DatagramSocket::MAX_DATAGRAM_BYTES);
+  return &buffer[0];
+}
+}  // namespace
+
+set<int> DatagramSocket::bind(const SocketEndpoint& endpoint) {
+  addrinfo hints, *servinfo, *p;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;  // use any IP address
+  const char* bindIp = endpoint.has_name() ? endpoint.name().c_str() : NULL;
+  string portname = std::to_string(endpoint.port());
+  int rc = getaddrinfo(bindIp, portname.c_str(), &hints, &servinfo);
+  if (rc != 0) {
+    throw std::runtime_error("Error getting address info for " + portname +
+                             ": " + gai_strerror(rc));
+  }
+
+  set<int> fds;
+  set<string> seenAddresses;
+  string error;
+  for (p = servinfo; p != NULL && error.empty(); p = p->ai_next) {
+    // "localhost" can resolve to the same address more than once
+    string addrKey(reinterpret_cast<const char*>(p->ai_addr), p->ai_addrlen);
+    if (!seenAddresses.insert(addrKey).second) {
+      continue;
+    }
+    int fd = int(::socket(p->ai_family, p->ai_socktype, p->ai_protocol));
+    if (fd == -1) {
+      auto localErrno = GetErrno();
+      LOG(INFO) << "Error creating udp socket " << p->ai_family << ": "
+                << localErrno << " " << strerror(localErrno);
+      continue;
+    }
+    initDatagramSocket(fd);
+    if (p->ai_family == AF_INET6) {
+      // The ipv4 addresses get their own socket
+      int flag = 1;
+      FATAL_FAIL(setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char*)&flag,
+                            sizeof(int)));
+    }
+    if (::bind(fd, p->ai_addr, int(p->ai_addrlen)) == -1) {
+      auto localErrno = GetErrno();
+      error = "Error binding udp port " + portname + ": " +
+              std::to_string(localErrno) + " " + strerror(localErrno);
+      close(fd);
+      continue;
+    }
+    fds.insert(fd);
+  }
+  freeaddrinfo(servinfo);
+  if (error.empty() && fds.empty()) {
+    error = "Could not bind udp port " + portname;
+  }
+  if (!error.empty()) {
+    for (int fd : fds) {
+      close(fd);
+    }
+    throw std::runtime_error(error);
+  }
+  return fds;
+}
+
+int DatagramSocket::connect(const SocketEndpoint& endpoint) {
+  addrinfo hints, *servinfo, *p;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  string portname = std::to_string(endpoint.port());
+  int rc = getaddrinfo(endpoint.name().c_str(), portname.c_str(), &hints,
+                       &servinfo);
+  if (rc != 0) {
+    LOG(INFO) << "Error getting address info for " << endpoint << ": "
+              << gai_strerror(rc);
+    SetErrno(EADDRNOTAVAIL);
+    return -1;
+  }
+  int fd = -1;
+  for (p = servinfo; p != NULL && fd == -1; p = p->ai_next) {
+    fd = int(::socket(p->ai_family, p->ai_socktype, p->ai_protocol));
+    if (fd == -1) {
+      continue;
+    }
+    initDatagramSocket(fd);
+    if (::connect(fd, p->ai_addr, int(p->ai_addrlen)) == -1) {
+      auto localErrno = GetErrno();
+      close(fd);
+      fd = -1;
+      SetErrno(localErrno);
+    }
+  }
+  freeaddrinfo(servinfo);
+  return fd;
+}
+
+void DatagramSocket::close(int fd) {
+#ifdef _MSC_VER
+  FATAL_FAIL(::closesocket(fd));
+#else
+  FATAL_FAIL(::close(fd));
+#endif
+}
+
+int DatagramSocket::receive(int fd, int maxDatagrams,
+                            vector<Datagram>* datagrams) {
+  char* buffer = receiveBuffer();
+  int received = 0;
+  while (received < maxDatagrams) {
+#ifdef __linux__
+    int count = min(BATCH, maxDatagrams - received);
+    mmsghdr messages[BATCH];
+    iovec iov[BATCH];
+    sockaddr_storage addresses[BATCH];
+    memset(messages, 0, sizeof(messages));
+    for (int a = 0; a < count; a++) {
+      iov[a].iov_base = buffer + a * MAX_DATAGRAM_BYTES;
+      iov[a].iov_len = MAX_DATAGRAM_BYTES;
+      messages[a].msg_hdr.msg_iov = &iov[a];
+      messages[a].msg_hdr.msg_iovlen = 1;
+      messages[a].msg_hdr.msg_name = &addresses[a];
+      messages[a].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+    }
+    int rc = ::recvmmsg(fd, messages, count, MSG_DONTWAIT, NULL);
+#else
+    int count = 1;
+    sockaddr_storage address;
+    socklen_t addressLength = sizeof(address);
+    int rc = int(::recvfrom(fd, buffer, MAX_DATAGRAM_BYTES, 0,
+                            (sockaddr*)&address, &addressLength));
+#endif
+    if (rc < 0) {
+      auto localErrno = GetErrno();
+      if (wouldBlock(localErrno) || received > 0) {
+        // A failure shows up again on the next read
+        SetErrno(localErrno);
+        break;
+      }
+      return -1;
+    }
+#ifdef __linux__
+    for (int a = 0; a < rc; a++) {
+      Datagram datagram;
+      datagram.data.assign((const char*)iov[a].iov_base, messages[a].msg_len);
+      datagram.addressLength = messages[a].msg_hdr.msg_namelen;
+      memcpy(&datagram.address, &addresses[a], datagram.addressLength);
+      datagrams->push_back(std::move(datagram));
+    }
+#else
+    Datagram datagram;
+    datagram.data.assign(buffer, rc);
+    datagram.addressLength = addressLength;
+    memcpy(&datagram.address, &address, addressLength);
+    datagrams->push_back(std::move(datagram));
+    rc = 1;
+#endif
+    received += rc;
+    if (rc < count) {
+      // The socket ran dry
+      break;
+    }
+  }
+  return received;
+}
+
+int DatagramSocket::send(int fd, std::deque<Datagram>* queue) {
+  int sent = 0;
+  while (!queue->empty()) {
+#ifdef __linux__
+    mmsghdr messages[BATCH];
+    iovec iov[BATCH];
+    memset(messages, 0, sizeof(messages));
+    int count = 0;
+    for (auto it = queue->begin(); it != queue->end() && count < BATCH;
+         ++it, ++count) {
+      iov[count].iov_base = (void*)it->data.data();
+      iov[count].iov_len = it->data.length();
+      messages[count].msg_hdr.msg_iov = &iov[count];
+      messages[count].msg_hdr.msg_iovlen = 1;
+      if (it->addressLength > 0) {
+        messages[count].msg_hdr.msg_name = (void*)&it->address;
+        messages[count].msg_hdr.msg_namelen = it->addressLength;
+      }
+    }
+    int rc = ::sendmmsg(fd, messages, count, MSG_DONTWAIT);
+#else
+    const Datagram& front = queue->front();
+    int rc = int(::sendto(
+        fd, front.data.data(), int(front.data.length()), 0,
+        front.addressLength > 0 ? (const sockaddr*)&front.address : NULL,
+        front.addressLength));
+    rc = rc < 0 ? rc : 1;
+#endif
+    if (rc < 0) {
+      auto localErrno = GetErrno();
+      if (wouldBlock(localErrno)) {
+        break;
+      }
+      VLOG(1) << "Dropping a datagram for fd " << fd << ": "
+              << strerror(localErrno);
+      queue->pop_front();
+      SetErrno(localErrno);
+      return -1;
+    }
+    queue->erase(queue->begin(), queue->begin() + rc);
+    sent += rc;
+  }
+  return sent;
+}
+
+string DatagramSocket::addressKey(const Datagram& datagram) {
+  const sockaddr* address = (const sockaddr*)&datagram.address;
+  string key(1, char(address->sa_family));
+  if (address->sa_family == AF_INET) {
+    auto in = (const sockaddr_in*)address;
+    key.append((const char*)&in->sin_addr, sizeof(in->sin_addr));
+    key.append((const char*)&in->sin_port, sizeof(in->sin_port));
+  } else if (address->sa_family == AF_INET6) {
+    auto in6 = (const sockaddr_in6*)address;
+    key.append((const char*)&in6->sin6_addr, sizeof(in6->sin6_addr));
+    key.append((const char*)&in6->sin6_port, sizeof(in6->sin6_port));
+    key.append((const char*)&in6->sin6_scope_id, sizeof(in6->sin6_scope_id));
+  } else {
+    key.append((const char*)&datagram.address, datagram.addressLength);
+  }
+  return key;
+}
+}  // namespace et
@@ -0,0 +1,65 @@
+#ifndef __DATAGRAM_SOCKET_H__
+#define __DATAGRAM_SOCKET_H__
+
+#include "Headers.hpp"
+
+namespace et {
+/** @brief A datagram and the address it came from or goes to. */
+struct Datagram {
+  string data;
+  sockaddr_storage address;
+  /** @brief 0 when the socket is connected and no address is needed. */
+  socklen_t addressLength = 0;
+};
+
+/**
+ * @brief Opens and drives the UDP sockets of datagram tunnels.
+ *
+ * The SocketHandlers only carry streams, so UDP tunnels use these instead.
+ * Sockets are non-blocking, and on Linux a batch of datagrams costs one
+ * `recvmmsg()` or `sendmmsg()` instead of a system call each.
+ */
+class DatagramSocket {
+ public:
+  /** @brief Room for the largest UDP datagram. */
+  static const int MAX_DATAGRAM_BYTES = 64 * 1024;
+  /** @brief Most datagrams moved in one system call. */
+  static const int BATCH = 16;
+  /** @brief Most datagrams read from one socket in one `update()`. */
+  static const int READ_DATAGRAMS = 64;
+  /** @brief Datagrams queued for a socket past which new ones are dropped. */
+  static const int MAX_QUEUED_DATAGRAMS = 256;
+  /** @brief Seconds a flow lives without a datagram either way. */
+  static const int IDLE_SECONDS = 60;
+
+  /**
+   * @brief Binds a socket to every address of @p endpoint.
+   * @throws std::runtime_error if one cannot be bound.
+   */
+  static set<int> bind(const SocketEndpoint& endpoint);
+
+  /** @brief Opens a socket connected to @p endpoint, or returns -1. */
+  static int connect(const SocketEndpoint& endpoint);
+
+  static void close(int fd);
+
+  /**
+   * @brief Reads up to @p maxDatagrams without waiting.
+   * @return How many were read, or -1 if the socket failed before any.
+   */
+  static int receive(int fd, int maxDatagrams, vector<Datagram>* datagrams);
+
+  /**
+   * @brief Sends from the front of @p queue until it is empty or the socket
+   * is full.  A datagram the socket refuses is dropped, as the network
+   * would.
+   * @return How many were sent, or -1 after dropping one that failed.
+   */
+  static int send(int fd, std::deque<Datagram>* queue);
+
+  /** @brief Identifies the peer in @p datagram, for finding its flow. */
+  static string addressKey(const Datagram& datagram);
+};
+}  // namespace et
+
+#endif  // __DATAGRAM_SOCKET_H__
@@ -0,0 +1,153 @@
+#include "DatagramSourceHandler.hpp"
+
+namespace et {
+DatagramSourceHandler::DatagramSourceHandler(
+    const SocketEndpoint& _source, const SocketEndpoint& _destination)
+    : source(_source),
+      destination(_destination),
+      readsPaused(false),
+      idleTimeout(std::chrono::seconds(DatagramSocket::IDLE_SECONDS)) {
+  for (int fd : DatagramSocket::bind(source)) {
+    sockets[fd];
+  }
+  LOG(INFO) << "Udp tunnel " << source << " -> " << destination
+            << " bound to " << sockets.size() << " sockets";
+}
+
+DatagramSourceHandler::~DatagramSourceHandler() {
+  for (auto& it : sockets) {
+    DatagramSocket::close(it.first);
+  }
+}
+
+void DatagramSourceHandler::update(
+    SocketIdAllocator* socketIds,
+    vector<PortForwardDestinationRequest>* requests,
+    vector<PortForwardData>* data) {
+  for (auto& it : sockets) {
+    // A datagram that fails is dropped, so go on with the rest
+    while (DatagramSocket::send(it.first, &it.second) < 0) {
+    }
+  }
+
+  auto now = Clock::now();
+  for (auto it = flows.begin(); it != flows.end();) {
+    if (now - it->second.lastActive < idleTimeout) {
+      ++it;
+      continue;
+    }
+    VLOG(1) << "Udp flow " << it->first << " expired";
+    PortForwardData pwd;
+    pwd.set_socketid(it->first);
+    pwd.set_sourcetodestination(true);
+    pwd.set_closed(true);
+    data->push_back(pwd);
+    peerFlows.erase(it->second.key);
+    it = flows.erase(it);
+  }
+
+  if (readsPaused) {
+    return;
+  }
+  vector<Datagram> datagrams;
+  for (auto& it : sockets) {
+    datagrams.clear();
+    if (DatagramSocket::receive(it.first, DatagramSocket::READ_DATAGRAMS,
+                                &datagrams) < 0) {
+      auto localErrno = GetErrno();
+      LOG(INFO) << "Error reading udp tunnel " << source << ": "
+                << strerror(localErrno);
+      continue;
+    }
+    for (auto& datagram : datagrams) {
+      receive(it.first, std::move(datagram), socketIds, requests, data);
+    }
+  }
+}
+
+void DatagramSourceHandler::receive(
+    int fd, Datagram&& datagram, SocketIdAllocator* socketIds,
+    vector<PortForwardDestinationRequest>* requests,
+    vector<PortForwardData>* data) {
+  string key = string((const char*)&fd, sizeof(fd)) +
+               DatagramSocket::addressKey(datagram);
+  int socketId;
+  auto peerIt = peerFlows.find(key);
+  if (peerIt != peerFlows.end()) {
+    socketId = peerIt->second;
+  } else {
+    socketId = socketIds->allocate();
+    if (socketId < 0) {
+      LOG(WARNING) << "Could not find empty socket id for a udp flow";
+      return;
+    }
+    VLOG(1) << "Udp tunnel " << source << " opened flow " << socketId;
+    Flow flow;
+    flow.fd = fd;
+    flow.peer.address = datagram.address;
+    flow.peer.addressLength = datagram.addressLength;
+    flow.key = key;
+    flows[socketId] = flow;
+    peerFlows[key] = socketId;
+
+    PortForwardDestinationRequest pfr;
+    *(pfr.mutable_destination()) = destination;
+    pfr.set_socketid(socketId);
+    pfr.set_udp(true);
+    requests->push_back(pfr);
+  }
+  flows[socketId].lastActive = Clock::now();
+
+  PortForwardData pwd;
+  pwd.set_socketid(socketId);
+  pwd.set_sourcetodestination(true);
+  pwd.set_buffer(std::move(datagram.data));
+  data->push_back(pwd);
+}
+
+void DatagramSourceHandler::sendDatagram(int socketId, const string& data) {
+  auto it = flows.find(socketId);
+  if (it == flows.end()) {
+    LOG(INFO) << "Tried to send a datagram on a udp flow that is already "
+                 "closed: "
+              << socketId;
+    return;
+  }
+  auto& queue = sockets[it->second.fd];
+  if (int(queue.size()) >= DatagramSocket::MAX_QUEUED_DATAGRAMS) {
+    VLOG(1) << "Dropping a datagram for udp flow " << socketId;
+    return;
+  }
+  it->second.lastActive = Clock::now();
+  Datagram datagram = it->second.peer;
+  datagram.data = data;
+  queue.push_back(std::move(datagram));
+  DatagramSocket::send(it->second.fd, &queue);
+}
+
+void DatagramSourceHandler::closeFlow(int socketId) {
+  auto it = flows.find(socketId);
+  if (it == flows.end()) {
+    return;
+  }
+  peerFlows.erase(it->second.key);
+  flows.erase(it);
+}
+
+void DatagramSourceHandler::getActiveFds(set<int>* fds) {
+  if (readsPaused) {
+    return;
+  }
+  for (auto& it : sockets) {
+    fds->insert(it.first);
+  }
+}
+
+void DatagramSourceHandler::getQueuedFds(set<int>* fds) {
+  for (auto& it : sockets) {
+    if (!it.second.empty()) {
+      fds->insert(it.first);
+    }
+  }
+}
+}  // namespace et
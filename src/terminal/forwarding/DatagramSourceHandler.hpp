@@ -0,0 +1,98 @@
+#ifndef __DATAGRAM_SOURCE_HANDLER_H__
+#define __DATAGRAM_SOURCE_HANDLER_H__
+
+#include "DatagramSocket.hpp"
+#include "SocketIdAllocator.hpp"
+
+namespace et {
+/**
+ * @brief Receives UDP datagrams on a local endpoint and tracks a flow per
+ * peer.
+ *
+ * A datagram from a new peer opens a flow: it gets a socket id and a
+ * destination request, and the peer sends what comes back for that id to
+ * the address the flow came from.  Each datagram travels as one
+ * PortForwardData, so its boundaries survive the tunnel.  A flow closes
+ * once no datagram has gone either way for `IDLE_SECONDS`.
+ *
+ * UDP has no flow control: datagrams are dropped when too many wait for
+ * the socket, and the socket is left to the kernel while reads are paused.
+ */
+class DatagramSourceHandler {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  /**
+   * @brief Binds the source endpoint.
+   * @throws std::runtime_error if it cannot be bound.
+   */
+  DatagramSourceHandler(const SocketEndpoint& _source,
+                        const SocketEndpoint& _destination);
+
+  ~DatagramSourceHandler();
+
+  /**
+   * @brief Sends queued datagrams, closes idle flows and reads what the
+   * sockets hold.  New flows take an id from @p socketIds and stage a
+   * destination request ahead of their data.
+   */
+  void update(SocketIdAllocator* socketIds,
+              vector<PortForwardDestinationRequest>* requests,
+              vector<PortForwardData>* data);
+
+  /** @brief Queues a datagram for the peer of flow `socketId`. */
+  void sendDatagram(int socketId, const string& data);
+
+  /** @brief Forgets flow `socketId`, for when the peer closed it. */
+  void closeFlow(int socketId);
+
+  /** @brief Whether any flow is open, and so may expire. */
+  inline bool hasFlows() const { return !flows.empty(); }
+
+  /** @brief Pauses or resumes reading the sockets. */
+  inline void setReadsPaused(bool paused) { readsPaused = paused; }
+
+  /** @brief Sets how long a flow lives without datagrams. */
+  inline void setIdleTimeout(Clock::duration timeout) {
+    idleTimeout = timeout;
+  }
+
+  /** @brief Adds the sockets worth reading. */
+  void getActiveFds(set<int>* fds);
+
+  /** @brief Adds the sockets with datagrams waiting to be sent. */
+  void getQueuedFds(set<int>* fds);
+
+ protected:
+  /** @brief A peer of the source endpoint. */
+  struct Flow {
+    /** @brief Socket the peer sends to; replies go out on it too. */
+    int fd;
+    /** @brief Address of the peer, without data. */
+    Datagram peer;
+    /** @brief `DatagramSocket::addressKey()` of the peer. */
+    string key;
+    Clock::time_point lastActive;
+  };
+
+  /** @brief Local endpoint peers send to. */
+  SocketEndpoint source;
+  /** @brief Remote endpoint that receives the datagrams. */
+  SocketEndpoint destination;
+  /** @brief Datagrams waiting for each bound socket. */
+  unordered_map<int, std::deque<Datagram>> sockets;
+  /** @brief Open flows by socket id. */
+  unordered_map<int, Flow> flows;
+  /** @brief Socket ids by fd and peer address. */
+  unordered_map<string, int> peerFlows;
+  bool readsPaused;
+  Clock::duration idleTimeout;
+
+  /** @brief Stages a datagram from a peer, opening its flow if needed. */
+  void receive(int fd, Datagram&& datagram, SocketIdAllocator* socketIds,
+               vector<PortForwardDestinationRequest>* requests,
+               vector<PortForwardData>* data);
+};
+}  // namespace et
+
+#endif  // __DATAGRAM_SOURCE_HANDLER_H__
@@ -0,0 +1,193 @@
+#include "ForwardChannel.hpp"
+
+namespace et {
+namespace {
+/** @brief Most queued strings handed to one writev(). */
+const int MAX_FLUSH_BUFFERS = 64;
+}  // namespace
+
+ForwardChannel::ForwardChannel(shared_ptr<SocketHandler> _socketHandler,
+                               int _fd, int _socketId,
+                               bool _sourceToDestination)
+    : socketHandler(_socketHandler),
+      fd(_fd),
+      socketId(_socketId),
+      sourceToDestination(_sourceToDestination),
+      queueOffset(0),
+      queuedBytes(0),
+      written(0),
+      sendWindowUpdates(false),
+      advertised(-1),
+      finishing(false),
+      overrun(false),
+      sent(0),
+      peerConsumed(0),
+      windowed(false),
+      readsPaused(false) {}
+
+void ForwardChannel::close() { socketHandler->close(fd); }
+
+void ForwardChannel::finish() {
+  finishing = true;
+  flush();
+}
+
+bool ForwardChannel::canRead() const {
+  return !finishing && !overrun && !readsPaused &&
+         (!windowed || sent - peerConsumed < WINDOW);
+}
+
+void ForwardChannel::windowUpdate(int64_t consumed) {
+  windowed = true;
+  // Updates are cumulative, so a late one changes nothing
+  peerConsumed = max(peerConsumed, min(consumed, sent));
+}
+
+void ForwardChannel::write(const string& s) {
+  if (fd == -1 || finishing || overrun || s.empty()) {
+    return;
+  }
+  VLOG(1) << "Queueing " << s.length() << " bytes for socket " << socketId;
+  queue.push_back(s);
+  queuedBytes += s.length();
+  flush();
+  if (queuedBytes <= MAX_QUEUED_BYTES) {
+    return;
+  }
+  // The peer does not keep to a window.  Waiting for the socket would
+  // stall every other tunnel, so this one is dropped instead.
+  LOG(WARNING) << "Socket " << socketId << " is behind by " << queuedBytes
+               << " bytes, closing it";
+  queue.clear();
+  queueOffset = 0;
+  queuedBytes = 0;
+  overrun = true;
+}
+
+void ForwardChannel::flush() {
+  while (fd != -1 && !queue.empty()) {
+    // Hand the socket as much of the queue as it takes in one call
+    struct iovec iov[MAX_FLUSH_BUFFERS];
+    int iovcnt = 0;
+    size_t offset = queueOffset;
+    for (auto it = queue.begin();
+         it != queue.end() && iovcnt < MAX_FLUSH_BUFFERS; ++it, ++iovcnt) {
+      iov[iovcnt].iov_base = (void*)(it->data() + offset);
+      iov[iovcnt].iov_len = it->length() - offset;
+      offset = 0;
+    }
+    // writev() returns what the socket took, where write() would wait
+    ssize_t bytesWritten = socketHandler->writev(fd, iov, iovcnt);
+    if (bytesWritten <= 0) {
+      auto writeErrno = GetErrno();
+      if (bytesWritten < 0 && writeErrno != EAGAIN &&
+          writeErrno != EWOULDBLOCK) {
+        // Reading the socket reports the failure to the peer
+        VLOG(1) << "Dropping " << queuedBytes << " bytes for socket "
+                << socketId << ": " << strerror(writeErrno);
+        queue.clear();
+        queueOffset = 0;
+        queuedBytes = 0;
+      }
+      break;
+    }
+    queuedBytes -= bytesWritten;
+    written += bytesWritten;
+    size_t remaining = bytesWritten;
+    while (remaining > 0) {
+      size_t frontLength = queue.front().length() - queueOffset;
+      if (remaining < frontLength) {
+        queueOffset += remaining;
+        break;
+      }
+      remaining -= frontLength;
+      queue.pop_front();
+      queueOffset = 0;
+    }
+    if (queueOffset > 0) {
+      // The socket is full
+      break;
+    }
+  }
+  if (finishing && fd != -1 && queue.empty()) {
+    VLOG(1) << "Socket " << socketId << " finished";
+    socketHandler->close(fd);
+    fd = -1;
+  }
+}
+
+void ForwardChannel::update(vector<PortForwardData>* retval) {
+  if (fd == -1) {
+    return;
+  }
+  if (overrun) {
+    PortForwardData pwd;
+    pwd.set_socketid(socketId);
+    pwd.set_sourcetodestination(sourceToDestination);
+    pwd.set_error("Socket fell too far behind");
+    retval->push_back(pwd);
+    socketHandler->close(fd);
+    fd = -1;
+    return;
+  }
+  flush();
+  if (fd == -1 || finishing) {
+    return;
+  }
+
+  if (sendWindowUpdates &&
+      (advertised < 0 || written - advertised >= UPDATE_BYTES)) {
+    // The first update, even with nothing written, starts the peer's window
+    PortForwardData pwd;
+    pwd.set_socketid(socketId);
+    pwd.set_sourcetodestination(sourceToDestination);
+    pwd.set_consumed(written);
+    retval->push_back(pwd);
+    advertised = written;
+  }
+
+  // No select() first: the socket is non-blocking, so reading it until it
+  // runs dry costs one extra read instead of a probe per read.
+  int64_t readBytes = 0;
+  while (canRead() && readBytes < READ_BYTES) {
+    int64_t count = min(int64_t(PACKET_BYTES), READ_BYTES - readBytes);
+    if (windowed) {
+      count = min(count, WINDOW - (sent - peerConsumed));
+    }
+    char buf[PACKET_BYTES];
+    ssize_t bytesRead = socketHandler->read(fd, buf, size_t(count));
+    auto readErrno = GetErrno();
+    if (bytesRead == -1 && (readErrno == EAGAIN || readErrno == EWOULDBLOCK)) {
+      // Bail for now
+      break;
+    }
+    PortForwardData pwd;
+    pwd.set_socketid(socketId);
+    pwd.set_sourcetodestination(sourceToDestination);
+    if (bytesRead == -1) {
+      VLOG(1) << "Got error reading socket " << socketId << " "
+              << strerror(readErrno);
+      pwd.set_error(strerror(readErrno));
+    } else if (bytesRead == 0) {
+      VLOG(1) << "Got close reading socket " << socketId;
+      pwd.set_closed(true);
+    } else {
+      VLOG(1) << "Reading " << bytesRead << " bytes from socket " << socketId;
+      pwd.set_buffer(buf, bytesRead);
+      sent += bytesRead;
+      readBytes += bytesRead;
+    }
+    retval->push_back(pwd);
+    if (bytesRead < 1) {
+      LOG(INFO) << "Socket " << socketId << " closed";
+      if (bytesRead < 0) {
+        STERROR << "Socket " << socketId << " closed with error " << readErrno
+                << ' ' << strerror(readErrno);
+      }
+      socketHandler->close(fd);
+      fd = -1;
+      break;
+    }
+  }
+}
+}  // namespace et
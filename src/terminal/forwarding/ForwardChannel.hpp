@@ -0,0 +1,137 @@
+#ifndef __FORWARD_CHANNEL_H__
+#define __FORWARD_CHANNEL_H__
+
+#include "ETerminal.pb.h"
+#include "Headers.hpp"
+#include "SocketHandler.hpp"
+
+namespace et {
+/**
+ * @brief One forwarded socket, flow controlled like an SSH channel.
+ *
+ * Data from the peer is queued and written as the socket takes it, so a
+ * slow consumer never blocks the session loop.  The channel tells the peer
+ * how much it has written out with window updates (`consumed` in
+ * PortForwardData), and the peer keeps at most `WINDOW` bytes beyond that
+ * in flight, which bounds the queue.  In the other direction the socket is
+ * only read while the peer's window has room, so a stalled consumer only
+ * holds up its own tunnel.
+ *
+ * Reads are not limited until the peer's first window update arrives, so
+ * peers that never send them (older ones, or a client behind a jumphost)
+ * work as before.  Their data is still queued, but past
+ * `MAX_QUEUED_BYTES` the socket is closed with an error: waiting for it
+ * would hold up every other tunnel.
+ *
+ * Each `update()` reads up to `READ_BYTES`, as large as the window allows,
+ * so bulk transfers cost one packet per read instead of one per kilobyte.
+ * A read is at most `PACKET_BYTES`: bulk packets go out once the session
+ * socket has room, and a larger one could block both ends writing to each
+ * other.
+ */
+class ForwardChannel {
+ public:
+  /** @brief Bytes the peer may send beyond what was written out (1MB). */
+  static const int64_t WINDOW = 1024 * 1024;
+  /** @brief Bytes written out between two window updates. */
+  static const int64_t UPDATE_BYTES = WINDOW / 4;
+  /** @brief Queued bytes past which a peer without windows loses the
+   * socket. */
+  static const int64_t MAX_QUEUED_BYTES = 2 * WINDOW;
+  /** @brief Most bytes read from the socket in one `update()`. */
+  static const int64_t READ_BYTES = 256 * 1024;
+  /** @brief Most bytes read into one packet. */
+  static const int64_t PACKET_BYTES = 16 * 1024;
+
+  /**
+   * @param _sourceToDestination Direction of the data read from @p _fd.
+   */
+  ForwardChannel(shared_ptr<SocketHandler> _socketHandler, int _fd,
+                 int _socketId, bool _sourceToDestination);
+
+  /**
+   * @brief Writes queued data, then reads what the peer's window allows, up
+   * to `READ_BYTES`.
+   * Stages data, a close or error, and window updates for the peer.  Once
+   * the socket closes or fails it is closed and the fd becomes -1.
+   */
+  void update(vector<PortForwardData>* retval);
+
+  /** @brief Queues bytes from the peer and writes what the socket takes. */
+  void write(const string& s);
+
+  /** @brief Handles a window update: the peer has written @p consumed. */
+  void windowUpdate(int64_t consumed);
+
+  /**
+   * @brief Whether the socket may be read: reads are not paused and the
+   * peer's window has room.
+   */
+  bool canRead() const;
+
+  /** @brief Whether bytes are waiting for the socket to take them. */
+  inline bool hasQueuedData() const { return queuedBytes > 0; }
+
+  /** @brief Sends window updates from the next `update()` on. */
+  inline void setSendWindowUpdates(bool enabled) {
+    sendWindowUpdates = enabled;
+  }
+
+  /** @brief Stops or resumes reading the socket, whatever the window. */
+  inline void setReadsPaused(bool paused) { readsPaused = paused; }
+
+  /** @brief Closes the socket. */
+  void close();
+
+  /**
+   * @brief Stops reading and closes the socket once the queued bytes are
+   * written, for when the peer closed its end.
+   */
+  void finish();
+
+  /** @brief Accessor for the wrapped descriptor. */
+  inline int getFd() const { return fd; }
+
+ protected:
+  /** @brief Socket helper that drives the forwarded socket. */
+  shared_ptr<SocketHandler> socketHandler;
+  /** @brief File descriptor of the forwarded socket. */
+  int fd;
+  /** @brief Logical identifier supplied over the control channel. */
+  int socketId;
+  /** @brief Direction of the data read from the socket. */
+  bool sourceToDestination;
+
+  /** @brief Bytes from the peer not written to the socket yet. */
+  std::deque<string> queue;
+  /** @brief Bytes of the front of `queue` already written. */
+  size_t queueOffset;
+  /** @brief Bytes in `queue` minus `queueOffset`. */
+  int64_t queuedBytes;
+  /** @brief Bytes from the peer written to the socket. */
+  int64_t written;
+  /** @brief Whether to tell the peer about `written`. */
+  bool sendWindowUpdates;
+  /** @brief `written` in the last window update, or -1 before the first. */
+  int64_t advertised;
+  /** @brief Whether to close the socket once `queue` is written. */
+  bool finishing;
+  /** @brief Whether the queue outgrew `MAX_QUEUED_BYTES`; the next
+   * `update()` reports an error and closes the socket. */
+  bool overrun;
+
+  /** @brief Bytes read from the socket and staged for the peer. */
+  int64_t sent;
+  /** @brief What the peer has written out of `sent`. */
+  int64_t peerConsumed;
+  /** @brief Whether the peer sent a window update. */
+  bool windowed;
+  /** @brief Whether reading the socket is paused. */
+  bool readsPaused;
+
+  /** @brief Writes queued bytes while the socket takes them. */
+  void flush();
+};
+}  // namespace et
+
+#endif  // __FORWARD_CHANNEL_H__
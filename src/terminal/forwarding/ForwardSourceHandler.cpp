@@ -6,7 +6,9 @@ ForwardSourceHandler::ForwardSourceHandler(
     const SocketEndpoint& _destination)
     : socketHandler(_socketHandler),
       source(_source),
-      destination(_destination) {
+      destination(_destination),
+      sendWindowUpdates(false),
+      readsPaused(false) {
   socketHandler->listen(source);
 }
 
@@ -15,55 +17,38 @@ ForwardSourceHandler::~ForwardSourceHandler() {
 }
 
 int ForwardSourceHandler::listen() {
-  // TODO: Replace with select
   for (int i : socketHandler->getEndpointFds(source)) {
-    int fd = socketHandler->accept(i);
+    int fd = accept(i);
     if (fd > -1) {
-      LOG(INFO) << "Tunnel " << source << " -> " << destination
-                << " socket created with fd " << fd;
-      unassignedFds.insert(fd);
       return fd;
     }
   }
   return -1;
 }
 
+int ForwardSourceHandler::accept(int listenFd) {
+  int fd = socketHandler->accept(listenFd);
+  if (fd > -1) {
+    LOG(INFO) << "Tunnel " << source << " -> " << destination
+              << " socket created with fd " << fd;
+    unassignedFds.insert(fd);
+  }
+  return fd;
+}
+
+void ForwardSourceHandler::getListenFds(set<int>* fds) {
+  for (int fd : socketHandler->getEndpointFds(source)) {
+    fds->insert(fd);
+  }
+}
+
 void ForwardSourceHandler::update(vector<PortForwardData>* data) {
   vector<int> socketsToRemove;
 
   for (auto& it : socketFdMap) {
-    int socketId = it.first;
-    int fd = it.second;
-
-    while (socketHandler->hasData(fd)) {
-      char buf[1024];
-      int bytesRead = socketHandler->read(fd, buf, 1024);
-      auto readErrno = GetErrno();
-      if (bytesRead == -1 &&
-          (readErrno == EAGAIN || readErrno == EWOULDBLOCK)) {
-        // Bail for now
-        break;
-      }
-      PortForwardData pwd;
-      pwd.set_socketid(socketId);
-      pwd.set_sourcetodestination(true);
-      if (bytesRead == -1) {
-        VLOG(1) << "Got error reading socket " << socketId << " "
-                << strerror(readErrno);
-        pwd.set_error(strerror(readErrno));
-      } else if (bytesRead == 0) {
-        VLOG(1) << "Got close reading socket " << socketId;
-        pwd.set_closed(true);
-      } else {
-        VLOG(1) << "Reading " << bytesRead << " bytes from socket " << socketId;
-        pwd.set_buffer(string(buf, bytesRead));
-      }
-      data->push_back(pwd);
-      if (bytesRead < 1) {
-        socketHandler->close(fd);
-        socketsToRemove.push_back(socketId);
-        break;
-      }
+    it.second->update(data);
+    if (it.second->getFd() == -1) {
+      socketsToRemove.push_back(it.first);
     }
   }
   for (auto& it : socketsToRemove) {
@@ -92,31 +77,61 @@ void ForwardSourceHandler::addSocket(int socketId, int sourceFd) {
   }
   LOG(INFO) << "Adding socket: " << socketId << " " << sourceFd;
   unassignedFds.erase(sourceFd);
-  socketFdMap[socketId] = sourceFd;
+  auto channel = make_shared<ForwardChannel>(socketHandler, sourceFd,
+                                             socketId, true);
+  channel->setSendWindowUpdates(sendWindowUpdates);
+  channel->setReadsPaused(readsPaused);
+  socketFdMap[socketId] = channel;
 }
 
-void ForwardSourceHandler::getActiveFds(set<int>* fds) {
-  for (int fd : socketHandler->getEndpointFds(source)) {
-    fds->insert(fd);
+void ForwardSourceHandler::setSendWindowUpdates(bool enabled) {
+  sendWindowUpdates = enabled;
+  for (auto& it : socketFdMap) {
+    it.second->setSendWindowUpdates(enabled);
   }
+}
+
+void ForwardSourceHandler::setReadsPaused(bool paused) {
+  readsPaused = paused;
   for (auto& it : socketFdMap) {
-    fds->insert(it.second);
+    it.second->setReadsPaused(paused);
+  }
+}
+
+void ForwardSourceHandler::getActiveFds(set<int>* fds) {
+  for (auto& it : socketFdMap) {
+    // A socket the peer has no room for stays unread, so do not wake on it
+    if (it.second->canRead()) {
+      fds->insert(it.second->getFd());
+    }
   }
   for (int fd : unassignedFds) {
     fds->insert(fd);
   }
 }
 
+void ForwardSourceHandler::getQueuedFds(set<int>* fds) {
+  for (auto& it : socketFdMap) {
+    if (it.second->hasQueuedData()) {
+      fds->insert(it.second->getFd());
+    }
+  }
+}
+
 void ForwardSourceHandler::sendDataOnSocket(int socketId, const string& data) {
   if (socketFdMap.find(socketId) == socketFdMap.end()) {
     LOG(INFO) << "Tried to write to a socket that no longer exists!";
     return;
   }
 
-  int fd = socketFdMap[socketId];
-  const char* buf = data.c_str();
-  int count = data.length();
-  socketHandler->writeAllOrReturn(fd, buf, count);
+  socketFdMap[socketId]->write(data);
+}
+
+void ForwardSourceHandler::windowUpdate(int socketId, int64_t consumed) {
+  auto it = socketFdMap.find(socketId);
+  if (it != socketFdMap.end()) {
+    it->second->windowUpdate(consumed);
+  }
 }
 
 void ForwardSourceHandler::closeSocket(int socketId) {
@@ -124,8 +139,11 @@ void ForwardSourceHandler::closeSocket(int socketId) {
   if (it == socketFdMap.end()) {
     LOG(WARNING) << "Tried to remove a socket that no longer exists!";
   } else {
-    socketHandler->close(it->second);
-    socketFdMap.erase(it);
+    // Whatever the peer sent before closing still goes out first
+    it->second->finish();
+    if (it->second->getFd() == -1) {
+      socketFdMap.erase(it);
+    }
   }
 }
 }  // namespace et
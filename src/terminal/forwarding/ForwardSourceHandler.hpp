@@ -1,8 +1,7 @@
 #ifndef __FORWARD_SOURCE_HANDLER_H__
 #define __FORWARD_SOURCE_HANDLER_H__
 
-#include "Headers.hpp"
-#include "SocketHandler.hpp"
+#include "ForwardChannel.hpp"
 
 namespace et {
 /**
@@ -17,12 +16,21 @@ class ForwardSourceHandler {
                        const SocketEndpoint& _source,
                        const SocketEndpoint& _destination);
 
-  ~ForwardSourceHandler();
+  virtual ~ForwardSourceHandler();
 
   /** @brief Starts listening on the source endpoint and returns the server fd.
    */
   int listen();
 
+  /**
+   * @brief Accepts one connection waiting on the listener @p listenFd.
+   * @return The new, unassigned socket, or -1 if none was waiting.
+   */
+  int accept(int listenFd);
+
+  /** @brief Adds the fds listening on the source endpoint. */
+  void getListenFds(set<int>* fds);
+
   /** @brief Polls all active sockets and stages `PortForwardData` for
    * destinations. */
   void update(vector<PortForwardData>* data);
@@ -36,13 +44,28 @@ class ForwardSourceHandler {
   /** @brief Maps a socketId (from the control channel) to a pending fd. */
   void addSocket(int socketId, int sourceFd);
 
-  /** @brief Closes the socket mapped to `socketId`. */
+  /** @brief Closes the socket mapped to `socketId` once the data queued
+   * for it is written. */
   void closeSocket(int socketId);
 
   /** @brief Sends bytes from the remote side down the local source socket. */
   void sendDataOnSocket(int socketId, const string& data);
 
-  void getActiveFds(set<int>* fds);
+  /** @brief Passes a window update to the socket mapped to `socketId`. */
+  void windowUpdate(int socketId, int64_t consumed);
+
+  /** @brief Sends window updates for current and future sockets. */
+  void setSendWindowUpdates(bool enabled);
+
+  /** @brief Pauses or resumes reads on current and future sockets. */
+  void setReadsPaused(bool paused);
+
+  /** @brief Adds the fds worth reading: unassigned sockets and sockets
+   * whose peer window has room.  Listeners are left to `getListenFds()`. */
+  virtual void getActiveFds(set<int>* fds);
+
+  /** @brief Adds the fds of sockets with data waiting to be written. */
+  void getQueuedFds(set<int>* fds);
 
   inline SocketEndpoint getDestination() { return destination; }
 
@@ -55,8 +78,12 @@ class ForwardSourceHandler {
   SocketEndpoint destination;
   /** @brief Sockets that are awaiting assignment from the control stream. */
   unordered_set<int> unassignedFds;
-  /** @brief Maps logical socket IDs to their accepted file descriptors. */
-  unordered_map<int, int> socketFdMap;
+  /** @brief Maps logical socket IDs to their accepted sockets. */
+  unordered_map<int, shared_ptr<ForwardChannel>> socketFdMap;
+  /** @brief Whether new sockets send window updates. */
+  bool sendWindowUpdates;
+  /** @brief Whether new sockets start with reads paused. */
+  bool readsPaused;
 };
 }  // namespace et
 
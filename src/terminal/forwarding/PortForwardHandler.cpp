@@ -2,23 +2,158 @@
 
 #include <cstdint>
 
+#include "TerminalPackets.hpp"
+
 namespace et {
+namespace {
+/** @brief Destinations connecting at once; more wait for a thread. */
+const int CONNECT_THREADS = 4;
+
+// Connects to a TCP destination: the host it names when hosts are allowed,
+// else localhost over ipv6 and then ipv4.
+int connectToPort(shared_ptr<SocketHandler> socketHandler,
+                  const SocketEndpoint& destination, bool connectHosts) {
+  if (connectHosts && !destination.name().empty()) {
+    return socketHandler->connect(destination);
+  }
+  // Try ipv6 first
+  SocketEndpoint ipv6Localhost;
+  ipv6Localhost.set_name("::1");
+  ipv6Localhost.set_port(destination.port());
+
+  int fd = socketHandler->connect(ipv6Localhost);
+  if (fd == -1) {
+    SocketEndpoint ipv4Localhost;
+    ipv4Localhost.set_name("127.0.0.1");
+    ipv4Localhost.set_port(destination.port());
+    // Try ipv4 next
+    fd = socketHandler->connect(ipv4Localhost);
+  }
+  return fd;
+}
+}  // namespace
+
 PortForwardHandler::PortForwardHandler(
     shared_ptr<SocketHandler> _networkSocketHandler,
     shared_ptr<SocketHandler> _pipeSocketHandler)
     : networkSocketHandler(_networkSocketHandler),
-      pipeSocketHandler(_pipeSocketHandler) {}
+      pipeSocketHandler(_pipeSocketHandler),
+      sendWindowUpdates(false),
+      readsPaused(false),
+      openEarly(false),
+      connectHosts(false),
+      connectsStopping(false) {}
 
-void PortForwardHandler::update(vector<PortForwardDestinationRequest>* requests,
-                                vector<PortForwardData>* dataToSend) {
+PortForwardHandler::~PortForwardHandler() {
+  connectsStopping = true;
+  // Waits for the connect threads, so every connect below has finished
+  connectPool.reset();
+  for (auto& it : pendingDestinations) {
+    abandonedConnects.push_back(std::move(it.second.fd));
+  }
+  for (auto& connect : abandonedConnects) {
+    int fd = connect.get();
+    if (fd >= 0) {
+      networkSocketHandler->close(fd);
+    }
+  }
+}
+
+void PortForwardHandler::setSendWindowUpdates(bool enabled) {
+  sendWindowUpdates = enabled;
+  for (auto& it : sourceHandlers) {
+    it->setSendWindowUpdates(enabled);
+  }
+  for (auto& it : destinationHandlers) {
+    it.second->setSendWindowUpdates(enabled);
+  }
+}
+
+void PortForwardHandler::setReadsPaused(bool paused) {
+  if (paused == readsPaused) {
+    return;
+  }
+  readsPaused = paused;
   for (auto& it : sourceHandlers) {
+    it->setReadsPaused(paused);
+  }
+  for (auto& it : destinationHandlers) {
+    it.second->setReadsPaused(paused);
+  }
+  for (auto& it : datagramSourceHandlers) {
+    it->setReadsPaused(paused);
+  }
+  for (auto& it : datagramDestinations) {
+    it.second->setReadsPaused(paused);
+  }
+}
+
+void PortForwardHandler::setOpenEarly(bool enabled) { openEarly = enabled; }
+
+bool PortForwardHandler::hasDatagramFlows() const {
+  return !socketIdDatagramSourceMap.empty() || !datagramDestinations.empty();
+}
+
+void PortForwardHandler::setConnectHosts(bool enabled) {
+  connectHosts = enabled;
+}
+
+void PortForwardHandler::setConnectCallback(std::function<void()> callback) {
+  lock_guard<std::mutex> guard(connectCallbackMutex);
+  connectCallback = callback;
+}
+
+void PortForwardHandler::update(
+    vector<PortForwardDestinationRequest>* requests,
+    vector<PortForwardData>* dataToSend) {
+  for (auto& it : socksSourceHandlers) {
+    size_t opened = requests->size();
+    it->handshake(&socketIds, requests, dataToSend);
+    for (size_t a = opened; a < requests->size(); a++) {
+      socketIdSocksHandlerMap[(*requests)[a].socketid()] = it;
+    }
+  }
+
+  // Ahead of the destination handlers, so a confirmation goes out before
+  // anything the destination sends
+  updatePendingDestinations(dataToSend);
+
+  for (auto& it : sourceHandlers) {
+    size_t staged = dataToSend->size();
     it->update(dataToSend);
-    int fd = it->listen();
-    if (fd >= 0) {
-      PortForwardDestinationRequest pfr;
-      *(pfr.mutable_destination()) = it->getDestination();
-      pfr.set_fd(fd);
-      requests->push_back(pfr);
+    for (size_t a = staged; a < dataToSend->size(); a++) {
+      const PortForwardData& pwd = (*dataToSend)[a];
+      if (pwd.has_closed() || pwd.has_error()) {
+        // The source handler has already dropped the socket
+        eraseSourceSocketId(pwd.socketid());
+      }
+    }
+  }
+
+  for (auto& it : datagramSourceHandlers) {
+    size_t opened = requests->size();
+    size_t staged = dataToSend->size();
+    it->update(&socketIds, requests, dataToSend);
+    for (size_t a = opened; a < requests->size(); a++) {
+      socketIdDatagramSourceMap[(*requests)[a].socketid()] = it;
+    }
+    for (size_t a = staged; a < dataToSend->size(); a++) {
+      const PortForwardData& pwd = (*dataToSend)[a];
+      if (pwd.has_closed()) {
+        // The flow went idle and the handler has already dropped it
+        socketIdDatagramSourceMap.erase(pwd.socketid());
+        socketIds.release(pwd.socketid());
+      }
+    }
+  }
+
+  for (auto it = datagramDestinations.begin();
+       it != datagramDestinations.end();) {
+    it->second->update(dataToSend);
+    if (it->second->getFd() == -1) {
+      it = datagramDestinations.erase(it);
+    } else {
+      ++it;
     }
   }
 
@@ -27,12 +162,127 @@ void PortForwardHandler::update(vector<PortForwardDestinationRequest>* requests,
     if (it.second->getFd() == -1) {
       // Kill the handler and don't update the rest: we'll pick
       // them up later
-      destinationHandlers.erase(it.first);
+      eraseDestination(it.first);
       break;
     }
   }
 }
 
+void PortForwardHandler::updatePendingDestinations(
+    vector<PortForwardData>* dataToSend) {
+  for (auto it = abandonedConnects.begin(); it != abandonedConnects.end();) {
+    if (it->wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      ++it;
+      continue;
+    }
+    int fd = it->get();
+    if (fd >= 0) {
+      networkSocketHandler->close(fd);
+    }
+    it = abandonedConnects.erase(it);
+  }
+
+  for (auto it = pendingDestinations.begin();
+       it != pendingDestinations.end();) {
+    auto& pending = it->second;
+    if (pending.fd.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready) {
+      ++it;
+      continue;
+    }
+    int socketId = it->first;
+    int fd = pending.fd.get();
+    PortForwardData pwd;
+    pwd.set_socketid(socketId);
+    pwd.set_sourcetodestination(false);
+    if (fd == -1) {
+      std::ostringstream error;
+      error << "Could not connect to " << pending.destination.name() << ":"
+            << pending.destination.port();
+      LOG(INFO) << "Could not open tunnel socket " << socketId << ": "
+                << error.str();
+      pwd.set_error(error.str());
+      dataToSend->push_back(pwd);
+      it = pendingDestinations.erase(it);
+      continue;
+    }
+    LOG(INFO) << "Created socket/fd pair: " << socketId << ' ' << fd;
+    auto handler =
+        shared_ptr<ForwardDestinationHandler>(new ForwardDestinationHandler(
+            networkSocketHandler, fd, socketId));
+    handler->setSendWindowUpdates(sendWindowUpdates);
+    handler->setReadsPaused(readsPaused);
+    if (pending.confirm) {
+      pwd.set_connected(true);
+      dataToSend->push_back(pwd);
+    }
+    for (auto& data : pending.data) {
+      handler->write(data);
+    }
+    if (pending.consumed >= 0) {
+      handler->windowUpdate(pending.consumed);
+    }
+    if (pending.finished) {
+      handler->finish();
+    }
+    if (handler->getFd() != -1) {
+      destinationHandlers[socketId] = handler;
+    }
+    it = pendingDestinations.erase(it);
+  }
+}
+
+void PortForwardHandler::accept(
+    int fd, vector<PortForwardDestinationRequest>* requests) {
+  auto socksIt = listenFdSocksHandlerMap.find(fd);
+  if (socksIt != listenFdSocksHandlerMap.end()) {
+    // SOCKS clients name their destination in the handshake
+    while (socksIt->second->accept(fd) >= 0) {
+    }
+    return;
+  }
+  auto it = listenFdSourceHandlerMap.find(fd);
+  if (it == listenFdSourceHandlerMap.end()) {
+    return;
+  }
+  int clientFd;
+  while ((clientFd = it->second->accept(fd)) >= 0) {
+    PortForwardDestinationRequest pfr;
+    *(pfr.mutable_destination()) = it->second->getDestination();
+    pfr.set_fd(clientFd);
+    if (!openEarly) {
+      unassignedFdSourceHandlerMap[clientFd] = it->second;
+      requests->push_back(pfr);
+      continue;
+    }
+    int socketId = socketIds.allocate();
+    if (socketId < 0) {
+      LOG(WARNING) << "Could not find empty socket id for fd " << clientFd;
+      it->second->closeUnassignedFd(clientFd);
+      continue;
+    }
+    it->second->addSocket(socketId, clientFd);
+    socketIdSourceHandlerMap[socketId] = it->second;
+    // A peer that takes our ids keeps to windows, so early data stops at
+    // the first one
+    it->second->windowUpdate(socketId, 0);
+    pfr.set_socketid(socketId);
+    requests->push_back(pfr);
+  }
+}
+
+void PortForwardHandler::addSourceHandler(
+    shared_ptr<ForwardSourceHandler> handler) {
+  handler->setSendWindowUpdates(sendWindowUpdates);
+  handler->setReadsPaused(readsPaused);
+  sourceHandlers.push_back(handler);
+  set<int> listenFds;
+  handler->getListenFds(&listenFds);
+  for (int fd : listenFds) {
+    listenFdSourceHandlerMap[fd] = handler;
+  }
+}
+
 PortForwardSourceResponse PortForwardHandler::createSource(
     const PortForwardSourceRequest& pfsr, string* sourceName, uid_t userid,
     gid_t groupid) {
@@ -42,6 +292,12 @@ PortForwardSourceResponse PortForwardHandler::createSource(
           "Do not set a source when forwarding named pipes with environment "
           "variables");
     }
+    if (pfsr.dynamic()) {
+      return createSocksSource(pfsr);
+    }
+    if (pfsr.udp()) {
+      return createDatagramSource(pfsr);
+    }
     SocketEndpoint source;
     if (pfsr.has_source()) {
       source = pfsr.source();
@@ -72,9 +328,9 @@ PortForwardSourceResponse PortForwardHandler::createSource(
         STFATAL << "Tried to create a port forward but with a place to put "
                    "the name!";
       }
-      auto handler = shared_ptr<ForwardSourceHandler>(new ForwardSourceHandler(
-          networkSocketHandler, source, pfsr.destination()));
-      sourceHandlers.push_back(handler);
+      addSourceHandler(
+          shared_ptr<ForwardSourceHandler>(new ForwardSourceHandler(
+              networkSocketHandler, source, pfsr.destination())));
       return PortForwardSourceResponse();
     } else {
       auto handler = shared_ptr<ForwardSourceHandler>(new ForwardSourceHandler(
@@ -85,7 +341,7 @@ PortForwardSourceResponse PortForwardHandler::createSource(
         FATAL_FAIL(::chown(source.name().c_str(), userid, groupid));
       }
 #endif
-      sourceHandlers.push_back(handler);
+      addSourceHandler(handler);
       return PortForwardSourceResponse();
     }
   } catch (const std::runtime_error& ex) {
@@ -95,24 +351,56 @@ PortForwardSourceResponse PortForwardHandler::createSource(
   }
 }
 
+PortForwardSourceResponse PortForwardHandler::createDatagramSource(
+    const PortForwardSourceRequest& pfsr) {
+  if (!openEarly) {
+    // Flows pick their own ids, which only such a peer takes
+    throw runtime_error("The other side does not forward udp");
+  }
+  if (!pfsr.source().has_port() || !pfsr.destination().has_port()) {
+    throw runtime_error("Only ports can forward udp");
+  }
+  auto handler = shared_ptr<DatagramSourceHandler>(
+      new DatagramSourceHandler(pfsr.source(), pfsr.destination()));
+  handler->setReadsPaused(readsPaused);
+  datagramSourceHandlers.push_back(handler);
+  return PortForwardSourceResponse();
+}
+
+PortForwardSourceResponse PortForwardHandler::createSocksSource(
+    const PortForwardSourceRequest& pfsr) {
+  if (!openEarly) {
+    // SOCKS connects pick their own ids, which only such a peer takes
+    throw runtime_error("The other side does not connect to hosts");
+  }
+  if (!pfsr.source().has_port()) {
+    throw runtime_error("Dynamic tunnels listen on a port");
+  }
+  auto handler = shared_ptr<SocksSourceHandler>(
+      new SocksSourceHandler(networkSocketHandler, pfsr.source()));
+  addSourceHandler(handler);
+  socksSourceHandlers.push_back(handler);
+  set<int> listenFds;
+  handler->getListenFds(&listenFds);
+  for (int fd : listenFds) {
+    listenFdSocksHandlerMap[fd] = handler;
+  }
+  return PortForwardSourceResponse();
+}
+
 PortForwardDestinationResponse PortForwardHandler::createDestination(
     const PortForwardDestinationRequest& pfdr) {
+  if (pfdr.udp()) {
+    return createDatagramDestination(pfdr);
+  }
+  if (pfdr.has_socketid() && pfdr.destination().has_port()) {
+    return startConnect(pfdr);
+  }
   int fd = -1;
   bool isTcp = pfdr.destination().has_port();
   if (pfdr.destination().has_port()) {
-    // Try ipv6 first
-    SocketEndpoint ipv6Localhost;
-    ipv6Localhost.set_name("::1");
-    ipv6Localhost.set_port(pfdr.destination().port());
-
-    fd = networkSocketHandler->connect(ipv6Localhost);
-    if (fd == -1) {
-      SocketEndpoint ipv4Localhost;
-      ipv4Localhost.set_name("127.0.0.1");
-      ipv4Localhost.set_port(pfdr.destination().port());
-      // Try ipv4 next
-      fd = networkSocketHandler->connect(ipv4Localhost);
-    }
+    fd = connectToPort(networkSocketHandler, pfdr.destination(),
+                       connectHosts);
   } else {
     fd = pipeSocketHandler->connect(pfdr.destination());
   }
@@ -121,48 +409,225 @@ PortForwardDestinationResponse PortForwardHandler::createDestination(
   if (fd == -1) {
     pfdresponse.set_error(strerror(GetErrno()));
   } else {
-    int socketId = rand();
-    int attempts = 0;
-    while (destinationHandlers.find(socketId) != destinationHandlers.end()) {
-      socketId = rand();
-      attempts++;
-      if (attempts >= 100000) {
-        pfdresponse.set_error("Could not find empty socket id");
-        break;
+    int socketId = -1;
+    if (!pfdr.has_socketid()) {
+      socketId = socketIds.allocate();
+      if (socketId >= 0) {
+        allocatedDestinationIds.insert(socketId);
       }
+    } else if (!destinationHandlers.count(pfdr.socketid()) &&
+               !datagramDestinations.count(pfdr.socketid()) &&
+               !pendingDestinations.count(pfdr.socketid())) {
+      // The source picked the id and may have sent data for it already
+      socketId = pfdr.socketid();
     }
-    if (!pfdresponse.has_error()) {
+    if (socketId < 0) {
+      pfdresponse.set_error(pfdr.has_socketid()
+                                ? "Socket id is already in use"
+                                : "Could not find empty socket id");
+      (isTcp ? networkSocketHandler : pipeSocketHandler)->close(fd);
+    } else {
       LOG(INFO) << "Created socket/fd pair: " << socketId << ' ' << fd;
-      destinationHandlers[socketId] =
+      auto handler =
           shared_ptr<ForwardDestinationHandler>(new ForwardDestinationHandler(
               isTcp ? networkSocketHandler : pipeSocketHandler, fd, socketId));
+      handler->setSendWindowUpdates(sendWindowUpdates);
+      handler->setReadsPaused(readsPaused);
+      destinationHandlers[socketId] = handler;
       pfdresponse.set_socketid(socketId);
     }
   }
   return pfdresponse;
 }
 
+PortForwardDestinationResponse PortForwardHandler::startConnect(
+    const PortForwardDestinationRequest& pfdr) {
+  PortForwardDestinationResponse pfdresponse;
+  pfdresponse.set_clientfd(pfdr.fd());
+  int socketId = pfdr.socketid();
+  if (destinationHandlers.count(socketId) ||
+      datagramDestinations.count(socketId) ||
+      pendingDestinations.count(socketId)) {
+    pfdresponse.set_error("Socket id is already in use");
+    return pfdresponse;
+  }
+  if (!connectPool) {
+    connectPool.reset(new ThreadPool(CONNECT_THREADS));
+  }
+  auto socketHandler = networkSocketHandler;
+  auto destination = pfdr.destination();
+  bool hosts = connectHosts;
+  // The result is set before the callback runs, so the update() it wakes
+  // up finds it
+  auto result = make_shared<std::promise<int>>();
+  PendingDestination pending;
+  pending.fd = result->get_future();
+  pending.destination = destination;
+  pending.confirm = pfdr.confirm();
+  connectPool->enqueue([this, result, socketHandler, destination, hosts]() {
+    result->set_value(connectsStopping
+                          ? -1
+                          : connectToPort(socketHandler, destination, hosts));
+    lock_guard<std::mutex> guard(connectCallbackMutex);
+    if (connectCallback) {
+      connectCallback();
+    }
+  });
+  VLOG(1) << "Connecting socket " << socketId << " to " << destination;
+  pendingDestinations[socketId] = std::move(pending);
+  pfdresponse.set_socketid(socketId);
+  return pfdresponse;
+}
+
+bool PortForwardHandler::handlePendingData(int socketId,
+                                           const PortForwardData& pwd) {
+  auto it = pendingDestinations.find(socketId);
+  if (it == pendingDestinations.end()) {
+    return false;
+  }
+  auto& pending = it->second;
+  if (pwd.has_error()) {
+    LOG(INFO) << "Port forward socket errored while connecting: " << socketId;
+    abandonedConnects.push_back(std::move(pending.fd));
+    pendingDestinations.erase(it);
+  } else if (pwd.has_closed()) {
+    // What came before the close still goes out once connected
+    pending.finished = true;
+  } else if (pwd.has_consumed()) {
+    pending.consumed = pwd.consumed();
+  } else {
+    pending.data.push_back(pwd.buffer());
+  }
+  return true;
+}
+
+bool PortForwardHandler::handleSocksReply(int socketId,
+                                          const PortForwardData& pwd) {
+  auto it = socketIdSocksHandlerMap.find(socketId);
+  if (it == socketIdSocksHandlerMap.end()) {
+    if (pwd.connected()) {
+      LOG(WARNING) << "Got a connect for a socket that is not waiting: "
+                   << socketId;
+      return true;
+    }
+    return false;
+  }
+  if (!pwd.connected() && !pwd.has_error() && !pwd.has_closed()) {
+    return false;
+  }
+  auto handler = it->second;
+  socketIdSocksHandlerMap.erase(it);
+  if (pwd.connected()) {
+    handler->connected(socketId);
+    socketIdSourceHandlerMap[socketId] = handler;
+  } else {
+    LOG(INFO) << "SOCKS connect " << socketId << " failed: " << pwd.error();
+    handler->refuse(socketId);
+    socketIds.release(socketId);
+  }
+  return true;
+}
+
+PortForwardDestinationResponse PortForwardHandler::createDatagramDestination(
+    const PortForwardDestinationRequest& pfdr) {
+  PortForwardDestinationResponse pfdresponse;
+  int socketId = pfdr.socketid();
+  if (!pfdr.has_socketid() || !pfdr.destination().has_port()) {
+    pfdresponse.set_error("Udp flows need a socket id and a port");
+    return pfdresponse;
+  }
+  if (destinationHandlers.count(socketId) ||
+      datagramDestinations.count(socketId) ||
+      pendingDestinations.count(socketId)) {
+    pfdresponse.set_error("Socket id is already in use");
+    return pfdresponse;
+  }
+  SocketEndpoint destination;
+  if (connectHosts && !pfdr.destination().name().empty()) {
+    destination = pfdr.destination();
+  } else {
+    // Connecting a UDP socket never fails for want of a listener, so there
+    // is no falling back from ipv6 like for tcp
+    destination.set_name("127.0.0.1");
+    destination.set_port(pfdr.destination().port());
+  }
+  int fd = DatagramSocket::connect(destination);
+  if (fd == -1) {
+    pfdresponse.set_error(strerror(GetErrno()));
+    return pfdresponse;
+  }
+  LOG(INFO) << "Created udp flow/fd pair: " << socketId << ' ' << fd;
+  auto handler = shared_ptr<DatagramDestinationHandler>(
+      new DatagramDestinationHandler(fd, socketId));
+  handler->setReadsPaused(readsPaused);
+  datagramDestinations[socketId] = handler;
+  pfdresponse.set_socketid(socketId);
+  return pfdresponse;
+}
+
 void PortForwardHandler::handlePacket(const Packet& packet,
                                       shared_ptr<Connection> connection) {
+  vector<Packet> replies;
+  handlePacket(packet, &replies);
+  for (auto& reply : replies) {
+    connection->writePacket(reply);
+  }
+}
+
+void PortForwardHandler::handlePacket(const Packet& packet,
+                                      vector<Packet>* replies) {
   switch (TerminalPacketType(packet.getHeader())) {
     case TerminalPacketType::PORT_FORWARD_DATA: {
       PortForwardData pwd = stringToProto<PortForwardData>(packet.getPayload());
-      if (pwd.sourcetodestination()) {
+      if (pwd.sourcetodestination()
+              ? handlePendingData(pwd.socketid(), pwd)
+              : handleSocksReply(pwd.socketid(), pwd)) {
+        break;
+      }
+      if (pwd.has_consumed()) {
+        // Window updates travel like data.  One for a socket that has
+        // already closed is expected and dropped.
+        VLOG(1) << "Got window update for socket " << pwd.socketid() << ": "
+                << pwd.consumed();
+        if (pwd.sourcetodestination()) {
+          auto it = destinationHandlers.find(pwd.socketid());
+          if (it != destinationHandlers.end()) {
+            it->second->windowUpdate(pwd.consumed());
+          }
+        } else {
+          auto it = socketIdSourceHandlerMap.find(pwd.socketid());
+          if (it != socketIdSourceHandlerMap.end()) {
+            it->second->windowUpdate(pwd.socketid(), pwd.consumed());
+          }
+        }
+      } else if (pwd.sourcetodestination()) {
         VLOG(1) << "Got data for destination socket: " << pwd.socketid();
+        auto datagramIt = datagramDestinations.find(pwd.socketid());
         auto it = destinationHandlers.find(pwd.socketid());
-        if (it == destinationHandlers.end()) {
+        if (datagramIt != datagramDestinations.end()) {
+          if (pwd.has_closed() || pwd.has_error()) {
+            LOG(INFO) << "Udp flow closed: " << pwd.socketid();
+            datagramIt->second->close();
+            datagramDestinations.erase(datagramIt);
+          } else {
+            datagramIt->second->write(pwd.buffer());
+          }
+        } else if (it == destinationHandlers.end()) {
           LOG(WARNING) << "Got data for a socket id that has already closed: "
                        << pwd.socketid();
         } else {
           if (pwd.has_closed()) {
             LOG(INFO) << "Port forward socket closed: " << pwd.socketid();
-            it->second->close();
-            destinationHandlers.erase(it);
+            // Whatever came before the close still goes out first
+            it->second->finish();
+            if (it->second->getFd() == -1) {
+              eraseDestination(it->first);
+            }
           } else if (pwd.has_error()) {
             // TODO: Probably need to do something better here
             LOG(INFO) << "Port forward socket errored: " << pwd.socketid();
             it->second->close();
-            destinationHandlers.erase(it);
+            eraseDestination(it->first);
           } else {
             it->second->write(pwd.buffer());
           }
@@ -181,16 +646,73 @@ void PortForwardHandler::handlePacket(const Packet& packet,
       }
       break;
     }
+    case TerminalPacketType::PORT_FORWARD_DATA_RAW: {
+      // Only data travels raw; closes and errors come as PORT_FORWARD_DATA.
+      const string payload = packet.getPayload();
+      bool sourceToDestination;
+      int socketId;
+      TerminalPackets::parseRawPortForwardData(payload, &sourceToDestination,
+                                               &socketId);
+      string data =
+          payload.substr(TerminalPackets::RAW_PORT_FORWARD_HEADER_LENGTH);
+      if (sourceToDestination) {
+        VLOG(1) << "Got data for destination socket: " << socketId;
+        auto pendingIt = pendingDestinations.find(socketId);
+        if (pendingIt != pendingDestinations.end()) {
+          pendingIt->second.data.push_back(data);
+          break;
+        }
+        auto datagramIt = datagramDestinations.find(socketId);
+        auto it = destinationHandlers.find(socketId);
+        if (datagramIt != datagramDestinations.end()) {
+          datagramIt->second->write(data);
+        } else if (it == destinationHandlers.end()) {
+          LOG(WARNING) << "Got data for a socket id that has already closed: "
+                       << socketId;
+        } else {
+          it->second->write(data);
+        }
+      } else {
+        VLOG(1) << "Got data for source socket: " << socketId;
+        sendDataToSourceOnSocket(socketId, data);
+      }
+      break;
+    }
     case TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST: {
       PortForwardDestinationRequest pfdr =
           stringToProto<PortForwardDestinationRequest>(packet.getPayload());
       LOG(INFO) << "Got new port destination request for "
                 << pfdr.destination();
       PortForwardDestinationResponse pfdresponse = createDestination(pfdr);
-      Packet sendPacket(
-          uint8_t(TerminalPacketType::PORT_FORWARD_DESTINATION_RESPONSE),
-          protoToString(pfdresponse));
-      connection->writePacket(sendPacket);
+      if (pfdr.has_socketid()) {
+        // The source did not wait for an answer, so only a failure gets
+        // one, or a connect it asked to hear about
+        if (pfdr.confirm() && !pfdresponse.has_error() &&
+            !pendingDestinations.count(pfdr.socketid())) {
+          PortForwardData pwd;
+          pwd.set_socketid(pfdr.socketid());
+          pwd.set_sourcetodestination(false);
+          pwd.set_connected(true);
+          replies->push_back(
+              Packet(uint8_t(TerminalPacketType::PORT_FORWARD_DATA),
+                     protoToString(pwd)));
+        }
+        if (pfdresponse.has_error()) {
+          LOG(INFO) << "Could not open tunnel socket " << pfdr.socketid()
+                    << ": " << pfdresponse.error();
+          PortForwardData pwd;
+          pwd.set_socketid(pfdr.socketid());
+          pwd.set_sourcetodestination(false);
+          pwd.set_error(pfdresponse.error());
+          replies->push_back(
+              Packet(uint8_t(TerminalPacketType::PORT_FORWARD_DATA),
+                     protoToString(pwd)));
+        }
+        break;
+      }
+      replies->push_back(
+          Packet(uint8_t(TerminalPacketType::PORT_FORWARD_DESTINATION_RESPONSE),
+                 protoToString(pfdresponse)));
       break;
     }
     case TerminalPacketType::PORT_FORWARD_DESTINATION_RESPONSE: {
@@ -214,11 +736,11 @@ void PortForwardHandler::handlePacket(const Packet& packet,
 }
 
 void PortForwardHandler::closeSourceFd(int fd) {
-  for (auto& it : sourceHandlers) {
-    if (it->hasUnassignedFd(fd)) {
-      it->closeUnassignedFd(fd);
-      return;
-    }
+  auto it = unassignedFdSourceHandlerMap.find(fd);
+  if (it != unassignedFdSourceHandlerMap.end()) {
+    it->second->closeUnassignedFd(fd);
+    unassignedFdSourceHandlerMap.erase(it);
+    return;
   }
   STERROR << "Tried to close an unassigned socket that didn't exist (maybe "
              "it was already removed?): "
@@ -226,12 +748,12 @@ void PortForwardHandler::closeSourceFd(int fd) {
 }
 
 void PortForwardHandler::addSourceSocketId(int socketId, int sourceFd) {
-  for (auto& it : sourceHandlers) {
-    if (it->hasUnassignedFd(sourceFd)) {
-      it->addSocket(socketId, sourceFd);
-      socketIdSourceHandlerMap[socketId] = it;
-      return;
-    }
+  auto it = unassignedFdSourceHandlerMap.find(sourceFd);
+  if (it != unassignedFdSourceHandlerMap.end()) {
+    it->second->addSocket(socketId, sourceFd);
+    socketIdSourceHandlerMap[socketId] = it->second;
+    unassignedFdSourceHandlerMap.erase(it);
+    return;
   }
   STERROR << "Tried to add a socketId but the corresponding sourceFd is "
              "already dead: "
@@ -239,13 +761,42 @@ void PortForwardHandler::addSourceSocketId(int socketId, int sourceFd) {
 }
 
 void PortForwardHandler::closeSourceSocketId(int socketId) {
+  auto datagramIt = socketIdDatagramSourceMap.find(socketId);
+  if (datagramIt != socketIdDatagramSourceMap.end()) {
+    datagramIt->second->closeFlow(socketId);
+    socketIdDatagramSourceMap.erase(datagramIt);
+    socketIds.release(socketId);
+    return;
+  }
   auto it = socketIdSourceHandlerMap.find(socketId);
   if (it == socketIdSourceHandlerMap.end()) {
-    STERROR << "Tried to close a socket id that doesn't exist";
+    // Both ends may close at once
+    LOG(INFO) << "Tried to close a socket id that is already closed: "
+              << socketId;
     return;
   }
   it->second->closeSocket(socketId);
-  socketIdSourceHandlerMap.erase(socketId);
+  eraseSourceSocketId(socketId);
+}
+
+void PortForwardHandler::eraseSourceSocketId(int socketId) {
+  if (socketIdSourceHandlerMap.erase(socketId) && openEarly) {
+    socketIds.release(socketId);
+  }
+}
+
+void PortForwardHandler::eraseDestination(int socketId) {
+  // Ids the source picked are the source's to free
+  if (destinationHandlers.erase(socketId) &&
+      allocatedDestinationIds.erase(socketId)) {
+    socketIds.release(socketId);
+  }
+}
+
+void PortForwardHandler::getListenFds(set<int>* fds) {
+  for (auto& it : listenFdSourceHandlerMap) {
+    fds->insert(it.first);
+  }
 }
 
 void PortForwardHandler::getForwardFds(set<int>* fds) {
@@ -254,18 +805,51 @@ void PortForwardHandler::getForwardFds(set<int>* fds) {
   }
   for (auto& it : destinationHandlers) {
     int fd = it.second->getFd();
-    if (fd >= 0) {
+    if (fd >= 0 && it.second->canRead()) {
       fds->insert(fd);
     }
   }
+  for (auto& handler : datagramSourceHandlers) {
+    handler->getActiveFds(fds);
+  }
+  for (auto& it : datagramDestinations) {
+    if (it.second->canRead()) {
+      fds->insert(it.second->getFd());
+    }
+  }
+}
+
+void PortForwardHandler::getForwardWriteFds(set<int>* fds) {
+  for (auto& handler : sourceHandlers) {
+    handler->getQueuedFds(fds);
+  }
+  for (auto& it : destinationHandlers) {
+    if (it.second->getFd() >= 0 && it.second->hasQueuedData()) {
+      fds->insert(it.second->getFd());
+    }
+  }
+  for (auto& handler : datagramSourceHandlers) {
+    handler->getQueuedFds(fds);
+  }
+  for (auto& it : datagramDestinations) {
+    if (it.second->hasQueuedData()) {
+      fds->insert(it.second->getFd());
+    }
+  }
 }
 
 void PortForwardHandler::sendDataToSourceOnSocket(int socketId,
                                                   const string& data) {
+  auto datagramIt = socketIdDatagramSourceMap.find(socketId);
+  if (datagramIt != socketIdDatagramSourceMap.end()) {
+    datagramIt->second->sendDatagram(socketId, data);
+    return;
+  }
   auto it = socketIdSourceHandlerMap.find(socketId);
   if (it == socketIdSourceHandlerMap.end()) {
-    STERROR << "Tried to send data on a socket id that doesn't exist: "
-            << socketId;
+    // The socket closed while the peer was still sending
+    LOG(INFO) << "Tried to send data on a socket id that is already closed: "
+              << socketId;
     return;
   }
   it->second->sendDataOnSocket(socketId, data);
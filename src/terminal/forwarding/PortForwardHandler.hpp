@@ -2,32 +2,78 @@
 #define __PORT_FORWARD_HANDLER_H__
 
 #include "Connection.hpp"
+#include "DatagramDestinationHandler.hpp"
+#include "DatagramSourceHandler.hpp"
 #include "ETerminal.pb.h"
 #include "ForwardDestinationHandler.hpp"
 #include "ForwardSourceHandler.hpp"
 #include "SocketHandler.hpp"
+#include "SocketIdAllocator.hpp"
+#include "SocksSourceHandler.hpp"
 
 namespace et {
 /**
  * @brief Coordinates port forwarding requests, source/destination sockets, and
  * data flow.
+ *
+ * Tunnel listeners stay open for the whole session, so the session loop
+ * watches them once (`getListenFds()`) and calls `accept()` only when one
+ * is readable.  Sockets are found by fd and by socket id through hash maps,
+ * so a range of thousands of forwarded ports costs nothing while idle.
+ *
+ * Opening a tunnel used to wait a round trip: the peer connected to the
+ * destination and picked the socket id before any data moved.  With
+ * `setOpenEarly()` the side that accepts picks the id and sends data right
+ * behind the request, within one window.  A destination that cannot
+ * connect reports it with an error for that id, as if the socket failed.
+ *
+ * UDP tunnels (`udp` in PortForwardSourceRequest) always open this way:
+ * every peer of the source endpoint is a flow with its own socket id, and
+ * each datagram is one PortForwardData.
+ *
+ * Destinations that come with a socket id connect on a pool of threads, so
+ * a slow or unreachable host never holds up the tunnels already open.
+ * Data for the id waits until the connect finishes, and `update()` stages
+ * the outcome.  Dynamic tunnels (`dynamic` in PortForwardSourceRequest)
+ * are SOCKS5 listeners whose clients name the host to connect to, which
+ * only a peer that sets `setConnectHosts()` honors.
  */
 class PortForwardHandler {
  public:
   /** @brief Constructs forwarding helpers for network and router sockets. */
   explicit PortForwardHandler(shared_ptr<SocketHandler> _networkSocketHandler,
                               shared_ptr<SocketHandler> _pipeSocketHandler);
-  /** @brief Polls all handlers for new destination/data and sends
-   * `PortForwardData`. */
+  /** @brief Waits for running connects and closes what they opened. */
+  ~PortForwardHandler();
+  /**
+   * @brief Polls all tunnel sockets and stages `PortForwardData`.  A
+   * datagram from a new peer of a UDP tunnel stages a destination request
+   * for its flow, which has to reach the peer before the data, and so
+   * does a SOCKS client that finished its handshake.  Also stages the
+   * outcome of finished destination connects.
+   */
   void update(vector<PortForwardDestinationRequest>* requests,
               vector<PortForwardData>* dataToSend);
+  /**
+   * @brief Accepts the connections waiting on @p fd, if it is a tunnel
+   * listener, and stages a destination request for each.  Sockets opened
+   * early are read from the next `update()` on.
+   */
+  void accept(int fd, vector<PortForwardDestinationRequest>* requests);
   /** @brief Handles control packets arriving over the SSH connection. */
   void handlePacket(const Packet& packet, shared_ptr<Connection> connection);
+  /** @brief Handles a tunnel packet and stages the packets it answers
+   * with. */
+  void handlePacket(const Packet& packet, vector<Packet>* replies);
   PortForwardSourceResponse createSource(const PortForwardSourceRequest& pfsr,
                                          string* sourceName, uid_t userid,
                                          gid_t groupid);
-  /** @brief Creates a remote destination handler that forwards data to a user's
-   * socket. */
+  /**
+   * @brief Creates a remote destination handler that forwards data to a
+   * user's socket.  A TCP destination with a socket id connects in the
+   * background: the response only says the connect started, and a failure
+   * comes from `update()` as an error for the id.
+   */
   PortForwardDestinationResponse createDestination(
       const PortForwardDestinationRequest& pfdr);
 
@@ -41,13 +87,58 @@ class PortForwardHandler {
   /** @brief Sends data back to the listener that originally accepted the source
    * socket. */
   void sendDataToSourceOnSocket(int socketId, const string& data);
+  /** @brief Adds the fds of the tunnel listeners. */
+  void getListenFds(set<int>* fds);
+  /** @brief Adds the tunnel fds worth reading, other than listeners. */
   void getForwardFds(set<int>* fds);
+  /** @brief Adds the tunnel fds with data waiting to be written. */
+  void getForwardWriteFds(set<int>* fds);
+  /**
+   * @brief Sends window updates for every tunnel, once the peer has said it
+   * understands them (`tunnelwindows` in InitialPayload/InitialResponse).
+   */
+  void setSendWindowUpdates(bool enabled);
+  /**
+   * @brief Pauses or resumes reading every tunnel, for while the data
+   * already read waits for room on the connection.
+   */
+  void setReadsPaused(bool paused);
+  /**
+   * @brief Opens tunnels without waiting for the destination, once the
+   * peer has said it takes our socket ids (`tunnelearlydata` in
+   * InitialPayload/InitialResponse).  Set before any tunnel opens: it also
+   * means the peer picks the ids of the sockets it asks us to connect.
+   */
+  void setOpenEarly(bool enabled);
+  /** @brief Whether a UDP flow is open, and so may expire without any
+   * socket becoming ready. */
+  bool hasDatagramFlows() const;
+  /**
+   * @brief Connects TCP destinations to the host they name rather than to
+   * localhost (`tunnelhosts` in InitialResponse).  Only the server does:
+   * the client connects just the ports it forwarded back to itself.
+   */
+  void setConnectHosts(bool enabled);
+  /**
+   * @brief Sets what is called, from a connect thread, when a destination
+   * connect finishes, so the thread waiting on the tunnels can wake up and
+   * call `update()`.  Pass an empty function to clear it.
+   */
+  void setConnectCallback(std::function<void()> callback);
 
  protected:
   /** @brief Handler used for the SSH/network-facing sockets. */
   shared_ptr<SocketHandler> networkSocketHandler;
   /** @brief Handler used for the router/pipe-facing sockets. */
   shared_ptr<SocketHandler> pipeSocketHandler;
+  /** @brief Whether tunnels send window updates. */
+  bool sendWindowUpdates;
+  /** @brief Whether reading tunnels is paused. */
+  bool readsPaused;
+  /** @brief Whether sockets accepted here get their ids here. */
+  bool openEarly;
+  /** @brief Whether destinations may name a host other than localhost. */
+  bool connectHosts;
   /** @brief Active destination handlers keyed by socket id. */
   unordered_map<int, shared_ptr<ForwardDestinationHandler>> destinationHandlers;
 
@@ -56,6 +147,91 @@ class PortForwardHandler {
   /** @brief Maps control socket IDs to their source handlers for routing data.
    */
   unordered_map<int, shared_ptr<ForwardSourceHandler>> socketIdSourceHandlerMap;
+  /** @brief Maps listener fds to their source handlers. */
+  unordered_map<int, shared_ptr<ForwardSourceHandler>> listenFdSourceHandlerMap;
+  /** @brief Handlers for the UDP tunnel sources. */
+  vector<shared_ptr<DatagramSourceHandler>> datagramSourceHandlers;
+  /** @brief Maps the ids of open UDP flows to their source handlers. */
+  unordered_map<int, shared_ptr<DatagramSourceHandler>>
+      socketIdDatagramSourceMap;
+  /** @brief UDP flows to destinations, keyed by socket id. */
+  unordered_map<int, shared_ptr<DatagramDestinationHandler>>
+      datagramDestinations;
+  /** @brief Maps the listener fds of dynamic tunnels to their handlers. */
+  unordered_map<int, shared_ptr<SocksSourceHandler>> listenFdSocksHandlerMap;
+  /** @brief Handlers for the dynamic tunnels. */
+  vector<shared_ptr<SocksSourceHandler>> socksSourceHandlers;
+  /** @brief Maps the ids of SOCKS connects waiting for the peer to their
+   * handlers. */
+  unordered_map<int, shared_ptr<SocksSourceHandler>> socketIdSocksHandlerMap;
+  /** @brief Maps accepted fds waiting for a socket id to their handlers. */
+  unordered_map<int, shared_ptr<ForwardSourceHandler>>
+      unassignedFdSourceHandlerMap;
+  /**
+   * @brief Socket ids this side picks: for destination handlers, or for
+   * source sockets and UDP flows when opening early.
+   */
+  SocketIdAllocator socketIds;
+  /** @brief Ids of destination handlers that came from `socketIds`. */
+  unordered_set<int> allocatedDestinationIds;
+
+  /** @brief A destination still connecting, and what came for it. */
+  struct PendingDestination {
+    /** @brief The connected fd, or -1 if the connect failed. */
+    std::future<int> fd;
+    /** @brief Host and port, for the error. */
+    SocketEndpoint destination;
+    /** @brief Whether the source wants to hear it connected. */
+    bool confirm = false;
+    /** @brief Data from the source, written once connected. */
+    vector<string> data;
+    /** @brief Last window update from the source, or -1. */
+    int64_t consumed = -1;
+    /** @brief Whether the source closed after `data`. */
+    bool finished = false;
+  };
+  /** @brief Destinations still connecting, by socket id. */
+  unordered_map<int, PendingDestination> pendingDestinations;
+  /** @brief Connects whose tunnel went away first; what they open is
+   * closed as they finish. */
+  vector<std::future<int>> abandonedConnects;
+  /** @brief Runs destination connects.  Started with the first one. */
+  unique_ptr<ThreadPool> connectPool;
+  /** @brief Set on destruction, so queued connects are skipped. */
+  std::atomic<bool> connectsStopping;
+  std::mutex connectCallbackMutex;
+  /** @brief See `setConnectCallback()`. */
+  std::function<void()> connectCallback;
+
+  /** @brief Adds a source handler and indexes its listeners. */
+  void addSourceHandler(shared_ptr<ForwardSourceHandler> handler);
+  /** @brief Creates a UDP tunnel source. */
+  PortForwardSourceResponse createDatagramSource(
+      const PortForwardSourceRequest& pfsr);
+  /** @brief Opens a UDP flow to its destination. */
+  PortForwardDestinationResponse createDatagramDestination(
+      const PortForwardDestinationRequest& pfdr);
+  /** @brief Creates a SOCKS5 listener for a dynamic tunnel. */
+  PortForwardSourceResponse createSocksSource(
+      const PortForwardSourceRequest& pfsr);
+  /** @brief Starts connecting a TCP destination the source picked the id
+   * of. */
+  PortForwardDestinationResponse startConnect(
+      const PortForwardDestinationRequest& pfdr);
+  /** @brief Opens the destinations whose connects finished and stages
+   * their outcome. */
+  void updatePendingDestinations(vector<PortForwardData>* dataToSend);
+  /** @brief Routes data for a destination still connecting.
+   * @return false if `socketId` is not connecting. */
+  bool handlePendingData(int socketId, const PortForwardData& pwd);
+  /** @brief Hands the outcome of a SOCKS connect to its client.
+   * @return false if `socketId` is not a SOCKS connect. */
+  bool handleSocksReply(int socketId, const PortForwardData& pwd);
+  /** @brief Drops a destination handler and frees its id if we picked it. */
+  void eraseDestination(int socketId);
+  /** @brief Forgets a closed source socket and frees its id if we picked
+   * it. */
+  void eraseSourceSocketId(int socketId);
 };
 }  // namespace et
 
@@ -0,0 +1,37 @@
+#include "SocketIdAllocator.hpp"
+
+namespace et {
+namespace {
+/** @brief Generation bits that fit in an id without making it negative. */
+const int GENERATION_MASK = 0x7FFF;
+}  // namespace
+
+int SocketIdAllocator::allocate() {
+  int slot;
+  if (!freeSlots.empty()) {
+    slot = freeSlots.front();
+    freeSlots.pop_front();
+  } else if (generations.size() < size_t(MAX_SLOTS)) {
+    slot = int(generations.size());
+    generations.push_back(0);
+  } else {
+    return -1;
+  }
+  generations[slot]++;
+  return ((generations[slot] & GENERATION_MASK) << SLOT_BITS) | slot;
+}
+
+void SocketIdAllocator::release(int id) {
+  if (id < 0) {
+    return;
+  }
+  int slot = id & (MAX_SLOTS - 1);
+  if (size_t(slot) >= generations.size() || generations[slot] % 2 == 0 ||
+      (generations[slot] & GENERATION_MASK) != (id >> SLOT_BITS)) {
+    LOG(WARNING) << "Tried to release a socket id that is not in use: " << id;
+    return;
+  }
+  generations[slot]++;
+  freeSlots.push_back(slot);
+}
+}  // namespace et
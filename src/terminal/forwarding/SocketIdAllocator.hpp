@@ -0,0 +1,36 @@
+#ifndef __FORWARD_SOCKET_ID_ALLOCATOR_H__
+#define __FORWARD_SOCKET_ID_ALLOCATOR_H__
+
+#include "Headers.hpp"
+
+namespace et {
+/**
+ * @brief Hands out tunnel socket ids from a dense table of slots.
+ *
+ * An id is a slot index in the low `SLOT_BITS` bits and the slot's
+ * generation above them.  Freed slots are reused oldest first and their
+ * generation moves on, so a packet the peer sent for a socket that has
+ * since closed does not reach the next socket in the same slot.
+ */
+class SocketIdAllocator {
+ public:
+  /** @brief Bits of an id that hold the slot index. */
+  static const int SLOT_BITS = 16;
+  /** @brief Most ids in use at once. */
+  static const int MAX_SLOTS = 1 << SLOT_BITS;
+
+  /** @brief Returns an unused id, or -1 if every slot is taken. */
+  int allocate();
+
+  /** @brief Frees @p id.  Ids that are not in use are ignored. */
+  void release(int id);
+
+ protected:
+  /** @brief Generation of each slot, odd while the slot is in use. */
+  vector<uint16_t> generations;
+  /** @brief Freed slots, oldest first. */
+  std::deque<int> freeSlots;
+};
+}  // namespace et
+
+#endif  // __FORWARD_SOCKET_ID_ALLOCATOR_H__
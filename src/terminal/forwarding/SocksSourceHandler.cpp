@@ -0,0 +1,234 @@
+#include "SocksSourceHandler.hpp"
+
+namespace et {
+namespace {
+const uint8_t SOCKS_VERSION = 5;
+const uint8_t METHOD_NO_AUTHENTICATION = 0;
+const uint8_t METHOD_NONE_ACCEPTABLE = 0xFF;
+const uint8_t COMMAND_CONNECT = 1;
+const uint8_t ADDRESS_IPV4 = 1;
+const uint8_t ADDRESS_DOMAIN = 3;
+const uint8_t ADDRESS_IPV6 = 4;
+const uint8_t REPLY_SUCCEEDED = 0;
+const uint8_t REPLY_FAILURE = 1;
+const uint8_t REPLY_COMMAND_NOT_SUPPORTED = 7;
+const uint8_t REPLY_ADDRESS_NOT_SUPPORTED = 8;
+}  // namespace
+
+SocksSourceHandler::SocksSourceHandler(shared_ptr<SocketHandler> _socketHandler,
+                                       const SocketEndpoint& _source)
+    : ForwardSourceHandler(_socketHandler, _source, SocketEndpoint()) {}
+
+void SocksSourceHandler::handshake(
+    SocketIdAllocator* socketIds,
+    vector<PortForwardDestinationRequest>* requests,
+    vector<PortForwardData>* data) {
+  for (int socketId : connectedIds) {
+    auto it = earlyData.find(socketId);
+    if (it == earlyData.end()) {
+      continue;
+    }
+    if (!it->second.empty() && socketFdMap.count(socketId)) {
+      PortForwardData pwd;
+      pwd.set_socketid(socketId);
+      pwd.set_sourcetodestination(true);
+      pwd.set_buffer(it->second);
+      data->push_back(pwd);
+    }
+    earlyData.erase(it);
+  }
+  connectedIds.clear();
+
+  // Sockets waiting for the peer are not read until it answers
+  unordered_set<int> waiting;
+  for (auto& it : connectingFds) {
+    waiting.insert(it.second);
+  }
+  // parse() may close sockets, so walk a copy
+  vector<int> fds(unassignedFds.begin(), unassignedFds.end());
+  for (int fd : fds) {
+    if (waiting.count(fd)) {
+      continue;
+    }
+    char buf[HANDSHAKE_BYTES];
+    ssize_t bytesRead = socketHandler->read(
+        fd, buf, HANDSHAKE_BYTES - handshakes[fd].buffer.length());
+    if (bytesRead < 0 && GetErrno() == EAGAIN) {
+      continue;
+    }
+    if (bytesRead <= 0) {
+      VLOG(1) << "SOCKS client " << fd << " left during the handshake";
+      fail(fd);
+      continue;
+    }
+    handshakes[fd].buffer.append(buf, bytesRead);
+    if (!parse(fd, socketIds, requests)) {
+      continue;
+    }
+    auto it = handshakes.find(fd);
+    if (it != handshakes.end() &&
+        it->second.buffer.length() >= size_t(HANDSHAKE_BYTES)) {
+      LOG(INFO) << "SOCKS handshake on " << fd << " is too long";
+      fail(fd);
+    }
+  }
+}
+
+bool SocksSourceHandler::parse(
+    int fd, SocketIdAllocator* socketIds,
+    vector<PortForwardDestinationRequest>* requests) {
+  auto& state = handshakes[fd];
+  const string& buffer = state.buffer;
+  if (!state.greeted) {
+    // VER NMETHODS METHODS...
+    if (buffer.length() < 2) {
+      return true;
+    }
+    size_t methods = uint8_t(buffer[1]);
+    if (uint8_t(buffer[0]) != SOCKS_VERSION) {
+      LOG(INFO) << "Not a SOCKS5 client on " << fd;
+      fail(fd);
+      return false;
+    }
+    if (buffer.length() < 2 + methods) {
+      return true;
+    }
+    if (buffer.find(char(METHOD_NO_AUTHENTICATION), 2) >= 2 + methods) {
+      LOG(INFO) << "SOCKS client on " << fd << " wants authentication";
+      reply(fd, string({char(SOCKS_VERSION), char(METHOD_NONE_ACCEPTABLE)}));
+      fail(fd);
+      return false;
+    }
+    reply(fd, string({char(SOCKS_VERSION), char(METHOD_NO_AUTHENTICATION)}));
+    state.buffer.erase(0, 2 + methods);
+    state.greeted = true;
+  }
+
+  // VER CMD RSV ATYP DST.ADDR DST.PORT
+  if (buffer.length() < 5) {
+    return true;
+  }
+  uint8_t command = buffer[1];
+  uint8_t addressType = buffer[3];
+  size_t addressOffset = 4;
+  size_t addressLength;
+  if (addressType == ADDRESS_IPV4) {
+    addressLength = 4;
+  } else if (addressType == ADDRESS_IPV6) {
+    addressLength = 16;
+  } else if (addressType == ADDRESS_DOMAIN) {
+    addressOffset = 5;
+    addressLength = uint8_t(buffer[4]);
+  } else {
+    replyToConnect(fd, REPLY_ADDRESS_NOT_SUPPORTED);
+    fail(fd);
+    return false;
+  }
+  size_t length = addressOffset + addressLength + 2;
+  if (buffer.length() < length) {
+    return true;
+  }
+  if (uint8_t(buffer[0]) != SOCKS_VERSION || command != COMMAND_CONNECT) {
+    replyToConnect(fd, REPLY_COMMAND_NOT_SUPPORTED);
+    fail(fd);
+    return false;
+  }
+
+  string host;
+  const char* address = buffer.data() + addressOffset;
+  if (addressType == ADDRESS_DOMAIN) {
+    host.assign(address, addressLength);
+  } else {
+    char name[INET6_ADDRSTRLEN];
+    int family = addressType == ADDRESS_IPV4 ? AF_INET : AF_INET6;
+    if (inet_ntop(family, address, name, sizeof(name)) == NULL) {
+      replyToConnect(fd, REPLY_ADDRESS_NOT_SUPPORTED);
+      fail(fd);
+      return false;
+    }
+    host = name;
+  }
+  int port = (uint8_t(buffer[length - 2]) << 8) | uint8_t(buffer[length - 1]);
+
+  int socketId = socketIds->allocate();
+  if (socketId < 0) {
+    LOG(WARNING) << "Could not find empty socket id for SOCKS client " << fd;
+    replyToConnect(fd, REPLY_FAILURE);
+    fail(fd);
+    return false;
+  }
+  LOG(INFO) << "SOCKS client " << fd << " connects to " << host << ":"
+            << port << " as socket " << socketId;
+  PortForwardDestinationRequest pfr;
+  pfr.mutable_destination()->set_name(host);
+  pfr.mutable_destination()->set_port(port);
+  pfr.set_fd(fd);
+  pfr.set_socketid(socketId);
+  pfr.set_confirm(true);
+  requests->push_back(pfr);
+  connectingFds[socketId] = fd;
+  earlyData[socketId] = buffer.substr(length);
+  handshakes.erase(fd);
+  return true;
+}
+
+bool SocksSourceHandler::isConnecting(int socketId) const {
+  return connectingFds.count(socketId) > 0;
+}
+
+void SocksSourceHandler::connected(int socketId) {
+  auto it = connectingFds.find(socketId);
+  if (it == connectingFds.end()) {
+    LOG(WARNING) << "Got a connect for a SOCKS socket that is not waiting: "
+                 << socketId;
+    return;
+  }
+  int fd = it->second;
+  connectingFds.erase(it);
+  replyToConnect(fd, REPLY_SUCCEEDED);
+  addSocket(socketId, fd);
+  // Like any socket opened early, data stops at the peer's first window
+  windowUpdate(socketId, 0);
+  connectedIds.push_back(socketId);
+}
+
+void SocksSourceHandler::refuse(int socketId) {
+  auto it = connectingFds.find(socketId);
+  if (it == connectingFds.end()) {
+    return;
+  }
+  int fd = it->second;
+  connectingFds.erase(it);
+  earlyData.erase(socketId);
+  replyToConnect(fd, REPLY_FAILURE);
+  closeUnassignedFd(fd);
+}
+
+void SocksSourceHandler::getActiveFds(set<int>* fds) {
+  ForwardSourceHandler::getActiveFds(fds);
+  for (auto& it : connectingFds) {
+    fds->erase(it.second);
+  }
+}
+
+void SocksSourceHandler::reply(int fd, const string& message) {
+  if (socketHandler->write(fd, message.data(), message.length()) !=
+      ssize_t(message.length())) {
+    LOG(INFO) << "Could not answer SOCKS client " << fd;
+  }
+}
+
+void SocksSourceHandler::replyToConnect(int fd, uint8_t status) {
+  // VER REP RSV ATYP BND.ADDR BND.PORT, with an unspecified ipv4 address
+  string message(10, '\0');
+  message[0] = char(SOCKS_VERSION);
+  message[1] = char(status);
+  message[3] = char(ADDRESS_IPV4);
+  reply(fd, message);
+}
+
+void SocksSourceHandler::fail(int fd) {
+  handshakes.erase(fd);
+  closeUnassignedFd(fd);
+}
+}  // namespace et
@@ -0,0 +1,85 @@
+#ifndef __SOCKS_SOURCE_HANDLER_H__
+#define __SOCKS_SOURCE_HANDLER_H__
+
+#include "ForwardSourceHandler.hpp"
+#include "SocketIdAllocator.hpp"
+
+namespace et {
+/**
+ * @brief Accepts SOCKS5 clients on a local endpoint, for dynamic tunnels
+ * (`dynamic` in PortForwardSourceRequest).
+ *
+ * An accepted socket first goes through the SOCKS5 handshake (RFC 1928,
+ * without authentication).  Its CONNECT becomes a destination request for
+ * the host and port it names, with `confirm` set, and the socket waits
+ * unread until the peer says the destination connected (`connected()`) or
+ * failed (`refuse()`).  From then on it is an ordinary tunnel socket.
+ *
+ * Only a peer that takes our socket ids and connects to named hosts can
+ * serve these, so the handler always picks the ids.
+ */
+class SocksSourceHandler : public ForwardSourceHandler {
+ public:
+  /** @brief Most bytes a handshake may hold before its CONNECT is read. */
+  static const int HANDSHAKE_BYTES = 1024;
+
+  SocksSourceHandler(shared_ptr<SocketHandler> _socketHandler,
+                     const SocketEndpoint& _source);
+
+  /**
+   * @brief Reads the handshakes of accepted sockets and answers them.  A
+   * complete CONNECT takes an id from @p socketIds and stages its request.
+   * Also stages what clients sent after their CONNECT, once connected.
+   */
+  void handshake(SocketIdAllocator* socketIds,
+                 vector<PortForwardDestinationRequest>* requests,
+                 vector<PortForwardData>* data);
+
+  /** @brief Whether `socketId` is a CONNECT waiting for the peer. */
+  bool isConnecting(int socketId) const;
+
+  /** @brief Tells the client of `socketId` it is connected and starts
+   * forwarding its socket. */
+  void connected(int socketId);
+
+  /** @brief Tells the client of `socketId` the connect failed and closes
+   * its socket. */
+  void refuse(int socketId);
+
+  /** @brief Leaves out the sockets waiting for the peer. */
+  void getActiveFds(set<int>* fds) override;
+
+ protected:
+  /** @brief An accepted socket still in its handshake. */
+  struct Handshake {
+    /** @brief Bytes read and not parsed yet. */
+    string buffer;
+    /** @brief Whether the method selection has been answered. */
+    bool greeted = false;
+  };
+
+  /** @brief Handshakes by fd. */
+  unordered_map<int, Handshake> handshakes;
+  /** @brief Fds of CONNECTs waiting for the peer, by socket id. */
+  unordered_map<int, int> connectingFds;
+  /** @brief What clients sent behind their CONNECT, by socket id. */
+  unordered_map<int, string> earlyData;
+  /** @brief Sockets connected since the last `handshake()`. */
+  vector<int> connectedIds;
+
+  /**
+   * @brief Parses what @p fd sent so far.
+   * @return false if the socket failed the handshake and was closed.
+   */
+  bool parse(int fd, SocketIdAllocator* socketIds,
+             vector<PortForwardDestinationRequest>* requests);
+  /** @brief Writes a short reply, which a new socket always takes. */
+  void reply(int fd, const string& message);
+  /** @brief Replies to a CONNECT with @p status. */
+  void replyToConnect(int fd, uint8_t status);
+  /** @brief Drops a socket that failed its handshake. */
+  void fail(int fd);
+};
+}  // namespace et
+
+#endif  // __SOCKS_SOURCE_HANDLER_H__
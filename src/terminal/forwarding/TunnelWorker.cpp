@@ -0,0 +1,279 @@
+#include "TunnelWorker.hpp"
+
+#include "TerminalPackets.hpp"
+
+namespace et {
+namespace {
+#ifdef WIN32
+/** @brief wake() does nothing on Windows, so idle passes poll instead. */
+const int IDLE_WAIT_MS = 10;
+#else
+const int IDLE_WAIT_MS = -1;
+#endif
+/** @brief Longest wait while UDP flows are open, so idle ones expire. */
+const int DATAGRAM_WAIT_MS = 1000;
+}  // namespace
+
+TunnelWorker::TunnelWorker(shared_ptr<PortForwardHandler> _handler,
+                           bool _rawPackets)
+    : handler(_handler),
+      rawPackets(_rawPackets),
+      eventLoop(new EventLoop()),
+      stopping(false),
+      readsPaused(false),
+      inbox(QUEUE_PACKETS),
+      inboxSignaled(false),
+      waitingForInbox(false),
+      outbox(QUEUE_PACKETS),
+      outboxSignaled(false),
+      waitingForRoom(false),
+      connectsFinished(false) {
+  notifyPipe[0] = notifyPipe[1] = -1;
+#ifndef WIN32
+  FATAL_FAIL(::pipe(notifyPipe));
+  for (int fd : notifyPipe) {
+    FATAL_FAIL(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+    FATAL_FAIL(fcntl(fd, F_SETFD, FD_CLOEXEC));
+  }
+#endif
+  // A finished destination connect waits for the next update()
+  handler->setConnectCallback([this]() {
+    connectsFinished = true;
+    eventLoop->wake();
+  });
+}
+
+TunnelWorker::~TunnelWorker() {
+  handler->setConnectCallback(std::function<void()>());
+  stop();
+#ifndef WIN32
+  ::close(notifyPipe[0]);
+  ::close(notifyPipe[1]);
+#endif
+}
+
+void TunnelWorker::start() {
+  workerThread.reset(new std::thread(&TunnelWorker::run, this));
+}
+
+void TunnelWorker::stop() {
+  if (!workerThread) {
+    return;
+  }
+  stopping = true;
+  eventLoop->wake();
+  workerThread->join();
+  workerThread.reset();
+}
+
+void TunnelWorker::post(const Packet& packet) {
+  if (backlog.empty() && inbox.push(packet)) {
+    if (!inboxSignaled.exchange(true)) {
+      eventLoop->wake();
+    }
+    return;
+  }
+  // Only a peer that ignores the tunnel windows gets this far ahead
+  if (backlog.empty()) {
+    LOG(INFO) << "Tunnel worker is behind, queueing for it";
+  }
+  backlog.push_back(packet);
+  flushBacklog();
+}
+
+void TunnelWorker::flushBacklog() {
+  bool pushed = false;
+  while (!backlog.empty() && inbox.push(backlog.front())) {
+    backlog.pop_front();
+    pushed = true;
+  }
+  if (!backlog.empty()) {
+    waitingForInbox = true;
+    // The worker may have emptied the queue before it saw the flag
+    while (!backlog.empty() && inbox.push(backlog.front())) {
+      backlog.pop_front();
+      pushed = true;
+    }
+  }
+  if (pushed && !inboxSignaled.exchange(true)) {
+    eventLoop->wake();
+  }
+}
+
+void TunnelWorker::take(vector<Frame>* frames) {
+#ifndef WIN32
+  char buf[64];
+  while (::read(notifyPipe[0], buf, sizeof(buf)) > 0) {
+  }
+#endif
+  // Cleared before popping, so a packet pushed after the last pop signals
+  // again
+  outboxSignaled = false;
+  Frame frame;
+  while (outbox.pop(&frame)) {
+    frames->push_back(std::move(frame));
+  }
+  if (waitingForRoom.exchange(false)) {
+    eventLoop->wake();
+  }
+  flushBacklog();
+}
+
+void TunnelWorker::setReadsPaused(bool paused) {
+  if (readsPaused.exchange(paused) && !paused) {
+    eventLoop->wake();
+  }
+}
+
+void TunnelWorker::notify() {
+  if (outboxSignaled.exchange(true)) {
+    return;
+  }
+#ifndef WIN32
+  char b = 0;
+  // A full pipe already has a wakeup pending, so the result is ignored.
+  ssize_t rc = ::write(notifyPipe[1], &b, 1);
+  (void)rc;
+#endif
+}
+
+void TunnelWorker::deliver(Frame&& frame) {
+  if (!overflow.empty() || !outbox.push(std::move(frame))) {
+    overflow.push_back(std::move(frame));
+  }
+  notify();
+}
+
+void TunnelWorker::flushOverflow() {
+  while (!overflow.empty() && outbox.push(std::move(overflow.front()))) {
+    overflow.pop_front();
+  }
+  if (overflow.empty()) {
+    return;
+  }
+  waitingForRoom = true;
+  // The session thread may have emptied the queue before it saw the flag
+  while (!overflow.empty() && outbox.push(std::move(overflow.front()))) {
+    overflow.pop_front();
+  }
+}
+
+void TunnelWorker::run() {
+  el::Helpers::setThreadName("tunnels");
+  // Tunnel listeners stay open for the whole session, so they are watched
+  // once and only accepted from when they are readable.
+  set<int> listenFds;
+  handler->getListenFds(&listenFds);
+  for (int fd : listenFds) {
+    eventLoop->addFd(fd);
+  }
+  set<int> registeredFds;
+  // Tunnel fds watched for room while data waits for them
+  set<int> writableFds;
+  // Poll the tunnels once before anything can wake us up
+  bool pendingWork = true;
+
+  while (!stopping) {
+    int idleWaitMs = IDLE_WAIT_MS;
+    if (handler->hasDatagramFlows() &&
+        (idleWaitMs < 0 || idleWaitMs > DATAGRAM_WAIT_MS)) {
+      idleWaitMs = DATAGRAM_WAIT_MS;
+    }
+    auto ready = eventLoop->wait(pendingWork ? 0 : idleWaitMs);
+    if (stopping) {
+      break;
+    }
+    // A connect that finished opens its tunnel in update()
+    bool tunnelsOpened = connectsFinished.exchange(false);
+
+    try {
+      // Cleared before popping, like `outboxSignaled`
+      inboxSignaled = false;
+      Packet packet;
+      vector<Packet> replies;
+      while (inbox.pop(&packet)) {
+        VLOG(4) << "Got PF packet type " << int(packet.getHeader());
+        handler->handlePacket(packet, &replies);
+        tunnelsOpened |=
+            packet.getHeader() ==
+            uint8_t(TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST);
+      }
+      if (waitingForInbox.exchange(false)) {
+        // The session thread moves its backlog over in take()
+        notify();
+      }
+      for (auto& reply : replies) {
+        deliver({reply, false});
+      }
+
+      flushOverflow();
+      // Tunnels are not read while what they sent waits for room
+      handler->setReadsPaused(readsPaused || !overflow.empty());
+      vector<PortForwardDestinationRequest> requests;
+      for (int fd : ready.readableFds) {
+        if (listenFds.count(fd)) {
+          handler->accept(fd, &requests);
+          // A SOCKS accept opens a socket without a request yet, and it may
+          // reuse the fd number of a tunnel that closed in this pass
+          tunnelsOpened = true;
+        }
+      }
+      vector<PortForwardData> dataToSend;
+      // New UDP flows add their requests, which go out ahead of their data
+      handler->update(&requests, &dataToSend);
+      for (auto& pfr : requests) {
+        VLOG(4) << "send PF request";
+        deliver({Packet(TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST,
+                        protoToString(pfr)),
+                 false});
+      }
+      for (auto& pwd : dataToSend) {
+        VLOG(4) << "send PF data";
+        // Window updates let the peer send more, so they skip the queue
+        deliver({TerminalPackets::portForwardData(pwd, rawPackets),
+                 !pwd.has_consumed()});
+      }
+      // update() stops early after closing a tunnel and reads a bounded
+      // amount per socket, so go around again until it is idle.
+      pendingWork = !requests.empty() || !dataToSend.empty();
+      tunnelsOpened |= !requests.empty();
+      // Asks for a wakeup if some did not fit
+      flushOverflow();
+    } catch (const runtime_error& re) {
+      STERROR << "Tunnel error: " << re.what();
+    }
+
+    // Tunnels only open or close in update() and handlePacket(), so this
+    // is the only place the registered set can go stale.
+    set<int> forwardFds;
+    handler->getForwardFds(&forwardFds);
+    for (int fd : registeredFds) {
+      if (!forwardFds.count(fd)) {
+        eventLoop->removeFd(fd);
+      }
+    }
+    for (int fd : forwardFds) {
+      // After a tunnel opened, re-add everything: a new tunnel may have
+      // reused the fd number of one that closed, which dropped it from
+      // the loop.  Re-adding a registered fd is a no-op.
+      if (tunnelsOpened || !registeredFds.count(fd)) {
+        eventLoop->addFd(fd);
+      }
+    }
+    registeredFds.swap(forwardFds);
+
+    set<int> writeFds;
+    handler->getForwardWriteFds(&writeFds);
+    for (int fd : writableFds) {
+      // Also drop fds that stay, when a tunnel may have reused one
+      if (tunnelsOpened || !writeFds.count(fd)) {
+        eventLoop->watchWritable(fd, false);
+      }
+    }
+    for (int fd : writeFds) {
+      eventLoop->watchWritable(fd, true);
+    }
+    writableFds.swap(writeFds);
+  }
+}
+}  // namespace et
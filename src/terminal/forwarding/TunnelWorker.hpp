@@ -0,0 +1,124 @@
+#ifndef __TUNNEL_WORKER_H__
+#define __TUNNEL_WORKER_H__
+
+#include "EventLoop.hpp"
+#include "Headers.hpp"
+#include "Packet.hpp"
+#include "PortForwardHandler.hpp"
+#include "SpscQueue.hpp"
+
+namespace et {
+/**
+ * @brief Runs the tunnels of a session on their own thread, so a busy or
+ * stalled tunnel never holds up the loop that carries the terminal.
+ *
+ * The session thread hands the tunnel packets it reads from the connection
+ * to `post()` and writes out what `take()` returns.  Both directions go
+ * through lock-free queues.  A side only makes a system call to wake the
+ * other one: the session thread wakes the worker's event loop when the
+ * inbound queue was idle, and the worker signals `getNotifyFd()` when
+ * packets show up for the connection.
+ *
+ * The PortForwardHandler belongs to the worker once `start()` is called,
+ * so set it up before that.
+ */
+class TunnelWorker {
+ public:
+  /** @brief A packet for the connection. */
+  struct Frame {
+    Packet packet;
+    /** @brief Whether it is tunnel data, which goes behind interactive
+     * packets (`Connection::writeBulkPacket()`). */
+    bool bulk = false;
+  };
+
+  /** @brief Packets each queue holds. */
+  static const size_t QUEUE_PACKETS = 1024;
+
+  /**
+   * @param _rawPackets Whether the peer reads tunnel data without protobuf.
+   */
+  TunnelWorker(shared_ptr<PortForwardHandler> _handler, bool _rawPackets);
+
+  /** @brief Stops the thread if it is still running. */
+  ~TunnelWorker();
+
+  /** @brief Starts the thread. */
+  void start();
+
+  /** @brief Stops the thread and waits for it.  Queued packets are lost. */
+  void stop();
+
+  /**
+   * @brief Hands a tunnel packet from the connection to the worker.
+   * Session thread only.  Never waits: when the worker is a full queue
+   * behind, which a peer that keeps to the tunnel windows never gets, the
+   * packet waits in `backlog` instead.
+   */
+  void post(const Packet& packet);
+
+  /** @brief Moves the packets waiting for the connection to @p frames, and
+   * what fits of `backlog` to the worker.  Session thread only. */
+  void take(vector<Frame>* frames);
+
+  /**
+   * @brief Becomes readable when packets wait for the connection.  It stays
+   * readable until `take()` is called.
+   */
+  int getNotifyFd() const { return notifyPipe[0]; }
+
+  /**
+   * @brief Stops or resumes reading the tunnels, for while the connection
+   * has a full bulk queue.
+   */
+  void setReadsPaused(bool paused);
+
+ protected:
+  shared_ptr<PortForwardHandler> handler;
+  bool rawPackets;
+  /** @brief Event loop of the worker thread. */
+  unique_ptr<EventLoop> eventLoop;
+  unique_ptr<std::thread> workerThread;
+  std::atomic<bool> stopping;
+  std::atomic<bool> readsPaused;
+
+  /** @brief Packets from the connection, for the worker. */
+  SpscQueue<Packet> inbox;
+  /** @brief Set once the worker has been woken for `inbox`. */
+  std::atomic<bool> inboxSignaled;
+  /** @brief Set while the session thread waits for room in `inbox`. */
+  std::atomic<bool> waitingForInbox;
+  /** @brief Packets from the worker, for the connection. */
+  SpscQueue<Frame> outbox;
+  /** @brief Set once `notifyPipe` has been written for `outbox`. */
+  std::atomic<bool> outboxSignaled;
+  /** @brief Set while the worker waits for room in `outbox`. */
+  std::atomic<bool> waitingForRoom;
+  /** @brief Set when a destination connect finishes. */
+  std::atomic<bool> connectsFinished;
+  /** @brief Signals the session thread that `outbox` has packets. */
+  int notifyPipe[2];
+
+  /**
+   * @brief Packets that did not fit in `outbox`.  Worker thread only; the
+   * tunnels are not read while it has any.
+   */
+  std::deque<Frame> overflow;
+  /** @brief Packets that did not fit in `inbox`.  Session thread only. */
+  std::deque<Packet> backlog;
+
+  /** @brief The worker thread. */
+  void run();
+  /** @brief Queues @p frame for the connection.  Worker thread only. */
+  void deliver(Frame&& frame);
+  /** @brief Moves what fits from `overflow` to `outbox`. */
+  void flushOverflow();
+  /** @brief Moves what fits from `backlog` to `inbox` and wakes the worker
+   * for it.  Session thread only. */
+  void flushBacklog();
+  /** @brief Wakes the session thread once for new packets in `outbox`. */
+  void notify();
+};
+}  // namespace et
+
+#endif  // __TUNNEL_WORKER_H__
@@ -62,6 +62,34 @@ class FlakySocketHandler : public SocketHandler {
     }
     return actualSocketHandler->write(fd, buf, count);
   }
+  virtual ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    if (enableFlake && millis % 10 == 0) {
+      SetErrno(EPIPE);
+      return -1;
+    }
+    if (enableFlake && millis % 10 == 5) {
+      SetErrno(EAGAIN);
+      return -1;
+    }
+    return actualSocketHandler->writev(fd, iov, iovcnt);
+  }
+  virtual ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    if (enableFlake && millis % 10 == 0) {
+      SetErrno(EPIPE);
+      return -1;
+    }
+    if (enableFlake && millis % 10 == 5) {
+      SetErrno(EAGAIN);
+      return -1;
+    }
+    return actualSocketHandler->readv(fd, iov, iovcnt);
+  }
   virtual vector<int> getActiveSockets() {
     return actualSocketHandler->getActiveSockets();
   }
@@ -0,0 +1,140 @@
+#ifndef __ET_TUNNEL_ECHO__
+#define __ET_TUNNEL_ECHO__
+
+#include <atomic>
+#include <future>
+#include <thread>
+
+#include "TestHeaders.hpp"
+
+namespace et {
+inline int listenOnPipe(const string& path) {
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  FATAL_FAIL(::bind(fd, (sockaddr*)&addr, sizeof(addr)));
+  FATAL_FAIL(::listen(fd, 16));
+  return fd;
+}
+
+inline int connectToPipe(const string& path) {
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  if (::connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+inline bool writeFully(int fd, const char* buf, size_t count) {
+  while (count > 0) {
+    ssize_t rc = ::write(fd, buf, count);
+    if (rc <= 0) {
+      return false;
+    }
+    buf += rc;
+    count -= rc;
+  }
+  return true;
+}
+
+/**
+ * @brief Echoes back everything sent to each connection accepted on a
+ * listening socket, one thread per connection, until stop() is called.
+ */
+class EchoServer {
+ public:
+  explicit EchoServer(int listener) : stopping(false) {
+    acceptThread = std::thread([this, listener]() {
+      vector<std::thread> echoers;
+      while (!stopping) {
+        if (!waitOnSocketReady(listener, false, 100)) {
+          continue;
+        }
+        int fd = ::accept(listener, NULL, NULL);
+        if (fd < 0) {
+          continue;
+        }
+        echoers.emplace_back([fd]() {
+          char buf[64 * 1024];
+          ssize_t rc;
+          while ((rc = ::read(fd, buf, sizeof(buf))) > 0 &&
+                 writeFully(fd, buf, rc)) {
+          }
+          ::close(fd);
+        });
+      }
+      for (auto& echoer : echoers) {
+        echoer.join();
+      }
+    });
+  }
+
+  ~EchoServer() { stop(); }
+
+  /**
+   * @brief Stops accepting and waits for every connection to be closed by
+   * its peer.
+   */
+  void stop() {
+    stopping = true;
+    if (acceptThread.joinable()) {
+      acceptThread.join();
+    }
+  }
+
+ private:
+  std::atomic<bool> stopping;
+  std::thread acceptThread;
+};
+
+/**
+ * @brief Writes @p payload to @p fd on one thread while reading the echo
+ * back on another.
+ *
+ * @return Everything read back, once it is as long as @p payload or the
+ *   socket is closed.
+ */
+inline std::future<string> echoThrough(int fd, const string& payload) {
+  return std::async(std::launch::async, [fd, &payload]() {
+    std::thread writer(
+        [fd, &payload]() { writeFully(fd, payload.data(), payload.size()); });
+    string got;
+    char buf[64 * 1024];
+    ssize_t rc;
+    while (got.size() < payload.size() &&
+           (rc = ::read(fd, buf, sizeof(buf))) > 0) {
+      got.append(buf, rc);
+    }
+    writer.join();
+    return got;
+  });
+}
+
+/**
+ * @brief Waits up to a minute for every echo, shutting down @p fds if one
+ * doesn't come back so a regression fails instead of hanging the suite.
+ *
+ * @return Whether every echo came back in time.
+ */
+inline bool waitForEchoes(vector<std::future<string>>* echoed,
+                          const vector<int>& fds) {
+  bool completed = true;
+  for (auto& future : *echoed) {
+    completed &= future.wait_for(std::chrono::seconds(60)) ==
+                 std::future_status::ready;
+  }
+  if (!completed) {
+    for (int fd : fds) {
+      ::shutdown(fd, SHUT_RDWR);
+    }
+  }
+  return completed;
+}
+}  // namespace et
+
+#endif  // __ET_TUNNEL_ECHO__
@@ -0,0 +1,74 @@
+#ifndef __ET_WRITE_RESUME_TIMING__
+#define __ET_WRITE_RESUME_TIMING__
+
+#include <atomic>
+#include <thread>
+
+#include "TestHeaders.hpp"
+
+namespace et {
+/**
+ * Fills the non-blocking @p writeFd until it reports EAGAIN, then runs
+ * @p writeAll of a short tail on a thread and drains @p readFd with
+ * @p readAll once the writer is parked on the full buffer.
+ *
+ * @return How long after the drain made room the writer finished (negative
+ *   if it finished while the drain was still running).
+ */
+inline std::chrono::steady_clock::duration measureWriteResume(
+    int writeFd, int readFd,
+    const std::function<void(int, const char*, size_t)>& writeAll,
+    const std::function<void(int, char*, size_t)>& readAll) {
+  string filler(4096, 'F');
+  size_t buffered = 0;
+  while (true) {
+    ssize_t rc = ::write(writeFd, filler.data(), filler.size());
+    if (rc < 0) {
+      REQUIRE((errno == EAGAIN || errno == EWOULDBLOCK));
+      break;
+    }
+    buffered += rc;
+  }
+
+  std::atomic<int64_t> finishedAt(0);
+  std::thread writer([&]() {
+    const string tail = "resume";
+    writeAll(writeFd, tail.data(), tail.size());
+    finishedAt = std::chrono::steady_clock::now().time_since_epoch().count();
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  REQUIRE(finishedAt == 0);
+  string drained(buffered, '\0');
+  readAll(readFd, &drained[0], drained.size());
+  // Once the filler is read the writer has all the room it needs
+  auto roomAt = std::chrono::steady_clock::now();
+  writer.join();
+
+  string tail(6, '\0');
+  readAll(readFd, &tail[0], tail.size());
+  REQUIRE(tail == "resume");
+  return std::chrono::steady_clock::duration(finishedAt.load()) -
+         roomAt.time_since_epoch();
+}
+
+/**
+ * @brief Runs measureWriteResume() up to @p attempts times and returns the
+ * shortest delay, stopping early once one is under @p bound, so a single
+ * descheduled writer on a busy machine doesn't fail the test.
+ */
+inline std::chrono::steady_clock::duration fastestWriteResume(
+    int attempts, std::chrono::steady_clock::duration bound, int writeFd,
+    int readFd,
+    const std::function<void(int, const char*, size_t)>& writeAll,
+    const std::function<void(int, char*, size_t)>& readAll) {
+  auto fastest = std::chrono::steady_clock::duration::max();
+  for (int a = 0; a < attempts && fastest >= bound; a++) {
+    fastest = std::min(
+        fastest, measureWriteResume(writeFd, readFd, writeAll, readAll));
+  }
+  return fastest;
+}
+}  // namespace et
+
+#endif  // __ET_WRITE_RESUME_TIMING__
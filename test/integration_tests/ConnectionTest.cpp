@@ -130,6 +130,11 @@ void listenFn(bool* stopListening, int serverFd,
     if (serverConnection->getSocketHandler()->hasData(serverFd)) {
       serverConnection->acceptNewConnection(serverFd);
     }
+    // No event loop here, so every pending socket gets a try
+    set<int> pendingFds;
+    serverConnection->getPendingHandshakeFds(&pendingFds);
+    serverConnection->getPendingResponseFds(&pendingFds);
+    serverConnection->processPendingHandshakes(pendingFds);
     ::usleep(10 * 1000);
   }
 }
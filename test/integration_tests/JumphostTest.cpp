@@ -2,6 +2,7 @@
 #include "TerminalClient.hpp"
 #include "TerminalServer.hpp"
 #include "TestHeaders.hpp"
+#include "TunnelEcho.hpp"
 #include "UserJumphostHandler.hpp"
 
 namespace et {
@@ -77,94 +78,201 @@ void readWriteTest(const string& clientId,
   ujh.reset();
 }
 
-TEST_CASE("JumphostEndToEndTest", "[JumphostEndToEndTest][integration]") {
-  shared_ptr<PipeSocketHandler> consoleSocketHandler(new PipeSocketHandler());
-  shared_ptr<PipeSocketHandler> terminalUserSocketHandler(
-      new PipeSocketHandler());
-  shared_ptr<PipeSocketHandler> routerSocketHandler(new PipeSocketHandler());
-  shared_ptr<PipeSocketHandler> serverSocketHandler(new PipeSocketHandler());
-  SocketEndpoint serverEndpoint;
-  shared_ptr<FakeConsole> fakeConsole;
-  shared_ptr<FakeUserTerminal> fakeUserTerminal;
+// Echoes more than one tunnel window through a reverse tunnel, so the
+// destination only gets past its first window if both ends agree on what
+// the jumphost relays.
+void reverseTunnelTest(const string& clientId,
+                       shared_ptr<PipeSocketHandler> routerSocketHandler,
+                       shared_ptr<FakeUserTerminal> fakeUserTerminal,
+                       SocketEndpoint serverEndpoint,
+                       shared_ptr<SocketHandler> clientSocketHandler,
+                       shared_ptr<SocketHandler> clientPipeSocketHandler,
+                       shared_ptr<FakeConsole> fakeConsole,
+                       const SocketEndpoint& routerEndpoint,
+                       shared_ptr<PipeSocketHandler> jumphostUserSocketHandler,
+                       shared_ptr<PipeSocketHandler>
+                           jumphostRouterSocketHandler,
+                       const SocketEndpoint& jumphostRouterEndpoint,
+                       const SocketEndpoint& jumphostEndpoint,
+                       const string& pipeDirectory) {
+  auto ujh = shared_ptr<UserJumphostHandler>(new UserJumphostHandler(
+      jumphostUserSocketHandler, clientId + "/" + CRYPTO_KEY, serverEndpoint,
+      jumphostRouterSocketHandler, jumphostRouterEndpoint));
+  thread ujhThread([ujh]() { ujh->run(); });
+  sleep(3);
 
-  shared_ptr<PipeSocketHandler> jumphostUserSocketHandler(
-      new PipeSocketHandler());
-  shared_ptr<PipeSocketHandler> jumphostRouterSocketHandler(
-      new PipeSocketHandler());
-  shared_ptr<PipeSocketHandler> jumphostSocketHandler(new PipeSocketHandler());
-  SocketEndpoint jumphostEndpoint;
+  auto uth = shared_ptr<UserTerminalHandler>(
+      new UserTerminalHandler(routerSocketHandler, fakeUserTerminal, true,
+                              routerEndpoint, clientId + "/" + CRYPTO_KEY));
+  thread uthThread([uth]() { uth->run(); });
+  sleep(3);
 
-  shared_ptr<PipeSocketHandler> clientSocketHandler(new PipeSocketHandler());
-  shared_ptr<PipeSocketHandler> clientPipeSocketHandler(
-      new PipeSocketHandler());
+  // An echo server on the client's side of the tunnel
+  const string sourcePath = pipeDirectory + "/tunnel_source";
+  const string destinationPath = pipeDirectory + "/tunnel_destination";
+  int listener = listenOnPipe(destinationPath);
+  EchoServer echoServer(listener);
 
-  string pipeDirectory;
+  shared_ptr<TerminalClient> terminalClient(new TerminalClient(
+      clientSocketHandler, clientPipeSocketHandler, jumphostEndpoint, clientId,
+      CRYPTO_KEY, fakeConsole, true, "", sourcePath + ":" + destinationPath,
+      false, "", MAX_CLIENT_KEEP_ALIVE_DURATION, {}));
+  thread terminalClientThread(
+      [terminalClient]() { terminalClient->run("", false); });
+  sleep(3);
 
-  srand(1);
-  el::Helpers::setThreadName("Main");
-  fakeConsole.reset(new FakeConsole(consoleSocketHandler));
+  const size_t kSize = 2 * 1024 * 1024;
+  string payload(kSize, '\0');
+  for (size_t a = 0; a < kSize; a++) {
+    payload[a] = rand() % 26 + 'A';
+  }
+  int fd = connectToPipe(sourcePath);
+  REQUIRE(fd >= 0);
+  vector<std::future<string>> echoed;
+  echoed.push_back(echoThrough(fd, payload));
+  bool completed = waitForEchoes(&echoed, {fd});
+  REQUIRE(completed);  // used to stall once the first window was sent
+  REQUIRE(echoed[0].get() == payload);
+  ::close(fd);
+  echoServer.stop();
+
+  terminalClient->shutdown();
+  terminalClientThread.join();
+  terminalClient.reset();
 
-  fakeUserTerminal.reset(new FakeUserTerminal(terminalUserSocketHandler));
-  fakeUserTerminal->setup(-1);
+  uth->shutdown();
+  uthThread.join();
+  uth.reset();
 
-  string tmpPath = GetTempDirectory() + string("etserver_test_XXXXXXXX");
-  pipeDirectory = string(mkdtemp(&tmpPath[0]));
+  ujh->shutdown();
+  ujhThread.join();
+  ujh.reset();
 
-  string routerPipePath = string(pipeDirectory) + "/pipe_router";
-  SocketEndpoint routerEndpoint;
-  routerEndpoint.set_name(routerPipePath);
+  ::close(listener);
+  FATAL_FAIL(::remove(destinationPath.c_str()));
+  ::remove(sourcePath.c_str());
+}
+
+class JumphostTestFixture {
+ public:
+  JumphostTestFixture() {
+    consoleSocketHandler.reset(new PipeSocketHandler());
+    terminalUserSocketHandler.reset(new PipeSocketHandler());
+    routerSocketHandler.reset(new PipeSocketHandler());
+    serverSocketHandler.reset(new PipeSocketHandler());
+    jumphostUserSocketHandler.reset(new PipeSocketHandler());
+    jumphostRouterSocketHandler.reset(new PipeSocketHandler());
+    jumphostSocketHandler.reset(new PipeSocketHandler());
+    clientSocketHandler.reset(new PipeSocketHandler());
+    clientPipeSocketHandler.reset(new PipeSocketHandler());
+
+    srand(1);
+    el::Helpers::setThreadName("Main");
+    fakeConsole.reset(new FakeConsole(consoleSocketHandler));
+
+    fakeUserTerminal.reset(new FakeUserTerminal(terminalUserSocketHandler));
+    fakeUserTerminal->setup(-1);
+
+    string tmpPath = GetTempDirectory() + string("etserver_test_XXXXXXXX");
+    pipeDirectory = string(mkdtemp(&tmpPath[0]));
+
+    routerPipePath = string(pipeDirectory) + "/pipe_router";
+    routerEndpoint.set_name(routerPipePath);
+
+    serverPipePath = string(pipeDirectory) + "/pipe_server";
+    serverEndpoint.set_name(serverPipePath);
+
+    jumphostRouterPipePath = string(pipeDirectory) + "/pipe_jumphost_router";
+    jumphostRouterEndpoint.set_name(jumphostRouterPipePath);
+
+    jumphostServerPipePath = string(pipeDirectory) + "/pipe_jumphost_server";
+    jumphostEndpoint.set_name(jumphostServerPipePath);
+
+    server = shared_ptr<TerminalServer>(
+        new TerminalServer(serverSocketHandler, serverEndpoint,
+                           routerSocketHandler, routerEndpoint));
+    serverThread = thread([this]() { server->run(); });
+    sleep(1);
+
+    jumphost = shared_ptr<TerminalServer>(new TerminalServer(
+        jumphostSocketHandler, jumphostEndpoint, jumphostRouterSocketHandler,
+        jumphostRouterEndpoint));
+    jumphostThread = thread([this]() { jumphost->run(); });
+    sleep(1);
+  }
+
+  ~JumphostTestFixture() {
+    server->shutdown();
+    serverThread.join();
+
+    consoleSocketHandler.reset();
+    terminalUserSocketHandler.reset();
+    serverSocketHandler.reset();
+
+    jumphost->shutdown();
+    jumphostThread.join();
+
+    jumphostUserSocketHandler.reset();
+    jumphostRouterSocketHandler.reset();
+    jumphostSocketHandler.reset();
 
-  string serverPipePath = string(pipeDirectory) + "/pipe_server";
-  serverEndpoint.set_name(serverPipePath);
+    clientSocketHandler.reset();
+    clientPipeSocketHandler.reset();
+    routerSocketHandler.reset();
 
-  string jumphostRouterPipePath =
-      string(pipeDirectory) + "/pipe_jumphost_router";
+    FATAL_FAIL(::remove(jumphostRouterPipePath.c_str()));
+    FATAL_FAIL(::remove(jumphostServerPipePath.c_str()));
+    FATAL_FAIL(::remove(routerPipePath.c_str()));
+    FATAL_FAIL(::remove(serverPipePath.c_str()));
+    FATAL_FAIL(::remove(pipeDirectory.c_str()));
+  }
+
+ protected:
+  shared_ptr<PipeSocketHandler> consoleSocketHandler;
+  shared_ptr<PipeSocketHandler> terminalUserSocketHandler;
+  shared_ptr<PipeSocketHandler> routerSocketHandler;
+  shared_ptr<PipeSocketHandler> serverSocketHandler;
+  SocketEndpoint serverEndpoint;
+  string serverPipePath;
+  SocketEndpoint routerEndpoint;
+  string routerPipePath;
+  shared_ptr<FakeConsole> fakeConsole;
+  shared_ptr<FakeUserTerminal> fakeUserTerminal;
+
+  shared_ptr<PipeSocketHandler> jumphostUserSocketHandler;
+  shared_ptr<PipeSocketHandler> jumphostRouterSocketHandler;
+  shared_ptr<PipeSocketHandler> jumphostSocketHandler;
+  SocketEndpoint jumphostEndpoint;
+  string jumphostServerPipePath;
   SocketEndpoint jumphostRouterEndpoint;
-  jumphostRouterEndpoint.set_name(jumphostRouterPipePath);
+  string jumphostRouterPipePath;
 
-  string jumphostServerPipePath =
-      string(pipeDirectory) + "/pipe_jumphost_server";
-  jumphostEndpoint.set_name(jumphostServerPipePath);
+  shared_ptr<PipeSocketHandler> clientSocketHandler;
+  shared_ptr<PipeSocketHandler> clientPipeSocketHandler;
 
-  auto server = shared_ptr<TerminalServer>(
-      new TerminalServer(serverSocketHandler, serverEndpoint,
-                         routerSocketHandler, routerEndpoint));
-  thread t_server([server]() { server->run(); });
-  sleep(1);
+  string pipeDirectory;
 
-  auto jumphost = shared_ptr<TerminalServer>(
-      new TerminalServer(jumphostSocketHandler, jumphostEndpoint,
-                         jumphostRouterSocketHandler, jumphostRouterEndpoint));
-  thread t_jumphost([jumphost]() { jumphost->run(); });
-  sleep(1);
+  shared_ptr<TerminalServer> server;
+  thread serverThread;
+  shared_ptr<TerminalServer> jumphost;
+  thread jumphostThread;
+};
 
+TEST_CASE_METHOD(JumphostTestFixture, "JumphostEndToEndTest",
+                 "[JumphostEndToEndTest][integration]") {
   readWriteTest("1234567890123456", routerSocketHandler, fakeUserTerminal,
                 serverEndpoint, clientSocketHandler, clientPipeSocketHandler,
                 fakeConsole, routerEndpoint, jumphostUserSocketHandler,
                 jumphostRouterSocketHandler, jumphostRouterEndpoint,
                 jumphostEndpoint);
-  server->shutdown();
-  t_server.join();
-
-  consoleSocketHandler.reset();
-  terminalUserSocketHandler.reset();
-  serverSocketHandler.reset();
-
-  jumphost->shutdown();
-  t_jumphost.join();
-
-  jumphostUserSocketHandler.reset();
-  jumphostRouterSocketHandler.reset();
-  jumphostSocketHandler.reset();
-
-  clientSocketHandler.reset();
-  clientPipeSocketHandler.reset();
-  routerSocketHandler.reset();
+}
 
-  FATAL_FAIL(::remove(jumphostRouterPipePath.c_str()));
-  FATAL_FAIL(::remove(jumphostServerPipePath.c_str()));
-  FATAL_FAIL(::remove(routerPipePath.c_str()));
-  FATAL_FAIL(::remove(serverPipePath.c_str()));
-  FATAL_FAIL(::remove(pipeDirectory.c_str()));
+TEST_CASE_METHOD(JumphostTestFixture, "JumphostReverseTunnel",
+                 "[JumphostEndToEndTest][integration]") {
+  reverseTunnelTest("1234567890123456", routerSocketHandler, fakeUserTerminal,
+                    serverEndpoint, clientSocketHandler,
+                    clientPipeSocketHandler, fakeConsole, routerEndpoint,
+                    jumphostUserSocketHandler, jumphostRouterSocketHandler,
+                    jumphostRouterEndpoint, jumphostEndpoint, pipeDirectory);
 }
 }  // namespace et
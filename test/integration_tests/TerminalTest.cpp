@@ -20,6 +20,7 @@
 #include "TerminalClient.hpp"
 #include "TerminalServer.hpp"
 #include "TestHeaders.hpp"
+#include "TunnelEcho.hpp"
 #include "TunnelUtils.hpp"
 
 namespace et {
@@ -279,6 +280,81 @@ void largeInputNoDeadlockTest(shared_ptr<PipeSocketHandler> routerSocketHandler,
   uth.reset();
 }
 
+// Echoes data through several tunnel connections at once, so both ends of
+// the session send tunnel data to each other at the same time.
+void tunnelEchoNoDeadlockTest(shared_ptr<PipeSocketHandler> routerSocketHandler,
+                              shared_ptr<FakeUserTerminal> fakeUserTerminal,
+                              SocketEndpoint serverEndpoint,
+                              shared_ptr<SocketHandler> clientSocketHandler,
+                              shared_ptr<SocketHandler> clientPipeSocketHandler,
+                              shared_ptr<FakeConsole> fakeConsole,
+                              const SocketEndpoint& routerEndpoint,
+                              const string& pipeDirectory) {
+  auto fakeSubprocessUtils = make_shared<FakeSubprocessUtils>();
+  auto sshSetupHandler = make_shared<FakeSshSetupHandler>(fakeSubprocessUtils);
+  auto [id, passkey] = sshSetupHandler->SetupSsh(
+      "", "localhost", "localhost", 2022, "", "", false, 0, "", "", {});
+
+  auto uth = shared_ptr<UserTerminalHandler>(
+      new UserTerminalHandler(routerSocketHandler, fakeUserTerminal, true,
+                              routerEndpoint, id + "/" + passkey));
+  thread uthThread([uth]() { uth->run(); });
+  sleep(1);
+
+  // An echo server behind the tunnel
+  const string sourcePath = pipeDirectory + "/tunnel_source";
+  const string destinationPath = pipeDirectory + "/tunnel_destination";
+  int listener = listenOnPipe(destinationPath);
+  EchoServer echoServer(listener);
+
+  shared_ptr<TerminalClient> terminalClient(new TerminalClient(
+      clientSocketHandler, clientPipeSocketHandler, serverEndpoint, id, passkey,
+      fakeConsole, false, sourcePath + ":" + destinationPath, "", false, "",
+      MAX_CLIENT_KEEP_ALIVE_DURATION, {}));
+  thread terminalClientThread(
+      [terminalClient]() { terminalClient->run("", false); });
+  sleep(3);
+  waitForFakeConsoleSetup(fakeConsole);
+
+  const int kConnections = 4;
+  const size_t kSize = 2 * 1024 * 1024;
+  string payload(kSize, '\0');
+  for (size_t a = 0; a < kSize; a++) {
+    payload[a] = rand() % 26 + 'A';
+  }
+  vector<int> fds;
+  vector<std::future<string>> echoed;
+  for (int a = 0; a < kConnections; a++) {
+    int fd = connectToPipe(sourcePath);
+    REQUIRE(fd >= 0);
+    fds.push_back(fd);
+    echoed.push_back(echoThrough(fd, payload));
+  }
+
+  bool completed = waitForEchoes(&echoed, fds);
+  REQUIRE(completed);  // both ends used to block writing to each other
+  for (auto& future : echoed) {
+    REQUIRE(future.get() == payload);
+  }
+  for (int fd : fds) {
+    ::close(fd);
+  }
+  // The echo server sees each close come through the tunnel
+  echoServer.stop();
+
+  terminalClient->shutdown();
+  terminalClientThread.join();
+  terminalClient.reset();
+
+  uth->shutdown();
+  uthThread.join();
+  uth.reset();
+
+  ::close(listener);
+  FATAL_FAIL(::remove(destinationPath.c_str()));
+  ::remove(sourcePath.c_str());
+}
+
 class LogInterceptHandler : public el::LogDispatchCallback {
  public:
   void handle(const el::LogDispatchData* data) {
@@ -446,6 +522,14 @@ TEST_CASE_METHOD(EndToEndTestFixture, "LargeInputNoDeadlock",
                            fakeConsole, routerEndpoint);
 }
 
+TEST_CASE_METHOD(EndToEndTestFixture, "TunnelEchoNoDeadlock",
+                 "[EndToEndTest][integration]") {
+  tunnelEchoNoDeadlockTest(routerSocketHandler, fakeUserTerminal,
+                           serverEndpoint, clientSocketHandler,
+                           clientPipeSocketHandler, fakeConsole,
+                           routerEndpoint, pipeDirectory);
+}
+
 void simultaneousTerminalConnectionTest(
     LogInterceptHandler& logInterceptHandler,
     shared_ptr<PipeSocketHandler> routerSocketHandler,
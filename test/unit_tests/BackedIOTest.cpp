@@ -1,12 +1,15 @@
 #include <atomic>
+#include <future>
 #include <thread>
 
 #include "BackedReader.hpp"
 #include "BackedWriter.hpp"
 #include "Connection.hpp"
+#include "FrameReader.hpp"
 #include "RawSocketUtils.hpp"
 #include "SocketHandler.hpp"
 #include "TestHeaders.hpp"
+#include "WriteResumeTiming.hpp"
 
 using namespace et;
 using Catch::Matchers::Equals;
@@ -33,8 +36,9 @@ class InMemorySocketHandler : public SocketHandler {
   ssize_t read(int fd, void* buf, size_t count) override {
     auto& q = buffers[fd];
     if (q.empty()) {
-      SetErrno(EPIPE);
-      return 0;
+      // Like a non-blocking socket with nothing to read
+      SetErrno(EAGAIN);
+      return -1;
     }
     size_t n = std::min(count, q.size());
     for (size_t i = 0; i < n; ++i) {
@@ -251,6 +255,75 @@ TEST_CASE("Connection writes and reads packets with backing buffers",
   conn.shutdown();
 }
 
+TEST_CASE("Connection reads while a writer is blocked", "[Connection]") {
+  // Holds every write until the test releases it, like a peer that has
+  // stopped draining its socket.
+  class StallingWriteHandler : public FdSocketHandler {
+   public:
+    std::atomic<bool> writeStarted{false};
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+
+    ssize_t write(int fd, const void* buf, size_t count) override {
+      writeStarted = true;
+      released.wait();
+      return FdSocketHandler::write(fd, buf, count);
+    }
+  };
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  auto handler = make_shared<StallingWriteHandler>();
+  auto peerHandler = make_shared<FdSocketHandler>();
+  const string key = "12345678901234567890123456789012";
+
+  auto reader = make_shared<BackedReader>(
+      handler, make_shared<CryptoHandler>(key, 0), fds[0]);
+  auto writer = make_shared<BackedWriter>(
+      handler, make_shared<CryptoHandler>(key, 0), fds[0]);
+  TestConnection conn(handler, reader, writer, fds[0], key);
+
+  std::thread blockedWriter(
+      [&]() { conn.writePacket(Packet(1, "outbound")); });
+  while (!handler->writeStarted) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  // The peer sends a packet while the local writer is stuck.
+  BackedWriter peerWriter(peerHandler, make_shared<CryptoHandler>(key, 0),
+                          fds[1]);
+  REQUIRE(peerWriter.write(Packet(2, "inbound")) ==
+          BackedWriterWriteState::SUCCESS);
+
+  auto readResult = std::async(std::launch::async, [&]() {
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    Packet in;
+    while (std::chrono::steady_clock::now() < deadline) {
+      if (conn.hasData() && conn.readPacket(&in)) {
+        return in.getPayload();
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return string();
+  });
+  const bool readWhileBlocked = readResult.wait_for(std::chrono::seconds(2)) ==
+                                std::future_status::ready;
+  handler->release.set_value();
+  blockedWriter.join();
+  REQUIRE(readWhileBlocked);
+  REQUIRE(readResult.get() == "inbound");
+
+  // Once released, the stalled write still reaches the peer.
+  BackedReader peerReader(peerHandler, make_shared<CryptoHandler>(key, 0),
+                          fds[1]);
+  Packet out;
+  REQUIRE(peerReader.read(&out) == 1);
+  REQUIRE(out.getPayload() == "outbound");
+
+  conn.shutdown();
+  ::close(fds[1]);
+}
+
 TEST_CASE("Connection closeSocket updates disconnected state", "[Connection]") {
   auto handler = make_shared<InMemorySocketHandler>();
   const int fd = handler->createChannel();
@@ -352,6 +425,59 @@ TEST_CASE("writeAllOrThrow retries ETIMEDOUT when patient", "[SocketHandler]") {
       handler->writeAllOrThrow(fd, data.data(), data.length(), true));
 }
 
+TEST_CASE("writeAllOrThrow resumes promptly after EAGAIN", "[SocketHandler]") {
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  for (int fd : fds) {
+    REQUIRE(::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK) == 0);
+  }
+  auto handler = make_shared<FdSocketHandler>();
+
+  // Sleeping a fixed 100ms per EAGAIN used to stall every burst; waiting on
+  // writability resumes as soon as the peer drains.
+  auto resumeDelay = fastestWriteResume(
+      5, std::chrono::milliseconds(1), fds[0], fds[1],
+      [&](int fd, const char* buf, size_t count) {
+        handler->writeAllOrThrow(fd, buf, count, true);
+      },
+      [&](int fd, char* buf, size_t count) {
+        handler->readAll(fd, buf, count, true);
+      });
+  REQUIRE(resumeDelay < std::chrono::milliseconds(1));
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+TEST_CASE("writevAllOrThrow resumes partial vectored writes",
+          "[SocketHandler]") {
+  // Accepts at most three bytes per call, so writes end mid-buffer.
+  class TrickleHandler : public InMemorySocketHandler {
+   public:
+    ssize_t write(int fd, const void* buf, size_t count) override {
+      return InMemorySocketHandler::write(fd, buf, std::min<size_t>(count, 3));
+    }
+  };
+  auto handler = make_shared<TrickleHandler>();
+  const int fd = handler->createChannel();
+
+  string a = "abcde";
+  string b = "";
+  string c = "fghijklm";
+  struct iovec iov[3];
+  iov[0].iov_base = &a[0];
+  iov[0].iov_len = a.length();
+  iov[1].iov_base = &b[0];
+  iov[1].iov_len = 0;
+  iov[2].iov_base = &c[0];
+  iov[2].iov_len = c.length();
+  handler->writevAllOrThrow(fd, iov, 3, true);
+
+  string out(13, '\0');
+  REQUIRE(handler->read(fd, &out[0], out.length()) == 13);
+  REQUIRE(out == "abcdefghijklm");
+}
+
 TEST_CASE("Connection severs instead of dying on unexpected read errno",
           "[Connection]") {
   // A client waking from sleep can see errnos like ENETDOWN; the connection
@@ -424,3 +550,218 @@ TEST_CASE("BackedWriter trims old data when connected and buffer exceeds 64MB",
 
   handler->close(fd);
 }
+
+TEST_CASE("FrameReader assembles a frame delivered in pieces",
+          "[FrameReader]") {
+  auto handler = make_shared<InMemorySocketHandler>();
+  const int fd = handler->createChannel();
+
+  ConnectRequest request;
+  request.set_clientid("piecewise-client");
+  request.set_version(PROTOCOL_VERSION);
+  string body = protoToString(request);
+  int64_t length = body.length();
+  string frame = string((const char*)&length, sizeof(int64_t)) + body;
+
+  FrameReader reader(handler, fd, 1024);
+  REQUIRE(reader.readAvailable() == FrameReader::FRAME_INCOMPLETE);
+  for (size_t i = 0; i + 1 < frame.length(); i++) {
+    handler->enqueue(fd, frame.substr(i, 1));
+    REQUIRE(reader.readAvailable() == FrameReader::FRAME_INCOMPLETE);
+  }
+  handler->enqueue(fd, frame.substr(frame.length() - 1));
+  REQUIRE(reader.readAvailable() == FrameReader::FRAME_COMPLETE);
+  REQUIRE(reader.parseProto<ConnectRequest>().clientid() ==
+          "piecewise-client");
+}
+
+TEST_CASE("FrameReader rejects frames above its cap", "[FrameReader]") {
+  auto handler = make_shared<InMemorySocketHandler>();
+  const int fd = handler->createChannel();
+
+  int64_t length = 128 * 1024 * 1024;
+  handler->enqueue(fd, string((const char*)&length, sizeof(int64_t)));
+
+  FrameReader reader(handler, fd, 4 * 1024);
+  REQUIRE(reader.readAvailable() == FrameReader::FRAME_ERROR);
+  REQUIRE_THAT(reader.getError(),
+               Catch::Matchers::ContainsSubstring("Invalid handshake size"));
+  // The error is sticky so callers can't accidentally resume the stream.
+  REQUIRE(reader.readAvailable() == FrameReader::FRAME_ERROR);
+}
+
+TEST_CASE("FrameReader reports a peer that hangs up mid-frame",
+          "[FrameReader]") {
+  auto handler = make_shared<FdSocketHandler>();
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  int64_t length = 16;
+  REQUIRE(::write(fds[0], &length, sizeof(int64_t)) == sizeof(int64_t));
+  REQUIRE(::write(fds[0], "abc", 3) == 3);
+  ::close(fds[0]);
+
+  FrameReader reader(handler, fds[1], 1024);
+  REQUIRE(reader.readAvailable() == FrameReader::FRAME_ERROR);
+  ::close(fds[1]);
+}
+
+TEST_CASE("BackedWriter sends bulk data behind interactive packets",
+          "[BackedIO]") {
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  auto handler = make_shared<FdSocketHandler>();
+  const string key = "12345678901234567890123456789012";
+  BackedWriter writer(handler, make_shared<CryptoHandler>(key, 0), fds[0]);
+  BackedReader reader(handler, make_shared<CryptoHandler>(key, 0), fds[1]);
+
+  const string chunk(1024, 'B');
+  writer.queueBulk(Packet(1, chunk));
+  writer.queueBulk(Packet(1, chunk));
+  REQUIRE(writer.getBulkBytes() == 2 * Packet(1, chunk).length());
+  REQUIRE(writer.writeBulk() == BackedWriterWriteState::SUCCESS);
+  REQUIRE(writer.write(Packet(2, "keystroke")) ==
+          BackedWriterWriteState::SUCCESS);
+  REQUIRE(writer.writeBulk() == BackedWriterWriteState::SUCCESS);
+  REQUIRE(writer.writeBulk() == BackedWriterWriteState::SKIPPED);
+  REQUIRE(writer.getBulkBytes() == 0);
+
+  // Packets are numbered in the order they go out
+  vector<uint8_t> headers;
+  for (int a = 0; a < 3; a++) {
+    Packet packet;
+    while (reader.read(&packet) == 0) {
+    }
+    headers.push_back(packet.getHeader());
+  }
+  REQUIRE(headers == vector<uint8_t>({1, 2, 1}));
+  REQUIRE(reader.getSequenceNumber() == 3);
+
+  // Bulk data stops at a full socket and stays queued
+  int queued = 0;
+  while (writer.writeBulk() != BackedWriterWriteState::SKIPPED ||
+         queued == 0) {
+    writer.queueBulk(Packet(1, chunk));
+    queued++;
+  }
+  REQUIRE(writer.getBulkBytes() == Packet(1, chunk).length());
+  REQUIRE(writer.write(Packet(2, "keystroke")) ==
+          BackedWriterWriteState::SUCCESS);
+
+  // Replay after a reconnect covers what went out, not what is queued
+  writer.revive(-1);
+  REQUIRE(writer.writeBulk() == BackedWriterWriteState::SKIPPED);
+  auto recovered = writer.recover(3);
+  REQUIRE(recovered.size() == size_t(queued));
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+namespace {
+// Sends tunnel data as fast as a reader draining 4MB/s over TCP takes it,
+// with a keystroke every 20ms, and returns how late each keystroke was.
+vector<int64_t> keystrokeDelaysMs(bool bulkLane) {
+  typedef std::chrono::steady_clock Clock;
+  int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+  REQUIRE(listener >= 0);
+  // A small receive window, like a slow link's
+  int rcvbuf = 64 * 1024;
+  ::setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrLen = sizeof(addr);
+  REQUIRE(::bind(listener, (sockaddr*)&addr, addrLen) == 0);
+  REQUIRE(::listen(listener, 1) == 0);
+  REQUIRE(::getsockname(listener, (sockaddr*)&addr, &addrLen) == 0);
+  int sender = ::socket(AF_INET, SOCK_STREAM, 0);
+  // and the send buffer autotuning grows for a long fat link
+  int sndbuf = 1024 * 1024;
+  ::setsockopt(sender, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  REQUIRE(::connect(sender, (sockaddr*)&addr, addrLen) == 0);
+  int receiver = ::accept(listener, NULL, NULL);
+  REQUIRE(receiver >= 0);
+  ::close(listener);
+
+  auto handler = make_shared<FdSocketHandler>();
+  const string key = "12345678901234567890123456789012";
+  auto writer = make_shared<BackedWriter>(
+      handler, make_shared<CryptoHandler>(key, 0), sender);
+#ifdef TCP_NOTSENT_LOWAT
+  if (!bulkLane) {
+    // As before the lanes, with nothing holding data back in the kernel
+    int unlimited = INT_MAX;
+    ::setsockopt(sender, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &unlimited,
+                 sizeof(unlimited));
+  }
+#endif
+  TestConnection conn(handler, nullptr, writer, sender, key);
+  const auto start = Clock::now();
+
+  vector<int64_t> delays;
+  std::thread peer([&]() {
+    BackedReader reader(handler, make_shared<CryptoHandler>(key, 0),
+                        receiver);
+    int64_t received = 0;
+    while (true) {
+      Packet packet;
+      int rc = reader.read(&packet);
+      if (rc == 0) {
+        continue;
+      }
+      if (rc < 0 || packet.getHeader() == 3) {
+        break;
+      }
+      if (packet.getHeader() == 2) {
+        auto due = start + std::chrono::milliseconds(
+                               std::stoll(packet.getPayload()));
+        delays.push_back(std::chrono::duration_cast<std::chrono::milliseconds>(
+                             Clock::now() - due)
+                             .count());
+        continue;
+      }
+      received += packet.length();
+      std::this_thread::sleep_until(
+          start + std::chrono::microseconds(received / 4));
+    }
+  });
+
+  const string chunk(16 * 1024, 'B');
+  int64_t nextKeystrokeMs = 100;
+  while (nextKeystrokeMs <= 2000) {
+    if (Clock::now() >= start + std::chrono::milliseconds(nextKeystrokeMs)) {
+      conn.writePacket(Packet(2, to_string(nextKeystrokeMs)));
+      nextKeystrokeMs += 20;
+    } else if (bulkLane) {
+      // Like the session loops, stop producing while the queue is full
+      if (conn.getBulkBytes() < BackedWriter::MAX_BULK_BYTES) {
+        conn.writeBulkPacket(Packet(1, chunk));
+      } else if (conn.flushBulk()) {
+        waitOnSocketReady(sender, true, 1);
+      }
+    } else {
+      conn.writePacket(Packet(1, chunk));
+    }
+  }
+  conn.writePacket(Packet(3, ""));
+  peer.join();
+  conn.shutdown();
+  ::close(receiver);
+  std::sort(delays.begin(), delays.end());
+  return delays;
+}
+}  // namespace
+
+TEST_CASE("Keystroke latency behind tunnel data",
+          "[.][EchoLatencyBenchmark]") {
+  auto oneLane = keystrokeDelaysMs(false);
+  auto twoLanes = keystrokeDelaysMs(true);
+  WARN("keystroke delay with one lane: median "
+       << oneLane[oneLane.size() / 2] << "ms, worst " << oneLane.back()
+       << "ms");
+  WARN("keystroke delay with a bulk lane: median "
+       << twoLanes[twoLanes.size() / 2] << "ms, worst " << twoLanes.back()
+       << "ms");
+  REQUIRE(twoLanes[twoLanes.size() / 2] < oneLane[oneLane.size() / 2]);
+}
@@ -1,3 +1,4 @@
+#include <future>
 #include <queue>
 
 #include "ClientConnection.hpp"
@@ -12,7 +13,10 @@ class SocketPairHandler : public SocketHandler {
  public:
   void queueConnectFd(int fd) { connectQueue.push(fd); }
 
-  bool hasData(int fd) override { return waitOnSocketData(fd); }
+  bool hasData(int fd) override {
+    pollfd pfd = {fd, POLLIN, 0};
+    return ::poll(&pfd, 1, 0) > 0;
+  }
 
   ssize_t read(int fd, void* buf, size_t count) override {
     return ::read(fd, buf, count);
@@ -33,7 +37,11 @@ class SocketPairHandler : public SocketHandler {
 
   set<int> listen(const SocketEndpoint&) override { return {}; }
   set<int> getEndpointFds(const SocketEndpoint&) override { return {}; }
-  int accept(int fd) override { return fd; }
+  int accept(int fd) override {
+    // Accepted sockets are non-blocking, as with the real handlers
+    FATAL_FAIL(::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK));
+    return fd;
+  }
   void stopListening(const SocketEndpoint&) override {}
   void close(int fd) override { ::close(fd); }
   vector<int> getActiveSockets() override { return {}; }
@@ -148,7 +156,7 @@ TEST_CASE("ServerConnection responds to known and unknown clients",
   missingKeyRequest.set_clientid("missing");
   missingKeyRequest.set_version(PROTOCOL_VERSION);
   handler->writeProto(firstPair[0], missingKeyRequest, true);
-  server.clientHandler(firstPair[1]);
+  REQUIRE(server.acceptNewConnection(firstPair[1]));
   auto missingKeyResponse =
       handler->readProto<ConnectResponse>(firstPair[0], true);
   REQUIRE(missingKeyResponse.status() == INVALID_KEY);
@@ -160,19 +168,20 @@ TEST_CASE("ServerConnection responds to known and unknown clients",
   server.addClientKey("client-one", clientKey);
   int secondPair[2];
   REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, secondPair) == 0);
+  REQUIRE(server.acceptNewConnection(secondPair[1]));
 
-  std::thread serverThread([&]() { server.clientHandler(secondPair[1]); });
-
+  // The request arrives after the accept, once the event loop sees it
   ConnectRequest knownClientRequest;
   knownClientRequest.set_clientid("client-one");
   knownClientRequest.set_version(PROTOCOL_VERSION);
   handler->writeProto(secondPair[0], knownClientRequest, true);
+  server.processPendingHandshakes({});
+  REQUIRE_FALSE(server.newClientCalled);
+  server.processPendingHandshakes({secondPair[1]});
 
   auto knownClientResponse =
       handler->readProto<ConnectResponse>(secondPair[0], true);
   REQUIRE(knownClientResponse.status() == NEW_CLIENT);
-
-  serverThread.join();
   REQUIRE(server.newClientCalled);
   REQUIRE(server.clientConnectionExists("client-one"));
 
@@ -181,6 +190,177 @@ TEST_CASE("ServerConnection responds to known and unknown clients",
   server.shutdown();
 }
 
+TEST_CASE("ServerConnection handshakes never wait on a slow peer",
+          "[ServerConnection]") {
+  auto handler = make_shared<SocketPairHandler>();
+  SocketEndpoint endpoint;
+  endpoint.set_name("server");
+  endpoint.set_port(0);
+  RecordingServerConnection server(handler, endpoint);
+  const string clientKey = "0123456789abcdef0123456789abcdef";
+  server.addClientKey("fast-client", clientKey);
+
+  // A peer that only sends part of its length prefix and then stalls.
+  int slowPair[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, slowPair) == 0);
+  REQUIRE(::write(slowPair[0], "\x10\x00\x00", 3) == 3);
+  REQUIRE(server.acceptNewConnection(slowPair[1]));
+
+  // A well behaved peer right behind it is answered immediately.
+  int fastPair[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fastPair) == 0);
+  ConnectRequest request;
+  request.set_clientid("fast-client");
+  request.set_version(PROTOCOL_VERSION);
+  handler->writeProto(fastPair[0], request, true);
+  REQUIRE(server.acceptNewConnection(fastPair[1]));
+  REQUIRE(handler->hasData(fastPair[0]));
+  auto response = handler->readProto<ConnectResponse>(fastPair[0], true);
+  REQUIRE(response.status() == NEW_CLIENT);
+  REQUIRE(server.newClientCalled);
+
+  set<int> pendingFds;
+  server.getPendingHandshakeFds(&pendingFds);
+  REQUIRE(pendingFds == set<int>({slowPair[1]}));
+
+  // A peer claiming a huge frame is dropped before anything is allocated.
+  int greedyPair[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, greedyPair) == 0);
+  int64_t hugeLength = 128 * 1024 * 1024;
+  REQUIRE(::write(greedyPair[0], &hugeLength, sizeof(int64_t)) ==
+          sizeof(int64_t));
+  REQUIRE(server.acceptNewConnection(greedyPair[1]));
+  pendingFds.clear();
+  server.getPendingHandshakeFds(&pendingFds);
+  REQUIRE(pendingFds == set<int>({slowPair[1]}));
+  char c;
+  REQUIRE(::read(greedyPair[0], &c, 1) == 0);
+
+  handler->close(slowPair[0]);
+  handler->close(fastPair[0]);
+  handler->close(greedyPair[0]);
+  server.shutdown();
+}
+
+TEST_CASE("ServerConnection queues responses a peer can't take yet",
+          "[ServerConnection]") {
+  auto handler = make_shared<SocketPairHandler>();
+  SocketEndpoint endpoint;
+  endpoint.set_name("server");
+  endpoint.set_port(0);
+  RecordingServerConnection server(handler, endpoint);
+  const string clientKey = "0123456789abcdef0123456789abcdef";
+  server.addClientKey("full-client", clientKey);
+
+  // A peer that doesn't read, so its socket has no room for the response.
+  int pair[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+  REQUIRE(::fcntl(pair[1], F_SETFL, O_NONBLOCK) == 0);
+  string filler(4096, 'F');
+  size_t buffered = 0;
+  while (true) {
+    ssize_t rc = ::write(pair[1], filler.data(), filler.size());
+    if (rc < 0) {
+      REQUIRE((errno == EAGAIN || errno == EWOULDBLOCK));
+      break;
+    }
+    buffered += rc;
+  }
+  ConnectRequest request;
+  request.set_clientid("full-client");
+  request.set_version(PROTOCOL_VERSION);
+  handler->writeProto(pair[0], request, true);
+  REQUIRE(server.acceptNewConnection(pair[1]));
+
+  set<int> responseFds;
+  server.getPendingResponseFds(&responseFds);
+  REQUIRE(responseFds == set<int>({pair[1]}));
+  REQUIRE_FALSE(server.newClientCalled);
+
+  // Once the peer reads, the event loop finishes the response.
+  string drained(buffered, '\0');
+  REQUIRE(::recv(pair[0], &drained[0], drained.size(), MSG_WAITALL) ==
+          ssize_t(buffered));
+  server.processPendingHandshakes({pair[1]});
+  responseFds.clear();
+  server.getPendingResponseFds(&responseFds);
+  REQUIRE(responseFds.empty());
+  auto response = handler->readProto<ConnectResponse>(pair[0], true);
+  REQUIRE(response.status() == NEW_CLIENT);
+  REQUIRE(server.newClientCalled);
+
+  handler->close(pair[0]);
+  server.shutdown();
+}
+
+TEST_CASE("ServerConnection reconnects are not delayed by a slow peer",
+          "[ServerConnection]") {
+  auto handler = make_shared<SocketPairHandler>();
+  SocketEndpoint endpoint;
+  endpoint.set_name("server");
+  endpoint.set_port(0);
+  RecordingServerConnection server(handler, endpoint);
+  const string clientKey = "0123456789abcdef0123456789abcdef";
+  server.addClientKey("slow-client", clientKey);
+  server.addClientKey("fast-client", clientKey);
+
+  // Returns the client end of a fresh socketpair and the server's answer.
+  auto connectClient = [&](const string& clientId, int* serverFd) {
+    int pair[2];
+    REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+    ConnectRequest request;
+    request.set_clientid(clientId);
+    request.set_version(PROTOCOL_VERSION);
+    handler->writeProto(pair[0], request, true);
+    REQUIRE(server.acceptNewConnection(pair[1]));
+    auto response = handler->readProto<ConnectResponse>(pair[0], true);
+    *serverFd = pair[1];
+    return make_pair(pair[0], response.status());
+  };
+
+  int serverFd;
+  auto slow = connectClient("slow-client", &serverFd);
+  REQUIRE(slow.second == NEW_CLIENT);
+  auto fast = connectClient("fast-client", &serverFd);
+  REQUIRE(fast.second == NEW_CLIENT);
+
+  // The slow client reconnects but never answers the recovery exchange, so
+  // the server sits in a blocking read for that session.
+  auto slowReconnect = connectClient("slow-client", &serverFd);
+  REQUIRE(slowReconnect.second == RETURNING_CLIENT);
+  handler->readProto<SequenceHeader>(slowReconnect.first, true);
+
+  // Meanwhile the other client keeps reconnecting and must be served right
+  // away every time.
+  int previousFd = fast.first;
+  for (int i = 0; i < 20; i++) {
+    auto start = std::chrono::steady_clock::now();
+    auto fastReconnect = connectClient("fast-client", &serverFd);
+    REQUIRE(fastReconnect.second == RETURNING_CLIENT);
+    handler->readProto<SequenceHeader>(fastReconnect.first, true);
+    SequenceHeader header;
+    header.set_sequencenumber(0);
+    handler->writeProto(fastReconnect.first, header, true);
+    handler->readProto<CatchupBuffer>(fastReconnect.first, true);
+    handler->writeProto(fastReconnect.first, CatchupBuffer(), true);
+    auto connection = server.getClientConnection("fast-client");
+    while (connection->getSocketFd() != serverFd &&
+           std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+      ::usleep(1000);
+    }
+    REQUIRE(connection->getSocketFd() == serverFd);
+    REQUIRE(std::chrono::steady_clock::now() - start <
+            std::chrono::seconds(2));
+    handler->close(previousFd);
+    previousFd = fastReconnect.first;
+  }
+
+  handler->close(previousFd);
+  handler->close(slow.first);
+  handler->close(slowReconnect.first);
+  server.shutdown();
+}
+
 TEST_CASE("ServerClientConnection verifies passkeys",
           "[ServerClientConnection]") {
   auto handler = make_shared<SocketPairHandler>();
@@ -240,3 +420,67 @@ TEST_CASE("Connection recover exchanges sequence and catchup", "[Connection]") {
   handler->close(reconnect[0]);
   remote.join();
 }
+
+TEST_CASE("Connection keeps writing while recover handshakes",
+          "[Connection]") {
+  auto handler = make_shared<SocketPairHandler>();
+  const string key = "zyxwvutsrqponmlkjihgfedcba987654";
+  auto reader =
+      make_shared<BackedReader>(handler, make_shared<CryptoHandler>(key, 0),
+                                -1);
+  auto writer =
+      make_shared<BackedWriter>(handler, make_shared<CryptoHandler>(key, 0),
+                                -1);
+  RecoverableConnection conn(handler, reader, writer, -1, key);
+  conn.write(Packet(1, "before"));
+
+  int reconnect[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, reconnect) == 0);
+  auto recovered = std::async(std::launch::async, [&]() {
+    return conn.recoverPublic(reconnect[0]);
+  });
+
+  handler->readProto<SequenceHeader>(reconnect[1], true);
+  SequenceHeader seqResponse;
+  seqResponse.set_sequencenumber(0);
+  handler->writeProto(reconnect[1], seqResponse, true);
+  auto catchup = handler->readProto<CatchupBuffer>(reconnect[1], true);
+  REQUIRE(catchup.buffer_size() == 1);
+
+  // The handshake is waiting on our catchup buffer, yet writes and reads go
+  // through instead of waiting for it.
+  auto wrote = std::async(std::launch::async, [&]() {
+    conn.writePacket(Packet(2, "during"));
+    Packet unused;
+    return conn.readPacket(&unused);
+  });
+  const bool wroteDuringRecover =
+      wrote.wait_for(std::chrono::seconds(2)) == std::future_status::ready;
+
+  CatchupBuffer back;
+  handler->writeProto(reconnect[1], back, true);
+  REQUIRE(recovered.get());
+  REQUIRE(wroteDuringRecover);
+  REQUIRE_FALSE(wrote.get());
+
+  // The packet written after the catchup snapshot follows on the new socket.
+  BackedReader peerReader(handler, make_shared<CryptoHandler>(key, 0),
+                          reconnect[1]);
+  peerReader.revive(reconnect[1], vector<string>(catchup.buffer().begin(),
+                                                 catchup.buffer().end()));
+  Packet before;
+  REQUIRE(peerReader.read(&before) == 1);
+  REQUIRE(before.getPayload() == "before");
+  Packet during;
+  REQUIRE(peerReader.read(&during) == 1);
+  REQUIRE(during.getHeader() == 2);
+  REQUIRE(during.getPayload() == "during");
+
+  conn.write(Packet(3, "after"));
+  Packet after;
+  REQUIRE(peerReader.read(&after) == 1);
+  REQUIRE(after.getPayload() == "after");
+
+  conn.shutdown();
+  handler->close(reconnect[1]);
+}
@@ -0,0 +1,109 @@
+#include "ConsoleWriter.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+namespace {
+// Console whose output end is a non-blocking socketpair with a small buffer,
+// standing in for a terminal emulator that renders slowly.
+class SlowConsole : public Console {
+ public:
+  SlowConsole() {
+    REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int bufferSize = 4096;
+    ::setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufferSize,
+                 sizeof(bufferSize));
+    ::fcntl(fds[0], F_SETFL, ::fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  }
+  ~SlowConsole() {
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+
+  TerminalInfo getTerminalInfo() override { return TerminalInfo(); }
+  void setup() override {}
+  void teardown() override {}
+  int getFd() override { return fds[0]; }
+  ssize_t writeSome(const char* buf, size_t count) override {
+    writeCalls++;
+    return Console::writeSome(buf, count);
+  }
+
+  string readAvailable() {
+    string s;
+    char buf[4096];
+    while (waitOnSocketReady(fds[1], false, 0)) {
+      ssize_t rc = ::read(fds[1], buf, sizeof(buf));
+      if (rc <= 0) {
+        break;
+      }
+      s.append(buf, rc);
+    }
+    return s;
+  }
+
+  int fds[2];
+  int writeCalls = 0;
+};
+}  // namespace
+
+TEST_CASE("ConsoleWriter queues output a slow console cannot take",
+          "[ConsoleWriter]") {
+  auto console = make_shared<SlowConsole>();
+  ConsoleWriter writer(console, 0);
+
+  writer.enqueue("hello");
+  REQUIRE(writer.flush());
+  REQUIRE(writer.empty());
+  REQUIRE(console->readAvailable() == "hello");
+
+  // A flood larger than the socket buffer returns instead of blocking.
+  string flood;
+  for (int a = 0;
+       flood.length() < size_t(2 * ConsoleWriter::MAX_QUEUED_BYTES); a++) {
+    flood += to_string(a) + "\n";
+  }
+  writer.enqueue(flood);
+  REQUIRE_FALSE(writer.flush());
+  REQUIRE_FALSE(writer.empty());
+  REQUIRE(writer.isFull());
+  REQUIRE_FALSE(writer.canResume());
+
+  // As the console drains, flushing resumes where it stopped.
+  string received;
+  while (!writer.empty()) {
+    received += console->readAvailable();
+    writer.flush();
+  }
+  received += console->readAvailable();
+  REQUIRE(received == flood);
+  REQUIRE(writer.canResume());
+}
+
+TEST_CASE("ConsoleWriter paces flushes during a burst", "[ConsoleWriter]") {
+  auto console = make_shared<SlowConsole>();
+  ConsoleWriter writer(console, 50);
+
+  // Output after an idle period goes out right away.
+  REQUIRE(writer.msUntilFlush() == 0);
+  writer.enqueue("a");
+  REQUIRE(writer.flush());
+
+  // The rest of the burst waits for the next frame and leaves together.
+  writer.enqueue("b");
+  writer.enqueue("c");
+  int64_t waitMs = writer.msUntilFlush();
+  REQUIRE(waitMs > 0);
+  REQUIRE(waitMs <= 50);
+  std::this_thread::sleep_for(std::chrono::milliseconds(waitMs));
+  REQUIRE(writer.msUntilFlush() == 0);
+  int writesBefore = console->writeCalls;
+  REQUIRE(writer.flush());
+  REQUIRE(console->writeCalls == writesBefore + 1);
+  REQUIRE(console->readAvailable() == "abc");
+
+  writer.enqueue("tail");
+  writer.drain();
+  REQUIRE(writer.empty());
+  REQUIRE(console->readAvailable() == "tail");
+}
@@ -0,0 +1,196 @@
+#include "DatagramDestinationHandler.hpp"
+#include "DatagramSourceHandler.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+namespace {
+// A UDP socket bound to a free loopback port.
+int boundSocket(sockaddr_in* addr) {
+  int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  REQUIRE(fd >= 0);
+  *addr = {};
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrLen = sizeof(*addr);
+  REQUIRE(::bind(fd, (sockaddr*)addr, addrLen) == 0);
+  REQUIRE(::getsockname(fd, (sockaddr*)addr, &addrLen) == 0);
+  return fd;
+}
+
+int freePort() {
+  sockaddr_in addr;
+  int fd = boundSocket(&addr);
+  ::close(fd);
+  return ntohs(addr.sin_port);
+}
+
+string receiveWithin(int fd, sockaddr_in* from = NULL) {
+  REQUIRE(waitOnSocketReady(fd, false, 5000));
+  char buf[64 * 1024];
+  socklen_t fromLen = sizeof(sockaddr_in);
+  ssize_t rc = ::recvfrom(fd, buf, sizeof(buf), 0, (sockaddr*)from,
+                          from ? &fromLen : NULL);
+  REQUIRE(rc >= 0);
+  return string(buf, rc);
+}
+
+// Updates @p source until it has staged @p count datagrams.
+void readSource(DatagramSourceHandler* source, SocketIdAllocator* socketIds,
+                size_t count, vector<PortForwardDestinationRequest>* requests,
+                vector<PortForwardData>* data) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (data->size() < count) {
+    REQUIRE(std::chrono::steady_clock::now() < deadline);
+    source->update(socketIds, requests, data);
+  }
+}
+}  // namespace
+
+TEST_CASE("A udp tunnel keeps datagram boundaries", "[DatagramForward]") {
+  SocketEndpoint sourceEndpoint;
+  sourceEndpoint.set_name("127.0.0.1");
+  sourceEndpoint.set_port(freePort());
+  sockaddr_in destinationAddr;
+  int destinationFd = boundSocket(&destinationAddr);
+  SocketEndpoint destinationEndpoint;
+  destinationEndpoint.set_name("127.0.0.1");
+  destinationEndpoint.set_port(ntohs(destinationAddr.sin_port));
+
+  DatagramSourceHandler source(sourceEndpoint, destinationEndpoint);
+  SocketIdAllocator socketIds;
+  sockaddr_in sourceAddr = {};
+  sourceAddr.sin_family = AF_INET;
+  sourceAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sourceAddr.sin_port = htons(sourceEndpoint.port());
+
+  // Two peers, so two flows, and datagrams of different sizes
+  sockaddr_in peerAddr;
+  int peers[2] = {boundSocket(&peerAddr), boundSocket(&peerAddr)};
+  const vector<string> sent = {"a", string(3000, 'b'), "", "dd"};
+  for (size_t a = 0; a < sent.size(); a++) {
+    REQUIRE(::sendto(peers[a % 2], sent[a].data(), sent[a].length(), 0,
+                     (sockaddr*)&sourceAddr,
+                     sizeof(sourceAddr)) == ssize_t(sent[a].length()));
+  }
+  vector<PortForwardDestinationRequest> requests;
+  vector<PortForwardData> data;
+  readSource(&source, &socketIds, sent.size(), &requests, &data);
+  REQUIRE(requests.size() == 2);
+  for (auto& pfr : requests) {
+    REQUIRE(pfr.udp());
+    REQUIRE(pfr.has_socketid());
+    REQUIRE(pfr.destination().port() == destinationEndpoint.port());
+  }
+  REQUIRE(requests[0].socketid() != requests[1].socketid());
+  REQUIRE(source.hasFlows());
+
+  // The destination side opens a flow per request and sends each datagram
+  // as it came
+  unordered_map<int, shared_ptr<DatagramDestinationHandler>> flows;
+  for (auto& pfr : requests) {
+    int fd = DatagramSocket::connect(destinationEndpoint);
+    REQUIRE(fd >= 0);
+    flows[pfr.socketid()] =
+        make_shared<DatagramDestinationHandler>(fd, pfr.socketid());
+  }
+  for (auto& pwd : data) {
+    REQUIRE(pwd.sourcetodestination());
+    REQUIRE(flows.count(pwd.socketid()));
+    flows[pwd.socketid()]->write(pwd.buffer());
+  }
+  for (size_t a = 0; a < sent.size(); a++) {
+    sockaddr_in from;
+    REQUIRE(receiveWithin(destinationFd, &from) == sent[a]);
+    // Answer each flow with its own port
+    string reply = std::to_string(ntohs(from.sin_port));
+    REQUIRE(::sendto(destinationFd, reply.data(), reply.length(), 0,
+                     (sockaddr*)&from,
+                     sizeof(from)) == ssize_t(reply.length()));
+  }
+
+  // Replies find their way back to the peer the flow came from
+  int replies = 0;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (replies < int(sent.size())) {
+    REQUIRE(std::chrono::steady_clock::now() < deadline);
+    for (auto& it : flows) {
+      vector<PortForwardData> back;
+      it.second->update(&back);
+      for (auto& pwd : back) {
+        REQUIRE_FALSE(pwd.sourcetodestination());
+        REQUIRE(pwd.socketid() == it.first);
+        REQUIRE(pwd.has_buffer());
+        source.sendDatagram(pwd.socketid(), pwd.buffer());
+        replies++;
+      }
+    }
+  }
+  string first = receiveWithin(peers[0]);
+  REQUIRE(receiveWithin(peers[0]) == first);
+  string second = receiveWithin(peers[1]);
+  REQUIRE(receiveWithin(peers[1]) == second);
+  REQUIRE(first != second);
+
+  for (auto& it : flows) {
+    it.second->close();
+  }
+  ::close(peers[0]);
+  ::close(peers[1]);
+  ::close(destinationFd);
+}
+
+TEST_CASE("Idle udp flows expire", "[DatagramForward]") {
+  SocketEndpoint sourceEndpoint;
+  sourceEndpoint.set_name("127.0.0.1");
+  sourceEndpoint.set_port(freePort());
+  SocketEndpoint destinationEndpoint;
+  destinationEndpoint.set_name("127.0.0.1");
+  destinationEndpoint.set_port(freePort());
+
+  DatagramSourceHandler source(sourceEndpoint, destinationEndpoint);
+  source.setIdleTimeout(std::chrono::milliseconds(100));
+  SocketIdAllocator socketIds;
+  sockaddr_in peerAddr;
+  int peer = boundSocket(&peerAddr);
+  sockaddr_in sourceAddr = peerAddr;
+  sourceAddr.sin_port = htons(sourceEndpoint.port());
+  REQUIRE(::sendto(peer, "x", 1, 0, (sockaddr*)&sourceAddr,
+                   sizeof(sourceAddr)) == 1);
+  vector<PortForwardDestinationRequest> requests;
+  vector<PortForwardData> data;
+  readSource(&source, &socketIds, 1, &requests, &data);
+  REQUIRE(requests.size() == 1);
+  int socketId = requests[0].socketid();
+
+  int fd = DatagramSocket::connect(destinationEndpoint);
+  REQUIRE(fd >= 0);
+  DatagramDestinationHandler destination(fd, socketId);
+  destination.setIdleTimeout(std::chrono::milliseconds(100));
+  vector<PortForwardData> back;
+  destination.update(&back);
+  REQUIRE(back.empty());
+  REQUIRE(destination.getFd() == fd);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  data.clear();
+  source.update(&socketIds, &requests, &data);
+  REQUIRE(data.size() == 1);
+  REQUIRE(data[0].socketid() == socketId);
+  REQUIRE(data[0].closed());
+  REQUIRE_FALSE(source.hasFlows());
+  destination.update(&back);
+  REQUIRE(back.size() == 1);
+  REQUIRE(back[0].closed());
+  REQUIRE(destination.getFd() == -1);
+
+  // The same peer opens a new flow afterwards
+  REQUIRE(::sendto(peer, "y", 1, 0, (sockaddr*)&sourceAddr,
+                   sizeof(sourceAddr)) == 1);
+  requests.clear();
+  data.clear();
+  readSource(&source, &socketIds, 1, &requests, &data);
+  REQUIRE(requests.size() == 1);
+  REQUIRE(requests[0].socketid() != socketId);
+  ::close(peer);
+}
@@ -0,0 +1,111 @@
+#include "EventLoop.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+TEST_CASE("EventLoop reports readable fds, timers and wakeups",
+          "[EventLoop]") {
+  EventLoop loop;
+  int fds[2];
+  REQUIRE(::pipe(fds) == 0);
+  loop.addFd(fds[0]);
+
+  // Nothing is pending, so a zero timeout returns empty-handed.
+  auto idle = loop.wait(0);
+  REQUIRE(idle.readableFds.empty());
+  REQUIRE(idle.timers.empty());
+  REQUIRE_FALSE(idle.woken);
+
+  REQUIRE(::write(fds[1], "x", 1) == 1);
+  auto readable = loop.wait(1000);
+  REQUIRE(readable.isReadable(fds[0]));
+  loop.removeFd(fds[0]);
+  REQUIRE_FALSE(loop.wait(0).isReadable(fds[0]));
+
+  int timer = loop.addTimer();
+  auto start = std::chrono::steady_clock::now();
+  loop.armTimer(timer, 20);
+  auto expired = loop.wait(-1);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  REQUIRE(expired.timers == vector<int>({timer}));
+  REQUIRE(elapsed >= std::chrono::milliseconds(15));
+  // One-shot: it does not fire again until re-armed.
+  REQUIRE(loop.wait(50).timers.empty());
+
+  loop.armTimer(timer, 10);
+  loop.disarmTimer(timer);
+  REQUIRE(loop.wait(50).timers.empty());
+
+  std::thread waker([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    loop.wake();
+  });
+  auto woken = loop.wait(-1);
+  waker.join();
+  REQUIRE(woken.woken);
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+TEST_CASE("EventLoop keeps watching a reused fd number", "[EventLoop]") {
+  EventLoop loop;
+  int first[2];
+  REQUIRE(::pipe(first) == 0);
+  loop.addFd(first[0]);
+  int reusedFd = first[0];
+  ::close(first[0]);
+  ::close(first[1]);
+
+  int second[2];
+  REQUIRE(::pipe(second) == 0);
+  REQUIRE(second[0] == reusedFd);
+  // The closed fd dropped out of the loop; adding the number again must
+  // register the new pipe.
+  loop.addFd(second[0]);
+  REQUIRE(::write(second[1], "x", 1) == 1);
+  REQUIRE(loop.wait(1000).isReadable(second[0]));
+
+  ::close(second[0]);
+  ::close(second[1]);
+}
+
+TEST_CASE("EventLoop reports watched signals", "[EventLoop]") {
+  EventLoop loop;
+  loop.watchSignal(SIGWINCH);
+
+  REQUIRE(::raise(SIGWINCH) == 0);
+  auto events = loop.wait(1000);
+  REQUIRE(events.signals == vector<int>({SIGWINCH}));
+
+  // Also when the signal is sent to the process from another thread.
+  std::thread sender([]() { ::kill(::getpid(), SIGWINCH); });
+  sender.join();
+  events = loop.wait(1000);
+  REQUIRE(std::count(events.signals.begin(), events.signals.end(),
+                     SIGWINCH) >= 1);
+  REQUIRE(loop.wait(0).signals.empty());
+}
+
+TEST_CASE("EventLoop reports writability only while asked", "[EventLoop]") {
+  EventLoop loop;
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  loop.addFd(fds[0]);
+
+  REQUIRE(loop.wait(0).writableFds.empty());
+  loop.watchWritable(fds[0], true);
+  auto events = loop.wait(0);
+  REQUIRE(events.isWritable(fds[0]));
+  REQUIRE_FALSE(events.isReadable(fds[0]));
+
+  // Dropping write interest keeps the read registration.
+  loop.watchWritable(fds[0], false);
+  REQUIRE(::write(fds[1], "x", 1) == 1);
+  events = loop.wait(1000);
+  REQUIRE(events.isReadable(fds[0]));
+  REQUIRE_FALSE(events.isWritable(fds[0]));
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
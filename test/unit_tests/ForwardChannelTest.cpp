@@ -0,0 +1,327 @@
+#include "CryptoHandler.hpp"
+#include "ForwardChannel.hpp"
+#include "TerminalPackets.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+namespace {
+// Forwards to OS socket descriptors, like the tunnel socket handlers.
+class FdSocketHandler : public SocketHandler {
+ public:
+  bool hasData(int fd) override { return waitOnSocketReady(fd, false, 0); }
+  ssize_t read(int fd, void* buf, size_t count) override {
+    return ::read(fd, buf, count);
+  }
+  ssize_t write(int fd, const void* buf, size_t count) override {
+    return ::write(fd, buf, count);
+  }
+  int connect(const SocketEndpoint&) override { return -1; }
+  set<int> listen(const SocketEndpoint&) override { return {}; }
+  set<int> getEndpointFds(const SocketEndpoint&) override { return {}; }
+  int accept(int) override { return -1; }
+  void stopListening(const SocketEndpoint&) override {}
+  void close(int fd) override { ::close(fd); }
+  vector<int> getActiveSockets() override { return {}; }
+};
+
+// A socket pair whose first end is non-blocking, like a tunnel socket.
+void tunnelPair(int fds[2]) {
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  REQUIRE(::fcntl(fds[0], F_SETFL, ::fcntl(fds[0], F_GETFL) | O_NONBLOCK) ==
+          0);
+}
+
+int64_t drain(int fd) {
+  int64_t total = 0;
+  char buf[64 * 1024];
+  ssize_t rc;
+  while ((rc = ::recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    total += rc;
+  }
+  return total;
+}
+
+int64_t lastConsumed(const vector<PortForwardData>& staged) {
+  int64_t consumed = -1;
+  for (auto& pwd : staged) {
+    if (pwd.has_consumed()) {
+      consumed = pwd.consumed();
+    }
+  }
+  return consumed;
+}
+}  // namespace
+
+TEST_CASE("A stalled tunnel does not hold up a fast one", "[ForwardChannel]") {
+  auto handler = make_shared<FdSocketHandler>();
+  int stalledFds[2];
+  int fastFds[2];
+  tunnelPair(stalledFds);
+  tunnelPair(fastFds);
+  ForwardChannel stalled(handler, stalledFds[0], 1, false);
+  ForwardChannel fast(handler, fastFds[0], 2, false);
+  stalled.setSendWindowUpdates(true);
+  fast.setSendWindowUpdates(true);
+
+  // The peer sends a full window to each; nobody reads the stalled one
+  const string chunk(16 * 1024, 'x');
+  const int64_t total = ForwardChannel::WINDOW;
+  int64_t fastReceived = 0;
+  vector<PortForwardData> fastUpdates;
+  auto start = std::chrono::steady_clock::now();
+  for (int64_t sent = 0; sent < total; sent += chunk.length()) {
+    stalled.write(chunk);
+    fast.write(chunk);
+    fastReceived += drain(fastFds[1]);
+    fast.update(&fastUpdates);
+  }
+  while (fast.hasQueuedData() || fastReceived < total) {
+    fastReceived += drain(fastFds[1]);
+    fast.update(&fastUpdates);
+  }
+  // Writing used to wait up to 30 seconds on the stalled socket
+  REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+  REQUIRE(fastReceived == total);
+  REQUIRE(stalled.hasQueuedData());
+
+  // Each channel only tells the peer what its own consumer took
+  fast.update(&fastUpdates);
+  REQUIRE(lastConsumed(fastUpdates) > total - ForwardChannel::UPDATE_BYTES);
+  vector<PortForwardData> stalledUpdates;
+  stalled.update(&stalledUpdates);
+  REQUIRE(lastConsumed(stalledUpdates) >= 0);
+  REQUIRE(lastConsumed(stalledUpdates) < lastConsumed(fastUpdates));
+
+  // A close from the peer waits for the queue to drain
+  stalled.finish();
+  REQUIRE(stalled.getFd() == stalledFds[0]);
+  int64_t stalledReceived = 0;
+  while (stalled.getFd() != -1) {
+    stalledReceived += drain(stalledFds[1]);
+    vector<PortForwardData> staged;
+    stalled.update(&staged);
+  }
+  stalledReceived += drain(stalledFds[1]);
+  REQUIRE(stalledReceived == total);
+
+  fast.close();
+  ::close(stalledFds[1]);
+  ::close(fastFds[1]);
+}
+
+TEST_CASE("A tunnel too far behind a peer without windows is closed",
+          "[ForwardChannel]") {
+  auto handler = make_shared<FdSocketHandler>();
+  int fds[2];
+  tunnelPair(fds);
+  ForwardChannel channel(handler, fds[0], 5, false);
+
+  // Nobody reads the socket and the peer keeps sending
+  const string chunk(16 * 1024, 'x');
+  auto start = std::chrono::steady_clock::now();
+  for (int64_t sent = 0; sent <= 2 * ForwardChannel::MAX_QUEUED_BYTES;
+       sent += chunk.length()) {
+    channel.write(chunk);
+  }
+  REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+  REQUIRE_FALSE(channel.hasQueuedData());
+
+  // The peer hears about it and the socket is closed
+  vector<PortForwardData> staged;
+  channel.update(&staged);
+  REQUIRE(staged.size() == 1);
+  REQUIRE(staged[0].socketid() == 5);
+  REQUIRE(staged[0].has_error());
+  REQUIRE(channel.getFd() == -1);
+  ::close(fds[1]);
+}
+
+TEST_CASE("A tunnel stops reading at the peer's window", "[ForwardChannel]") {
+  auto handler = make_shared<FdSocketHandler>();
+  int fds[2];
+  tunnelPair(fds);
+  ForwardChannel channel(handler, fds[0], 3, true);
+
+  // Without window updates from the peer reads are not limited
+  const string chunk(2048, 'y');
+  int64_t staged = 0;
+  auto feed = [&]() {
+    REQUIRE(::write(fds[1], chunk.data(), chunk.length()) ==
+            ssize_t(chunk.length()));
+    vector<PortForwardData> data;
+    channel.update(&data);
+    for (auto& pwd : data) {
+      REQUIRE(pwd.sourcetodestination());
+      REQUIRE(pwd.socketid() == 3);
+      staged += pwd.buffer().length();
+    }
+  };
+  feed();
+  REQUIRE(staged == int64_t(chunk.length()));
+
+  channel.windowUpdate(staged);
+  while (channel.canRead()) {
+    feed();
+  }
+  REQUIRE(staged == int64_t(chunk.length()) + ForwardChannel::WINDOW);
+  // What the socket still holds waits for the peer
+  feed();
+  REQUIRE(staged == int64_t(chunk.length()) + ForwardChannel::WINDOW);
+
+  channel.windowUpdate(staged);
+  REQUIRE(channel.canRead());
+  vector<PortForwardData> data;
+  channel.update(&data);
+  REQUIRE(data.size() > 0);
+
+  channel.close();
+  ::close(fds[1]);
+}
+
+TEST_CASE("A paused tunnel is not read", "[ForwardChannel]") {
+  auto handler = make_shared<FdSocketHandler>();
+  int fds[2];
+  tunnelPair(fds);
+  ForwardChannel channel(handler, fds[0], 4, true);
+  const string chunk(1024, 'p');
+  REQUIRE(::write(fds[1], chunk.data(), chunk.length()) ==
+          ssize_t(chunk.length()));
+
+  channel.setReadsPaused(true);
+  REQUIRE(!channel.canRead());
+  vector<PortForwardData> data;
+  channel.update(&data);
+  REQUIRE(data.empty());
+
+  // Nothing was lost while paused
+  channel.setReadsPaused(false);
+  REQUIRE(channel.canRead());
+  channel.update(&data);
+  REQUIRE(data.size() == 1);
+  REQUIRE(data[0].buffer() == chunk);
+
+  channel.close();
+  ::close(fds[1]);
+}
+
+namespace {
+// Connects two TCP sockets over loopback; the second is non-blocking, like
+// a tunnel socket.
+void loopbackPair(int fds[2]) {
+  int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+  REQUIRE(listener >= 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrLen = sizeof(addr);
+  REQUIRE(::bind(listener, (sockaddr*)&addr, addrLen) == 0);
+  REQUIRE(::listen(listener, 1) == 0);
+  REQUIRE(::getsockname(listener, (sockaddr*)&addr, &addrLen) == 0);
+  fds[0] = ::socket(AF_INET, SOCK_STREAM, 0);
+  REQUIRE(::connect(fds[0], (sockaddr*)&addr, addrLen) == 0);
+  fds[1] = ::accept(listener, NULL, NULL);
+  REQUIRE(fds[1] >= 0);
+  ::close(listener);
+  REQUIRE(::fcntl(fds[1], F_SETFL, ::fcntl(fds[1], F_GETFL) | O_NONBLOCK) ==
+          0);
+}
+
+// Pushes 64MB from one loopback socket to another through a pair of
+// channels, with every packet encrypted and decrypted as on the wire, and
+// returns MB/s.  The kilobyte pump stands in for the source channel the
+// way it read before: a select() and a packet per kilobyte.
+double tunnelMbPerSecond(bool kilobytePump) {
+  const int64_t total = 64 * 1024 * 1024;
+  auto handler = make_shared<FdSocketHandler>();
+  int in[2];
+  int out[2];
+  loopbackPair(in);
+  loopbackPair(out);
+  ForwardChannel source(handler, in[1], 1, true);
+  ForwardChannel destination(handler, out[1], 1, true);
+  destination.setSendWindowUpdates(true);
+  const string key = "12345678901234567890123456789012";
+  auto encryptHandler = make_shared<CryptoHandler>(key, 0);
+  auto decryptHandler = make_shared<CryptoHandler>(key, 0);
+
+  auto start = std::chrono::steady_clock::now();
+  std::thread producer([&]() {
+    const string chunk(64 * 1024, 'z');
+    for (int64_t sent = 0; sent < total;) {
+      ssize_t rc = ::write(in[0], chunk.data(), chunk.length());
+      if (rc < 0) {
+        break;
+      }
+      sent += rc;
+    }
+  });
+  std::atomic<bool> done(false);
+  std::thread consumer([&]() {
+    string buf(256 * 1024, '\0');
+    int64_t received = 0;
+    while (received < total) {
+      ssize_t rc = ::read(out[0], &buf[0], buf.length());
+      if (rc <= 0) {
+        break;
+      }
+      received += rc;
+    }
+    done = true;
+  });
+
+  while (!done) {
+    vector<PortForwardData> staged;
+    if (kilobytePump) {
+      while (handler->hasData(in[1])) {
+        char buf[1024];
+        ssize_t bytesRead = handler->read(in[1], buf, sizeof(buf));
+        if (bytesRead <= 0) {
+          break;
+        }
+        PortForwardData pwd;
+        pwd.set_socketid(1);
+        pwd.set_sourcetodestination(true);
+        pwd.set_buffer(string(buf, bytesRead));
+        staged.push_back(pwd);
+      }
+    } else {
+      source.update(&staged);
+    }
+    destination.update(&staged);
+    for (auto& pwd : staged) {
+      Packet packet = TerminalPackets::portForwardData(pwd, true);
+      packet.encrypt(encryptHandler);
+      Packet received(packet.serialize());
+      received.decrypt(decryptHandler);
+      if (received.getHeader() ==
+          TerminalPacketType::PORT_FORWARD_DATA_RAW) {
+        destination.write(received.getPayload().substr(
+            TerminalPackets::RAW_PORT_FORWARD_HEADER_LENGTH));
+      } else {
+        source.windowUpdate(
+            stringToProto<PortForwardData>(received.getPayload()).consumed());
+      }
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  producer.join();
+  consumer.join();
+  source.close();
+  destination.close();
+  ::close(in[0]);
+  ::close(out[0]);
+  double seconds =
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() /
+      1000000.0;
+  return total / (1024.0 * 1024.0) / seconds;
+}
+}  // namespace
+
+TEST_CASE("Tunnel throughput over loopback", "[.][TunnelBenchmark]") {
+  double kilobytes = tunnelMbPerSecond(true);
+  double large = tunnelMbPerSecond(false);
+  WARN("tunnel throughput with 1KB reads: " << kilobytes << "MB/s");
+  WARN("tunnel throughput with large reads: " << large << "MB/s");
+  REQUIRE(large > 2 * kilobytes);
+}
@@ -37,7 +37,11 @@ class MockSocketHandler : public SocketHandler {
   }
 
   ssize_t read(int /*fd*/, void* buf, size_t count) override {
-    REQUIRE_FALSE(readQueue.empty());
+    if (readQueue.empty()) {
+      // Like a drained non-blocking socket
+      SetErrno(EAGAIN);
+      return -1;
+    }
     auto read = readQueue.front();
     readQueue.pop_front();
     SetErrno(read.errnoValue);
@@ -389,13 +393,17 @@ TEST_CASE("ForwardSourceHandler getActiveFds returns all fd types",
   set<int> fds;
   handler.getActiveFds(&fds);
 
-  // Should contain: endpoint fds (100, 101), socketFdMap fd (42),
-  // unassigned fd (43)
-  CHECK(fds.count(100) == 1);
-  CHECK(fds.count(101) == 1);
+  // Should contain: socketFdMap fd (42), unassigned fd (43)
   CHECK(fds.count(42) == 1);
   CHECK(fds.count(43) == 1);
-  CHECK(fds.size() == 4);
+  CHECK(fds.size() == 2);
+
+  // and the endpoint fds (100, 101) are the listen fds
+  set<int> listenFds;
+  handler.getListenFds(&listenFds);
+  CHECK(listenFds.count(100) == 1);
+  CHECK(listenFds.count(101) == 1);
+  CHECK(listenFds.size() == 2);
 }
 
 TEST_CASE("ForwardSourceHandler getActiveFds with no sockets",
@@ -414,9 +422,14 @@ TEST_CASE("ForwardSourceHandler getActiveFds with no sockets",
   set<int> fds;
   handler.getActiveFds(&fds);
 
-  // Should contain only the endpoint fd
-  CHECK(fds.count(100) == 1);
-  CHECK(fds.size() == 1);
+  // Nothing to read until a connection is accepted
+  CHECK(fds.empty());
+
+  // Only the endpoint fd is listened on
+  set<int> listenFds;
+  handler.getListenFds(&listenFds);
+  CHECK(listenFds.count(100) == 1);
+  CHECK(listenFds.size() == 1);
 }
 
 TEST_CASE("ForwardSourceHandler closeSocket closes and removes socket",
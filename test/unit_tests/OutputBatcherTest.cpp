@@ -0,0 +1,48 @@
+#include "OutputBatcher.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+TEST_CASE("OutputBatcher sends output after an idle period at once",
+          "[OutputBatcher]") {
+  OutputBatcher batcher(50000);
+  REQUIRE(batcher.usUntilReady() == -1);
+
+  batcher.append("a", 1);
+  REQUIRE(batcher.isReady());
+  REQUIRE(batcher.take() == "a");
+  REQUIRE(batcher.empty());
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  batcher.append("b", 1);
+  REQUIRE(batcher.isReady());
+}
+
+TEST_CASE("OutputBatcher gathers a burst", "[OutputBatcher]") {
+  OutputBatcher batcher(50000);
+  batcher.append("first", 5);
+  REQUIRE(batcher.take() == "first");
+
+  // Output right behind the previous send waits for the window.
+  batcher.append("a", 1);
+  batcher.append("b", 1);
+  int64_t waitUs = batcher.usUntilReady();
+  REQUIRE(waitUs > 0);
+  REQUIRE(waitUs <= 50000);
+  REQUIRE_FALSE(batcher.isReady());
+  std::this_thread::sleep_for(std::chrono::microseconds(waitUs));
+  REQUIRE(batcher.isReady());
+  REQUIRE(batcher.take() == "ab");
+
+  // A full batch does not wait.
+  string big(OutputBatcher::MAX_BATCH_BYTES, 'x');
+  batcher.append(big.data(), big.length());
+  REQUIRE(batcher.isReady());
+  REQUIRE(batcher.take().length() == big.length());
+
+  OutputBatcher unbatched(0);
+  unbatched.append("a", 1);
+  REQUIRE(unbatched.take() == "a");
+  unbatched.append("b", 1);
+  REQUIRE(unbatched.isReady());
+}
@@ -0,0 +1,58 @@
+#include "OutputCredit.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+TEST_CASE("OutputCredit limits output once the client grants credit",
+          "[OutputCredit]") {
+  OutputCredit credit;
+  const int64_t window = OutputCredit::MIN_WINDOW;
+
+  // Clients that never grant are not limited
+  credit.sent(10 * window);
+  REQUIRE(credit.hasCredit());
+  REQUIRE_FALSE(credit.isEnabled());
+
+  credit.granted(10 * window);
+  REQUIRE(credit.isEnabled());
+  REQUIRE(credit.inFlight() == 0);
+  credit.sent(window - 1);
+  REQUIRE(credit.hasCredit());
+  credit.sent(1);
+  REQUIRE_FALSE(credit.hasCredit());
+
+  // Old grants and grants past what was sent change nothing
+  credit.granted(5);
+  REQUIRE(credit.inFlight() == window);
+  credit.granted(100 * window);
+  REQUIRE(credit.inFlight() == 0);
+  REQUIRE(credit.hasCredit());
+}
+
+TEST_CASE("OutputCredit sizes the window from the bandwidth-delay product",
+          "[OutputCredit]") {
+  OutputCredit credit;
+  auto now = OutputCredit::Clock::now();
+  credit.granted(0, now);
+
+  // 1MB/s with a 100ms round trip holds 100KB, and the window is twice that
+  const int64_t chunk = 10 * 1000;
+  int64_t sent = 0;
+  for (int a = 0; a < 100; a++) {
+    credit.sent(chunk, now + std::chrono::milliseconds(10 * a));
+    sent += chunk;
+    if (a >= 10) {
+      credit.granted(sent - 10 * chunk,
+                     now + std::chrono::milliseconds(10 * a));
+    }
+  }
+  REQUIRE(credit.getWindow() >= 200 * 1000);
+  REQUIRE(credit.getWindow() <= 230 * 1000);
+
+  // A fast local link never goes below the minimum
+  OutputCredit local;
+  local.granted(0, now);
+  local.sent(100, now);
+  local.granted(100, now + std::chrono::microseconds(50));
+  REQUIRE(local.getWindow() == int64_t(OutputCredit::MIN_WINDOW));
+}
@@ -1,4 +1,5 @@
 #include "PortForwardHandler.hpp"
+#include "TerminalPackets.hpp"
 #include "TestHeaders.hpp"
 
 using namespace et;
@@ -149,6 +150,7 @@ TEST_CASE("PortForwardHandler update with no handlers",
   vector<PortForwardDestinationRequest> requests;
   vector<PortForwardData> dataToSend;
 
+  handler.accept(100, &requests);
   handler.update(&requests, &dataToSend);
 
   CHECK(requests.empty());
@@ -350,6 +352,35 @@ TEST_CASE("PortForwardHandler handlePacket PORT_FORWARD_DATA destination",
   CHECK(networkHandler->writes[42][0] == "test data");
 }
 
+TEST_CASE("PortForwardHandler handlePacket PORT_FORWARD_DATA_RAW destination",
+          "[PortForwardHandler]") {
+  auto networkHandler = make_shared<FakePortForwardSocketHandler>();
+  auto pipeHandler = make_shared<FakePortForwardSocketHandler>();
+  PortForwardHandler handler(networkHandler, pipeHandler);
+  auto connection = make_shared<FakeConnection>();
+
+  networkHandler->setConnectResult(42);
+  PortForwardDestinationRequest destRequest;
+  SocketEndpoint destination;
+  destination.set_port(8080);
+  *destRequest.mutable_destination() = destination;
+  destRequest.set_fd(100);
+  PortForwardDestinationResponse destResponse =
+      handler.createDestination(destRequest);
+  REQUIRE_FALSE(destResponse.has_error());
+
+  PortForwardData data;
+  data.set_sourcetodestination(true);
+  data.set_socketid(destResponse.socketid());
+  data.set_buffer(string("raw\0data", 8));
+  Packet packet = TerminalPackets::portForwardData(data, true);
+  REQUIRE(packet.getHeader() == TerminalPacketType::PORT_FORWARD_DATA_RAW);
+  handler.handlePacket(packet, connection);
+
+  REQUIRE(networkHandler->writes.count(42) == 1);
+  CHECK(networkHandler->writes[42][0] == string("raw\0data", 8));
+}
+
 TEST_CASE("PortForwardHandler handlePacket PORT_FORWARD_DATA close destination",
           "[PortForwardHandler]") {
   auto networkHandler = make_shared<FakePortForwardSocketHandler>();
@@ -464,7 +495,6 @@ TEST_CASE("PortForwardHandler handlePacket PORT_FORWARD_DESTINATION_RESPONSE",
 
   // Simulate accepting a connection on the source
   vector<PortForwardDestinationRequest> requests;
-  vector<PortForwardData> dataToSend;
 
   // Get the listen fd
   auto fds = networkHandler->getEndpointFds(source);
@@ -473,7 +503,7 @@ TEST_CASE("PortForwardHandler handlePacket PORT_FORWARD_DESTINATION_RESPONSE",
 
   // Queue an accept
   networkHandler->queueAccept(listenFd, 123);
-  handler.update(&requests, &dataToSend);
+  handler.accept(listenFd, &requests);
 
   REQUIRE(requests.size() == 1);
   int clientFd = requests[0].fd();
@@ -514,14 +544,13 @@ TEST_CASE(
 
   // Simulate accepting a connection on the source
   vector<PortForwardDestinationRequest> requests;
-  vector<PortForwardData> dataToSend;
 
   auto fds = networkHandler->getEndpointFds(source);
   REQUIRE_FALSE(fds.empty());
   int listenFd = *(fds.begin());
 
   networkHandler->queueAccept(listenFd, 123);
-  handler.update(&requests, &dataToSend);
+  handler.accept(listenFd, &requests);
 
   REQUIRE(requests.size() == 1);
   int clientFd = requests[0].fd();
@@ -558,14 +587,13 @@ TEST_CASE("PortForwardHandler closeSourceFd", "[PortForwardHandler]") {
 
   // Accept a connection
   vector<PortForwardDestinationRequest> requests;
-  vector<PortForwardData> dataToSend;
 
   auto fds = networkHandler->getEndpointFds(source);
   REQUIRE_FALSE(fds.empty());
   int listenFd = *(fds.begin());
 
   networkHandler->queueAccept(listenFd, 123);
-  handler.update(&requests, &dataToSend);
+  handler.accept(listenFd, &requests);
 
   REQUIRE(requests.size() == 1);
   int clientFd = requests[0].fd();
@@ -596,14 +624,13 @@ TEST_CASE("PortForwardHandler addSourceSocketId", "[PortForwardHandler]") {
 
   // Accept a connection
   vector<PortForwardDestinationRequest> requests;
-  vector<PortForwardData> dataToSend;
 
   auto fds = networkHandler->getEndpointFds(source);
   REQUIRE_FALSE(fds.empty());
   int listenFd = *(fds.begin());
 
   networkHandler->queueAccept(listenFd, 123);
-  handler.update(&requests, &dataToSend);
+  handler.accept(listenFd, &requests);
 
   REQUIRE(requests.size() == 1);
   int clientFd = requests[0].fd();
@@ -634,14 +661,13 @@ TEST_CASE("PortForwardHandler closeSourceSocketId", "[PortForwardHandler]") {
 
   // Accept and map a connection
   vector<PortForwardDestinationRequest> requests;
-  vector<PortForwardData> dataToSend;
 
   auto fds = networkHandler->getEndpointFds(source);
   REQUIRE_FALSE(fds.empty());
   int listenFd = *(fds.begin());
 
   networkHandler->queueAccept(listenFd, 123);
-  handler.update(&requests, &dataToSend);
+  handler.accept(listenFd, &requests);
 
   REQUIRE(requests.size() == 1);
   int clientFd = requests[0].fd();
@@ -656,6 +682,54 @@ TEST_CASE("PortForwardHandler closeSourceSocketId", "[PortForwardHandler]") {
                   clientFd) != networkHandler->closedFds.end());
 }
 
+TEST_CASE("PortForwardHandler accepts only on the readable listener",
+          "[PortForwardHandler]") {
+  auto networkHandler = make_shared<FakePortForwardSocketHandler>();
+  auto pipeHandler = make_shared<FakePortForwardSocketHandler>();
+  PortForwardHandler handler(networkHandler, pipeHandler);
+
+  // Two forwarded ports
+  vector<int> listenFds;
+  for (int port : {8080, 8081}) {
+    PortForwardSourceRequest sourceRequest;
+    sourceRequest.mutable_source()->set_port(port);
+    sourceRequest.mutable_destination()->set_port(port + 1000);
+    handler.createSource(sourceRequest, nullptr, 1000, 1000);
+    auto fds = networkHandler->getEndpointFds(sourceRequest.source());
+    REQUIRE(fds.size() == 1);
+    listenFds.push_back(*(fds.begin()));
+  }
+  set<int> watched;
+  handler.getListenFds(&watched);
+  REQUIRE(watched == set<int>(listenFds.begin(), listenFds.end()));
+
+  // Everything waiting on the readable one is accepted at once
+  networkHandler->queueAccept(listenFds[0], 123);
+  networkHandler->queueAccept(listenFds[0], 124);
+  networkHandler->queueAccept(listenFds[1], 125);
+  vector<PortForwardDestinationRequest> requests;
+  handler.accept(listenFds[0], &requests);
+  REQUIRE(requests.size() == 2);
+  CHECK(requests[0].fd() == 123);
+  CHECK(requests[1].fd() == 124);
+  CHECK(requests[0].destination().port() == 9080);
+  CHECK(networkHandler->acceptQueue[listenFds[1]].size() == 1);
+
+  // Other fds are not listeners
+  handler.accept(123, &requests);
+  CHECK(requests.size() == 2);
+
+  // Each accepted socket is found by fd
+  handler.addSourceSocketId(7, 123);
+  handler.closeSourceFd(124);
+  handler.sendDataToSourceOnSocket(7, "mapped");
+  REQUIRE(networkHandler->writes.count(123) == 1);
+  CHECK(networkHandler->writes[123][0] == "mapped");
+  CHECK(std::find(networkHandler->closedFds.begin(),
+                  networkHandler->closedFds.end(),
+                  124) != networkHandler->closedFds.end());
+}
+
 TEST_CASE("PortForwardHandler getForwardFds with no handlers",
           "[PortForwardHandler]") {
   auto networkHandler = make_shared<FakePortForwardSocketHandler>();
@@ -675,7 +749,7 @@ TEST_CASE(
   auto pipeHandler = make_shared<FakePortForwardSocketHandler>();
   PortForwardHandler handler(networkHandler, pipeHandler);
 
-  // Create a source (this creates a listener fd via listen())
+  // Create a source (this creates a listener fd)
   PortForwardSourceRequest sourceRequest;
   SocketEndpoint source;
   source.set_port(8080);
@@ -698,12 +772,16 @@ TEST_CASE(
 
   set<int> fds;
   handler.getForwardFds(&fds);
+  set<int> listenFds;
+  handler.getListenFds(&listenFds);
 
-  // Should include the source listener fd (assigned by
-  // FakePortForwardSocketHandler)
+  // The source listener fd (assigned by FakePortForwardSocketHandler) is
+  // only a listen fd
   auto sourceFds = networkHandler->getEndpointFds(source);
+  REQUIRE_FALSE(sourceFds.empty());
   for (int fd : sourceFds) {
-    CHECK(fds.count(fd) == 1);
+    CHECK(listenFds.count(fd) == 1);
+    CHECK(fds.count(fd) == 0);
   }
 
   // Should include the destination fd (42)
@@ -763,14 +841,13 @@ TEST_CASE("PortForwardHandler sendDataToSourceOnSocket",
 
   // Accept and map a connection
   vector<PortForwardDestinationRequest> requests;
-  vector<PortForwardData> dataToSend;
 
   auto fds = networkHandler->getEndpointFds(source);
   REQUIRE_FALSE(fds.empty());
   int listenFd = *(fds.begin());
 
   networkHandler->queueAccept(listenFd, 123);
-  handler.update(&requests, &dataToSend);
+  handler.accept(listenFd, &requests);
 
   REQUIRE(requests.size() == 1);
   int clientFd = requests[0].fd();
@@ -783,3 +860,479 @@ TEST_CASE("PortForwardHandler sendDataToSourceOnSocket",
   REQUIRE(networkHandler->writes.count(clientFd) == 1);
   CHECK(networkHandler->writes[clientFd][0] == "hello world");
 }
+
+TEST_CASE("PortForwardHandler opens tunnels early", "[PortForwardHandler]") {
+  auto networkHandler = make_shared<FakePortForwardSocketHandler>();
+  auto pipeHandler = make_shared<FakePortForwardSocketHandler>();
+  PortForwardHandler handler(networkHandler, pipeHandler);
+  handler.setOpenEarly(true);
+
+  PortForwardSourceRequest sourceRequest;
+  sourceRequest.mutable_source()->set_port(8080);
+  sourceRequest.mutable_destination()->set_port(9090);
+  handler.createSource(sourceRequest, nullptr, 1000, 1000);
+  auto fds = networkHandler->getEndpointFds(sourceRequest.source());
+  REQUIRE(fds.size() == 1);
+  int listenFd = *(fds.begin());
+
+  // The request carries the id, and data follows without a response
+  networkHandler->queueAccept(listenFd, 123);
+  networkHandler->queueRead(123, 5, "hello");
+  vector<PortForwardDestinationRequest> requests;
+  handler.accept(listenFd, &requests);
+  REQUIRE(requests.size() == 1);
+  REQUIRE(requests[0].has_socketid());
+  int socketId = requests[0].socketid();
+  vector<PortForwardData> dataToSend;
+  handler.update(&requests, &dataToSend);
+  REQUIRE(dataToSend.size() == 1);
+  CHECK(dataToSend[0].socketid() == socketId);
+  CHECK(dataToSend[0].buffer() == "hello");
+
+  handler.sendDataToSourceOnSocket(socketId, "world");
+  REQUIRE(networkHandler->writes.count(123) == 1);
+  CHECK(networkHandler->writes[123][0] == "world");
+
+  // A destination that could not connect closes the socket
+  PortForwardData failure;
+  failure.set_socketid(socketId);
+  failure.set_sourcetodestination(false);
+  failure.set_error("Connection refused");
+  handler.handlePacket(Packet(uint8_t(TerminalPacketType::PORT_FORWARD_DATA),
+                              protoToString(failure)),
+                       make_shared<FakeConnection>());
+  CHECK(std::find(networkHandler->closedFds.begin(),
+                  networkHandler->closedFds.end(),
+                  123) != networkHandler->closedFds.end());
+
+  // Its slot is free again, under a new id
+  networkHandler->queueAccept(listenFd, 124);
+  requests.clear();
+  handler.accept(listenFd, &requests);
+  REQUIRE(requests.size() == 1);
+  const int slotMask = SocketIdAllocator::MAX_SLOTS - 1;
+  CHECK((requests[0].socketid() & slotMask) == (socketId & slotMask));
+  CHECK(requests[0].socketid() != socketId);
+}
+
+TEST_CASE("PortForwardHandler connects early opened tunnels",
+          "[PortForwardHandler]") {
+  auto networkHandler = make_shared<FakePortForwardSocketHandler>();
+  auto pipeHandler = make_shared<FakePortForwardSocketHandler>();
+  PortForwardHandler handler(networkHandler, pipeHandler);
+  auto connection = make_shared<FakeConnection>();
+
+  PortForwardDestinationRequest request;
+  request.mutable_destination()->set_port(8080);
+  request.set_fd(100);
+  request.set_socketid(7);
+  auto requestPacket = [&]() {
+    return Packet(uint8_t(TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST),
+                  protoToString(request));
+  };
+  // Connects run in the background, so updates pick up how they went
+  vector<PortForwardDestinationRequest> requests;
+  vector<PortForwardData> dataToSend;
+  auto updateUntil = [&](std::function<bool()> done) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!done()) {
+      REQUIRE(std::chrono::steady_clock::now() < deadline);
+      handler.update(&requests, &dataToSend);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  };
+
+  // Nothing is sent back when the connect works, and data that comes
+  // before it waits for the socket
+  networkHandler->setConnectResult(42);
+  handler.handlePacket(requestPacket(), connection);
+  CHECK(connection->sentPackets.empty());
+  PortForwardData data;
+  data.set_sourcetodestination(true);
+  data.set_socketid(7);
+  data.set_buffer("early");
+  handler.handlePacket(Packet(uint8_t(TerminalPacketType::PORT_FORWARD_DATA),
+                              protoToString(data)),
+                       connection);
+  updateUntil([&]() { return networkHandler->writes.count(42) > 0; });
+  CHECK(networkHandler->writes[42][0] == "early");
+  CHECK(dataToSend.empty());
+  CHECK(connection->sentPackets.empty());
+
+  // A failure comes back as an error for the socket
+  request.set_socketid(8);
+  networkHandler->setConnectResult(-1);
+  handler.handlePacket(requestPacket(), connection);
+  CHECK(connection->sentPackets.empty());
+  updateUntil([&]() { return !dataToSend.empty(); });
+  REQUIRE(dataToSend.size() == 1);
+  CHECK(dataToSend[0].socketid() == 8);
+  CHECK_FALSE(dataToSend[0].sourcetodestination());
+  CHECK(dataToSend[0].has_error());
+
+  // So does an id that is still in use, without connecting
+  size_t connects = networkHandler->connectEndpoints.size();
+  request.set_socketid(7);
+  handler.handlePacket(requestPacket(), connection);
+  REQUIRE(connection->sentPackets.size() == 1);
+  REQUIRE(connection->sentPackets[0].getHeader() ==
+          uint8_t(TerminalPacketType::PORT_FORWARD_DATA));
+  auto pwd =
+      stringToProto<PortForwardData>(connection->sentPackets[0].getPayload());
+  CHECK(pwd.socketid() == 7);
+  CHECK_FALSE(pwd.sourcetodestination());
+  CHECK(pwd.has_error());
+  CHECK(networkHandler->connectEndpoints.size() == connects);
+}
+
+TEST_CASE("PortForwardHandler frees the ids of legacy destinations",
+          "[PortForwardHandler]") {
+  auto networkHandler = make_shared<FakePortForwardSocketHandler>();
+  auto pipeHandler = make_shared<FakePortForwardSocketHandler>();
+  PortForwardHandler handler(networkHandler, pipeHandler);
+  // Opening our own tunnels early doesn't change who picks the ids of
+  // destinations a legacy peer asks for
+  handler.setOpenEarly(true);
+
+  networkHandler->setConnectResult(42);
+  PortForwardDestinationRequest request;
+  request.mutable_destination()->set_port(8080);
+  request.set_fd(100);
+  PortForwardDestinationResponse response = handler.createDestination(request);
+  REQUIRE_FALSE(response.has_error());
+  int socketId = response.socketid();
+
+  PortForwardData closed;
+  closed.set_sourcetodestination(true);
+  closed.set_socketid(socketId);
+  closed.set_closed(true);
+  handler.handlePacket(Packet(uint8_t(TerminalPacketType::PORT_FORWARD_DATA),
+                              protoToString(closed)),
+                       make_shared<FakeConnection>());
+  REQUIRE(std::find(networkHandler->closedFds.begin(),
+                    networkHandler->closedFds.end(),
+                    42) != networkHandler->closedFds.end());
+
+  // Its slot is free again, under a new id
+  networkHandler->setConnectResult(43);
+  request.set_fd(101);
+  response = handler.createDestination(request);
+  REQUIRE_FALSE(response.has_error());
+  const int slotMask = SocketIdAllocator::MAX_SLOTS - 1;
+  CHECK((response.socketid() & slotMask) == (socketId & slotMask));
+  CHECK(response.socketid() != socketId);
+}
+
+TEST_CASE("PortForwardHandler connects to named hosts",
+          "[PortForwardHandler]") {
+  auto networkHandler = make_shared<FakePortForwardSocketHandler>();
+  auto pipeHandler = make_shared<FakePortForwardSocketHandler>();
+  PortForwardHandler handler(networkHandler, pipeHandler);
+  std::atomic<int> callbacks(0);
+  handler.setConnectCallback([&]() { callbacks++; });
+
+  PortForwardDestinationRequest request;
+  request.mutable_destination()->set_name("example.com");
+  request.mutable_destination()->set_port(80);
+  request.set_socketid(3);
+  request.set_confirm(true);
+
+  // Only localhost, unless the handler connects to hosts
+  networkHandler->setConnectResult(42);
+  CHECK_FALSE(handler.createDestination(request).has_error());
+  vector<PortForwardDestinationRequest> requests;
+  vector<PortForwardData> dataToSend;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (dataToSend.empty()) {
+    REQUIRE(std::chrono::steady_clock::now() < deadline);
+    handler.update(&requests, &dataToSend);
+  }
+  REQUIRE(networkHandler->connectEndpoints.size() == 1);
+  CHECK(networkHandler->connectEndpoints[0].name() == "::1");
+  // The source asked to hear the socket connected
+  REQUIRE(dataToSend.size() == 1);
+  CHECK(dataToSend[0].socketid() == 3);
+  CHECK(dataToSend[0].connected());
+  CHECK_FALSE(dataToSend[0].sourcetodestination());
+  // The callback runs once the result is out
+  while (callbacks == 0) {
+    REQUIRE(std::chrono::steady_clock::now() < deadline);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  handler.setConnectHosts(true);
+  request.set_socketid(4);
+  networkHandler->setConnectResult(43);
+  CHECK_FALSE(handler.createDestination(request).has_error());
+  dataToSend.clear();
+  while (dataToSend.empty()) {
+    REQUIRE(std::chrono::steady_clock::now() < deadline);
+    handler.update(&requests, &dataToSend);
+  }
+  REQUIRE(networkHandler->connectEndpoints.size() == 2);
+  CHECK(networkHandler->connectEndpoints[1].name() == "example.com");
+  CHECK(networkHandler->connectEndpoints[1].port() == 80);
+  CHECK(dataToSend[0].socketid() == 4);
+  CHECK(dataToSend[0].connected());
+}
+
+TEST_CASE("PortForwardHandler proxies SOCKS connects",
+          "[PortForwardHandler]") {
+  auto networkHandler = make_shared<FakePortForwardSocketHandler>();
+  auto pipeHandler = make_shared<FakePortForwardSocketHandler>();
+  PortForwardHandler handler(networkHandler, pipeHandler);
+
+  PortForwardSourceRequest sourceRequest;
+  sourceRequest.mutable_source()->set_name("localhost");
+  sourceRequest.mutable_source()->set_port(1080);
+  sourceRequest.set_dynamic(true);
+  // Only a peer that takes our ids serves SOCKS
+  CHECK(handler.createSource(sourceRequest, nullptr, -1, -1).has_error());
+  handler.setOpenEarly(true);
+  REQUIRE_FALSE(
+      handler.createSource(sourceRequest, nullptr, -1, -1).has_error());
+  auto fds = networkHandler->getEndpointFds(sourceRequest.source());
+  REQUIRE(fds.size() == 1);
+  int listenFd = *(fds.begin());
+
+  // The client names its destination in the handshake, not on accept
+  networkHandler->queueAccept(listenFd, 123);
+  vector<PortForwardDestinationRequest> requests;
+  handler.accept(listenFd, &requests);
+  CHECK(requests.empty());
+  set<int> forwardFds;
+  handler.getForwardFds(&forwardFds);
+  CHECK(forwardFds.count(123));
+
+  const string greeting("\x05\x01\x00", 3);
+  const string connect =
+      string("\x05\x01\x00\x03\x0b", 5) + "example.com" + "\x01\xbb";
+  networkHandler->queueRead(123, greeting.length(), greeting);
+  networkHandler->queueRead(123, connect.length() + 5, connect + "early");
+  vector<PortForwardData> dataToSend;
+  handler.update(&requests, &dataToSend);
+  REQUIRE(networkHandler->writes[123].size() == 1);
+  CHECK(networkHandler->writes[123][0] == string("\x05\x00", 2));
+  handler.update(&requests, &dataToSend);
+  REQUIRE(requests.size() == 1);
+  CHECK(requests[0].destination().name() == "example.com");
+  CHECK(requests[0].destination().port() == 443);
+  CHECK(requests[0].confirm());
+  REQUIRE(requests[0].has_socketid());
+  int socketId = requests[0].socketid();
+  CHECK(dataToSend.empty());
+
+  // The socket waits unread for the server
+  forwardFds.clear();
+  handler.getForwardFds(&forwardFds);
+  CHECK_FALSE(forwardFds.count(123));
+
+  PortForwardData connected;
+  connected.set_socketid(socketId);
+  connected.set_sourcetodestination(false);
+  connected.set_connected(true);
+  vector<Packet> replies;
+  handler.handlePacket(Packet(uint8_t(TerminalPacketType::PORT_FORWARD_DATA),
+                              protoToString(connected)),
+                       &replies);
+  CHECK(replies.empty());
+  REQUIRE(networkHandler->writes[123].size() == 2);
+  CHECK(networkHandler->writes[123][1] ==
+        string("\x05\x00\x00\x01\x00\x00\x00\x00\x00\x00", 10));
+  // What the client sent behind its CONNECT goes out first
+  requests.clear();
+  networkHandler->queueRead(123, 5, "hello");
+  handler.update(&requests, &dataToSend);
+  REQUIRE(dataToSend.size() == 2);
+  CHECK(dataToSend[0].socketid() == socketId);
+  CHECK(dataToSend[0].buffer() == "early");
+  CHECK(dataToSend[1].buffer() == "hello");
+  handler.sendDataToSourceOnSocket(socketId, "world");
+  CHECK(networkHandler->writes[123].back() == "world");
+
+  // A connect the server could not make is refused
+  networkHandler->queueAccept(listenFd, 124);
+  handler.accept(listenFd, &requests);
+  networkHandler->queueRead(124, greeting.length() + connect.length(),
+                            greeting + connect);
+  dataToSend.clear();
+  handler.update(&requests, &dataToSend);
+  REQUIRE(requests.size() == 1);
+  PortForwardData failure;
+  failure.set_socketid(requests[0].socketid());
+  failure.set_sourcetodestination(false);
+  failure.set_error("Could not connect to example.com:443");
+  handler.handlePacket(Packet(uint8_t(TerminalPacketType::PORT_FORWARD_DATA),
+                              protoToString(failure)),
+                       &replies);
+  REQUIRE(networkHandler->writes[124].size() == 2);
+  CHECK(networkHandler->writes[124][1][1] == '\x01');
+  CHECK(std::find(networkHandler->closedFds.begin(),
+                  networkHandler->closedFds.end(),
+                  124) != networkHandler->closedFds.end());
+
+  // And so is a command other than CONNECT
+  networkHandler->queueAccept(listenFd, 125);
+  handler.accept(listenFd, &requests);
+  string bind = connect;
+  bind[1] = 2;
+  networkHandler->queueRead(125, greeting.length() + bind.length(),
+                            greeting + bind);
+  requests.clear();
+  handler.update(&requests, &dataToSend);
+  CHECK(requests.empty());
+  REQUIRE(networkHandler->writes[125].size() == 2);
+  CHECK(networkHandler->writes[125][1][1] == '\x07');
+  CHECK(std::find(networkHandler->closedFds.begin(),
+                  networkHandler->closedFds.end(),
+                  125) != networkHandler->closedFds.end());
+}
+
+TEST_CASE("PortForwardHandler forwards udp flows", "[PortForwardHandler]") {
+  auto networkHandler = make_shared<FakePortForwardSocketHandler>();
+  auto pipeHandler = make_shared<FakePortForwardSocketHandler>();
+  PortForwardHandler client(networkHandler, pipeHandler);
+  PortForwardHandler server(networkHandler, pipeHandler);
+
+  // The server side "service": a udp socket that answers every datagram
+  auto udpSocket = [](sockaddr_in* addr) {
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    REQUIRE(fd >= 0);
+    *addr = {};
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(*addr);
+    REQUIRE(::bind(fd, (sockaddr*)addr, addrLen) == 0);
+    REQUIRE(::getsockname(fd, (sockaddr*)addr, &addrLen) == 0);
+    return fd;
+  };
+  sockaddr_in serviceAddr;
+  int serviceFd = udpSocket(&serviceAddr);
+  sockaddr_in sourceAddr;
+  ::close(udpSocket(&sourceAddr));
+
+  PortForwardSourceRequest sourceRequest;
+  sourceRequest.mutable_source()->set_name("127.0.0.1");
+  sourceRequest.mutable_source()->set_port(ntohs(sourceAddr.sin_port));
+  sourceRequest.mutable_destination()->set_port(ntohs(serviceAddr.sin_port));
+  sourceRequest.set_udp(true);
+  // Flows pick their own ids, so the peer has to take them
+  CHECK(client.createSource(sourceRequest, nullptr, -1, -1).has_error());
+  client.setOpenEarly(true);
+  server.setOpenEarly(true);
+  REQUIRE_FALSE(
+      client.createSource(sourceRequest, nullptr, -1, -1).has_error());
+
+  // Moves what one side staged to the other until @p done
+  int flowId = -1;
+  auto pump = [&](PortForwardHandler* from, PortForwardHandler* to,
+                  const std::function<bool()>& done) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!done()) {
+      REQUIRE(std::chrono::steady_clock::now() < deadline);
+      vector<PortForwardDestinationRequest> requests;
+      vector<PortForwardData> dataToSend;
+      from->update(&requests, &dataToSend);
+      vector<Packet> replies;
+      for (auto& pfr : requests) {
+        REQUIRE(pfr.udp());
+        flowId = pfr.socketid();
+        to->handlePacket(
+            Packet(
+                uint8_t(TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST),
+                protoToString(pfr)),
+            &replies);
+      }
+      for (auto& pwd : dataToSend) {
+        to->handlePacket(TerminalPackets::portForwardData(pwd, true),
+                         &replies);
+      }
+      REQUIRE(replies.empty());
+    }
+  };
+
+  sockaddr_in peerAddr;
+  int peerFd = udpSocket(&peerAddr);
+  REQUIRE(::sendto(peerFd, "ping", 4, 0, (sockaddr*)&sourceAddr,
+                   sizeof(sourceAddr)) == 4);
+  char buf[64];
+  sockaddr_in from;
+  socklen_t fromLen = sizeof(from);
+  pump(&client, &server, [&]() {
+    return server.hasDatagramFlows() && waitOnSocketReady(serviceFd, false, 0);
+  });
+  REQUIRE(::recvfrom(serviceFd, buf, sizeof(buf), 0, (sockaddr*)&from,
+                     &fromLen) == 4);
+  CHECK(string(buf, 4) == "ping");
+  REQUIRE(client.hasDatagramFlows());
+
+  REQUIRE(::sendto(serviceFd, "pong", 4, 0, (sockaddr*)&from, fromLen) == 4);
+  pump(&server, &client,
+       [&]() { return waitOnSocketReady(peerFd, false, 0); });
+  REQUIRE(::recv(peerFd, buf, sizeof(buf), 0) == 4);
+  CHECK(string(buf, 4) == "pong");
+
+  // A close ends the flow on either side
+  set<int> forwardFds;
+  server.getForwardFds(&forwardFds);
+  REQUIRE(forwardFds.size() == 1);
+  PortForwardData closed;
+  closed.set_socketid(flowId);
+  closed.set_sourcetodestination(true);
+  closed.set_closed(true);
+  vector<Packet> replies;
+  server.handlePacket(Packet(uint8_t(TerminalPacketType::PORT_FORWARD_DATA),
+                             protoToString(closed)),
+                      &replies);
+  CHECK(replies.empty());
+  CHECK_FALSE(server.hasDatagramFlows());
+  client.closeSourceSocketId(flowId);
+  CHECK_FALSE(client.hasDatagramFlows());
+
+  ::close(peerFd);
+  ::close(serviceFd);
+}
+
+TEST_CASE("PortForwardHandler opens udp destinations", "[PortForwardHandler]") {
+  // Exposes the socket of a udp flow
+  class DatagramPortForwardHandler : public PortForwardHandler {
+   public:
+    using PortForwardHandler::PortForwardHandler;
+    int flowFd(int socketId) {
+      return datagramDestinations[socketId]->getFd();
+    }
+  };
+  auto networkHandler = make_shared<FakePortForwardSocketHandler>();
+  auto pipeHandler = make_shared<FakePortForwardSocketHandler>();
+  DatagramPortForwardHandler handler(networkHandler, pipeHandler);
+  auto peerOf = [&](int socketId) {
+    sockaddr_in addr = {};
+    socklen_t addrLen = sizeof(addr);
+    REQUIRE(::getpeername(handler.flowFd(socketId), (sockaddr*)&addr,
+                          &addrLen) == 0);
+    return ntohl(addr.sin_addr.s_addr);
+  };
+
+  PortForwardDestinationRequest request;
+  request.mutable_destination()->set_name("127.0.0.2");
+  request.mutable_destination()->set_port(5353);
+  request.set_udp(true);
+  request.set_socketid(1);
+  // Without hosts, flows go to localhost whatever they name
+  REQUIRE_FALSE(handler.createDestination(request).has_error());
+  CHECK(peerOf(1) == INADDR_LOOPBACK);
+
+  handler.setConnectHosts(true);
+  request.set_socketid(2);
+  REQUIRE_FALSE(handler.createDestination(request).has_error());
+  CHECK(peerOf(2) == INADDR_LOOPBACK + 1);
+
+  // An id that is still connecting over tcp is taken
+  PortForwardDestinationRequest tcpRequest;
+  tcpRequest.mutable_destination()->set_port(8080);
+  tcpRequest.set_socketid(3);
+  REQUIRE_FALSE(handler.createDestination(tcpRequest).has_error());
+  request.set_socketid(3);
+  CHECK(handler.createDestination(request).error() ==
+        "Socket id is already in use");
+}
@@ -0,0 +1,102 @@
+#include "PredictiveEcho.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+namespace {
+// Replays everything written to the console to see what the user sees.
+struct ConsoleScreen {
+  PredictiveEcho echo{24, 80};
+  ScreenModel console{24, 80};
+
+  void server(const string& s) { console.write(echo.onServerOutput(s)); }
+  void type(const string& s) { console.write(echo.onKeystrokes(s)); }
+};
+}  // namespace
+
+TEST_CASE("PredictiveEcho shows keystrokes once echoes line up",
+          "[PredictiveEcho]") {
+  ConsoleScreen screen;
+  screen.server("$ ");
+
+  // The first keystroke of a run waits for its echo.
+  screen.type("l");
+  REQUIRE(screen.echo.pendingPredictions() == 1);
+  REQUIRE(screen.echo.displayedPredictions() == 0);
+  REQUIRE(screen.console.getRowText(0) == "$");
+  screen.server("l");
+  REQUIRE(screen.echo.pendingPredictions() == 0);
+
+  // Later ones show up right away, ahead of the server.
+  screen.type("s -");
+  REQUIRE(screen.echo.displayedPredictions() == 3);
+  REQUIRE(screen.console.getRowText(0) == "$ ls -");
+  REQUIRE(screen.console.getCursorColumn() == 6);
+
+  // Partial echoes confirm the front and keep the rest on screen.
+  screen.server("s");
+  REQUIRE(screen.echo.pendingPredictions() == 2);
+  REQUIRE(screen.console.getRowText(0) == "$ ls -");
+  REQUIRE(screen.console.getCursorColumn() == 6);
+  screen.server(" -");
+  REQUIRE(screen.echo.pendingPredictions() == 0);
+  REQUIRE(screen.echo.displayedPredictions() == 0);
+  REQUIRE(screen.console.getRowText(0) == "$ ls -");
+  REQUIRE(screen.console.getCursorColumn() == 6);
+
+  // Backspace takes back a character still waiting for its echo.
+  screen.type("la\x7f");
+  REQUIRE(screen.echo.pendingPredictions() == 1);
+  REQUIRE(screen.console.getRowText(0) == "$ ls -l");
+  REQUIRE(screen.console.getCursorColumn() == 7);
+}
+
+TEST_CASE("PredictiveEcho erases mispredictions", "[PredictiveEcho]") {
+  ConsoleScreen screen;
+  screen.server("> ");
+  screen.type("a");
+  screen.server("a");
+  screen.type("bc");
+  REQUIRE(screen.console.getRowText(0) == "> abc");
+
+  // The program drew something else, so the guesses disappear.
+  screen.server("X");
+  REQUIRE(screen.echo.pendingPredictions() == 0);
+  REQUIRE(screen.console.getRowText(0) == "> aX");
+  REQUIRE(screen.console.getCursorColumn() == 4);
+
+  // After that, typing is tentative again.
+  screen.type("d");
+  REQUIRE(screen.echo.displayedPredictions() == 0);
+}
+
+TEST_CASE("PredictiveEcho never draws input that is not echoed",
+          "[PredictiveEcho]") {
+  ConsoleScreen screen;
+  screen.server("$ sudo ls");
+  screen.type("\r");
+  screen.server("\r\nPassword: ");
+  screen.type("hunter2");
+  REQUIRE(screen.echo.displayedPredictions() == 0);
+  REQUIRE(screen.console.getRowText(1) == "Password:");
+  int64_t expiry = screen.echo.msUntilExpiry();
+  REQUIRE(expiry > 0);
+  REQUIRE(expiry <= int64_t(PredictiveEcho::ECHO_TIMEOUT_MS));
+  REQUIRE(screen.echo.expire().empty());
+
+  screen.type("\r");
+  screen.server("\r\n");
+  REQUIRE(screen.echo.pendingPredictions() == 0);
+  REQUIRE(screen.echo.msUntilExpiry() == -1);
+}
+
+TEST_CASE("PredictiveEcho stays off on the alternate screen",
+          "[PredictiveEcho]") {
+  ConsoleScreen screen;
+  screen.server("\x1b[?1049h\x1b[H");
+  screen.type("i");
+  REQUIRE(screen.echo.pendingPredictions() == 0);
+  screen.server("\x1b[?1049l$ ");
+  screen.type("x");
+  REQUIRE(screen.echo.pendingPredictions() == 1);
+}
@@ -1,5 +1,6 @@
 #include "RawSocketUtils.hpp"
 #include "TestHeaders.hpp"
+#include "WriteResumeTiming.hpp"
 
 using namespace et;
 
@@ -206,3 +207,102 @@ TEST_CASE("RawSocketUtils roundtrip with multiple messages",
   writer.join();
   ::close(fds[0]);
 }
+
+TEST_CASE("RawSocketUtils writeAll resumes promptly after EAGAIN",
+          "[RawSocketUtils]") {
+  int fds[2];
+  REQUIRE(::pipe(fds) == 0);
+  REQUIRE(::fcntl(fds[1], F_SETFL, ::fcntl(fds[1], F_GETFL) | O_NONBLOCK) ==
+          0);
+
+  // The old retry loop slept 100ms per EAGAIN; waiting on writability
+  // resumes as soon as the pipe drains.
+  auto resumeDelay = fastestWriteResume(5, std::chrono::milliseconds(1), fds[1],
+                                       fds[0], RawSocketUtils::writeAll,
+                                       RawSocketUtils::readAll);
+  REQUIRE(resumeDelay < std::chrono::milliseconds(1));
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+#ifndef WIN32
+TEST_CASE("RawSocketUtils passes descriptors over a unix socket",
+          "[RawSocketUtils]") {
+  int sockets[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+  int pipeFds[2];
+  REQUIRE(::pipe(pipeFds) == 0);
+
+  RawSocketUtils::sendFd(sockets[0], pipeFds[1]);
+  int received = RawSocketUtils::receiveFd(sockets[1], 1000);
+  REQUIRE(received >= 0);
+  REQUIRE(received != pipeFds[1]);
+  REQUIRE((::fcntl(received, F_GETFD) & FD_CLOEXEC));
+
+  // The received descriptor is the same pipe
+  ::close(pipeFds[1]);
+  const string payload = "through the passed fd";
+  RawSocketUtils::writeAll(received, payload.data(), payload.size());
+  ::close(received);
+  string buffer(payload.size(), '\0');
+  RawSocketUtils::readAll(pipeFds[0], &buffer[0], buffer.size());
+  REQUIRE(buffer == payload);
+
+  // A peer that never sends one doesn't hold us up
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE_THROWS(RawSocketUtils::receiveFd(sockets[1], 50));
+  REQUIRE(std::chrono::steady_clock::now() - start <
+          std::chrono::milliseconds(1000));
+
+  // Plain data is not mistaken for a descriptor
+  RawSocketUtils::writeAll(sockets[0], "x", 1);
+  REQUIRE_THROWS(RawSocketUtils::receiveFd(sockets[1], 1000));
+  ::close(sockets[0]);
+  REQUIRE_THROWS(RawSocketUtils::receiveFd(sockets[1], 1000));
+
+  ::close(pipeFds[0]);
+  ::close(sockets[1]);
+}
+
+TEST_CASE("RawSocketUtils rejects more than one descriptor",
+          "[RawSocketUtils]") {
+  int sockets[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+  int pipeFds[2];
+  REQUIRE(::pipe(pipeFds) == 0);
+
+  char marker = 'F';
+  iovec iov;
+  iov.iov_base = &marker;
+  iov.iov_len = 1;
+  union {
+    cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(pipeFds))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(pipeFds));
+  memcpy(CMSG_DATA(cmsg), pipeFds, sizeof(pipeFds));
+  REQUIRE(::sendmsg(sockets[0], &msg, 0) == 1);
+  REQUIRE_THROWS(RawSocketUtils::receiveFd(sockets[1], 1000));
+
+  // Both copies were closed, so ours is the pipe's only writer
+  ::close(pipeFds[1]);
+  REQUIRE(::fcntl(pipeFds[0], F_SETFL, O_NONBLOCK) == 0);
+  char buffer;
+  REQUIRE(::read(pipeFds[0], &buffer, 1) == 0);
+
+  ::close(pipeFds[0]);
+  ::close(sockets[0]);
+  ::close(sockets[1]);
+}
+#endif
@@ -0,0 +1,146 @@
+#include "RouterFrame.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+namespace {
+// Forwards to a socketpair and counts the syscalls each helper makes.
+class CountingSocketHandler : public SocketHandler {
+ public:
+  int writes = 0;
+  int writevs = 0;
+
+  bool hasData(int fd) override { return waitOnSocketReady(fd, false, 0); }
+  ssize_t read(int fd, void* buf, size_t count) override {
+    return ::read(fd, buf, count);
+  }
+  ssize_t write(int fd, const void* buf, size_t count) override {
+    writes++;
+    return ::write(fd, buf, count);
+  }
+  ssize_t writev(int fd, const struct iovec* iov, int iovcnt) override {
+    writevs++;
+    return ::writev(fd, iov, iovcnt);
+  }
+
+  int connect(const SocketEndpoint&) override { return -1; }
+  set<int> listen(const SocketEndpoint&) override { return {}; }
+  set<int> getEndpointFds(const SocketEndpoint&) override { return {}; }
+  int accept(int) override { return -1; }
+  void stopListening(const SocketEndpoint&) override {}
+  void close(int fd) override { ::close(fd); }
+  vector<int> getActiveSockets() override { return {}; }
+};
+
+string readAvailable(int fd) {
+  string s;
+  char buf[4096];
+  while (waitOnSocketReady(fd, false, 100)) {
+    ssize_t rc = ::read(fd, buf, sizeof(buf));
+    if (rc <= 0) {
+      break;
+    }
+    s.append(buf, rc);
+  }
+  return s;
+}
+}  // namespace
+
+TEST_CASE("RouterFrame sends a keystroke in one syscall", "[RouterFrame]") {
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  auto handler = make_shared<CountingSocketHandler>();
+
+  TerminalBuffer tb;
+  tb.set_buffer("a");
+  RouterFrame::write(handler, fds[0], TERMINAL_BUFFER, protoToString(tb),
+                     true);
+  REQUIRE(handler->writes == 0);
+  REQUIRE(handler->writevs == 1);
+
+  RouterFrameDecoder decoder;
+  string bytes = readAvailable(fds[1]);
+  REQUIRE(bytes.length() ==
+          COMPACT_ROUTER_FRAME_HEADER_LENGTH + protoToString(tb).length());
+  decoder.append(bytes.data(), bytes.length());
+  char type;
+  string body;
+  REQUIRE(decoder.next(&type, &body));
+  REQUIRE(type == TERMINAL_BUFFER);
+  REQUIRE(stringToProto<TerminalBuffer>(body).buffer() == "a");
+  REQUIRE_FALSE(decoder.next(&type, &body));
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+TEST_CASE("RouterFrame legacy frames keep the old wire format",
+          "[RouterFrame]") {
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  auto handler = make_shared<CountingSocketHandler>();
+
+  TerminalInfo ti;
+  ti.set_row(24);
+  ti.set_column(80);
+  const string body = protoToString(ti);
+  RouterFrame::write(handler, fds[0], TERMINAL_INFO, body, false);
+  REQUIRE(handler->writevs == 1);
+
+  // A type byte followed by exactly what writeProto() produces.
+  string expected(1, char(TERMINAL_INFO));
+  int64_t length = body.length();
+  expected.append((const char*)&length, sizeof(int64_t));
+  expected.append(body);
+  REQUIRE(readAvailable(fds[1]) == expected);
+
+  // writeProto() itself also leaves in a single vectored write.
+  handler->writevs = 0;
+  handler->writeProto(fds[0], ti, false);
+  REQUIRE(handler->writes == 0);
+  REQUIRE(handler->writevs == 1);
+  REQUIRE(readAvailable(fds[1]) == expected.substr(1));
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+TEST_CASE("RouterFrameDecoder reassembles split and batched frames",
+          "[RouterFrame]") {
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  auto handler = make_shared<CountingSocketHandler>();
+
+  RouterFrame::write(handler, fds[0], TERMINAL_BUFFER, "first", true);
+  RouterFrame::write(handler, fds[0], TERMINAL_INFO, "", true);
+  RouterFrame::write(handler, fds[0], TERMINAL_BUFFER, string(1000, 'x'),
+                     true);
+  string bytes = readAvailable(fds[1]);
+
+  // Deliver the stream one byte at a time.
+  RouterFrameDecoder decoder;
+  vector<pair<char, string>> frames;
+  for (char c : bytes) {
+    decoder.append(&c, 1);
+    char type;
+    string body;
+    while (decoder.next(&type, &body)) {
+      frames.push_back(make_pair(type, body));
+    }
+  }
+  REQUIRE(frames.size() == 3);
+  REQUIRE(frames[0] == make_pair(char(TERMINAL_BUFFER), string("first")));
+  REQUIRE(frames[1] == make_pair(char(TERMINAL_INFO), string()));
+  REQUIRE(frames[2] == make_pair(char(TERMINAL_BUFFER), string(1000, 'x')));
+
+  // A length beyond the cap is rejected instead of being buffered.
+  RouterFrameDecoder badDecoder;
+  const char badHeader[] = {TERMINAL_BUFFER, '\x7f', '\xff', '\xff', '\xff'};
+  badDecoder.append(badHeader, sizeof(badHeader));
+  char type;
+  string body;
+  REQUIRE_THROWS(badDecoder.next(&type, &body));
+
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
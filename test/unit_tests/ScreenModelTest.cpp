@@ -0,0 +1,161 @@
+#include "ScreenModel.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+TEST_CASE("ScreenModel prints, wraps and scrolls into the scrollback",
+          "[ScreenModel]") {
+  ScreenModel model(3, 5, 2);
+  model.write("abcdefg");
+  REQUIRE(model.getRowText(0) == "abcde");
+  REQUIRE(model.getRowText(1) == "fg");
+  REQUIRE(model.getCursorRow() == 1);
+  REQUIRE(model.getCursorColumn() == 2);
+
+  model.write("\r\nline3\r\nline4\r\nline5\r\nline6");
+  REQUIRE(model.getRowText(0) == "line4");
+  REQUIRE(model.getRowText(2) == "line6");
+  // Only the newest lines stay within the scrollback limit.
+  REQUIRE(model.getScrollback() == deque<string>({"fg", "line3"}));
+
+  // Wide characters take two cells; combining marks join the previous one.
+  model.write("\x1b[2J\x1b[H\xe4\xb8\xadx\x1b[2;1He\xcc\x81!");
+  REQUIRE(model.getRowText(0) == "\xe4\xb8\xadx");
+  REQUIRE(model.getRowText(1) == "e\xcc\x81!");
+  REQUIRE(model.getCursorColumn() == 2);
+}
+
+TEST_CASE("ScreenModel follows cursor movement and editing",
+          "[ScreenModel]") {
+  ScreenModel model(4, 10);
+  model.write("0123456789\x1b[2;3Hxy\x1b[1;5H\x1b[K");
+  REQUIRE(model.getRowText(0) == "0123");
+  REQUIRE(model.getRowText(1) == "  xy");
+
+  model.write("\x1b[2;1H\x1b[2P");
+  REQUIRE(model.getRowText(1) == "xy");
+  model.write("\x1b[3@");
+  REQUIRE(model.getRowText(1) == "   xy");
+  model.write("\x1b[1;1H\x1b[L");
+  REQUIRE(model.getRowText(0) == "");
+  REQUIRE(model.getRowText(1) == "0123");
+  model.write("\x1b[M");
+  REQUIRE(model.getRowText(0) == "0123");
+
+  // Scrolling inside a region leaves the lines outside it alone.
+  model.write("\x1b[2J\x1b[1;1Htop\x1b[4;1Hbottom\x1b[2;3r");
+  model.write("\x1b[2;1Ha\r\nb\r\nc");
+  REQUIRE(model.getRowText(0) == "top");
+  REQUIRE(model.getRowText(1) == "b");
+  REQUIRE(model.getRowText(2) == "c");
+  REQUIRE(model.getRowText(3) == "bottom");
+  REQUIRE(model.getScrollback().empty());
+
+  model.write("\x1b]2;my title\x07");
+  REQUIRE(model.getTitle() == "my title");
+}
+
+TEST_CASE("ScreenModel keeps the primary screen under the alternate one",
+          "[ScreenModel]") {
+  ScreenModel model(3, 10);
+  model.write("$ vim\r\n");
+  model.write("\x1b[?1049h\x1b[Hediting");
+  REQUIRE(model.isAlternateScreen());
+  REQUIRE(model.getRowText(0) == "editing");
+  model.write("\x1b[?1049l");
+  REQUIRE_FALSE(model.isAlternateScreen());
+  REQUIRE(model.getRowText(0) == "$ vim");
+  REQUIRE(model.getCursorRow() == 1);
+  REQUIRE(model.getCursorColumn() == 0);
+}
+
+TEST_CASE("ScreenModel snapshots repaint an identical screen",
+          "[ScreenModel]") {
+  ScreenModel model(4, 12);
+  for (int a = 0; a < 10; a++) {
+    model.write("\x1b[1;3" + to_string(a % 8) + "mline " + to_string(a) +
+                "\x1b[0m\r\n");
+  }
+  model.write("\x1b]0;session\x07\x1b[?2004h\x1b[?1h\x1b=");
+  model.write("\x1b[?1049h\x1b[H\x1b[7mstatus\x1b[27m\x1b[3;5Hx\x1b[4m");
+
+  ScreenModel replay(4, 12);
+  replay.write("stale\r\n");
+  replay.write(model.snapshot());
+
+  REQUIRE(replay.isAlternateScreen());
+  for (int row = 0; row < 4; row++) {
+    REQUIRE(replay.getRowText(row) == model.getRowText(row));
+  }
+  REQUIRE(replay.getCursorRow() == model.getCursorRow());
+  REQUIRE(replay.getCursorColumn() == model.getCursorColumn());
+  REQUIRE(replay.getTitle() == "session");
+  // The rendered primary screen and scrollback match too, attributes
+  // included.
+  REQUIRE(replay.snapshot() == model.snapshot());
+}
+
+TEST_CASE("ScreenModel snapshots leave out history the client has",
+          "[ScreenModel]") {
+  ScreenModel model(4, 12);
+  ScreenModel client(4, 12);
+  for (int a = 0; a < 10; a++) {
+    model.write("line " + to_string(a) + "\r\n");
+  }
+  client.write(model.snapshot(0));
+  int64_t synced = model.getScrollbackEnd();
+  REQUIRE(client.getScrollback() == model.getScrollback());
+
+  // Nothing scrolled off since, so a second snapshot adds no history
+  client.write(model.snapshot(synced));
+  REQUIRE(client.getScrollback() == model.getScrollback());
+
+  // Only what scrolled off after the first one is sent
+  for (int a = 10; a < 15; a++) {
+    model.write("line " + to_string(a) + "\r\n");
+  }
+  string snapshot = model.snapshot(synced);
+  REQUIRE(snapshot.find("line 6") == string::npos);
+  client.write(snapshot);
+  REQUIRE(client.getScrollback() == model.getScrollback());
+  for (int row = 0; row < 4; row++) {
+    REQUIRE(client.getRowText(row) == model.getRowText(row));
+  }
+}
+
+TEST_CASE("ScreenModel keeps the cursor line when shrinking",
+          "[ScreenModel]") {
+  ScreenModel model(4, 10);
+  model.write("a\r\nb\r\nc\r\nlong line");
+  model.resize(2, 4);
+  REQUIRE(model.getRows() == 2);
+  REQUIRE(model.getColumns() == 4);
+  REQUIRE(model.getRowText(0) == "c");
+  REQUIRE(model.getRowText(1) == "long");
+  REQUIRE(model.getCursorRow() == 1);
+  REQUIRE(model.getCursorColumn() == 3);
+  REQUIRE(model.getScrollback() == deque<string>({"a", "b"}));
+
+  model.resize(3, 6);
+  REQUIRE(model.getRowText(2) == "");
+  model.write("\r\nafter");
+  REQUIRE(model.getRowText(2) == "after");
+}
+
+TEST_CASE("ScreenModel clamps the screen size", "[ScreenModel]") {
+  ScreenModel model(0, 100000);
+  REQUIRE(model.getRows() == 1);
+  REQUIRE(model.getColumns() == ScreenModel::MAX_COLUMNS);
+
+  // A client can report any window size
+  model.resize(65535, 65535);
+  REQUIRE(model.getRows() == ScreenModel::MAX_ROWS);
+  REQUIRE(model.getColumns() == ScreenModel::MAX_COLUMNS);
+  model.write("\x1b[999;999Hx");
+  REQUIRE(model.getCursorRow() == 998);
+  REQUIRE(model.getCursorColumn() == 999);
+
+  model.resize(-1, 0);
+  REQUIRE(model.getRows() == 1);
+  REQUIRE(model.getColumns() == 1);
+}
@@ -0,0 +1,66 @@
+#include "SessionScheduler.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+namespace {
+// Has every session read as much as it may every millisecond for a second
+// and returns what each one got after the initial burst.
+vector<int64_t> flood(SessionScheduler* scheduler, const vector<int>& ids,
+                      SessionScheduler::Clock::time_point start) {
+  vector<int64_t> totals(ids.size(), 0);
+  for (int ms = 0; ms < 1000; ms++) {
+    auto now = start + std::chrono::milliseconds(ms);
+    for (size_t a = 0; a < ids.size(); a++) {
+      int64_t granted = scheduler->acquire(ids[a], 16 * 1024, now);
+      if (ms >= 100) {
+        totals[a] += granted;
+      }
+    }
+  }
+  return totals;
+}
+}  // namespace
+
+TEST_CASE("SessionScheduler splits the rate evenly between bulk sessions",
+          "[SessionScheduler]") {
+  const int64_t rate = 1024 * 1024;
+  SessionScheduler scheduler(rate, 4, 1);
+  vector<int> ids = {scheduler.addSession(), scheduler.addSession(),
+                     scheduler.addSession()};
+  auto totals = flood(&scheduler, ids, SessionScheduler::Clock::now());
+
+  int64_t sum = totals[0] + totals[1] + totals[2];
+  REQUIRE(sum > rate * 8 / 10);
+  REQUIRE(sum < rate);
+  for (int64_t total : totals) {
+    REQUIRE(total > sum / 3 - 2 * SessionScheduler::QUANTUM);
+    REQUIRE(total < sum / 3 + 2 * SessionScheduler::QUANTUM);
+  }
+}
+
+TEST_CASE("SessionScheduler favors sessions with recent input",
+          "[SessionScheduler]") {
+  const int64_t rate = 1024 * 1024;
+  SessionScheduler scheduler(rate, 4, 1);
+  int bulk = scheduler.addSession();
+  int interactive = scheduler.addSession();
+  auto start = SessionScheduler::Clock::now();
+  // Input within the last second keeps the session interactive throughout
+  scheduler.noteInput(interactive, start);
+  auto totals = flood(&scheduler, {bulk, interactive}, start);
+  REQUIRE(totals[1] > 3 * totals[0]);
+
+  // A session that stops asking gives up its share
+  int idle = scheduler.addSession();
+  auto later = start + std::chrono::seconds(2);
+  REQUIRE(scheduler.acquire(idle, 1, later) == 1);
+  later += std::chrono::seconds(1);
+  REQUIRE(scheduler.acquire(bulk, 1024 * 1024, later) ==
+          2 * SessionScheduler::QUANTUM);
+
+  // Sessions that leave do not hold anything back
+  scheduler.removeSession(bulk);
+  scheduler.removeSession(interactive);
+  REQUIRE(scheduler.usUntilReady(idle, later) == 0);
+}
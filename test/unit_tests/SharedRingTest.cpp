@@ -0,0 +1,189 @@
+#include "RawSocketUtils.hpp"
+#include "SharedRing.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+#ifdef __linux__
+namespace {
+bool signaled(int fd) { return waitOnSocketReady(fd, false, 0); }
+
+// Reads what is in the ring, sleeping on its eventfd the way etserver does.
+size_t readSome(SharedRing* ring, char* buf, size_t length) {
+  while (true) {
+    size_t count = ring->read(buf, length);
+    if (count > 0) {
+      return count;
+    }
+    waitOnSocketReady(ring->getDataFd(), false, 1000);
+    ring->clearDataSignal();
+  }
+}
+
+string readExactly(SharedRing* ring, size_t length) {
+  string s(length, '\0');
+  size_t received = 0;
+  while (received < length) {
+    received += readSome(ring, &s[received], length - received);
+  }
+  return s;
+}
+
+string randomString(size_t length) {
+  string s(length, '\0');
+  for (size_t a = 0; a < length; a++) {
+    s[a] = char(rand() % 256);
+  }
+  return s;
+}
+}  // namespace
+
+TEST_CASE("SharedRing signals only when it stops being empty",
+          "[SharedRing]") {
+  auto link = SharedRingLink::create(4096);
+  SharedRing* ring = link->toServer();
+  REQUIRE(ring->getCapacity() == 4096);
+  REQUIRE(ring->readable() == 0);
+  REQUIRE_FALSE(signaled(ring->getDataFd()));
+
+  string first = randomString(3000);
+  REQUIRE(ring->write(first.data(), first.length()) == first.length());
+  REQUIRE(signaled(ring->getDataFd()));
+  ring->clearDataSignal();
+  REQUIRE_FALSE(signaled(ring->getDataFd()));
+
+  // More data on a ring that is not empty needs no wakeup
+  REQUIRE(ring->write("b", 1) == 1);
+  REQUIRE_FALSE(signaled(ring->getDataFd()));
+  REQUIRE(ring->readable() == 3001);
+  REQUIRE(readExactly(ring, 3001) == first + "b");
+
+  // This one wraps around the end of the storage
+  string second = randomString(3000);
+  REQUIRE(ring->write(second.data(), second.length()) == second.length());
+  REQUIRE(signaled(ring->getDataFd()));
+  ring->clearDataSignal();
+  REQUIRE(readExactly(ring, second.length()) == second);
+  char c;
+  REQUIRE(ring->read(&c, 1) == 0);
+
+  // A full ring takes what fits and wakes the writer once space frees up
+  string big = randomString(5000);
+  REQUIRE(ring->write(big.data(), big.length()) == 4096);
+  REQUIRE_FALSE(ring->hasSpace(1));
+  REQUIRE_FALSE(signaled(ring->getSpaceFd()));
+  REQUIRE(readExactly(ring, 10) == big.substr(0, 10));
+  REQUIRE(signaled(ring->getSpaceFd()));
+  ring->clearSpaceSignal();
+  REQUIRE(ring->hasSpace(10));
+  REQUIRE_FALSE(ring->hasSpace(11));
+}
+
+TEST_CASE("SharedRingLink connects two ends over a unix socket",
+          "[SharedRing]") {
+  int sockets[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+  auto server = SharedRingLink::create(4096);
+  server->send(sockets[0]);
+  auto terminal = SharedRingLink::receive(sockets[1], 1000);
+  REQUIRE(terminal->toTerminal()->getCapacity() == 4096);
+
+  // Much more than the ring holds, so the writer has to wait for room
+  string input = randomString(256 * 1024);
+  thread writer([&]() {
+    server->toTerminal()->writeAll(input.data(), input.length());
+  });
+  REQUIRE(readExactly(terminal->toTerminal(), input.length()) == input);
+  writer.join();
+
+  string output = randomString(1000);
+  REQUIRE(terminal->toServer()->write(output.data(), output.length()) ==
+          output.length());
+  REQUIRE(readExactly(server->toServer(), output.length()) == output);
+
+  // A writer stuck on a full ring gives up once the other end goes away
+  ::close(sockets[1]);
+  terminal.reset();
+  string big = randomString(8192);
+  REQUIRE_THROWS(server->toTerminal()->writeAll(big.data(), big.length()));
+  ::close(sockets[0]);
+}
+
+TEST_CASE("SharedRing throughput and latency against a unix socket",
+          "[.][SharedRingBenchmark]") {
+  int sockets[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+  auto server = SharedRingLink::create();
+  server->send(sockets[0]);
+  auto terminal = SharedRingLink::receive(sockets[1], 1000);
+
+  // One terminal read's worth per write, as on the router hop
+  const size_t chunk = 16 * 1024;
+  const size_t total = 4 * 1024 * 1024;
+  const string payload = randomString(chunk);
+
+  BENCHMARK("unix socket, 4MB in 16KB writes") {
+    thread reader([&]() {
+      string buf(total, '\0');
+      RawSocketUtils::readAll(sockets[1], &buf[0], total);
+    });
+    for (size_t sent = 0; sent < total; sent += chunk) {
+      RawSocketUtils::writeAll(sockets[0], payload.data(), chunk);
+    }
+    reader.join();
+  };
+
+  BENCHMARK("shared ring, 4MB in 16KB writes") {
+    thread reader([&]() {
+      string buf(chunk, '\0');
+      size_t received = 0;
+      while (received < total) {
+        received += readSome(terminal->toTerminal(), &buf[0], chunk);
+      }
+    });
+    for (size_t sent = 0; sent < total; sent += chunk) {
+      server->toTerminal()->writeAll(payload.data(), chunk);
+    }
+    reader.join();
+  };
+
+  // Keystroke-sized round trips
+  thread socketEcho([&]() {
+    char c;
+    do {
+      RawSocketUtils::readAll(sockets[1], &c, 1);
+      RawSocketUtils::writeAll(sockets[1], &c, 1);
+    } while (c != 'q');
+  });
+  BENCHMARK("unix socket round trip") {
+    char c = 'p';
+    RawSocketUtils::writeAll(sockets[0], &c, 1);
+    RawSocketUtils::readAll(sockets[0], &c, 1);
+    return c;
+  };
+  RawSocketUtils::writeAll(sockets[0], "q", 1);
+  char c;
+  RawSocketUtils::readAll(sockets[0], &c, 1);
+  socketEcho.join();
+
+  thread ringEcho([&]() {
+    char c;
+    do {
+      readSome(terminal->toTerminal(), &c, 1);
+      terminal->toServer()->writeAll(&c, 1);
+    } while (c != 'q');
+  });
+  BENCHMARK("shared ring round trip") {
+    char c = 'p';
+    server->toTerminal()->writeAll(&c, 1);
+    readSome(server->toServer(), &c, 1);
+    return c;
+  };
+  server->toTerminal()->writeAll("q", 1);
+  readSome(server->toServer(), &c, 1);
+  ringEcho.join();
+
+  ::close(sockets[0]);
+  ::close(sockets[1]);
+}
+#endif
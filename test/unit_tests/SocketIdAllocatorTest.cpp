@@ -0,0 +1,46 @@
+#include "SocketIdAllocator.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+TEST_CASE("SocketIdAllocator reuses slots under new ids",
+          "[SocketIdAllocator]") {
+  SocketIdAllocator allocator;
+  const int slotMask = SocketIdAllocator::MAX_SLOTS - 1;
+  int first = allocator.allocate();
+  int second = allocator.allocate();
+  REQUIRE(first >= 0);
+  REQUIRE(second >= 0);
+  REQUIRE((first & slotMask) == 0);
+  REQUIRE((second & slotMask) == 1);
+
+  // The freed slot comes back, but a late packet for the old id cannot
+  // reach the socket that has it now
+  allocator.release(first);
+  int reused = allocator.allocate();
+  REQUIRE((reused & slotMask) == 0);
+  REQUIRE(reused != first);
+  allocator.release(first);
+  int third = allocator.allocate();
+  REQUIRE((third & slotMask) == 2);
+
+  // Freed slots are reused oldest first
+  allocator.release(second);
+  allocator.release(reused);
+  REQUIRE((allocator.allocate() & slotMask) == 1);
+  REQUIRE((allocator.allocate() & slotMask) == 0);
+}
+
+TEST_CASE("SocketIdAllocator runs out of slots", "[SocketIdAllocator]") {
+  SocketIdAllocator allocator;
+  set<int> ids;
+  for (int i = 0; i < SocketIdAllocator::MAX_SLOTS; i++) {
+    ids.insert(allocator.allocate());
+  }
+  REQUIRE(ids.size() == size_t(SocketIdAllocator::MAX_SLOTS));
+  REQUIRE(*(ids.begin()) >= 0);
+  REQUIRE(allocator.allocate() == -1);
+  int last = *(ids.rbegin());
+  allocator.release(last);
+  REQUIRE(allocator.allocate() >= 0);
+}
@@ -0,0 +1,52 @@
+#include "SpscQueue.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+TEST_CASE("SpscQueue keeps order and refuses values when full",
+          "[SpscQueue]") {
+  SpscQueue<string> queue(3);
+  REQUIRE(queue.getCapacity() == 4);
+  REQUIRE(queue.empty());
+  for (int a = 0; a < 4; a++) {
+    REQUIRE(queue.push(std::to_string(a)));
+  }
+  REQUIRE_FALSE(queue.push(string("full")));
+
+  string value;
+  REQUIRE(queue.pop(&value));
+  REQUIRE(value == "0");
+  REQUIRE(queue.push(string("4")));
+  for (int a = 1; a <= 4; a++) {
+    REQUIRE(queue.pop(&value));
+    REQUIRE(value == std::to_string(a));
+  }
+  REQUIRE_FALSE(queue.pop(&value));
+  REQUIRE(queue.empty());
+}
+
+TEST_CASE("SpscQueue hands values between threads", "[SpscQueue]") {
+  SpscQueue<int> queue(64);
+  const int count = 200000;
+  std::thread producer([&queue]() {
+    for (int a = 0; a < count; a++) {
+      while (!queue.push(a)) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  int expected = 0;
+  bool inOrder = true;
+  while (expected < count) {
+    int value;
+    if (!queue.pop(&value)) {
+      std::this_thread::yield();
+      continue;
+    }
+    inOrder &= (value == expected);
+    expected++;
+  }
+  producer.join();
+  REQUIRE(inOrder);
+  REQUIRE(queue.empty());
+}
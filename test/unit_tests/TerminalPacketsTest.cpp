@@ -0,0 +1,55 @@
+#include "TerminalPackets.hpp"
+#include "TestHeaders.hpp"
+
+using namespace et;
+
+TEST_CASE("TerminalPackets carries terminal bytes in both forms",
+          "[TerminalPackets]") {
+  string bytes("ls -l\0\xff\r", 8);
+
+  Packet proto = TerminalPackets::terminalBuffer(bytes, false);
+  REQUIRE(proto.getHeader() == TerminalPacketType::TERMINAL_BUFFER);
+  REQUIRE(stringToProto<TerminalBuffer>(proto.getPayload()).buffer() ==
+          bytes);
+  REQUIRE(TerminalPackets::terminalBufferData(proto) == bytes);
+
+  Packet raw = TerminalPackets::terminalBuffer(bytes, true);
+  REQUIRE(raw.getHeader() == TerminalPacketType::TERMINAL_BUFFER_RAW);
+  REQUIRE(raw.getPayload() == bytes);
+  REQUIRE(TerminalPackets::terminalBufferData(raw) == bytes);
+}
+
+TEST_CASE("TerminalPackets carries tunnel data raw", "[TerminalPackets]") {
+  PortForwardData pwd;
+  pwd.set_sourcetodestination(false);
+  pwd.set_socketid(0x01020304);
+  pwd.set_buffer(string("\0data", 5));
+
+  Packet raw = TerminalPackets::portForwardData(pwd, true);
+  REQUIRE(raw.getHeader() == TerminalPacketType::PORT_FORWARD_DATA_RAW);
+  bool sourceToDestination = true;
+  int socketId = 0;
+  TerminalPackets::parseRawPortForwardData(raw.getPayload(),
+                                           &sourceToDestination, &socketId);
+  REQUIRE_FALSE(sourceToDestination);
+  REQUIRE(socketId == 0x01020304);
+  REQUIRE(raw.getPayload().substr(
+              TerminalPackets::RAW_PORT_FORWARD_HEADER_LENGTH) ==
+          pwd.buffer());
+
+  // Peers that did not ask for raw packets still get protobuf
+  Packet proto = TerminalPackets::portForwardData(pwd, false);
+  REQUIRE(proto.getHeader() == TerminalPacketType::PORT_FORWARD_DATA);
+  REQUIRE(stringToProto<PortForwardData>(proto.getPayload()).buffer() ==
+          pwd.buffer());
+
+  // Closes and errors have no raw form
+  PortForwardData closed;
+  closed.set_socketid(7);
+  closed.set_closed(true);
+  REQUIRE(TerminalPackets::portForwardData(closed, true).getHeader() ==
+          TerminalPacketType::PORT_FORWARD_DATA);
+
+  REQUIRE_THROWS(TerminalPackets::parseRawPortForwardData(
+      "\x01\x02", &sourceToDestination, &socketId));
+}
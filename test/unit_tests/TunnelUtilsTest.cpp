@@ -139,6 +139,63 @@ TEST_CASE("Parses mixed socket and port comma-separated", "[TunnelUtils]") {
   REQUIRE_FALSE(requests[1].destination().has_port());
 }
 
+TEST_CASE("Parses udp port forwards", "[TunnelUtils]") {
+  auto requests = parseRangesToRequests("5353:53/udp,8000-8001:9000-9001/udp");
+
+  REQUIRE(requests.size() == 3);
+  REQUIRE(requests[0].udp());
+  REQUIRE(requests[0].source().port() == 5353);
+  REQUIRE(requests[0].destination().port() == 53);
+  for (int i = 1; i < 3; ++i) {
+    INFO("Checking element " << i);
+    REQUIRE(requests[i].udp());
+    REQUIRE(requests[i].source().port() == 8000 + i - 1);
+    REQUIRE(requests[i].destination().port() == 9000 + i - 1);
+  }
+
+  requests = parseRangesToRequests("127.0.0.1:5353:localhost:53/udp");
+  REQUIRE(requests.size() == 1);
+  REQUIRE(requests[0].udp());
+  REQUIRE(requests[0].source().name() == "127.0.0.1");
+  REQUIRE(requests[0].destination().port() == 53);
+
+  // Without the suffix, or on a socket path, it is not udp
+  requests = parseRangesToRequests("1000:2000,8080:/tmp/udp");
+  REQUIRE(requests.size() == 2);
+  REQUIRE_FALSE(requests[0].udp());
+  REQUIRE_FALSE(requests[1].udp());
+  REQUIRE(requests[1].destination().name() == "/tmp/udp");
+
+  REQUIRE_THROWS_WITH(parseRangesToRequests("/tmp/local.sock:53/udp"),
+                      ContainsSubstring("only ports can forward udp"));
+}
+
+TEST_CASE("Parses dynamic tunnels", "[TunnelUtils]") {
+  auto requests =
+      parseDynamicTunnelArg("1080,0.0.0.0:1081,[::1]:1082,[::]:1083");
+
+  REQUIRE(requests.size() == 4);
+  for (auto& request : requests) {
+    REQUIRE(request.dynamic());
+    REQUIRE_FALSE(request.has_destination());
+  }
+  REQUIRE(requests[0].source().name() == "localhost");
+  REQUIRE(requests[0].source().port() == 1080);
+  REQUIRE(requests[1].source().name() == "0.0.0.0");
+  REQUIRE(requests[1].source().port() == 1081);
+  REQUIRE(requests[2].source().name() == "::1");
+  REQUIRE(requests[2].source().port() == 1082);
+  REQUIRE(requests[3].source().name() == "::");
+
+  REQUIRE_THROWS_WITH(parseDynamicTunnelArg("::1:1080"),
+                      ContainsSubstring("square brackets"));
+  for (auto input : {"localhost", "1080:", ":1080", "99999", "10-20"}) {
+    INFO("Parsing '" << input << "'");
+    REQUIRE_THROWS_WITH(parseDynamicTunnelArg(input),
+                        ContainsSubstring("[bind_address:]port"));
+  }
+}
+
 TEST_CASE("Rejects malformed port forward input", "[TunnelUtils]") {
   SECTION("Mismatched range lengths") {
     REQUIRE_THROWS_WITH(
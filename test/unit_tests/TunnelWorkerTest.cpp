@@ -0,0 +1,147 @@
+#include "PipeSocketHandler.hpp"
+#include "TerminalPackets.hpp"
+#include "TestHeaders.hpp"
+#include "TunnelWorker.hpp"
+
+using namespace et;
+
+namespace {
+// Takes frames from @p worker until one carries data, or gives up after
+// about five seconds.
+bool takeData(TunnelWorker* worker, PortForwardData* pwd) {
+  for (int a = 0; a < 50; a++) {
+    if (!waitOnSocketReady(worker->getNotifyFd(), false, 100)) {
+      continue;
+    }
+    vector<TunnelWorker::Frame> frames;
+    worker->take(&frames);
+    for (auto& frame : frames) {
+      if (frame.bulk) {
+        *pwd = stringToProto<PortForwardData>(frame.packet.getPayload());
+        return true;
+      }
+    }
+  }
+  return false;
+}
+}  // namespace
+
+TEST_CASE("TunnelWorker runs tunnels off the session thread",
+          "[TunnelWorker]") {
+  auto socketHandler = make_shared<PipeSocketHandler>();
+  string tmpPath = GetTempDirectory() + string("et_test_XXXXXXXX");
+  string pipeDirectory = string(mkdtemp(&tmpPath[0]));
+  SocketEndpoint destination;
+  destination.set_name(pipeDirectory + "/destination");
+  set<int> listenFds = socketHandler->listen(destination);
+  REQUIRE(listenFds.size() == 1);
+  int listenFd = *listenFds.begin();
+
+  auto handler = make_shared<PortForwardHandler>(socketHandler, socketHandler);
+  TunnelWorker worker(handler, false);
+  worker.start();
+
+  // The peer opens a tunnel early and sends data right behind the request
+  PortForwardDestinationRequest pfdr;
+  *pfdr.mutable_destination() = destination;
+  pfdr.set_fd(100);
+  pfdr.set_socketid(7);
+  worker.post(Packet(TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST,
+                     protoToString(pfdr)));
+  PortForwardData data;
+  data.set_socketid(7);
+  data.set_sourcetodestination(true);
+  data.set_buffer("hello");
+  worker.post(TerminalPackets::portForwardData(data, false));
+
+  REQUIRE(waitOnSocketReady(listenFd, false, 5000));
+  int fd = socketHandler->accept(listenFd);
+  REQUIRE(fd >= 0);
+  string received;
+  for (int a = 0; a < 50 && received.length() < 5; a++) {
+    if (waitOnSocketReady(fd, false, 100)) {
+      char buf[16];
+      ssize_t rc = socketHandler->read(fd, buf, sizeof(buf));
+      REQUIRE(rc > 0);
+      received.append(buf, rc);
+    }
+  }
+  REQUIRE(received == "hello");
+
+  // What the destination answers comes back as tunnel data
+  REQUIRE(socketHandler->write(fd, "world", 5) == 5);
+  PortForwardData reply;
+  REQUIRE(takeData(&worker, &reply));
+  REQUIRE(reply.socketid() == 7);
+  REQUIRE_FALSE(reply.sourcetodestination());
+  REQUIRE(reply.buffer() == "world");
+
+  // and so does the close
+  socketHandler->close(fd);
+  REQUIRE(takeData(&worker, &reply));
+  REQUIRE(reply.closed());
+
+  worker.stop();
+  socketHandler->stopListening(destination);
+  FATAL_FAIL(::remove(destination.name().c_str()));
+  FATAL_FAIL(::remove(pipeDirectory.c_str()));
+}
+
+TEST_CASE("TunnelWorker posts never wait for the worker", "[TunnelWorker]") {
+  auto socketHandler = make_shared<PipeSocketHandler>();
+  string tmpPath = GetTempDirectory() + string("et_test_XXXXXXXX");
+  string pipeDirectory = string(mkdtemp(&tmpPath[0]));
+  SocketEndpoint destination;
+  destination.set_name(pipeDirectory + "/destination");
+  set<int> listenFds = socketHandler->listen(destination);
+  REQUIRE(listenFds.size() == 1);
+  int listenFd = *listenFds.begin();
+
+  auto handler = make_shared<PortForwardHandler>(socketHandler, socketHandler);
+  TunnelWorker worker(handler, false);
+
+  // A peer without windows sends more than the queue holds before the
+  // worker gets to any of it
+  PortForwardDestinationRequest pfdr;
+  *pfdr.mutable_destination() = destination;
+  pfdr.set_fd(100);
+  pfdr.set_socketid(9);
+  worker.post(Packet(TerminalPacketType::PORT_FORWARD_DESTINATION_REQUEST,
+                     protoToString(pfdr)));
+  const int packets = 3 * TunnelWorker::QUEUE_PACKETS;
+  PortForwardData data;
+  data.set_socketid(9);
+  data.set_sourcetodestination(true);
+  data.set_buffer("x");
+  auto start = std::chrono::steady_clock::now();
+  for (int a = 0; a < packets; a++) {
+    worker.post(TerminalPackets::portForwardData(data, false));
+  }
+  REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+  // The backlog follows once the session thread takes what the worker sent
+  worker.start();
+  REQUIRE(waitOnSocketReady(listenFd, false, 5000));
+  int fd = socketHandler->accept(listenFd);
+  REQUIRE(fd >= 0);
+  int received = 0;
+  for (int a = 0; a < 500 && received < packets; a++) {
+    if (waitOnSocketReady(worker.getNotifyFd(), false, 0)) {
+      vector<TunnelWorker::Frame> frames;
+      worker.take(&frames);
+    }
+    if (waitOnSocketReady(fd, false, 10)) {
+      char buf[4096];
+      ssize_t rc = socketHandler->read(fd, buf, sizeof(buf));
+      REQUIRE(rc > 0);
+      received += rc;
+    }
+  }
+  REQUIRE(received == packets);
+
+  socketHandler->close(fd);
+  worker.stop();
+  socketHandler->stopListening(destination);
+  FATAL_FAIL(::remove(destination.name().c_str()));
+  FATAL_FAIL(::remove(pipeDirectory.c_str()));
+}
@@ -45,3 +45,138 @@ TEST_CASE("AcceptDoesNotAbortWhenNoPendingConnection", "[UnixSocketHandler]") {
   FATAL_FAIL(::remove(pipePath.c_str()));
   FATAL_FAIL(::remove(pipeDirectory.c_str()));
 }
+
+TEST_CASE("ReadsNeverWaitAndClosedFdsAreRetired", "[UnixSocketHandler]") {
+  shared_ptr<PipeSocketHandler> socketHandler(new PipeSocketHandler());
+
+  string tmpPath = GetTempDirectory() + string("et_test_XXXXXXXX");
+  string pipeDirectory = string(mkdtemp(&tmpPath[0]));
+  string pipePath = pipeDirectory + "/pipe";
+
+  SocketEndpoint endpoint;
+  endpoint.set_name(pipePath);
+
+  set<int> serverFds = socketHandler->listen(endpoint);
+  REQUIRE(!serverFds.empty());
+  int serverFd = *serverFds.begin();
+
+  int clientFd = socketHandler->connect(endpoint);
+  REQUIRE(clientFd > 0);
+  int acceptedFd = -1;
+  for (int a = 0; a < 100 && acceptedFd < 0; a++) {
+    acceptedFd = socketHandler->accept(serverFd);
+    if (acceptedFd < 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  REQUIRE(acceptedFd > 0);
+
+  // A read with nothing pending must fail straight away instead of sitting
+  // in a select() for several seconds.
+  char buf[16];
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(socketHandler->read(acceptedFd, buf, sizeof(buf)) == -1);
+  REQUIRE((GetErrno() == EAGAIN || GetErrno() == EWOULDBLOCK));
+  REQUIRE(std::chrono::steady_clock::now() - start <
+          std::chrono::milliseconds(500));
+
+  // Once data has arrived it is read normally.
+  REQUIRE(socketHandler->write(clientFd, "ping", 4) == 4);
+  REQUIRE(socketHandler->hasData(acceptedFd));
+  REQUIRE(socketHandler->read(acceptedFd, buf, sizeof(buf)) == 4);
+  REQUIRE(string(buf, 4) == "ping");
+
+  vector<int> active = socketHandler->getActiveSockets();
+  REQUIRE(find(active.begin(), active.end(), acceptedFd) != active.end());
+
+  // Once closed, the fd is retired: stale users get EPIPE rather than
+  // touching whatever the number is reused for.
+  socketHandler->close(acceptedFd);
+  active = socketHandler->getActiveSockets();
+  REQUIRE(find(active.begin(), active.end(), acceptedFd) == active.end());
+  REQUIRE(socketHandler->read(acceptedFd, buf, sizeof(buf)) == -1);
+  REQUIRE(GetErrno() == EPIPE);
+  REQUIRE(socketHandler->write(acceptedFd, "x", 1) == -1);
+  REQUIRE(GetErrno() == EPIPE);
+
+  // The next accepted connection may well reuse the number and must be
+  // tracked afresh.
+  int secondClientFd = socketHandler->connect(endpoint);
+  REQUIRE(secondClientFd > 0);
+  int secondAcceptedFd = -1;
+  for (int a = 0; a < 100 && secondAcceptedFd < 0; a++) {
+    secondAcceptedFd = socketHandler->accept(serverFd);
+    if (secondAcceptedFd < 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  REQUIRE(secondAcceptedFd > 0);
+  REQUIRE(socketHandler->write(secondClientFd, "pong", 4) == 4);
+  REQUIRE(socketHandler->hasData(secondAcceptedFd));
+  REQUIRE(socketHandler->read(secondAcceptedFd, buf, sizeof(buf)) == 4);
+  REQUIRE(string(buf, 4) == "pong");
+
+  socketHandler->close(secondAcceptedFd);
+  socketHandler->close(secondClientFd);
+  socketHandler->close(clientFd);
+  socketHandler->stopListening(endpoint);
+  FATAL_FAIL(::remove(pipePath.c_str()));
+  FATAL_FAIL(::remove(pipeDirectory.c_str()));
+}
+
+TEST_CASE("VectoredWritesAndReadsUseOneCall", "[UnixSocketHandler]") {
+  shared_ptr<PipeSocketHandler> socketHandler(new PipeSocketHandler());
+
+  string tmpPath = GetTempDirectory() + string("et_test_XXXXXXXX");
+  string pipeDirectory = string(mkdtemp(&tmpPath[0]));
+  string pipePath = pipeDirectory + "/pipe";
+
+  SocketEndpoint endpoint;
+  endpoint.set_name(pipePath);
+
+  set<int> serverFds = socketHandler->listen(endpoint);
+  REQUIRE(!serverFds.empty());
+  int serverFd = *serverFds.begin();
+
+  int clientFd = socketHandler->connect(endpoint);
+  REQUIRE(clientFd > 0);
+  int acceptedFd = -1;
+  for (int a = 0; a < 100 && acceptedFd < 0; a++) {
+    acceptedFd = socketHandler->accept(serverFd);
+    if (acceptedFd < 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  REQUIRE(acceptedFd > 0);
+
+  char header[] = "head";
+  string body = "body-bytes";
+  struct iovec out[2];
+  out[0].iov_base = header;
+  out[0].iov_len = 4;
+  out[1].iov_base = &body[0];
+  out[1].iov_len = body.length();
+  REQUIRE(socketHandler->writev(clientFd, out, 2) == 14);
+
+  REQUIRE(socketHandler->hasData(acceptedFd));
+  char first[4];
+  string second(10, '\0');
+  struct iovec in[2];
+  in[0].iov_base = first;
+  in[0].iov_len = sizeof(first);
+  in[1].iov_base = &second[0];
+  in[1].iov_len = second.length();
+  REQUIRE(socketHandler->readv(acceptedFd, in, 2) == 14);
+  REQUIRE(string(first, 4) == "head");
+  REQUIRE(second == body);
+
+  // Closed descriptors are refused just like plain reads and writes.
+  socketHandler->close(acceptedFd);
+  REQUIRE(socketHandler->readv(acceptedFd, in, 2) == -1);
+  REQUIRE(GetErrno() == EPIPE);
+
+  socketHandler->close(clientFd);
+  socketHandler->stopListening(endpoint);
+  FATAL_FAIL(::remove(pipePath.c_str()));
+  FATAL_FAIL(::remove(pipeDirectory.c_str()));
+}
@@ -58,6 +58,66 @@ TEST_CASE("UserTerminalRouter acceptNewConnection with no client",
   FATAL_FAIL(::remove(pipeDirectory.c_str()));
 }
 
+TEST_CASE("UserTerminalRouter registers terminals without blocking",
+          "[UserTerminalRouter]") {
+  auto socketHandler = std::make_shared<PipeSocketHandler>();
+
+  string tmpPath =
+      GetTempDirectory() + string("et_test_router_pending_XXXXXXXX");
+  string pipeDirectory = string(mkdtemp(&tmpPath[0]));
+  string pipePath = pipeDirectory + "/router_pipe";
+
+  SocketEndpoint routerEndpoint;
+  routerEndpoint.set_name(pipePath);
+
+  UserTerminalRouter router(socketHandler, routerEndpoint);
+
+  TerminalUserInfo tui;
+  tui.set_id("pending-id");
+  tui.set_passkey("pending-passkey");
+  string packet =
+      Packet(TerminalPacketType::TERMINAL_USER_INFO, protoToString(tui))
+          .serialize();
+  int64_t length = packet.length();
+  string frame = string((const char*)&length, sizeof(int64_t)) + packet;
+
+  // The terminal connects but only delivers half of its user info.
+  const int clientFd = socketHandler->connect(routerEndpoint);
+  REQUIRE(clientFd > 0);
+  size_t half = frame.length() / 2;
+  socketHandler->writeAllOrThrow(clientFd, frame.data(), half, false);
+  while (!socketHandler->hasData(router.getServerFd())) {
+    ::usleep(1000);
+  }
+  IdKeyPair result = router.acceptNewConnection();
+  REQUIRE(result.id == "");
+  set<int> pendingFds;
+  router.getPendingFds(&pendingFds);
+  REQUIRE(pendingFds.size() == 1);
+  REQUIRE(router.processPendingConnections(pendingFds).empty());
+
+  socketHandler->writeAllOrThrow(clientFd, frame.data() + half,
+                                 frame.length() - half, false);
+  // Sockets the event loop did not report are left alone
+  const int terminalFd = *pendingFds.begin();
+  while (!socketHandler->hasData(terminalFd)) {
+    ::usleep(1000);
+  }
+  REQUIRE(router.processPendingConnections({}).empty());
+  vector<IdKeyPair> registered = router.processPendingConnections(pendingFds);
+  REQUIRE(registered.size() == 1);
+  REQUIRE(registered[0].id == "pending-id");
+  REQUIRE(registered[0].key == "pending-passkey");
+  pendingFds.clear();
+  router.getPendingFds(&pendingFds);
+  REQUIRE(pendingFds.empty());
+
+  socketHandler->close(clientFd);
+  socketHandler->close(router.getServerFd());
+  FATAL_FAIL(::remove(pipePath.c_str()));
+  FATAL_FAIL(::remove(pipeDirectory.c_str()));
+}
+
 TEST_CASE("UserTerminalRouter getSocketHandler returns handler",
           "[UserTerminalRouter]") {
   auto socketHandler = std::make_shared<PipeSocketHandler>();